@@ -0,0 +1,628 @@
+#include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+
+//Bundles. Sending a directory one file at a time costs a handshake, and the 8 timeouts at the end, for every file, which
+//for thousands of small files is most of the time. A bundle sends all of them in one transfer instead: a manifest of what's
+//in the directory, then the files back to back in the order the manifest lists them, each split into data records and
+//closed off with an end record. Small files share packets that way, since the protocols only see one long stream:
+//	magic     the 8 bytes of BUNDLE_MAGIC
+//	manifest  how many entries (varint), then for each one BUNDLE_DIRECTORY or BUNDLE_FILE (1 byte), its permissions (varint),
+//	          how long it was when the manifest was made (8 bytes, lowest byte first), how long its path is (varint, up to
+//	          BUNDLE_MAX_PATH), then its path, relative to the directory sent, with / between the parts
+//	data      BUNDLE_DATA (1 byte), how long it is (varint, up to BUNDLE_MAX_DATA), then that many bytes of the file
+//	file end  BUNDLE_END_FILE (1 byte), once all of the file has been sent, whether or not it's as long as the manifest said
+//	end       BUNDLE_END (1 byte), after the last file
+//Directories come before what's in them. The receiving side hands the files to a few writer threads, each taking every
+//file that comes to its turn, so opening, writing and closing small files goes on for several at once.
+#define BUNDLE_MAGIC "GBNBDL01"
+#define BUNDLE_MAGIC_BYTES 8
+#define BUNDLE_DIRECTORY 0
+#define BUNDLE_FILE 1
+#define BUNDLE_DATA 0
+#define BUNDLE_END_FILE 1
+#define BUNDLE_END 2
+#define BUNDLE_MAX_PATH 4096
+#define BUNDLE_MAX_DATA 65536
+
+//What a stream that isn't a bundle is written to, in the receiving side's directory
+#define BUNDLE_PLAIN_NAME "received"
+
+//How many bytes of files the receiving side holds for its writer threads before it waits for them to catch up. Holding
+//back the receive loop for long makes the other side give up, so this is generous, and whatever's still queued once the
+//last packet is in is written before the transfer ends.
+#define BUNDLE_QUEUE_BYTES (16 * 1024 * 1024)
+
+//One thing in a bundle's manifest
+typedef struct BundleEntry {
+	string path;
+	bool directory;
+	unsigned int mode;
+	uint64_t size;
+} BundleEntry;
+
+//Returns true if the given path, from a manifest, stays inside the directory it's relative to: not empty, not starting
+//with /, and with no part that's empty, "." or "..".
+static bool safeBundlePath(const string& path) {
+	if (path.empty() || path[0] == '/' || path.find('\0') != string::npos) return false;
+	size_t start = 0;
+	while (start <= path.length()) {
+		size_t end = path.find('/', start);
+		if (end == string::npos) end = path.length();
+		string part = path.substr(start, end - start);
+		if (part.empty() || part.compare(".") == 0 || part.compare("..") == 0) return false;
+		start = end + 1;
+	}
+	return true;
+}
+
+//Opens the directory a manifest path is in, under the directory open as "root", one part at a time and never through a
+//link, so a link the receiving side already had can't send what's written outside it. Returns the directory, for the
+//caller to close, with the last part of the path in "name", or -1 if any part isn't a real directory.
+static int openBundleParent(int root, const string& path, string* name) {
+	int parent = dup(root);
+	size_t start = 0, end;
+	while (parent != -1 && (end = path.find('/', start)) != string::npos) {
+		int next = openat(parent, path.substr(start, end - start).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		close(parent);
+		parent = next;
+		start = end + 1;
+	}
+	*name = path.substr(start);
+	return parent;
+}
+
+
+//Sends a directory, or a single file, as a bundle. What's in the directory is listed when the reader is opened, and each
+//file is only opened once its turn comes. Anything that's neither a directory nor a regular file, like a symbolic link,
+//is left out.
+class BundleReader {
+	private:
+		vector<BundleEntry> entries;
+		//What was given to open, and whether it's a single file rather than a directory
+		string root;
+		bool single;
+		//What's been made ready to send, and how much of it has been
+		vector<char> pending;
+		size_t pendingSent;
+		//The entry whose file is being sent, and its descriptor (-1 between files)
+		size_t next;
+		int descriptor;
+		char* chunk;
+		long long files, bytes, skipped;
+		uint64_t totalBytes;
+		bool ended;
+
+		BundleReader(const char* path) {
+			root = path;
+			single = false;
+			pendingSent = 0;
+			next = 0;
+			descriptor = -1;
+			chunk = new char[BUNDLE_MAX_DATA];
+			files = bytes = skipped = 0;
+			totalBytes = 0;
+			ended = false;
+		}
+
+		//Adds what's in the directory at "relative" (inside root) to the manifest, sorted by name, each directory followed
+		//by what's in it
+		void list(const string& relative) {
+			string full = relative.empty() ? root : root + "/" + relative;
+			DIR* directory = opendir(full.c_str());
+			if (directory == NULL) {
+				skipped++;
+				return;
+			}
+			vector<string> names;
+			for (struct dirent* found = readdir(directory); found != NULL; found = readdir(directory)) {
+				if (strcmp(found->d_name, ".") != 0 && strcmp(found->d_name, "..") != 0) names.push_back(found->d_name);
+			}
+			closedir(directory);
+			sort(names.begin(), names.end());
+			for (size_t i = 0; i < names.size(); i++) {
+				string path = relative.empty() ? names[i] : relative + "/" + names[i];
+				struct stat status;
+				if (path.length() > BUNDLE_MAX_PATH || lstat((root + "/" + path).c_str(), &status) != 0) {
+					skipped++;
+					continue;
+				}
+				if (S_ISDIR(status.st_mode)) {
+					add(path, true, status.st_mode, 0);
+					list(path);
+				}
+				else if (S_ISREG(status.st_mode)) add(path, false, status.st_mode, status.st_size);
+				else skipped++;
+			}
+		}
+
+		void add(const string& path, bool directory, unsigned int mode, uint64_t size) {
+			BundleEntry entry;
+			entry.path = path;
+			entry.directory = directory;
+			entry.mode = mode & 07777;
+			entry.size = size;
+			entries.push_back(entry);
+			if (!directory) totalBytes += size;
+		}
+
+		//Puts the magic and the manifest in what's to be sent
+		void putManifest() {
+			char head[1 + 2 * WIRE_MAX_VARINT + 8];
+			pending.insert(pending.end(), BUNDLE_MAGIC, BUNDLE_MAGIC + BUNDLE_MAGIC_BYTES);
+			pending.insert(pending.end(), head, head + putVarint(head, entries.size()));
+			for (size_t i = 0; i < entries.size(); i++) {
+				head[0] = entries[i].directory ? BUNDLE_DIRECTORY : BUNDLE_FILE;
+				int length = 1 + putVarint(head + 1, entries[i].mode);
+				putFixed64(head + length, entries[i].size);
+				length += 8;
+				length += putVarint(head + length, entries[i].path.length());
+				pending.insert(pending.end(), head, head + length);
+				pending.insert(pending.end(), entries[i].path.begin(), entries[i].path.end());
+			}
+		}
+
+		//Makes the next records ready to send: the next data of the file being sent, the end of it, or the end of the
+		//bundle once there are no files left. Returns false once even that's gone.
+		bool fill() {
+			pending.clear();
+			pendingSent = 0;
+			if (ended) return false;
+			while (descriptor == -1) {
+				while (next < entries.size() && entries[next].directory) next++;
+				if (next == entries.size()) {
+					pending.push_back(BUNDLE_END);
+					ended = true;
+					return true;
+				}
+				descriptor = ::open(single ? root.c_str() : (root + "/" + entries[next].path).c_str(), O_RDONLY);
+				//A file that's gone since the manifest was made is sent empty
+				if (descriptor != -1) break;
+				skipped++;
+				pending.push_back(BUNDLE_END_FILE);
+				next++;
+				return true;
+			}
+			ssize_t got = ::read(descriptor, chunk, BUNDLE_MAX_DATA);
+			if (got <= 0) {
+				if (got < 0) skipped++;
+				close(descriptor);
+				descriptor = -1;
+				files++;
+				next++;
+				pending.push_back(BUNDLE_END_FILE);
+				return true;
+			}
+			char head[1 + WIRE_MAX_VARINT];
+			head[0] = BUNDLE_DATA;
+			pending.insert(pending.end(), head, head + 1 + putVarint(head + 1, got));
+			pending.insert(pending.end(), chunk, chunk + got);
+			bytes += got;
+			return true;
+		}
+
+	public:
+		//Opens a reader for the directory at "path", listing everything in it, or for the one file at "path" if it's
+		//a regular file, sent under its own name. Returns NULL if it's neither, or couldn't be read.
+		static BundleReader* open(const char* path) {
+			struct stat status;
+			if (stat(path, &status) != 0 || !(S_ISDIR(status.st_mode) || S_ISREG(status.st_mode))) return NULL;
+			BundleReader* send = new BundleReader(path);
+			if (S_ISDIR(status.st_mode)) send->list("");
+			else {
+				const char* name = strrchr(path, '/');
+				send->single = true;
+				send->add(name == NULL ? path : name + 1, false, status.st_mode, status.st_size);
+			}
+			send->putManifest();
+			return send;
+		}
+
+		~BundleReader() {
+			if (descriptor != -1) close(descriptor);
+			delete[] chunk;
+		}
+
+		//Reads up to "room" bytes of what's to be sent into "to". Returns how many were read, and 0 at the end.
+		ssize_t read(char* to, size_t room) {
+			size_t send = 0;
+			while (send < room) {
+				if (pendingSent == pending.size() && !fill()) break;
+				size_t taken = pending.size() - pendingSent < room - send ? pending.size() - pendingSent : room - send;
+				memcpy(to + send, &pending[pendingSent], taken);
+				pendingSent += taken;
+				send += taken;
+			}
+			return send;
+		}
+
+		//Returns how many files and directories the manifest lists
+		size_t getEntries() {
+			return entries.size();
+		}
+
+		//Returns how long the files were altogether when the manifest was made
+		uint64_t getTotalBytes() {
+			return totalBytes;
+		}
+
+		//Returns how many files have been sent in full so far, and how many bytes of them
+		long long getFiles() {
+			return files;
+		}
+
+		long long getBytes() {
+			return bytes;
+		}
+
+		//Returns how many things were left out, because they weren't directories or regular files, or couldn't be read
+		long long getSkipped() {
+			return skipped;
+		}
+};
+
+
+//Something for one of a BundleWriter's threads to do: write the next bytes of a file, and close it if they're the last
+typedef struct BundleJob {
+	size_t entry;
+	char* data;
+	int length;
+	bool last;
+} BundleJob;
+
+//The jobs waiting for one of a BundleWriter's threads, and the file it has open (-1 if none) and whether writing it failed
+typedef struct BundleQueue {
+	deque<BundleJob> jobs;
+	condition_variable work;
+	bool idle;
+	int descriptor;
+	bool failed;
+} BundleQueue;
+
+//Writes a bundle out into a directory, making the directories in the manifest as it goes, and handing the files to
+//writer threads. File number i (counting files only) goes to thread i % threads, which writes each of its files in full
+//before starting on the next, so the files of one thread come out in order while the other threads get on with theirs.
+//With no threads, each file is written as it comes in, by whoever calls write.
+//A stream that doesn't start with BUNDLE_MAGIC is written as it is to BUNDLE_PLAIN_NAME in the directory.
+class BundleWriter {
+	private:
+		//The directory written into, and the same directory open, for everything in the manifest to be opened under
+		string root;
+		int rootDescriptor;
+		vector<BundleEntry> entries;
+		//Bytes taken in that haven't been acted on yet, since a record can be split between writes
+		vector<char> pending;
+		bool started, plain, broken, ended;
+		FILE* plainFile;
+		//How many manifest entries are still to come, which entry's file is being written, how many files there have been
+		//so far, and the data record being taken in and how much of it is left
+		unsigned int listed;
+		bool manifestDone;
+		size_t current;
+		long long fileNumber;
+		BundleJob job;
+		int left;
+
+		//The writer threads, none if the files are written by whoever calls write, and a queue of jobs for each. A thread
+		//that's run out of jobs waits on its queue's "work" until there are more, or it's told to stop.
+		vector<thread> workers;
+		vector<BundleQueue*> queues;
+		mutex lock;
+		condition_variable room;
+		long long queuedBytes;
+		bool stopping, full;
+		long long files, bytes, failures;
+
+		//Does a job from the given queue: opens its file if it's the first, writes its data, and closes the file if it's
+		//the last. Counts what was done in "done" (files, bytes and failures), for the caller to add up.
+		void writeJob(BundleQueue* queue, BundleJob* next, long long* done) {
+			BundleEntry* entry = &entries[next->entry];
+			if (queue->descriptor == -1 && !queue->failed) {
+				//A link already at the path, or in the directories on the way, is refused instead of followed
+				string name;
+				int parent = openBundleParent(rootDescriptor, entry->path, &name);
+				if (parent != -1) {
+					queue->descriptor = openat(parent, name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+					close(parent);
+				}
+				queue->failed = queue->descriptor == -1;
+			}
+			if (!queue->failed && next->length > 0 && ::write(queue->descriptor, next->data, next->length) != next->length) queue->failed = true;
+			if (!queue->failed) done[1] += next->length;
+			delete[] next->data;
+			if (!next->last) return;
+			if (queue->descriptor != -1) {
+				if (fchmod(queue->descriptor, entry->mode) != 0 || close(queue->descriptor) != 0) queue->failed = true;
+				queue->descriptor = -1;
+			}
+			done[queue->failed ? 2 : 0]++;
+			queue->failed = false;
+		}
+
+		//Writes the jobs in queue "which" until told to stop, taking all of them that are there at once
+		void run(int which) {
+			BundleQueue* queue = queues[which];
+			unique_lock<mutex> guard(lock);
+			while (true) {
+				while (!stopping && queue->jobs.empty()) {
+					queue->idle = true;
+					queue->work.wait(guard);
+				}
+				queue->idle = false;
+				if (queue->jobs.empty()) break;
+				deque<BundleJob> taken;
+				taken.swap(queue->jobs);
+				guard.unlock();
+				long long done[3] = {0, 0, 0}, length = 0;
+				for (size_t i = 0; i < taken.size(); i++) {
+					length += taken[i].length;
+					writeJob(queue, &taken[i], done);
+				}
+				guard.lock();
+				queuedBytes -= length;
+				files += done[0];
+				bytes += done[1];
+				failures += done[2];
+				if (full) room.notify_one();
+			}
+		}
+
+		//Hands the job being put together to its file's thread, waiting if too much is queued already, or does it straight
+		//away if there are no threads
+		void queueJob() {
+			BundleQueue* queue = queues[fileNumber % queues.size()];
+			if (workers.empty()) {
+				long long done[3] = {0, 0, 0};
+				writeJob(queue, &job, done);
+				files += done[0];
+				bytes += done[1];
+				failures += done[2];
+			}
+			else {
+				unique_lock<mutex> guard(lock);
+				while (queuedBytes > BUNDLE_QUEUE_BYTES) {
+					full = true;
+					room.wait(guard);
+				}
+				full = false;
+				queuedBytes += job.length;
+				queue->jobs.push_back(job);
+				if (queue->idle) queue->work.notify_one();
+			}
+			job.data = NULL;
+			job.length = 0;
+		}
+
+		//Makes a directory from the manifest, or finds it's there already. Returns false if it couldn't be made, or
+		//what's there is a link or anything else that isn't a directory.
+		bool makeDirectory(const BundleEntry& entry) {
+			string name;
+			int parent = openBundleParent(rootDescriptor, entry.path, &name);
+			if (parent == -1) return false;
+			bool send = mkdirat(parent, name.c_str(), 0700 | entry.mode) == 0;
+			if (!send && errno == EEXIST) {
+				struct stat status;
+				send = fstatat(parent, name.c_str(), &status, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(status.st_mode);
+			}
+			close(parent);
+			return send;
+		}
+
+		//Acts on as much of what's pending as makes whole records. Returns how many bytes were used, or -1 if they don't
+		//make sense.
+		int takeRecords() {
+			char* from = &pending[0];
+			size_t length = pending.size(), used = 0;
+			while (used < length && !ended) {
+				unsigned int value;
+				if (!manifestDone) {
+					if (listed == (unsigned int) -1) {
+						int got = getVarint(from + used, length - used, &value);
+						if (got == 0) return length - used < WIRE_MAX_VARINT ? used : -1;
+						used += got;
+						listed = value;
+						entries.reserve(value < 1000000 ? value : 1000000);
+						manifestDone = listed == 0;
+						continue;
+					}
+					//An entry is only taken once all of it is there
+					size_t at = used + 1;
+					unsigned int mode, pathLength;
+					if (at >= length) return used;
+					int got = getVarint(from + at, length - at, &mode);
+					if (got == 0) return length - at < WIRE_MAX_VARINT ? used : -1;
+					at += got;
+					if (at + 8 > length) return used;
+					uint64_t size = getFixed64(from + at);
+					at += 8;
+					got = getVarint(from + at, length - at, &pathLength);
+					if (got == 0) return length - at < WIRE_MAX_VARINT ? used : -1;
+					at += got;
+					if (pathLength > BUNDLE_MAX_PATH) return -1;
+					if (at + pathLength > length) return used;
+					BundleEntry entry;
+					entry.directory = from[used] == BUNDLE_DIRECTORY;
+					entry.path = string(from + at, pathLength);
+					//The mode comes from the other side, so it never makes anything setuid, setgid or sticky here,
+					//and nobody else gets to write into a directory it made
+					entry.mode = mode & (entry.directory ? 0755 : 0777);
+					entry.size = size;
+					if ((from[used] != BUNDLE_DIRECTORY && from[used] != BUNDLE_FILE) || !safeBundlePath(entry.path)) return -1;
+					//Directories are made straight away, since the files in them come after
+					if (entry.directory && !makeDirectory(entry)) {
+						lock_guard<mutex> guard(lock);
+						failures++;
+					}
+					entries.push_back(entry);
+					used = at + pathLength;
+					manifestDone = --listed == 0;
+					current = 0;
+					continue;
+				}
+				if (left > 0) {
+					int taken = length - used < (size_t) left ? length - used : left;
+					memcpy(job.data + job.length, from + used, taken);
+					job.length += taken;
+					used += taken;
+					left -= taken;
+					if (left == 0) queueJob();
+					continue;
+				}
+				while (current < entries.size() && entries[current].directory) current++;
+				char kind = from[used];
+				if (kind == BUNDLE_END) {
+					ended = true;
+					used++;
+					continue;
+				}
+				if (current == entries.size()) return -1;
+				if (kind == BUNDLE_END_FILE) {
+					job.entry = current;
+					job.last = true;
+					queueJob();
+					job.last = false;
+					current++;
+					fileNumber++;
+					used++;
+					continue;
+				}
+				if (kind != BUNDLE_DATA) return -1;
+				int got = getVarint(from + used + 1, length - used - 1, &value);
+				if (got == 0) return length - used - 1 < WIRE_MAX_VARINT ? used : -1;
+				if (value == 0 || value > BUNDLE_MAX_DATA) return -1;
+				used += 1 + got;
+				job.entry = current;
+				job.data = new char[value];
+				job.length = 0;
+				left = value;
+			}
+			return used;
+		}
+
+	public:
+		//Writes into the directory at "directory", which has to be there already, on "threads" writer threads (0 for none)
+		BundleWriter(const char* directory, int threads) {
+			root = directory;
+			rootDescriptor = ::open(directory, O_RDONLY | O_DIRECTORY);
+			started = plain = broken = ended = false;
+			plainFile = NULL;
+			listed = (unsigned int) -1;
+			manifestDone = false;
+			current = 0;
+			fileNumber = 0;
+			job.data = NULL;
+			job.length = 0;
+			job.last = false;
+			left = 0;
+			queuedBytes = 0;
+			stopping = full = false;
+			files = bytes = failures = 0;
+			for (int i = 0; i < (threads < 1 ? 1 : threads); i++) {
+				BundleQueue* queue = new BundleQueue;
+				queue->idle = false;
+				queue->descriptor = -1;
+				queue->failed = false;
+				queues.push_back(queue);
+			}
+			for (int i = 0; i < threads; i++) workers.push_back(thread(&BundleWriter::run, this, i));
+		}
+
+		~BundleWriter() {
+			finish();
+			if (job.data != NULL) delete[] job.data;
+			for (size_t i = 0; i < queues.size(); i++) {
+				if (queues[i]->descriptor != -1) close(queues[i]->descriptor);
+				delete queues[i];
+			}
+			if (rootDescriptor != -1) close(rootDescriptor);
+		}
+
+		//Takes the next bytes of what was sent. Returns false once it's turned out not to make sense.
+		bool write(const char* data, size_t length) {
+			if (plain) {
+				if (fwrite(data, 1, length, plainFile) != length) broken = true;
+				return !broken;
+			}
+			if (broken || length == 0) return !broken;
+			//Data records are copied straight into their job, everything else is gathered until it's whole
+			if (left > 0 && pending.empty()) {
+				int taken = length < (size_t) left ? length : left;
+				memcpy(job.data + job.length, data, taken);
+				job.length += taken;
+				left -= taken;
+				data += taken;
+				length -= taken;
+				if (left == 0) queueJob();
+			}
+			pending.insert(pending.end(), data, data + length);
+			if (!started) {
+				if (pending.size() < BUNDLE_MAGIC_BYTES && memcmp(&pending[0], BUNDLE_MAGIC, pending.size()) == 0) return true;
+				if (memcmp(&pending[0], BUNDLE_MAGIC, BUNDLE_MAGIC_BYTES) != 0) return startPlain();
+				started = true;
+				pending.erase(pending.begin(), pending.begin() + BUNDLE_MAGIC_BYTES);
+			}
+			if (pending.empty()) return true;
+			int used = takeRecords();
+			if (used < 0) broken = true;
+			else pending.erase(pending.begin(), pending.begin() + used);
+			return !broken;
+		}
+
+		//Writes what's come so far, and everything after it, to BUNDLE_PLAIN_NAME, since it isn't a bundle
+		bool startPlain() {
+			plain = true;
+			plainFile = fopen((root + "/" + BUNDLE_PLAIN_NAME).c_str(), "wb");
+			broken = plainFile == NULL || fwrite(&pending[0], 1, pending.size(), plainFile) != pending.size();
+			pending.clear();
+			return !broken;
+		}
+
+		//Waits for the writer threads to write everything, once nothing more is coming. Returns false if what was sent
+		//didn't make sense, stopped short, or any of it couldn't be written.
+		bool finish() {
+			//Anything too short to hold the whole magic, even nothing at all, was a file like any other
+			if (!started && !plain) startPlain();
+			if (plainFile != NULL) {
+				if (fclose(plainFile) != 0) broken = true;
+				plainFile = NULL;
+			}
+			if (!workers.empty()) {
+				{
+					lock_guard<mutex> guard(lock);
+					stopping = true;
+				}
+				for (size_t i = 0; i < queues.size(); i++) queues[i]->work.notify_one();
+				for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+				workers.clear();
+			}
+			if (plain) return !broken;
+			return !broken && ended && failures == 0;
+		}
+
+		//Returns how many files were written in full, and how many bytes of them
+		long long getFiles() {
+			return files;
+		}
+
+		long long getBytes() {
+			return bytes;
+		}
+
+		//Returns how many files and directories couldn't be made or written
+		long long getFailures() {
+			return failures;
+		}
+
+		//Returns true if what came started with BUNDLE_MAGIC
+		bool isBundle() {
+			return started;
+		}
+};
@@ -0,0 +1,344 @@
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+
+//Compression of each packet's data before it's sent. Every packet is packed on its own, so a lost one never holds up
+//unpacking the rest, at the cost of a poorer ratio than packing the whole file as one stream would get.
+//LZ is a small LZ77 codec in the style of LZ4, fast enough to keep up with the link. Deflate (zlib) packs text tighter
+//but takes several times longer. Whichever is used, a packet that doesn't come out smaller goes out as it is.
+#define CODEC_NONE 0
+#define CODEC_LZ 1
+#define CODEC_DEFLATE 2
+#define NUM_CODECS 3
+
+//Not every program prints these
+[[maybe_unused]] static const char* codecNames[NUM_CODECS] = {"none", "lz", "deflate"};
+
+//LZ matches are at least this long, and found through a hash of their first 4 bytes
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+//After this many packets in a row didn't come out smaller, only one in every PACK_RETRY is tried, until one does.
+//That keeps data that's already compressed from costing anything much.
+#define PACK_GIVE_UP 16
+#define PACK_RETRY 16
+
+//The level deflate is run at
+#define DEFLATE_LEVEL 6
+
+
+//Packs and unpacks single packets with any codec. Each one keeps what the codecs need from one packet to the next,
+//so each thread needs its own.
+class Codec {
+	private:
+		//The LZ hash table holds positions offset by "base", which moves past every packet instead of the table being cleared
+		uint32_t base;
+		uint32_t* slots;
+		z_stream deflater, inflater;
+		bool deflating, inflating;
+
+		static inline uint32_t hash(const unsigned char* at) {
+			uint32_t word;
+			memcpy(&word, at, 4);
+			return (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+		}
+
+		//Writes what's left of a length that didn't fit in its 4 bits, 255 at a time
+		static inline unsigned char* putLength(unsigned char* to, int length) {
+			for (; length >= 255; length -= 255) *to++ = 255;
+			*to++ = (unsigned char) length;
+			return to;
+		}
+
+		//Writes one LZ sequence: the literals, then a match "offset" back (none if "match" is 0).
+		//Returns where it left off, or NULL if it doesn't fit before "end".
+		static unsigned char* putSequence(unsigned char* to, unsigned char* end, const unsigned char* literals, int literalLength, int offset, int match) {
+			if (to + 1 + literalLength / 255 + 1 + literalLength + 2 + (match > 0 ? (match - LZ_MIN_MATCH) / 255 + 1 : 0) > end) return NULL;
+			int extra = match > 0 ? match - LZ_MIN_MATCH : 0;
+			unsigned char* token = to++;
+			*token = (unsigned char) ((literalLength < 15 ? literalLength : 15) << 4 | (extra < 15 ? extra : 15));
+			if (literalLength >= 15) to = putLength(to, literalLength - 15);
+			memcpy(to, literals, literalLength);
+			to += literalLength;
+			if (match == 0) return to;
+			*to++ = (unsigned char) offset;
+			*to++ = (unsigned char) (offset >> 8);
+			if (extra >= 15) to = putLength(to, extra - 15);
+			return to;
+		}
+
+		//Reads a length that didn't fit in its 4 bits. Returns -1 if it runs past "end".
+		static int getLength(const unsigned char** from, const unsigned char* end) {
+			int send = 0;
+			unsigned char next;
+			do {
+				if (*from == end) return -1;
+				next = *(*from)++;
+				send += next;
+			} while (next == 255);
+			return send;
+		}
+
+		int lzPack(const char* input, int length, char* output, int room) {
+			const unsigned char* in = (const unsigned char*) input;
+			unsigned char* out = (unsigned char*) output, *end = out + room;
+			//Start over well before the positions could wrap around
+			if (base > UINT32_MAX - 2 * 65536u - (uint32_t) length) {
+				memset(slots, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+				base = 65536;
+			}
+			//Everything this packet puts in the table is from "start" on, and the next packet starts past all of it,
+			//even if this one gives up part way
+			uint32_t start = base;
+			base += length + 65536;
+
+			int anchor = 0, at = 0;
+			while (at + LZ_MIN_MATCH <= length) {
+				uint32_t key = hash(in + at);
+				int64_t candidate = (int64_t) slots[key] - start;
+				slots[key] = start + at;
+				if (candidate < 0 || at - candidate > 65535 || memcmp(in + candidate, in + at, LZ_MIN_MATCH) != 0) {
+					//Step further the longer nothing matches, so incompressible data goes by quickly
+					at += 1 + ((at - anchor) >> 5);
+					continue;
+				}
+				//Compare 8 bytes at a time until they differ, then find where
+				int match = LZ_MIN_MATCH;
+				while (at + match + 8 <= length) {
+					uint64_t earlier, now;
+					memcpy(&earlier, in + candidate + match, 8);
+					memcpy(&now, in + at + match, 8);
+					if (earlier != now) break;
+					match += 8;
+				}
+				while (at + match < length && in[candidate + match] == in[at + match]) match++;
+				out = putSequence(out, end, in + anchor, at - anchor, at - (int) candidate, match);
+				if (out == NULL) return 0;
+				at += match;
+				anchor = at;
+			}
+			out = putSequence(out, end, in + anchor, length - anchor, 0, 0);
+			return out == NULL ? 0 : out - (unsigned char*) output;
+		}
+
+		static int lzUnpack(const char* input, int length, char* output, int room) {
+			const unsigned char* in = (const unsigned char*) input, *end = in + length;
+			unsigned char* out = (unsigned char*) output, *outEnd = out + room;
+			while (in < end) {
+				unsigned char token = *in++;
+				int literals = token >> 4, match = token & 15;
+				if (literals == 15) {
+					int more = getLength(&in, end);
+					if (more < 0) return -1;
+					literals += more;
+				}
+				if (literals > end - in || literals > outEnd - out) return -1;
+				memcpy(out, in, literals);
+				in += literals;
+				out += literals;
+				//The last sequence is only literals
+				if (in == end) break;
+
+				if (end - in < 2) return -1;
+				int offset = in[0] | in[1] << 8;
+				in += 2;
+				if (match == 15) {
+					int more = getLength(&in, end);
+					if (more < 0) return -1;
+					match += more;
+				}
+				match += LZ_MIN_MATCH;
+				if (offset == 0 || offset > out - (unsigned char*) output || match > outEnd - out) return -1;
+				//Matches can overlap what they write. From 8 bytes back on, every 8 bytes copied are already there,
+				//but anything closer has to go a byte at a time.
+				const unsigned char* copy = out - offset;
+				int i = 0;
+				if (offset >= 8) {
+					for (; i + 8 <= match; i += 8) memcpy(out + i, copy + i, 8);
+				}
+				for (; i < match; i++) out[i] = copy[i];
+				out += match;
+			}
+			return out - (unsigned char*) output;
+		}
+
+		int deflatePack(const char* input, int length, char* output, int room) {
+			if (!deflating) {
+				memset(&deflater, 0, sizeof(deflater));
+				//Raw deflate, without zlib's header and trailer, since the packet's checksum already covers it
+				if (deflateInit2(&deflater, DEFLATE_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+				deflating = true;
+			}
+			else deflateReset(&deflater);
+			deflater.next_in = (Bytef*) input;
+			deflater.avail_in = length;
+			deflater.next_out = (Bytef*) output;
+			deflater.avail_out = room;
+			if (deflate(&deflater, Z_FINISH) != Z_STREAM_END) return 0;
+			return room - deflater.avail_out;
+		}
+
+		int deflateUnpack(const char* input, int length, char* output, int room) {
+			if (!inflating) {
+				memset(&inflater, 0, sizeof(inflater));
+				if (inflateInit2(&inflater, -15) != Z_OK) return -1;
+				inflating = true;
+			}
+			else inflateReset(&inflater);
+			inflater.next_in = (Bytef*) input;
+			inflater.avail_in = length;
+			inflater.next_out = (Bytef*) output;
+			inflater.avail_out = room;
+			if (inflate(&inflater, Z_FINISH) != Z_STREAM_END || inflater.avail_in != 0) return -1;
+			return room - inflater.avail_out;
+		}
+
+	public:
+		Codec() {
+			base = 65536;
+			slots = new uint32_t[1 << LZ_HASH_BITS]();
+			deflating = inflating = false;
+		}
+
+		~Codec() {
+			delete[] slots;
+			if (deflating) deflateEnd(&deflater);
+			if (inflating) inflateEnd(&inflater);
+		}
+
+		//Packs "length" bytes of input with the given codec (CODEC_...) into "output", which has room for "room" bytes.
+		//Returns how long the packed data is, or 0 if it doesn't fit.
+		int pack(int codec, const char* input, int length, char* output, int room) {
+			if (room <= 0) return 0;
+			if (codec == CODEC_LZ) return lzPack(input, length, output, room);
+			if (codec == CODEC_DEFLATE) return deflatePack(input, length, output, room);
+			return 0;
+		}
+
+		//Unpacks data packed with the given codec into "output", which has room for "room" bytes.
+		//Returns how long the unpacked data is, or -1 if it doesn't unpack (or wouldn't fit).
+		int unpack(int codec, const char* input, int length, char* output, int room) {
+			if (codec == CODEC_LZ) return lzUnpack(input, length, output, room);
+			if (codec == CODEC_DEFLATE) return deflateUnpack(input, length, output, room);
+			return -1;
+		}
+};
+
+
+//Packs packets on worker threads on the sending side, so the send loop can get on with sending the first packets of a
+//window while the rest are still being packed. Each packet's data stays where it is, and the packed copy goes in its
+//"packed" buffer (allocated here the first time), with "codec" saying whether to send that (CODEC_NONE if not).
+class PacketPacker {
+	private:
+		int codec, packetSize;
+		vector<thread> workers;
+		//The packets waiting to be packed, and those being packed right now
+		vector<Packet*> queued, busy;
+		mutex lock;
+		condition_variable work, done;
+		bool stopping;
+		//How many packets in a row didn't come out smaller, and how many have been passed over since
+		atomic<int> misses, skipped;
+		//Used to pack with when there are no workers
+		Codec* sameThread;
+
+		//Packs a single packet, leaving it as it is if packing doesn't make it smaller
+		void packOne(Codec* with, Packet* pack) {
+			pack->codec = CODEC_NONE;
+			if (misses.load(memory_order_relaxed) >= PACK_GIVE_UP && skipped.fetch_add(1, memory_order_relaxed) % PACK_RETRY != 0) return;
+			if (pack->packed == NULL) pack->packed = new char[packetSize];
+			int used = with->pack(codec, pack->content, pack->length, pack->packed, pack->length - 1);
+			if (used == 0) {
+				misses.fetch_add(1, memory_order_relaxed);
+				return;
+			}
+			misses.store(0, memory_order_relaxed);
+			pack->codec = codec;
+			pack->packedLength = used;
+		}
+
+		void run() {
+			Codec with;
+			unique_lock<mutex> guard(lock);
+			while (true) {
+				while (!stopping && queued.empty()) work.wait(guard);
+				if (queued.empty()) return;
+				Packet* pack = queued.front();
+				queued.erase(queued.begin());
+				busy.push_back(pack);
+				guard.unlock();
+				packOne(&with, pack);
+				guard.lock();
+				busy.erase(find(busy.begin(), busy.end(), pack));
+				done.notify_all();
+			}
+		}
+
+	public:
+		//"codec" is what to pack with, "packetSize" the most data a packet can hold, and "threads" how many workers to
+		//pack on (0 to pack each packet in the send loop, as it's sent)
+		PacketPacker(int packCodec, int size, int threads) {
+			codec = packCodec;
+			packetSize = size;
+			stopping = false;
+			misses = skipped = 0;
+			sameThread = threads > 0 ? NULL : new Codec();
+			for (int i = 0; i < threads; i++) workers.push_back(thread(&PacketPacker::run, this));
+		}
+
+		//Finishes whatever's still queued, then stops the workers
+		~PacketPacker() {
+			{
+				lock_guard<mutex> guard(lock);
+				stopping = true;
+			}
+			work.notify_all();
+			for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+			if (sameThread != NULL) delete sameThread;
+		}
+
+		//Queues the given packets to be packed, in order
+		void pack(Packet* packets, int count) {
+			if (count <= 0) return;
+			{
+				lock_guard<mutex> guard(lock);
+				for (int i = 0; i < count; i++) {
+					packets[i].codec = CODEC_NONE;
+					queued.push_back(packets + i);
+				}
+			}
+			work.notify_all();
+		}
+
+		//Waits until the given packet is packed (or packs it now, if there are no workers)
+		void wait(Packet* pack) {
+			unique_lock<mutex> guard(lock);
+			if (sameThread != NULL) {
+				vector<Packet*>::iterator found = find(queued.begin(), queued.end(), pack);
+				if (found == queued.end()) return;
+				queued.erase(found);
+				packOne(sameThread, pack);
+				return;
+			}
+			while (find(queued.begin(), queued.end(), pack) != queued.end() || find(busy.begin(), busy.end(), pack) != busy.end()) done.wait(guard);
+		}
+
+		//Waits until every packet queued is packed. Packets that would have been packed in the send loop are just dropped
+		//from the queue, since nothing's going to send them now.
+		void finish() {
+			unique_lock<mutex> guard(lock);
+			if (sameThread != NULL) queued.clear();
+			while (!queued.empty() || !busy.empty()) done.wait(guard);
+		}
+
+		int getCodec() {
+			return codec;
+		}
+};
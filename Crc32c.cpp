@@ -0,0 +1,143 @@
+#include <stdint.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+
+//CRC32C (the Castagnoli polynomial, as used by iSCSI, SCTP and ext4), for checking packets more thoroughly than the
+//16 bit internet checksum does: it catches every burst of errors up to 32 bits long, and any odd number of flipped bits,
+//and unlike a plain sum it notices when pieces of the data get swapped around.
+//There are three ways of working it out, all giving the same answer. Which one crc32c uses is picked the first time
+//it's called, from what the processor can do:
+//	crc32cTable      slicing-by-8, a byte at a time from 8 lookup tables. Works anywhere.
+//	crc32cHardware   the SSE4.2 crc32 instruction, 8 bytes at a time
+//	crc32cInterleaved  three runs of the crc32 instruction over three parts of the data at once (the instruction takes
+//	                 3 cycles but can start every cycle), joined back together with a carry-less multiply (PCLMUL)
+#define CRC32C_POLY 0x82F63B78
+
+//How long each of the three parts is for big and small pieces of data. Anything too short for even the small ones
+//goes through the plain hardware loop.
+#define CRC32C_LONG_PART 2048
+#define CRC32C_SHORT_PART 128
+
+static uint32_t crc32cTables[8][256];
+
+//Returns a(x) times b(x) mod the polynomial, both written reflected (x^0 is the top bit), like the CRC itself
+static uint32_t crc32cMultiply(uint32_t a, uint32_t b) {
+	uint32_t send = 0;
+	for (uint32_t bit = 0x80000000; bit != 0; bit >>= 1) {
+		if (a & bit) send ^= b;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return send;
+}
+
+//Returns x^power mod the polynomial, reflected
+static uint32_t crc32cPower(long power) {
+	uint32_t send = 0x80000000, square = 0x40000000;
+	for (; power > 0; power >>= 1) {
+		if (power & 1) send = crc32cMultiply(send, square);
+		square = crc32cMultiply(square, square);
+	}
+	return send;
+}
+
+//Works the CRC out with lookup tables, 8 bytes at a time. "crc" is the running value, before the final inversion.
+static uint32_t crc32cTable(uint32_t crc, const char* data, size_t length) {
+	const unsigned char* next = (const unsigned char*) data;
+	for (; length >= 8; length -= 8, next += 8) {
+		uint32_t low = crc ^ (next[0] | next[1] << 8 | next[2] << 16 | (uint32_t) next[3] << 24);
+		crc = crc32cTables[7][low & 0xFF] ^ crc32cTables[6][(low >> 8) & 0xFF] ^ crc32cTables[5][(low >> 16) & 0xFF] ^
+			crc32cTables[4][low >> 24] ^ crc32cTables[3][next[4]] ^ crc32cTables[2][next[5]] ^ crc32cTables[1][next[6]] ^
+			crc32cTables[0][next[7]];
+	}
+	while (length-- > 0) crc = crc32cTables[0][(crc ^ *next++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+//The multipliers that move a part's CRC past the one or two parts after it (see crc32cShift)
+static uint64_t crc32cLongShifts[2], crc32cShortShifts[2];
+
+//Works the CRC out with the crc32 instruction
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const char* data, size_t length) {
+	uint64_t wide = crc;
+	for (; length >= 8; length -= 8, data += 8) {
+		uint64_t next;
+		memcpy(&next, data, 8);
+		wide = _mm_crc32_u64(wide, next);
+	}
+	crc = (uint32_t) wide;
+	while (length-- > 0) crc = _mm_crc32_u8(crc, *data++);
+	return crc;
+}
+
+//Returns the CRC as if "by" more bytes of zeroes came after it. A carry-less multiply by x^(8by - 33) gives a 64 bit
+//product, and running that through the crc32 instruction multiplies it by the remaining x^33 and reduces it.
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32cShift(uint32_t crc, uint64_t multiplier) {
+	__m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi64_si128(multiplier), 0);
+	return (uint32_t) _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+//Runs the crc32 instruction over three parts of "part" bytes each, at the same time, then joins them up
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32cThreeParts(uint32_t crc, const char* data, size_t part, uint64_t* shifts) {
+	uint64_t first = crc, second = 0, third = 0;
+	for (size_t i = 0; i < part; i += 8) {
+		uint64_t a, b, c;
+		memcpy(&a, data + i, 8);
+		memcpy(&b, data + part + i, 8);
+		memcpy(&c, data + 2 * part + i, 8);
+		first = _mm_crc32_u64(first, a);
+		second = _mm_crc32_u64(second, b);
+		third = _mm_crc32_u64(third, c);
+	}
+	return crc32cShift((uint32_t) first, shifts[1]) ^ crc32cShift((uint32_t) second, shifts[0]) ^ (uint32_t) third;
+}
+
+//Works the CRC out in three parts at a time where it can, and with the plain hardware loop for what's left
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32cInterleaved(uint32_t crc, const char* data, size_t length) {
+	for (; length >= 3 * CRC32C_LONG_PART; length -= 3 * CRC32C_LONG_PART, data += 3 * CRC32C_LONG_PART) {
+		crc = crc32cThreeParts(crc, data, CRC32C_LONG_PART, crc32cLongShifts);
+	}
+	for (; length >= 3 * CRC32C_SHORT_PART; length -= 3 * CRC32C_SHORT_PART, data += 3 * CRC32C_SHORT_PART) {
+		crc = crc32cThreeParts(crc, data, CRC32C_SHORT_PART, crc32cShortShifts);
+	}
+	return crc32cHardware(crc, data, length);
+}
+#endif
+
+//Builds the tables (and the multipliers for the interleaved version) and returns the fastest version this processor can run
+static uint32_t (*crc32cPick())(uint32_t, const char*, size_t) {
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32cTables[0][i] = crc;
+	}
+	for (int i = 0; i < 256; i++) {
+		for (int table = 1; table < 8; table++) {
+			uint32_t last = crc32cTables[table - 1][i];
+			crc32cTables[table][i] = crc32cTables[0][last & 0xFF] ^ (last >> 8);
+		}
+	}
+#if defined(__x86_64__)
+	for (int i = 0; i < 2; i++) {
+		//Reflected, so the 32 bit value lands in the low half as the instruction expects
+		crc32cLongShifts[i] = crc32cPower(8L * CRC32C_LONG_PART * (i + 1) - 33);
+		crc32cShortShifts[i] = crc32cPower(8L * CRC32C_SHORT_PART * (i + 1) - 33);
+	}
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) return __builtin_cpu_supports("pclmul") ? crc32cInterleaved : crc32cHardware;
+#endif
+	return crc32cTable;
+}
+
+//Returns the CRC32C of the given bytes
+uint32_t crc32c(const char* data, size_t length) {
+	static uint32_t (*version)(uint32_t, const char*, size_t) = crc32cPick();
+	return ~version(0xFFFFFFFF, data, length);
+}
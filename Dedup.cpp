@@ -0,0 +1,567 @@
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+
+
+//Deduplicated transfers. The receiving side keeps a block store: a directory holding blocks of DEDUP_BLOCK bytes from
+//files it was sent before, each known by its key (the MD5 of what's in it), whatever file it came from. Before the
+//sending side reads its file, it works out the key of every block and asks which ones the store has (see
+//SocketReadWriter::fetchDedup), then only sends the data of the blocks it doesn't. A block that's the same as one earlier
+//in the same file is only sent once too, and the receiving side copies it from what it's already written.
+//What the sending side sends goes through the protocols exactly like a file would, so they don't need to know about it:
+//	magic    the 8 bytes of DEDUP_MAGIC
+//	data     DEDUP_DATA (1 byte), how long the block is (varint), then the block
+//	stored   DEDUP_STORED (1 byte), then the key of a block the store has (DEDUP_KEY_BYTES)
+//	copy     DEDUP_COPY (1 byte), then the number of an earlier block of the file that's the same (varint)
+//	end      DEDUP_END (1 byte), then the XXH64 of the whole file as the sending side read it (8 bytes)
+//There's one record for every block of the file, in order. The end is there so the file put back together can be checked.
+#define DEDUP_MAGIC "GBNDDP01"
+#define DEDUP_MAGIC_BYTES 8
+#define DEDUP_DATA 0
+#define DEDUP_STORED 1
+#define DEDUP_COPY 2
+#define DEDUP_END 3
+#define DEDUP_BLOCK 65536
+
+//The store is two files in its directory. "blocks" has a slot of DEDUP_BLOCK bytes for each block it can hold, and "index",
+//which is mapped into memory, says what's in them: the store header, then an entry for each slot.
+//	header   the 8 bytes of STORE_MAGIC, how many slots there are (8 bytes), the clock (8 bytes), then 8 bytes that are always 0
+//	entry    the key of the block in the slot (DEDUP_KEY_BYTES), how long it is (4 bytes, 0 for an empty slot), 4 bytes
+//	         that are always 0, and when it was last used (8 bytes, by the clock, which goes up by one every time a block is used)
+//Once the store is full, the block that's gone unused the longest makes room for a new one, unless it's been used by the
+//transfer under way (asked about, sent or copied), since the sending side may be counting on it.
+#define STORE_MAGIC "GBNSTO01"
+#define STORE_HEADER_BYTES 32
+#define STORE_ENTRY_BYTES 32
+
+
+//Works out the key of a block into "key", which needs room for DEDUP_KEY_BYTES
+static void blockKey(const char* data, int length, char* key) {
+	FileDigest digest(DIGEST_MD5);
+	digest.add(data, length);
+	digest.finish((unsigned char*) key);
+}
+
+
+//The receiving side's store of blocks from files it was sent before
+class BlockStore {
+	private:
+		int indexFile, blockFile;
+		unsigned char* mapped;
+		size_t mappedLength;
+		long long slots, used;
+		//The clock, and what it was when the transfer under way first used a block (pinning is false between transfers)
+		uint64_t clock, pin;
+		bool pinning;
+		//Which slot each key is in, the slots that hold blocks from the most recently used to the least, where each slot
+		//is in that list, and the slots that are empty
+		unordered_map<string, long long> slotOf;
+		list<long long> recent;
+		vector<list<long long>::iterator> place;
+		vector<long long> empty;
+
+		BlockStore(int index, int blocks, long long count) {
+			indexFile = index;
+			blockFile = blocks;
+			mapped = NULL;
+			mappedLength = 0;
+			slots = count;
+			used = 0;
+			clock = pin = 0;
+			pinning = false;
+		}
+
+		unsigned char* entry(long long slot) {
+			return mapped + STORE_HEADER_BYTES + slot * STORE_ENTRY_BYTES;
+		}
+
+		int lengthOf(long long slot) {
+			return readLittle32(entry(slot) + DEDUP_KEY_BYTES);
+		}
+
+		//Takes up the index already in the file if it's for this many slots, or starts one over with every slot empty.
+		//Returns false if the index couldn't be mapped.
+		bool load() {
+			mappedLength = STORE_HEADER_BYTES + slots * STORE_ENTRY_BYTES;
+			struct stat status;
+			bool fresh = fstat(indexFile, &status) != 0 || (size_t) status.st_size != mappedLength;
+			if (fresh && (ftruncate(indexFile, 0) != 0 || ftruncate(indexFile, mappedLength) != 0 || ftruncate(blockFile, 0) != 0)) return false;
+			void* at = mmap(NULL, mappedLength, PROT_READ | PROT_WRITE, MAP_SHARED, indexFile, 0);
+			if (at == MAP_FAILED) return false;
+			mapped = (unsigned char*) at;
+			if (fresh || memcmp(mapped, STORE_MAGIC, 8) != 0 || (long long) readLittle64(mapped + 8) != slots) {
+				memset(mapped, 0, mappedLength);
+				putFixed64((char*) mapped + 8, slots);
+				memcpy(mapped, STORE_MAGIC, 8);
+			}
+			clock = readLittle64(mapped + 16);
+
+			//The blocks go in the list in the order they were last used
+			vector<pair<uint64_t, long long> > held;
+			place.assign(slots, recent.end());
+			//Empty slots are taken from the back, so the lowest go last in the list and the blocks file only grows as it fills
+			for (long long slot = slots - 1; slot >= 0; slot--) {
+				if (lengthOf(slot) == 0) empty.push_back(slot);
+				else held.push_back(make_pair(readLittle64(entry(slot) + DEDUP_KEY_BYTES + 8), slot));
+			}
+			sort(held.begin(), held.end());
+			for (size_t i = 0; i < held.size(); i++) {
+				long long slot = held[i].second;
+				slotOf[string((char*) entry(slot), DEDUP_KEY_BYTES)] = slot;
+				recent.push_front(slot);
+				place[slot] = recent.begin();
+			}
+			used = held.size();
+			return true;
+		}
+
+		//Notes that the block in the given slot was just used, which also keeps it for the rest of the transfer
+		void touch(long long slot) {
+			if (!pinning) {
+				pin = clock;
+				pinning = true;
+			}
+			putFixed64((char*) entry(slot) + DEDUP_KEY_BYTES + 8, ++clock);
+			putFixed64((char*) mapped + 16, clock);
+			recent.splice(recent.begin(), recent, place[slot]);
+		}
+
+		//Empties the given slot
+		void drop(long long slot) {
+			slotOf.erase(string((char*) entry(slot), DEDUP_KEY_BYTES));
+			memset(entry(slot), 0, STORE_ENTRY_BYTES);
+			recent.erase(place[slot]);
+			place[slot] = recent.end();
+			empty.push_back(slot);
+			used--;
+		}
+
+	public:
+		//Opens the store in the given directory, making it if there isn't one, to hold up to "bytes" bytes of blocks.
+		//A store opened for a different size starts over empty. Only one process can have a store open at a time.
+		//Returns NULL if it couldn't be opened.
+		static BlockStore* open(const char* directory, long long bytes) {
+			if (bytes < DEDUP_BLOCK || (mkdir(directory, 0755) != 0 && errno != EEXIST)) return NULL;
+			string path = directory;
+			int index = ::open((path + "/index").c_str(), O_RDWR | O_CREAT, 0644);
+			if (index == -1) return NULL;
+			int blocks = flock(index, LOCK_EX | LOCK_NB) != 0 ? -1 : ::open((path + "/blocks").c_str(), O_RDWR | O_CREAT, 0644);
+			if (blocks == -1) {
+				close(index);
+				return NULL;
+			}
+			BlockStore* send = new BlockStore(index, blocks, bytes / DEDUP_BLOCK);
+			if (!send->load()) {
+				delete send;
+				return NULL;
+			}
+			return send;
+		}
+
+		~BlockStore() {
+			if (mapped != NULL) munmap(mapped, mappedLength);
+			close(blockFile);
+			close(indexFile);
+		}
+
+		//Returns true if the store has the block with the given key, which is then kept for the rest of the transfer
+		bool has(const char* key) {
+			unordered_map<string, long long>::iterator found = slotOf.find(string(key, DEDUP_KEY_BYTES));
+			if (found == slotOf.end()) return false;
+			touch(found->second);
+			return true;
+		}
+
+		//Reads the block with the given key into "to", which needs room for DEDUP_BLOCK bytes, and how long it is into
+		//"length". Returns false if the store doesn't have it, or what's in its slot turns out not to be it any more
+		//(if the process died while writing it), in which case the slot is emptied.
+		bool get(const char* key, char* to, int* length) {
+			unordered_map<string, long long>::iterator found = slotOf.find(string(key, DEDUP_KEY_BYTES));
+			if (found == slotOf.end()) return false;
+			long long slot = found->second;
+			*length = lengthOf(slot);
+			char check[DEDUP_KEY_BYTES];
+			bool read = pread(blockFile, to, *length, slot * DEDUP_BLOCK) == *length;
+			if (read) blockKey(to, *length, check);
+			if (!read || memcmp(check, key, DEDUP_KEY_BYTES) != 0) {
+				drop(slot);
+				return false;
+			}
+			touch(slot);
+			return true;
+		}
+
+		//Keeps the given block, in an empty slot or in place of the one that's gone unused the longest. Returns false if
+		//there's no room, because every block has been used by the transfer under way, or it couldn't be written.
+		bool put(const char* key, const char* data, int length) {
+			if (has(key)) return true;
+			long long slot;
+			if (!empty.empty()) {
+				slot = empty.back();
+				empty.pop_back();
+			} else {
+				slot = recent.back();
+				if (pinning && readLittle64(entry(slot) + DEDUP_KEY_BYTES + 8) > pin) return false;
+				drop(slot);
+				empty.pop_back();
+			}
+			//The entry only says what's in the slot once it's been written, and get checks it anyway
+			if (pwrite(blockFile, data, length, slot * DEDUP_BLOCK) != length) {
+				empty.push_back(slot);
+				return false;
+			}
+			memcpy(entry(slot), key, DEDUP_KEY_BYTES);
+			for (int i = 0; i < 4; i++) entry(slot)[DEDUP_KEY_BYTES + i] = (unsigned char) (length >> (8 * i));
+			slotOf[string(key, DEDUP_KEY_BYTES)] = slot;
+			recent.push_front(slot);
+			place[slot] = recent.begin();
+			used++;
+			touch(slot);
+			return true;
+		}
+
+		//Writes everything out once a transfer is over, and lets any block make room for new ones again
+		void finish() {
+			fdatasync(blockFile);
+			msync(mapped, mappedLength, MS_SYNC);
+			pinning = false;
+		}
+
+		//Returns how many blocks the store holds
+		long long size() {
+			return used;
+		}
+};
+
+
+//Reads the sending side's file as the records for a deduplicated transfer. The key of every block is worked out when
+//it's opened, and which of them the store on the other side has has to be filled in (see setStored) before the first read.
+class DedupReader {
+	private:
+		int descriptor;
+		uint64_t size;
+		long long blocks;
+		//The key of each block that isn't the same as an earlier one, and for each block, which of those it is, and the
+		//first block that's the same as it (itself, if there's none earlier)
+		vector<char> keys;
+		vector<long long> keyOf, firstOf;
+		//Which of the keys the store on the other side has
+		vector<bool> stored;
+		char digest[8];
+		//The start of the record being passed on, how much of it has been, and the block after it and how much of its
+		//data is left
+		char head[1 + DEDUP_KEY_BYTES];
+		int headLength, headSent;
+		long long next;
+		char* block;
+		int blockLength, left;
+		long long dataBytes, storedBytes, copiedBytes;
+		bool ended, failed;
+
+		DedupReader(int file, uint64_t bytes) {
+			descriptor = file;
+			size = bytes;
+			blocks = (bytes + DEDUP_BLOCK - 1) / DEDUP_BLOCK;
+			memcpy(head, DEDUP_MAGIC, DEDUP_MAGIC_BYTES);
+			headLength = DEDUP_MAGIC_BYTES;
+			headSent = 0;
+			next = 0;
+			block = new char[DEDUP_BLOCK];
+			blockLength = left = 0;
+			dataBytes = storedBytes = copiedBytes = 0;
+			ended = failed = false;
+		}
+
+		int lengthOf(long long index) {
+			return index == blocks - 1 ? size - index * DEDUP_BLOCK : DEDUP_BLOCK;
+		}
+
+		//Works out the key of every block, and the digest of the whole file. Returns false if it couldn't be read.
+		bool scan() {
+			unordered_map<string, long long> firstWith;
+			FileDigest whole(DIGEST_XXH64);
+			char key[DEDUP_KEY_BYTES];
+			for (long long i = 0; i < blocks; i++) {
+				int length = lengthOf(i);
+				if (pread(descriptor, block, length, i * DEDUP_BLOCK) != length) return false;
+				whole.add(block, length);
+				blockKey(block, length, key);
+				pair<unordered_map<string, long long>::iterator, bool> added = firstWith.insert(make_pair(string(key, DEDUP_KEY_BYTES), i));
+				firstOf.push_back(added.first->second);
+				if (added.second) keys.insert(keys.end(), key, key + DEDUP_KEY_BYTES);
+				keyOf.push_back(added.second ? keys.size() / DEDUP_KEY_BYTES - 1 : keyOf[added.first->second]);
+			}
+			stored.assign(keys.size() / DEDUP_KEY_BYTES, false);
+			whole.finish((unsigned char*) digest);
+			return true;
+		}
+
+		//Starts the record for the next block, or the end once there are none left. Returns false once even that's gone.
+		bool startRecord() {
+			if (ended) return false;
+			headSent = 0;
+			if (next == blocks) {
+				head[0] = DEDUP_END;
+				memcpy(head + 1, digest, 8);
+				headLength = 9;
+				ended = true;
+				return true;
+			}
+			int length = lengthOf(next);
+			if (firstOf[next] != next) {
+				head[0] = DEDUP_COPY;
+				headLength = 1 + putVarint(head + 1, firstOf[next]);
+				copiedBytes += length;
+			} else if (stored[keyOf[next]]) {
+				head[0] = DEDUP_STORED;
+				memcpy(head + 1, &keys[keyOf[next] * DEDUP_KEY_BYTES], DEDUP_KEY_BYTES);
+				headLength = 1 + DEDUP_KEY_BYTES;
+				storedBytes += length;
+			} else {
+				//The file got shorter since it was opened, which can't be sent as it was
+				if (pread(descriptor, block, length, next * DEDUP_BLOCK) != length) {
+					failed = true;
+					return false;
+				}
+				head[0] = DEDUP_DATA;
+				headLength = 1 + putVarint(head + 1, length);
+				blockLength = left = length;
+				dataBytes += length;
+			}
+			next++;
+			return true;
+		}
+
+	public:
+		//Opens a reader for "source", which isn't owned by it, working out the key of each block. Returns NULL if it
+		//isn't a regular file, or couldn't be read.
+		static DedupReader* open(FILE* source) {
+			struct stat status;
+			if (fstat(fileno(source), &status) != 0 || !S_ISREG(status.st_mode)) return NULL;
+			DedupReader* send = new DedupReader(fileno(source), status.st_size);
+			if (!send->scan()) {
+				delete send;
+				return NULL;
+			}
+			return send;
+		}
+
+		~DedupReader() {
+			delete[] block;
+		}
+
+		//Returns the keys of the file's blocks (leaving out any that are the same as an earlier one), all in a row, and
+		//how many there are in "count"
+		const char* getKeys(int* count) {
+			*count = stored.size();
+			return keys.empty() ? NULL : &keys[0];
+		}
+
+		//Notes that the store on the other side has the block with the given key (numbered as in getKeys)
+		void setStored(int key) {
+			if (key >= 0 && (size_t) key < stored.size()) stored[key] = true;
+		}
+
+		//Reads up to "room" bytes of what's to be sent into "to". Returns how many were read, 0 at the end and -1 if the
+		//file couldn't be read.
+		ssize_t read(char* to, size_t room) {
+			size_t send = 0;
+			while (send < room) {
+				if (headSent < headLength) {
+					size_t taken = headLength - headSent < (int) (room - send) ? headLength - headSent : room - send;
+					memcpy(to + send, head + headSent, taken);
+					headSent += taken;
+					send += taken;
+					continue;
+				}
+				if (left > 0) {
+					size_t taken = room - send < (size_t) left ? room - send : left;
+					memcpy(to + send, block + blockLength - left, taken);
+					left -= taken;
+					send += taken;
+					continue;
+				}
+				if (!startRecord()) break;
+			}
+			return failed && send == 0 ? -1 : send;
+		}
+
+		//Returns how many bytes of the file went as data
+		long long getDataBytes() {
+			return dataBytes;
+		}
+
+		//Returns how many bytes of the file didn't need sending, because the store had them or they came earlier in the file
+		long long getSavedBytes() {
+			return storedBytes + copiedBytes;
+		}
+};
+
+
+//Writes what a DedupReader sent into the receiving side's file, keeping every block that comes as data in the store.
+//The file has to be open for reading too, as blocks that come more than once are copied from it.
+//Anything that doesn't start with DEDUP_MAGIC isn't a deduplicated transfer, and is written as it is.
+class DedupWriter {
+	private:
+		FILE* output;
+		BlockStore* store;
+		//The magic or start of a record being taken in, and how much of it has been
+		char head[1 + DEDUP_KEY_BYTES];
+		int headLength;
+		bool started, plain, broken, ended;
+		//The data block being taken in, how much of it has been, and how long it is
+		char* block;
+		int filled, blockLength;
+		//How many blocks have been written
+		long long written;
+		FileDigest* digest;
+		int result;
+		long long dataBytes, storedBytes, copiedBytes;
+
+		//Writes a whole block of the file
+		void writeBlock(const char* data, int length) {
+			if ((int) fwrite(data, 1, length, output) != length) broken = true;
+			digest->add(data, length);
+			written++;
+		}
+
+		//Acts on the start of a record once enough of it is there to. Returns false if it makes no sense.
+		bool takeRecord() {
+			unsigned int value;
+			switch (head[0]) {
+				case DEDUP_DATA:
+					if (getVarint(head + 1, headLength - 1, &value) == 0) return headLength - 1 < WIRE_MAX_VARINT;
+					headLength = 0;
+					filled = 0;
+					blockLength = value;
+					return value > 0 && value <= DEDUP_BLOCK;
+				case DEDUP_STORED: {
+					if (headLength < 1 + DEDUP_KEY_BYTES) return true;
+					headLength = 0;
+					int length;
+					if (!store->get(head + 1, block, &length)) return false;
+					writeBlock(block, length);
+					storedBytes += length;
+					return true;
+				}
+				case DEDUP_COPY:
+					if (getVarint(head + 1, headLength - 1, &value) == 0) return headLength - 1 < WIRE_MAX_VARINT;
+					headLength = 0;
+					//Only a whole block can be the same as a later one
+					if (value >= written || fflush(output) != 0) return false;
+					if (pread(fileno(output), block, DEDUP_BLOCK, (off_t) value * DEDUP_BLOCK) != DEDUP_BLOCK) return false;
+					writeBlock(block, DEDUP_BLOCK);
+					copiedBytes += DEDUP_BLOCK;
+					return true;
+				case DEDUP_END: {
+					if (headLength < 9) return true;
+					headLength = 0;
+					unsigned char sum[8];
+					digest->finish(sum);
+					result = memcmp(sum, head + 1, 8) == 0 ? DIGEST_MATCH : DIGEST_MISMATCH;
+					ended = true;
+					return true;
+				}
+			}
+			return false;
+		}
+
+	public:
+		//Writes into "file" and keeps blocks in "keep", neither of them owned by the writer
+		DedupWriter(FILE* file, BlockStore* keep) {
+			output = file;
+			store = keep;
+			headLength = 0;
+			started = plain = broken = ended = false;
+			block = new char[DEDUP_BLOCK];
+			filled = blockLength = 0;
+			written = 0;
+			digest = new FileDigest(DIGEST_XXH64);
+			result = DIGEST_UNCHECKED;
+			dataBytes = storedBytes = copiedBytes = 0;
+		}
+
+		~DedupWriter() {
+			delete[] block;
+			delete digest;
+		}
+
+		//Takes the next bytes of what was sent. Returns false once it's turned out not to make sense, or the file won't take it.
+		bool write(const char* data, size_t length) {
+			if (plain) {
+				if (fwrite(data, 1, length, output) != length) broken = true;
+				return !broken;
+			}
+			while (length > 0 && !broken) {
+				if (!started) {
+					head[headLength] = *data++;
+					length--;
+					if (head[headLength] != DEDUP_MAGIC[headLength]) {
+						plain = true;
+						if (fwrite(head, 1, headLength + 1, output) != (size_t) headLength + 1 || fwrite(data, 1, length, output) != length) broken = true;
+						return !broken;
+					}
+					if (++headLength == DEDUP_MAGIC_BYTES) {
+						started = true;
+						headLength = 0;
+					}
+					continue;
+				}
+				if (filled < blockLength) {
+					size_t taken = length < (size_t) (blockLength - filled) ? length : blockLength - filled;
+					memcpy(block + filled, data, taken);
+					filled += taken;
+					data += taken;
+					length -= taken;
+					if (filled == blockLength) {
+						char key[DEDUP_KEY_BYTES];
+						blockKey(block, blockLength, key);
+						store->put(key, block, blockLength);
+						writeBlock(block, blockLength);
+						dataBytes += blockLength;
+						filled = blockLength = 0;
+					}
+					continue;
+				}
+				//Nothing can come after the end
+				if (ended) broken = true;
+				else {
+					head[headLength++] = *data++;
+					length--;
+					//A record can make sense and still not get written, which has already broken the writer
+					if (!takeRecord()) broken = true;
+				}
+			}
+			return !broken;
+		}
+
+		//Flushes the file and the store once nothing more is coming, and returns how putting the file back together went:
+		//DIGEST_MATCH if it's the same as the sending side's, DIGEST_MISMATCH if it isn't or something went wrong on the way,
+		//and DIGEST_UNCHECKED if this wasn't a deduplicated transfer at all (unless the file wouldn't take it).
+		int finish() {
+			if (!started && !plain && headLength > 0) {
+				if (fwrite(head, 1, headLength, output) != (size_t) headLength) broken = true;
+				plain = true;
+			}
+			if (fflush(output) != 0 || ferror(output)) broken = true;
+			store->finish();
+			if (broken) return DIGEST_MISMATCH;
+			if (!started) return DIGEST_UNCHECKED;
+			return !ended ? DIGEST_MISMATCH : result;
+		}
+
+		//Returns how many bytes of the file came as data
+		long long getDataBytes() {
+			return dataBytes;
+		}
+
+		//Returns how many bytes of the file didn't need sending, because the store had them or they came earlier in the file
+		long long getSavedBytes() {
+			return storedBytes + copiedBytes;
+		}
+};
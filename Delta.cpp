@@ -0,0 +1,568 @@
+#include <vector>
+#include <math.h>
+
+
+//Delta transfers, the way rsync does them. When the receiving side already has an old copy of the file (its "basis"),
+//it cuts that into blocks and sends the sending side two checksums of each: a weak one that can be rolled along the file a
+//byte at a time, and XXH64 to be sure. The sending side rolls the weak checksum along its own file looking for blocks the
+//other side already has, and instead of the file sends a stream of the data it has to (literals) and references to those
+//blocks. The receiving side puts the file back together from the stream and its basis.
+//The stream goes through the protocols exactly like a file would, so they don't need to know anything about it:
+//	magic     the 8 bytes of DELTA_MAGIC
+//	literal   DELTA_LITERAL (1 byte), how long it is (varint), then that many bytes of the file
+//	copy      DELTA_COPY (1 byte), the first block (varint), then how many blocks in a row (varint)
+//	end       DELTA_END (1 byte), then the XXH64 of the whole file as the sending side read it (8 bytes)
+//The end is there because a block can, very rarely, match both checksums without being the same, so the file put back
+//together is checked against it.
+#define DELTA_MAGIC "GBNDLT01"
+#define DELTA_MAGIC_BYTES 8
+#define DELTA_LITERAL 0
+#define DELTA_COPY 1
+#define DELTA_END 2
+
+//How big the blocks are when nobody says: about the square root of the basis's size, kept between these
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK 65536
+
+//How much data goes in one literal at most, which also bounds how much of the file the sending side holds on to
+#define DELTA_MAX_LITERAL 65536
+
+//How many bytes each block's signature takes on the wire: the weak checksum (4 bytes) then XXH64 (8 bytes), lowest byte first
+#define DELTA_SIGNATURE_BYTES 12
+
+
+//The weak checksum of a block is two sums, "a" of its bytes and "b" of each byte times how far it is from the end
+//(counting the last as 1). Taking one byte off the front and putting another on the back only needs the two bytes.
+static inline uint32_t weakChecksum(uint32_t a, uint32_t b) {
+	return (a & 0xFFFF) | (b << 16);
+}
+
+//Works out both sums of a block from scratch
+static void weakSums(const char* data, int length, uint32_t* a, uint32_t* b) {
+	uint32_t sumA = 0, sumB = 0;
+	for (int i = 0; i < length; i++) {
+		sumA += (unsigned char) data[i];
+		sumB += sumA;
+	}
+	*a = sumA;
+	*b = sumB;
+}
+
+//Rolls both sums of a block of "length" bytes one byte along: "out" leaves the front, "in" joins the back
+static inline void rollSums(uint32_t* a, uint32_t* b, unsigned char out, unsigned char in, int length) {
+	*a += in - out;
+	*b += *a - (uint32_t) length * out;
+}
+
+//The strong checksum of a block
+static uint64_t strongChecksum(const char* data, int length) {
+	FileDigest digest(DIGEST_XXH64);
+	digest.add(data, length);
+	unsigned char out[8];
+	digest.finish(out);
+	return readLittle64(out);
+}
+
+
+//The signatures of every block of the receiving side's basis. The receiving side works them out from the file, and the
+//sending side fills them in as they arrive, then looks blocks up by their weak checksum.
+class BlockSignatures {
+	private:
+		//How long the blocks are, how many there are, and how long the last one is (it can be shorter)
+		int blockSize, count, lastLength;
+		vector<uint32_t> weak;
+		vector<uint64_t> strong;
+		//Which blocks' signatures are in, and how many that is
+		vector<bool> known;
+		int knownCount;
+		//The whole blocks by weak checksum, once index is called: heads holds the first block in each slot (-1 for none),
+		//and "next" the block after each in its slot. "tags" has a bit for each 16 bit hash of a weak checksum in the table,
+		//small enough to stay in the L1 cache, so the bytes that can't start a block (nearly all of them) are turned away quickly.
+		vector<int> heads, next;
+		uint32_t mask;
+		vector<uint64_t> tags;
+
+		static inline uint32_t tagOf(uint32_t checksum) {
+			return (checksum ^ (checksum >> 16)) & 0xFFFF;
+		}
+
+	public:
+		BlockSignatures(int size, int blocks, int last) {
+			weak.assign(blocks, 0);
+			strong.assign(blocks, 0);
+			known.assign(blocks, false);
+			blockSize = size;
+			count = blocks;
+			lastLength = last;
+			knownCount = 0;
+			mask = 0;
+		}
+
+		//Works out the signatures of every block of the given file, from where it is now to the end, with blocks of the given
+		//size (0 picks one from the file's size). Returns NULL if the file couldn't be read.
+		static BlockSignatures* fromFile(FILE* file, int size) {
+			if (size <= 0) {
+				off_t start = ftello(file);
+				if (start == -1 || fseeko(file, 0, SEEK_END) != 0) return NULL;
+				off_t length = ftello(file) - start;
+				fseeko(file, start, SEEK_SET);
+				size = ((int) sqrt((double) length) + 63) & ~63;
+				if (size < DELTA_MIN_BLOCK) size = DELTA_MIN_BLOCK;
+				if (size > DELTA_MAX_BLOCK) size = DELTA_MAX_BLOCK;
+			}
+
+			BlockSignatures* send = new BlockSignatures(size, 0, 0);
+			char* block = new char[size];
+			size_t got;
+			while ((got = fread(block, 1, size, file)) > 0) {
+				uint32_t a, b;
+				weakSums(block, got, &a, &b);
+				send->weak.push_back(weakChecksum(a, b));
+				send->strong.push_back(strongChecksum(block, got));
+				send->known.push_back(true);
+				send->lastLength = got;
+				if (got < (size_t) size) break;
+			}
+			delete[] block;
+			if (ferror(file)) {
+				delete send;
+				return NULL;
+			}
+			send->count = send->knownCount = send->weak.size();
+			return send;
+		}
+
+		int getBlockSize() {
+			return blockSize;
+		}
+
+		int getCount() {
+			return count;
+		}
+
+		int getLastLength() {
+			return lastLength;
+		}
+
+		//Returns how long the given block is
+		int blockLength(int index) {
+			return index == count - 1 ? lastLength : blockSize;
+		}
+
+		//Returns true once every block's signature is in
+		bool isComplete() {
+			return knownCount == count;
+		}
+
+		//Returns the first block from "from" on whose signature isn't in yet, or the number of blocks if there's none
+		int firstMissing(int from) {
+			while (from < count && known[from]) from++;
+			return from;
+		}
+
+		//Writes the signatures of up to "most" blocks from "first" on, as they go on the wire, returning how many bytes it took
+		int put(char* to, int first, int most) {
+			int send = 0;
+			for (int i = first; i < count && i < first + most; i++) {
+				for (int j = 0; j < 4; j++) to[send++] = (char) (weak[i] >> (8 * j));
+				for (int j = 0; j < 8; j++) to[send++] = (char) (strong[i] >> (8 * j));
+			}
+			return send;
+		}
+
+		//Reads "records" signatures as they come off the wire, for the blocks from "first" on. Any past the last block are ignored.
+		void get(const char* from, int records, int first) {
+			for (int i = 0; i < records && first + i < count; i++, from += DELTA_SIGNATURE_BYTES) {
+				int block = first + i;
+				weak[block] = readLittle32((const unsigned char*) from);
+				strong[block] = readLittle64((const unsigned char*) from + 4);
+				if (!known[block]) knownCount++;
+				known[block] = true;
+			}
+		}
+
+		//Builds the table find looks blocks up in, from whichever whole blocks' signatures are in.
+		//Returns how many blocks went in it.
+		int index() {
+			int send = 0;
+			uint32_t slots = 1;
+			while (slots < (uint32_t) count * 2) slots <<= 1;
+			mask = slots - 1;
+			heads.assign(slots, -1);
+			next.assign(count, -1);
+			tags.assign(65536 / 64, 0);
+			//Going backwards leaves each slot's blocks in order, so the first of two identical blocks is the one found
+			for (int i = count - 1; i >= 0; i--) {
+				if (!known[i] || blockLength(i) != blockSize) continue;
+				uint32_t slot = (weak[i] ^ (weak[i] >> 16)) & mask;
+				next[i] = heads[slot];
+				heads[slot] = i;
+				tags[tagOf(weak[i]) >> 6] |= (uint64_t) 1 << (tagOf(weak[i]) & 63);
+				send++;
+			}
+			return send;
+		}
+
+		//Returns the whole block the given data (blockSize bytes, with the given weak checksum) matches, or -1 if there's none.
+		//"preferred" is tried first, since the block after the last one matched is the likeliest to match next.
+		int find(uint32_t checksum, const char* data, int preferred) {
+			uint32_t tag = tagOf(checksum);
+			if (!(tags[tag >> 6] >> (tag & 63) & 1)) return -1;
+			int at = heads[(checksum ^ (checksum >> 16)) & mask];
+			if (at == -1) return -1;
+			uint64_t sum = 0;
+			bool summed = false;
+			if (preferred >= 0 && preferred < count && known[preferred] && weak[preferred] == checksum && blockLength(preferred) == blockSize) {
+				sum = strongChecksum(data, blockSize);
+				summed = true;
+				if (strong[preferred] == sum) return preferred;
+			}
+			for (; at != -1; at = next[at]) {
+				if (weak[at] != checksum) continue;
+				if (!summed) {
+					sum = strongChecksum(data, blockSize);
+					summed = true;
+				}
+				if (strong[at] == sum) return at;
+			}
+			return -1;
+		}
+
+		//Returns true if the given data matches the last block, when that's shorter than the rest
+		bool matchesLast(const char* data, int length) {
+			int last = count - 1;
+			if (last < 0 || !known[last] || length != lastLength || lastLength == blockSize) return false;
+			uint32_t a, b;
+			weakSums(data, length, &a, &b);
+			return weak[last] == weakChecksum(a, b) && strong[last] == strongChecksum(data, length);
+		}
+};
+
+
+//Turns the sending side's file into a delta stream against the other side's signatures, as it's read
+class DeltaEncoder {
+	private:
+		FILE* source;
+		BlockSignatures* signatures;
+		int blockSize;
+		//The file as read so far. The bytes from "literal" up to "at" are waiting to go out as a literal, and the block being
+		//looked for starts at "at". "filled" is how much of "data" holds the file, and "capacity" how much it could.
+		char* data;
+		int capacity, filled, literal, at;
+		//Set once all of the file has been read, and once the end of the stream has been made.
+		//"matching" is false if there isn't a single whole block to look for.
+		bool ended, done, matching;
+		//Whether "a" and "b" hold the weak sums of the block at "at"
+		bool rolling;
+		uint32_t a, b;
+		//A run of blocks to copy that hasn't been written into the stream yet (copyCount is 0 if there's none)
+		int copyFirst, copyCount;
+		//The stream made but not read yet, from outAt on
+		vector<char> out;
+		size_t outAt;
+		FileDigest* digest;
+		long literalBytes, copiedBytes;
+
+		void putVarintOut(unsigned int value) {
+			char bytes[WIRE_MAX_VARINT];
+			out.insert(out.end(), bytes, bytes + putVarint(bytes, value));
+		}
+
+		void flushCopy() {
+			if (copyCount == 0) return;
+			out.push_back(DELTA_COPY);
+			putVarintOut(copyFirst);
+			putVarintOut(copyCount);
+			copyCount = 0;
+		}
+
+		//Puts everything from "literal" to "at" in the stream as a literal
+		void flushLiteral() {
+			if (at == literal) return;
+			flushCopy();
+			out.push_back(DELTA_LITERAL);
+			putVarintOut(at - literal);
+			out.insert(out.end(), data + literal, data + at);
+			literalBytes += at - literal;
+			literal = at;
+		}
+
+		//Adds the given block to the run being copied, which first puts whatever comes before it in the stream
+		void addCopy(int block) {
+			flushLiteral();
+			if (copyCount > 0 && block != copyFirst + copyCount) flushCopy();
+			if (copyCount == 0) copyFirst = block;
+			copyCount++;
+			copiedBytes += signatures->blockLength(block);
+		}
+
+		//Moves what's still wanted to the front of "data", and reads in more of the file behind it
+		void refill() {
+			memmove(data, data + literal, filled - literal);
+			filled -= literal;
+			at -= literal;
+			literal = 0;
+			while (!ended && filled < capacity) {
+				size_t got = fread(data + filled, 1, capacity - filled, source);
+				digest->add(data + filled, got);
+				filled += got;
+				if (got == 0) ended = true;
+			}
+		}
+
+		//Makes more of the stream, until there's something to read or it's over
+		void produce() {
+			while (outAt == out.size() && !done) {
+				if (filled - at < blockSize && !ended) refill();
+				int left = filled - at;
+
+				//What's left is too short for a whole block, but might still be the basis's short last block
+				if (left < blockSize) {
+					if (left > 0 && signatures->matchesLast(data + at, left)) {
+						addCopy(signatures->getCount() - 1);
+						literal = at = filled;
+					}
+					at = filled;
+					flushLiteral();
+					flushCopy();
+					out.push_back(DELTA_END);
+					unsigned char sum[8];
+					digest->finish(sum);
+					out.insert(out.end(), sum, sum + 8);
+					done = true;
+					break;
+				}
+
+				//With nothing to look for, it's all literal
+				if (!matching) {
+					at = filled - literal > DELTA_MAX_LITERAL ? literal + DELTA_MAX_LITERAL : filled;
+					flushLiteral();
+					continue;
+				}
+
+				if (!rolling) {
+					weakSums(data + at, blockSize, &a, &b);
+					rolling = true;
+				}
+				//Look for a block at each byte in turn, each one that doesn't start one going in the literal, until one does,
+				//the literal is as long as it can be, or there's no more of the file in "data" to roll on to
+				int found, preferred = copyCount > 0 ? copyFirst + copyCount : -1, last = filled - blockSize, stop = literal + DELTA_MAX_LITERAL;
+				while ((found = signatures->find(weakChecksum(a, b), data + at, preferred)) == -1 && at < last && at < stop) {
+					rollSums(&a, &b, data[at], data[at + blockSize], blockSize);
+					at++;
+				}
+				if (found != -1) {
+					addCopy(found);
+					at += blockSize;
+					literal = at;
+					rolling = false;
+				}
+				else if (at >= stop) flushLiteral();
+				else {
+					at++;
+					rolling = false;
+				}
+			}
+		}
+
+	public:
+		//Reads the file from "file", which isn't owned by the encoder, against the given signatures, which are
+		DeltaEncoder(FILE* file, BlockSignatures* blocks) {
+			source = file;
+			signatures = blocks;
+			matching = signatures->index() > 0;
+			blockSize = signatures->getBlockSize();
+			capacity = DELTA_MAX_LITERAL + 2 * blockSize;
+			data = new char[capacity];
+			filled = literal = at = 0;
+			ended = done = rolling = false;
+			a = b = 0;
+			copyFirst = copyCount = 0;
+			out.insert(out.end(), DELTA_MAGIC, DELTA_MAGIC + DELTA_MAGIC_BYTES);
+			outAt = 0;
+			digest = new FileDigest(DIGEST_XXH64);
+			literalBytes = copiedBytes = 0;
+		}
+
+		~DeltaEncoder() {
+			delete[] data;
+			delete digest;
+			delete signatures;
+		}
+
+		//Reads up to "room" bytes of the stream into "to". Returns how many were read, which is 0 once it's over.
+		int read(char* to, int room) {
+			int send = 0;
+			while (send < room) {
+				if (outAt == out.size()) {
+					out.clear();
+					outAt = 0;
+					if (done) break;
+					produce();
+					continue;
+				}
+				int taken = out.size() - outAt < (size_t) (room - send) ? out.size() - outAt : room - send;
+				memcpy(to + send, &out[outAt], taken);
+				outAt += taken;
+				send += taken;
+			}
+			return send;
+		}
+
+		//Returns how much of the file went in the stream as literals so far
+		long getLiteralBytes() {
+			return literalBytes;
+		}
+
+		//Returns how much of the file was left for the other side to copy from its basis so far
+		long getCopiedBytes() {
+			return copiedBytes;
+		}
+};
+
+
+//Puts the file back together on the receiving side, from a delta stream and the basis
+class DeltaDecoder {
+	private:
+		FILE *output, *basis;
+		BlockSignatures* signatures;
+		//The op being read, up to the end of its varints (or its digest), and how much of a literal is still to come
+		char head[1 + DELTA_MAGIC_BYTES + 2 * WIRE_MAX_VARINT];
+		int headLength;
+		long literalLeft;
+		//How much of the magic has come so far. A stream that doesn't start with it isn't a delta, and is written as it is.
+		int magicSeen;
+		bool plain, ended, broken;
+		char* block;
+		FileDigest* digest;
+		unsigned char expected[8];
+		long literalBytes, copiedBytes;
+
+		//Writes to the output, digesting what it takes. Anything it won't take breaks the decoder.
+		void put(const char* data, size_t length) {
+			if (fwrite(data, 1, length, output) != length) broken = true;
+			else digest->add(data, length);
+		}
+
+		//Copies the given blocks of the basis to the output. Returns false if there's no such block.
+		bool copyBlocks(unsigned int first, unsigned int blocks) {
+			if (first >= (unsigned int) signatures->getCount() || blocks > (unsigned int) signatures->getCount() - first) return false;
+			if (fseeko(basis, (off_t) first * signatures->getBlockSize(), SEEK_SET) != 0) return false;
+			for (unsigned int i = first; i < first + blocks; i++) {
+				int length = signatures->blockLength(i);
+				if (fread(block, 1, length, basis) != (size_t) length) return false;
+				put(block, length);
+				copiedBytes += length;
+			}
+			return true;
+		}
+
+		//Acts on the op in "head", if all of it is there. Returns false if it makes no sense.
+		bool takeHead() {
+			unsigned int first, blocks;
+			int used;
+			switch (head[0]) {
+				case DELTA_LITERAL:
+					used = getVarint(head + 1, headLength - 1, &first);
+					if (used == 0) return headLength - 1 < WIRE_MAX_VARINT;
+					literalLeft = first;
+					headLength = 0;
+					return true;
+				case DELTA_COPY:
+					used = getVarint(head + 1, headLength - 1, &first);
+					if (used == 0) return headLength - 1 < WIRE_MAX_VARINT;
+					if (getVarint(head + 1 + used, headLength - 1 - used, &blocks) == 0) return headLength - 1 - used < WIRE_MAX_VARINT;
+					headLength = 0;
+					return copyBlocks(first, blocks);
+				case DELTA_END:
+					if (headLength < 9) return true;
+					memcpy(expected, head + 1, 8);
+					ended = true;
+					headLength = 0;
+					return true;
+				default:
+					return false;
+			}
+		}
+
+	public:
+		//Writes the file to "file" and reads blocks from "old", neither of them owned by the decoder.
+		//"blocks" are the basis's signatures, for the size of its blocks.
+		DeltaDecoder(FILE* file, FILE* old, BlockSignatures* blocks) {
+			output = file;
+			basis = old;
+			signatures = blocks;
+			headLength = 0;
+			literalLeft = 0;
+			magicSeen = 0;
+			plain = ended = broken = false;
+			block = new char[signatures->getBlockSize()];
+			digest = new FileDigest(DIGEST_XXH64);
+			literalBytes = copiedBytes = 0;
+		}
+
+		~DeltaDecoder() {
+			delete[] block;
+			delete digest;
+		}
+
+		//Takes the next bytes of the stream. Returns false once it's turned out not to make sense, or the output won't take it.
+		bool write(const char* data, size_t length) {
+			if (plain) {
+				if (fwrite(data, 1, length, output) != length) broken = true;
+				return !broken;
+			}
+			while (length > 0 && !broken) {
+				if (magicSeen < DELTA_MAGIC_BYTES) {
+					head[magicSeen] = *data;
+					if (*data++ != DELTA_MAGIC[magicSeen++]) {
+						//Not a delta after all
+						plain = true;
+						if (fwrite(head, 1, magicSeen, output) != (size_t) magicSeen || fwrite(data, 1, length - 1, output) != length - 1) broken = true;
+						return !broken;
+					}
+					length--;
+					continue;
+				}
+				if (literalLeft > 0) {
+					size_t taken = length < (size_t) literalLeft ? length : literalLeft;
+					put(data, taken);
+					literalBytes += taken;
+					literalLeft -= taken;
+					data += taken;
+					length -= taken;
+					continue;
+				}
+				//Nothing may follow the end
+				if (ended || headLength == (int) sizeof(head)) broken = true;
+				else {
+					head[headLength++] = *data++;
+					length--;
+					broken = !takeHead();
+				}
+			}
+			return !broken;
+		}
+
+		//Says how putting the file back together went, once the stream is over: DIGEST_MATCH if it came out as the sending
+		//side read it, DIGEST_MISMATCH if it didn't, the stream was cut short or the output wouldn't take all of it, and
+		//DIGEST_UNCHECKED if it wasn't a delta.
+		int finish() {
+			//Whatever the output still has buffered has to make it out too
+			if (fflush(output) != 0 || ferror(output)) broken = true;
+			if (broken) return DIGEST_MISMATCH;
+			if (plain || magicSeen == 0) return DIGEST_UNCHECKED;
+			if (!ended || headLength > 0 || literalLeft > 0) return DIGEST_MISMATCH;
+			unsigned char sum[8];
+			digest->finish(sum);
+			return memcmp(sum, expected, 8) == 0 ? DIGEST_MATCH : DIGEST_MISMATCH;
+		}
+
+		long getLiteralBytes() {
+			return literalBytes;
+		}
+
+		long getCopiedBytes() {
+			return copiedBytes;
+		}
+};
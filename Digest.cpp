@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+
+//Digests of a whole file, worked out a piece at a time as the file goes by, so checking a transfer never means
+//reading the file again. MD5 is there to match what md5sum prints, and XXH64 (xxHash) is several times faster,
+//for when only the two sides need to agree.
+#define DIGEST_MD5 0
+#define DIGEST_XXH64 1
+#define NUM_DIGESTS 2
+#define ALL_DIGESTS ((1 << NUM_DIGESTS) - 1)
+
+//The longest any digest is, in bytes
+#define DIGEST_MAX_BYTES 16
+
+static const char* digestNames[NUM_DIGESTS] = {"md5", "xxh64"};
+static const int digestLengths[NUM_DIGESTS] = {16, 8};
+
+//How a transfer's digests compared
+#define DIGEST_UNCHECKED -1		//There was nothing to compare, for example because the other side never sent one
+#define DIGEST_MISMATCH 0
+#define DIGEST_MATCH 1
+
+//Returns the best digest in the given set (1 << DIGEST_...), or -1 if it's empty
+int bestDigest(int offered) {
+	for (int i = NUM_DIGESTS - 1; i >= 0; i--) {
+		if (offered & (1 << i)) return i;
+	}
+	return -1;
+}
+
+static const uint64_t XXH_PRIME1 = 0x9E3779B185EBCA87ULL, XXH_PRIME2 = 0xC2B2AE3D27D4EB4FULL, XXH_PRIME3 = 0x165667B19E3779F9ULL,
+	XXH_PRIME4 = 0x85EBCA77C2B2AE63ULL, XXH_PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static const uint32_t md5Shifts[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static const uint32_t md5Constants[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static inline uint32_t rotate32(uint32_t value, int bits) {
+	return (value << bits) | (value >> (32 - bits));
+}
+
+static inline uint64_t rotate64(uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+//Reads little endian numbers, whatever this machine's byte order
+static inline uint32_t readLittle32(const unsigned char* bytes) {
+	return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+static inline uint64_t readLittle64(const unsigned char* bytes) {
+	return readLittle32(bytes) | (uint64_t) readLittle32(bytes + 4) << 32;
+}
+
+
+//One file's digest, fed the file's bytes in order with add, and read once at the end with finish
+class FileDigest {
+	private:
+		int algorithm;
+		//Bytes that don't make up a whole block yet (64 for MD5, 32 for XXH64), and how many have been added in all
+		unsigned char pending[64];
+		int pendingBytes;
+		uint64_t total;
+		//MD5's four words, or XXH64's four lanes
+		uint32_t md5[4];
+		uint64_t lanes[4];
+
+		//One step of an MD5 round: "mixed" is the round's function of b, c and d
+		static inline void md5Step(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d, uint32_t mixed, uint32_t word, int step) {
+			uint32_t next = d;
+			d = c;
+			c = b;
+			b = b + rotate32(a + mixed + md5Constants[step] + word, md5Shifts[step]);
+			a = next;
+		}
+
+		void md5Block(const unsigned char* block) {
+			uint32_t words[16];
+			for (int i = 0; i < 16; i++) words[i] = readLittle32(block + i * 4);
+			uint32_t a = md5[0], b = md5[1], c = md5[2], d = md5[3];
+			//One loop per round, so the compiler can unroll each without a branch on the round in every step
+			_Pragma("GCC unroll 16") for (int i = 0; i < 16; i++) md5Step(a, b, c, d, d ^ (b & (c ^ d)), words[i], i);
+			_Pragma("GCC unroll 16") for (int i = 16; i < 32; i++) md5Step(a, b, c, d, c ^ (d & (b ^ c)), words[(5 * i + 1) & 15], i);
+			_Pragma("GCC unroll 16") for (int i = 32; i < 48; i++) md5Step(a, b, c, d, b ^ c ^ d, words[(3 * i + 5) & 15], i);
+			_Pragma("GCC unroll 16") for (int i = 48; i < 64; i++) md5Step(a, b, c, d, c ^ (b | ~d), words[(7 * i) & 15], i);
+			md5[0] += a;
+			md5[1] += b;
+			md5[2] += c;
+			md5[3] += d;
+		}
+
+		static uint64_t xxhRound(uint64_t lane, uint64_t input) {
+			return rotate64(lane + input * XXH_PRIME2, 31) * XXH_PRIME1;
+		}
+
+		static uint64_t xxhMerge(uint64_t hash, uint64_t lane) {
+			return (hash ^ xxhRound(0, lane)) * XXH_PRIME1 + XXH_PRIME4;
+		}
+
+		void xxhBlock(const unsigned char* block) {
+			for (int i = 0; i < 4; i++) lanes[i] = xxhRound(lanes[i], readLittle64(block + i * 8));
+		}
+
+		//Works through a whole block of the current algorithm
+		void block(const unsigned char* bytes) {
+			if (algorithm == DIGEST_MD5) md5Block(bytes);
+			else xxhBlock(bytes);
+		}
+
+		int blockSize() {
+			return algorithm == DIGEST_MD5 ? 64 : 32;
+		}
+
+	public:
+		FileDigest(int digestAlgorithm) {
+			algorithm = digestAlgorithm;
+			pendingBytes = 0;
+			total = 0;
+			md5[0] = 0x67452301;
+			md5[1] = 0xefcdab89;
+			md5[2] = 0x98badcfe;
+			md5[3] = 0x10325476;
+			lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+			lanes[1] = XXH_PRIME2;
+			lanes[2] = 0;
+			lanes[3] = -XXH_PRIME1;
+		}
+
+		//Adds the next bytes of the file
+		void add(const char* data, size_t length) {
+			const unsigned char* next = (const unsigned char*) data;
+			int size = blockSize();
+			total += length;
+			//Finish off a block started by an earlier call first
+			if (pendingBytes > 0) {
+				size_t taken = length < (size_t) (size - pendingBytes) ? length : size - pendingBytes;
+				memcpy(pending + pendingBytes, next, taken);
+				pendingBytes += taken;
+				next += taken;
+				length -= taken;
+				if (pendingBytes < size) return;
+				block(pending);
+				pendingBytes = 0;
+			}
+			for (; length >= (size_t) size; length -= size, next += size) block(next);
+			memcpy(pending, next, length);
+			pendingBytes = length;
+		}
+
+		//Writes the digest, in the byte order its usual hex form is printed in, to "out" and returns how long it is.
+		//Nothing can be added afterwards.
+		int finish(unsigned char* out) {
+			if (algorithm == DIGEST_MD5) {
+				uint64_t bits = total * 8;
+				unsigned char padding[72] = {0x80};
+				int padded = (pendingBytes < 56 ? 56 : 120) - pendingBytes;
+				for (int i = 0; i < 8; i++) padding[padded + i] = (unsigned char) (bits >> (8 * i));
+				add((char*) padding, padded + 8);
+				for (int i = 0; i < 16; i++) out[i] = (unsigned char) (md5[i / 4] >> (8 * (i % 4)));
+				return 16;
+			}
+
+			uint64_t hash;
+			if (total >= 32) {
+				hash = rotate64(lanes[0], 1) + rotate64(lanes[1], 7) + rotate64(lanes[2], 12) + rotate64(lanes[3], 18);
+				for (int i = 0; i < 4; i++) hash = xxhMerge(hash, lanes[i]);
+			}
+			else hash = XXH_PRIME5;
+			hash += total;
+
+			int at = 0;
+			for (; at + 8 <= pendingBytes; at += 8) hash = rotate64(hash ^ xxhRound(0, readLittle64(pending + at)), 27) * XXH_PRIME1 + XXH_PRIME4;
+			if (at + 4 <= pendingBytes) {
+				hash = rotate64(hash ^ (readLittle32(pending + at) * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+				at += 4;
+			}
+			for (; at < pendingBytes; at++) hash = rotate64(hash ^ (pending[at] * XXH_PRIME5), 11) * XXH_PRIME1;
+			hash ^= hash >> 33;
+			hash *= XXH_PRIME2;
+			hash ^= hash >> 29;
+			hash *= XXH_PRIME3;
+			hash ^= hash >> 32;
+			for (int i = 0; i < 8; i++) out[i] = (unsigned char) (hash >> (56 - 8 * i));
+			return 8;
+		}
+
+		int getAlgorithm() {
+			return algorithm;
+		}
+
+		//Writes the given digest bytes as lowercase hex (with a terminating 0) to "out", which needs room for 2 * length + 1
+		static void toHex(unsigned char* digest, int length, char* out) {
+			for (int i = 0; i < length; i++) snprintf(out + 2 * i, 3, "%02x", digest[i]);
+			out[2 * length] = '\0';
+		}
+};
@@ -0,0 +1,188 @@
+#include <vector>
+
+
+//Forward error correction. For every group of packets sent in a round, the sender also sends a parity packet holding the
+//XOR of their data, so the receiver can rebuild any one of them that got lost from the rest of the group, instead of
+//waiting a whole round (timeout included) for it to be sent again. XOR can only bring back one packet per group, so
+//smaller groups rebuild more at the cost of more parity: a group of K packets adds 1/K to what's sent.
+//Groups never span rounds. The receiver rebuilds what it can at the end of each round, and then forgets that round's parity.
+
+//XORs "length" bytes of "from" into "to"
+static void xorInto(char* to, const char* from, int length) {
+	int i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t a, b;
+		memcpy(&a, to + i, 8);
+		memcpy(&b, from + i, 8);
+		a ^= b;
+		memcpy(to + i, &a, 8);
+	}
+	for (; i < length; i++) to[i] ^= from[i];
+}
+
+
+//Builds parity packets on the sending side, one group at a time
+class ParityEncoder {
+	private:
+		int groupSize, count, longest;
+		int ids[WIRE_MAX_GROUP];
+		unsigned int lengthXor;
+		//The XOR of the group's data so far. Only the first "longest" bytes mean anything.
+		char* data;
+
+	public:
+		//"group" is how many packets go in each group, and "packetSize" the most data a packet can hold
+		ParityEncoder(int group, int packetSize) {
+			groupSize = group;
+			count = longest = 0;
+			lengthXor = 0;
+			data = new char[packetSize];
+		}
+
+		~ParityEncoder() {
+			delete[] data;
+		}
+
+		//Adds a packet to the group. Returns true once the group is full, meaning its parity should go out.
+		bool add(int id, const char* content, int length) {
+			if (length > longest) {
+				memset(data + longest, 0, length - longest);
+				longest = length;
+			}
+			xorInto(data, content, length);
+			lengthXor ^= length;
+			ids[count++] = id;
+			return count == groupSize;
+		}
+
+		//Returns how many packets are in the group so far
+		int size() {
+			return count;
+		}
+
+		//Returns the id of the first packet in the group
+		int firstId() {
+			return ids[0];
+		}
+
+		//Writes the group's parity datagram to "frame", which needs room for WIRE_MAX_PARITY_HEADER, the packet size and
+		//WIRE_PARITY_CHECK_BYTES, and starts a new group. "round" is the number of the round it's sent in.
+		//Returns how long the datagram is.
+		int finish(char* frame, unsigned char round) {
+			int used = putParityHeader(frame, round, ids, count, lengthXor);
+			memcpy(frame + used, data, longest);
+			used += longest;
+			uint32_t check = crc32c(frame + 1, used - 1);
+			for (int i = 0; i < WIRE_PARITY_CHECK_BYTES; i++) frame[used + i] = (char) (check >> (8 * i));
+			count = longest = 0;
+			lengthXor = 0;
+			return used + WIRE_PARITY_CHECK_BYTES;
+		}
+};
+
+
+//One parity packet, as the receiving side keeps it
+typedef struct ParityGroup {
+	int count, ids[WIRE_MAX_GROUP];
+	unsigned int lengthXor;
+	int length;
+	char* data;
+} ParityGroup;
+
+//Keeps the parity that arrives during a round on the receiving side, and rebuilds lost packets from it
+class ParityDecoder {
+	private:
+		vector<ParityGroup> groups;
+		int packetSize;
+
+	public:
+		//"packetSize" is the most data a packet can hold
+		ParityDecoder(int size) {
+			packetSize = size;
+		}
+
+		~ParityDecoder() {
+			forget();
+		}
+
+		//Keeps the given parity datagram, if it's intact and was sent in the given round. Returns true if it was kept.
+		bool add(char* frame, size_t length, unsigned char round) {
+			ParityGroup group;
+			unsigned char sentIn;
+			int used = getParityHeader(frame, length, &sentIn, group.ids, &group.count, &group.lengthXor);
+			if (used == 0 || sentIn != round) return false;
+			group.length = length - WIRE_PARITY_CHECK_BYTES - used;
+			if (group.length > packetSize) return false;
+			group.data = new char[group.length > 0 ? group.length : 1];
+			memcpy(group.data, frame + used, group.length);
+			groups.push_back(group);
+			return true;
+		}
+
+		//Returns how many parity packets are being kept
+		int size() {
+			return groups.size();
+		}
+
+		//Drops every parity packet being kept
+		void forget() {
+			for (size_t i = 0; i < groups.size(); i++) delete[] groups[i].data;
+			groups.clear();
+		}
+
+		//Rebuilds every packet in the window that's the only one missing from its group. A packet counts as there if it's
+		//been received (transmitted or secured), and all of a group has to be in the window for it to be any use.
+		//A rebuilt packet gets its data, length and a checksum by the given integrity algorithm, and is marked transmitted.
+		//The window indexes of the rebuilt packets go in "rebuilt", which needs room for the window size, and "unrecoverable"
+		//is added to for every packet missing from a group that lost too many to rebuild.
+		//Every parity packet is forgotten afterwards. Returns how many packets were rebuilt.
+		int rebuild(Packet* window, int windowSize, int integrity, int* rebuilt, long* unrecoverable) {
+			int send = 0;
+			for (size_t g = 0; g < groups.size(); g++) {
+				ParityGroup* group = &groups[g];
+				int slots[WIRE_MAX_GROUP], missing = 0, lost = -1;
+				bool whole = true;
+				for (int i = 0; i < group->count; i++) {
+					int index = 0;
+					while (index < windowSize && window[index].id != group->ids[i]) index++;
+					whole = index < windowSize;
+					if (!whole) break;
+					slots[i] = index;
+					if (!window[index].transmitted && !window[index].secured) {
+						missing++;
+						lost = i;
+					}
+				}
+				if (!whole || missing == 0) continue;
+				if (missing > 1) {
+					*unrecoverable += missing;
+					continue;
+				}
+
+				//The lost packet is whatever the XOR of the rest leaves over, its length included
+				unsigned int length = group->lengthXor;
+				for (int i = 0; i < group->count; i++) {
+					if (i != lost) length ^= window[slots[i]].length;
+				}
+				if (length > (unsigned int) group->length) continue;
+				char* content = new char[length > 0 ? length : 1];
+				memcpy(content, group->data, length);
+				for (int i = 0; i < group->count; i++) {
+					Packet* member = window + slots[i];
+					if (i != lost) xorInto(content, member->content, member->length < (int) length ? member->length : length);
+				}
+
+				Packet* pack = window + slots[lost];
+				if (pack->content != NULL) delete[] pack->content;
+				pack->content = content;
+				pack->length = length;
+				pack->checksum = packetChecksum(integrity, content, length);
+				pack->integrity = integrity;
+				pack->transmitted = true;
+				pack->secured = false;
+				rebuilt[send++] = slots[lost];
+			}
+			forget();
+			return send;
+		}
+};
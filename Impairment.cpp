@@ -0,0 +1,791 @@
+#include <list>
+#include <math.h>
+
+
+//The kinds of datagram the impairment stages can tell apart. Stages can be limited to any mix of them.
+#define KIND_DATA 0
+#define KIND_ACK 1
+#define KIND_READY 2
+#define KIND_FIN 3
+#define KIND_HELLO 4
+#define KIND_PARITY 5
+#define KIND_SIGNATURES 6
+#define KIND_JOURNAL 7
+#define KIND_DEDUP 8
+#define KIND_PROBE 9
+#define KIND_OTHER 10
+#define ALL_KINDS ((1 << (KIND_OTHER + 1)) - 1)
+
+
+//Seeded random numbers for anything that has to be repeatable (impairments, the simulator).
+//This is splitmix64, which is plenty for simulating a network and has no hidden state of its own.
+class SeededRandom {
+	private:
+		unsigned long long state;
+
+	public:
+		SeededRandom(unsigned long long seed) {
+			state = seed;
+		}
+
+		//Gives the next raw 64 bit random number
+		unsigned long long next() {
+			unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			return z ^ (z >> 31);
+		}
+
+		//Gives a random number from 0 (inclusive) to 1 (exclusive)
+		double uniform() {
+			return (next() >> 11) * (1.0 / 9007199254740992.0);
+		}
+};
+
+
+//Returns the current time in seconds, for the stages that hold datagrams
+static double impairmentClock() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//A datagram passing through the impairment stages.
+//due is when it should come out of the stage currently holding it.
+typedef struct Impaired {
+	char* data;
+	size_t length;
+	int kind;
+	double due;
+} Impaired;
+
+//Makes a copy of a datagram for the stages to work on
+Impaired* newImpaired(char* data, size_t length, int kind) {
+	Impaired* send = new Impaired;
+	send->data = new char[length > 0 ? length : 1];
+	memcpy(send->data, data, length);
+	send->length = length;
+	send->kind = kind;
+	send->due = 0;
+	return send;
+}
+
+void deleteImpaired(Impaired* datagram) {
+	delete[] datagram->data;
+	delete datagram;
+}
+
+
+//One stage of impairment. A datagram goes in through push, and whatever comes out (nothing, the datagram,
+//a changed datagram, several copies) is added to "out". Stages that hold datagrams back give them up through release.
+//Datagrams of kinds the stage isn't limited to go straight through.
+class ImpairmentStage {
+	protected:
+		int kinds;
+		SeededRandom* random;
+
+		//What the stage does to datagrams of the kinds it applies to
+		virtual void impair(Impaired* datagram, double now, list<Impaired*>& out) = 0;
+
+	public:
+		ImpairmentStage() {
+			kinds = ALL_KINDS;
+			random = NULL;
+		}
+
+		//Limits the stage to the kinds of datagram in the given bitmask (1 << KIND_...)
+		void setKinds(int mask) {
+			kinds = mask;
+		}
+
+		//Gives the stage its own random numbers, so adding a stage doesn't change what the others do
+		void setSeed(unsigned long long seed) {
+			if (random != NULL) delete random;
+			random = new SeededRandom(seed);
+		}
+
+		void push(Impaired* datagram, double now, list<Impaired*>& out) {
+			if (kinds & (1 << datagram->kind)) impair(datagram, now, out);
+			else out.push_back(datagram);
+		}
+
+		//Gives up every held datagram that's due by the given time
+		virtual void release(double now, list<Impaired*>& out) {}
+
+		//Returns when the next held datagram is due, or infinity if nothing is held
+		virtual double nextDue() {
+			return INFINITY;
+		}
+
+		//Gives up everything held, due or not
+		virtual void drain(list<Impaired*>& out) {}
+
+		virtual ~ImpairmentStage() {
+			if (random != NULL) delete random;
+		}
+};
+
+//Drops each datagram independently with the same chance
+class LossStage : public ImpairmentStage {
+	private:
+		double chance;
+
+	protected:
+		void impair(Impaired* datagram, double now, list<Impaired*>& out) {
+			if (random->uniform() < chance) deleteImpaired(datagram);
+			else out.push_back(datagram);
+		}
+
+	public:
+		LossStage(double lossChance) {
+			chance = lossChance;
+		}
+};
+
+//Gilbert-Elliott burst loss. The link flips between a good and a bad state, each with its own loss chance,
+//so losses come in bursts the way they do on real congested or wireless links.
+class BurstLossStage : public ImpairmentStage {
+	private:
+		double goodToBad, badToGood, lossGood, lossBad;
+		bool bad;
+
+	protected:
+		void impair(Impaired* datagram, double now, list<Impaired*>& out) {
+			//Move between states first, then lose the datagram with the chance of the state we're in
+			bad = bad ? random->uniform() >= badToGood : random->uniform() < goodToBad;
+			if (random->uniform() < (bad ? lossBad : lossGood)) deleteImpaired(datagram);
+			else out.push_back(datagram);
+		}
+
+	public:
+		BurstLossStage(double toBad, double toGood, double goodLoss, double badLoss) {
+			goodToBad = toBad;
+			badToGood = toGood;
+			lossGood = goodLoss;
+			lossBad = badLoss;
+			bad = false;
+		}
+};
+
+//Sends some datagrams twice
+class DuplicateStage : public ImpairmentStage {
+	private:
+		double chance;
+
+	protected:
+		void impair(Impaired* datagram, double now, list<Impaired*>& out) {
+			out.push_back(datagram);
+			if (random->uniform() < chance) out.push_back(newImpaired(datagram->data, datagram->length, datagram->kind));
+		}
+
+	public:
+		DuplicateStage(double duplicateChance) {
+			chance = duplicateChance;
+		}
+};
+
+//Flips random bits in some datagrams. Only bytes from "skip" onward are touched, so by default the header
+//is left alone and the damage lands where the checksum is supposed to catch it.
+//A skip of WIRE_SKIP_HEADER skips however much of each datagram is header.
+class CorruptStage : public ImpairmentStage {
+	private:
+		double chance;
+		int bits;
+		size_t skip;
+
+	protected:
+		void impair(Impaired* datagram, double now, list<Impaired*>& out) {
+			size_t from = skip == WIRE_SKIP_HEADER ? wireHeaderLength(datagram->data, datagram->length) : skip;
+			if (datagram->length > from && random->uniform() < chance) {
+				for (int i = 0; i < bits; i++) {
+					size_t bit = random->next() % ((datagram->length - from) * 8);
+					datagram->data[from + bit / 8] ^= 1 << (bit % 8);
+				}
+			}
+			out.push_back(datagram);
+		}
+
+	public:
+		CorruptStage(double corruptChance, int flippedBits, size_t skipBytes) {
+			chance = corruptChance;
+			bits = flippedBits < 1 ? 1 : flippedBits;
+			skip = skipBytes;
+		}
+};
+
+//Base for stages that hold datagrams until they're due
+class HoldingStage : public ImpairmentStage {
+	protected:
+		list<Impaired*> held;
+
+	public:
+		void release(double now, list<Impaired*>& out) {
+			for (list<Impaired*>::iterator i = held.begin(); i != held.end();) {
+				if ((*i)->due <= now) {
+					out.push_back(*i);
+					i = held.erase(i);
+				}
+				else i++;
+			}
+		}
+
+		double nextDue() {
+			double send = INFINITY;
+			for (list<Impaired*>::iterator i = held.begin(); i != held.end(); i++) {
+				if ((*i)->due < send) send = (*i)->due;
+			}
+			return send;
+		}
+
+		void drain(list<Impaired*>& out) {
+			out.splice(out.end(), held);
+		}
+
+		~HoldingStage() {
+			for (list<Impaired*>::iterator i = held.begin(); i != held.end(); i++) deleteImpaired(*i);
+		}
+};
+
+//Delays every datagram by a fixed time plus up to "jitter" more. Jitter alone can reorder datagrams.
+class DelayStage : public HoldingStage {
+	private:
+		double delay, jitter;
+
+	protected:
+		void impair(Impaired* datagram, double now, list<Impaired*>& out) {
+			datagram->due = now + delay + (jitter > 0 ? random->uniform() * jitter : 0);
+			held.push_back(datagram);
+		}
+
+	public:
+		DelayStage(double fixedDelay, double extraJitter) {
+			delay = fixedDelay;
+			jitter = extraJitter;
+		}
+};
+
+//Holds some datagrams back while "gap" later ones go past, so they arrive out of order.
+//A held datagram is let go after at most "maxHold" seconds, in case nothing else comes along.
+class ReorderStage : public HoldingStage {
+	private:
+		double chance, maxHold;
+		int gap;
+		//How many more datagrams have to pass each held one, in the same order as "held"
+		list<int> passesLeft;
+
+	protected:
+		void impair(Impaired* datagram, double now, list<Impaired*>& out) {
+			if (random->uniform() < chance) {
+				datagram->due = now + maxHold;
+				held.push_back(datagram);
+				passesLeft.push_back(gap);
+				return;
+			}
+			out.push_back(datagram);
+
+			//This one just passed everything held, so let go of whatever has been passed enough
+			list<int>::iterator count = passesLeft.begin();
+			for (list<Impaired*>::iterator i = held.begin(); i != held.end();) {
+				if (--(*count) <= 0) {
+					out.push_back(*i);
+					i = held.erase(i);
+					count = passesLeft.erase(count);
+				}
+				else {
+					i++;
+					count++;
+				}
+			}
+		}
+
+	public:
+		ReorderStage(double reorderChance, int passedBy, double longestHold) {
+			chance = reorderChance;
+			gap = passedBy < 1 ? 1 : passedBy;
+			maxHold = longestHold;
+		}
+
+		void release(double now, list<Impaired*>& out) {
+			list<int>::iterator count = passesLeft.begin();
+			for (list<Impaired*>::iterator i = held.begin(); i != held.end();) {
+				if ((*i)->due <= now) {
+					out.push_back(*i);
+					i = held.erase(i);
+					count = passesLeft.erase(count);
+				}
+				else {
+					i++;
+					count++;
+				}
+			}
+		}
+
+		void drain(list<Impaired*>& out) {
+			HoldingStage::drain(out);
+			passesLeft.clear();
+		}
+};
+
+//Limits throughput with a token bucket. Datagrams wait their turn in a queue behind the bucket,
+//and are dropped if the queue already holds "queueBytes" (0 for no limit), like a router buffer.
+class RateStage : public HoldingStage {
+	private:
+		double rate, burst, tokens, lastFill, queued, queueLimit;
+
+		//Adds the tokens earned since the last fill
+		void refill(double now) {
+			tokens += (now - lastFill) * rate;
+			if (tokens > burst) tokens = burst;
+			lastFill = now;
+		}
+
+		//How many tokens a datagram needs. Anything bigger than the bucket just needs a full bucket.
+		double cost(Impaired* datagram) {
+			return datagram->length < burst ? datagram->length : burst;
+		}
+
+	protected:
+		void impair(Impaired* datagram, double now, list<Impaired*>& out) {
+			refill(now);
+			if (held.empty() && tokens >= cost(datagram)) {
+				tokens -= cost(datagram);
+				out.push_back(datagram);
+			}
+			else if (queueLimit > 0 && queued + datagram->length > queueLimit) {
+				deleteImpaired(datagram);
+			}
+			else {
+				queued += datagram->length;
+				held.push_back(datagram);
+			}
+		}
+
+	public:
+		RateStage(double bytesPerSecond, double burstBytes, double queueBytes) {
+			rate = bytesPerSecond;
+			burst = tokens = burstBytes < 1 ? 1 : burstBytes;
+			queueLimit = queueBytes;
+			lastFill = impairmentClock();
+			queued = 0;
+		}
+
+		void release(double now, list<Impaired*>& out) {
+			refill(now);
+			while (!held.empty() && tokens >= cost(held.front())) {
+				Impaired* datagram = held.front();
+				held.pop_front();
+				queued -= datagram->length;
+				tokens -= cost(datagram);
+				out.push_back(datagram);
+			}
+		}
+
+		double nextDue() {
+			if (held.empty()) return INFINITY;
+			return lastFill + (cost(held.front()) - tokens) / rate;
+		}
+
+		void drain(list<Impaired*>& out) {
+			HoldingStage::drain(out);
+			queued = 0;
+		}
+};
+
+//Drops datagrams whose id is in a given list, once per entry. This is the old feignError list,
+//so it only looks at the datagrams its kinds are limited to. Only data, ack and nack datagrams have an id to check.
+class IdDropStage : public ImpairmentStage {
+	private:
+		int numDrops;
+		int* drops;
+		bool* alreadyDone;
+
+	protected:
+		void impair(Impaired* datagram, double now, list<Impaired*>& out) {
+			int id;
+			if (wireId(datagram->data, datagram->length, &id) > 0) {
+				if (feignError(id, numDrops, drops, 0, 1, 0, alreadyDone)) {
+					deleteImpaired(datagram);
+					return;
+				}
+			}
+			out.push_back(datagram);
+		}
+
+	public:
+		IdDropStage(int count, int* ids) {
+			numDrops = count;
+			drops = new int[count];
+			alreadyDone = new bool[count];
+			for (int i = 0; i < count; i++) {
+				drops[i] = ids[i];
+				alreadyDone[i] = false;
+			}
+		}
+
+		~IdDropStage() {
+			delete[] drops;
+			delete[] alreadyDone;
+		}
+};
+
+
+//A chain of impairment stages. Each datagram goes through every stage in order.
+class ImpairmentPipeline {
+	private:
+		ImpairmentStage** stages;
+		int numStages;
+		unsigned long long seed;
+
+		//Pushes the given datagrams through the stages from "first" onward, adding what comes out the end to "out"
+		void pushFrom(int first, list<Impaired*>& datagrams, double now, list<Impaired*>& out) {
+			for (int s = first; s < numStages && !datagrams.empty(); s++) {
+				list<Impaired*> next;
+				for (list<Impaired*>::iterator i = datagrams.begin(); i != datagrams.end(); i++) {
+					stages[s]->push(*i, now, next);
+				}
+				datagrams.swap(next);
+			}
+			out.splice(out.end(), datagrams);
+		}
+
+	public:
+		ImpairmentPipeline(unsigned long long randomSeed) {
+			stages = NULL;
+			numStages = 0;
+			seed = randomSeed;
+		}
+
+		//Adds a stage to the end of the chain. The pipeline takes care of deleting it.
+		void add(ImpairmentStage* stage) {
+			ImpairmentStage** bigger = new ImpairmentStage*[numStages + 1];
+			for (int i = 0; i < numStages; i++) bigger[i] = stages[i];
+			if (stages != NULL) delete[] stages;
+			stages = bigger;
+
+			//Every stage gets its own numbers, based on the pipeline's seed and where the stage is
+			SeededRandom mixer(seed + numStages);
+			stage->setSeed(mixer.next());
+			stages[numStages++] = stage;
+		}
+
+		int getSize() {
+			return numStages;
+		}
+
+		//Sends a datagram through every stage, adding whatever comes out the end to "out"
+		void push(Impaired* datagram, double now, list<Impaired*>& out) {
+			list<Impaired*> datagrams;
+			datagrams.push_back(datagram);
+			pushFrom(0, datagrams, now, out);
+		}
+
+		//Lets go of everything held that's due, sending it through the rest of the stages
+		void release(double now, list<Impaired*>& out) {
+			for (int s = 0; s < numStages; s++) {
+				list<Impaired*> due;
+				stages[s]->release(now, due);
+				pushFrom(s + 1, due, now, out);
+			}
+		}
+
+		//Gives up everything held by any stage, due or not
+		void drain(list<Impaired*>& out) {
+			for (int s = 0; s < numStages; s++) {
+				list<Impaired*> held;
+				stages[s]->drain(held);
+				pushFrom(s + 1, held, INFINITY, out);
+			}
+		}
+
+		double nextDue() {
+			double send = INFINITY;
+			for (int s = 0; s < numStages; s++) {
+				double due = stages[s]->nextDue();
+				if (due < send) send = due;
+			}
+			return send;
+		}
+
+		~ImpairmentPipeline() {
+			for (int i = 0; i < numStages; i++) delete stages[i];
+			if (stages != NULL) delete[] stages;
+		}
+
+		//Builds a pipeline from a description like "loss=0.01,delay=0.02:0.005,corrupt=0.001:2@data,seed=7".
+		//Stages are applied in the order given. Each one can end in @ followed by the kinds it applies to,
+		//joined with + (data, ack, ready, fin, hello, parity, signatures, journal, dedup, probe), otherwise it applies to everything. The stages are:
+		//	loss=chance                                       independent loss
+		//	burst=goodToBad:badToGood[:goodLoss[:badLoss]]    Gilbert-Elliott burst loss (losses default to 0 and 1)
+		//	reorder=chance[:gap[:maxHold]]                    hold a datagram back until gap others pass (default 3, 0.05s)
+		//	duplicate=chance                                  send a datagram twice
+		//	corrupt=chance[:bits[:skip]]                      flip bits, leaving the first skip bytes alone (default 1 bit)
+		//	delay=seconds[:jitter]                            delay every datagram
+		//	rate=bytesPerSecond[:burst[:queue]]               token bucket rate limit with a drop-tail queue
+		//	seed=number                                       seed for everything after it
+		//"defaultSkip" is used for corrupt when no skip is given.
+		//Returns the pipeline, or NULL if the description couldn't be understood.
+		static ImpairmentPipeline* parse(string* description, size_t defaultSkip) {
+			ImpairmentPipeline* send = new ImpairmentPipeline(1);
+			size_t start = 0;
+
+			while (start < description->length()) {
+				size_t end = description->find(',', start);
+				if (end == string::npos) end = description->length();
+				string item = description->substr(start, end - start);
+				start = end + 1;
+				if (item.length() == 0) continue;
+
+				//Split off the kinds this stage is limited to
+				int kinds = ALL_KINDS;
+				size_t at = item.find('@');
+				if (at != string::npos) {
+					string names = item.substr(at + 1) + "+";
+					item = item.substr(0, at);
+					kinds = 0;
+					for (size_t from = 0, plus; (plus = names.find('+', from)) != string::npos; from = plus + 1) {
+						string name = names.substr(from, plus - from);
+						if (name.compare("data") == 0) kinds |= 1 << KIND_DATA;
+						else if (name.compare("ack") == 0) kinds |= 1 << KIND_ACK;
+						else if (name.compare("ready") == 0) kinds |= 1 << KIND_READY;
+						else if (name.compare("fin") == 0) kinds |= 1 << KIND_FIN;
+						else if (name.compare("hello") == 0) kinds |= 1 << KIND_HELLO;
+						else if (name.compare("parity") == 0) kinds |= 1 << KIND_PARITY;
+						else if (name.compare("signatures") == 0) kinds |= 1 << KIND_SIGNATURES;
+						else if (name.compare("journal") == 0) kinds |= 1 << KIND_JOURNAL;
+						else if (name.compare("dedup") == 0) kinds |= 1 << KIND_DEDUP;
+						else if (name.compare("probe") == 0) kinds |= 1 << KIND_PROBE;
+						else {
+							delete send;
+							return NULL;
+						}
+					}
+				}
+
+				//Then the name, and up to four numbers after it
+				size_t equals = item.find('=');
+				if (equals == string::npos) {
+					delete send;
+					return NULL;
+				}
+				string name = item.substr(0, equals);
+				double values[4] = {0, 0, 0, 0};
+				int numValues = 0;
+				const char* cursor = item.c_str() + equals + 1;
+				while (numValues < 4 && *cursor != '\0') {
+					char* after;
+					values[numValues++] = strtod(cursor, &after);
+					if (after == cursor || (*after != ':' && *after != '\0')) {
+						delete send;
+						return NULL;
+					}
+					cursor = *after == ':' ? after + 1 : after;
+				}
+
+				ImpairmentStage* stage = NULL;
+				if (name.compare("seed") == 0) send->seed = (unsigned long long) values[0];
+				else if (name.compare("loss") == 0) stage = new LossStage(values[0]);
+				else if (name.compare("burst") == 0) stage = new BurstLossStage(values[0], values[1], values[2], numValues > 3 ? values[3] : 1);
+				else if (name.compare("reorder") == 0) stage = new ReorderStage(values[0], numValues > 1 ? (int) values[1] : 3, numValues > 2 ? values[2] : 0.05);
+				else if (name.compare("duplicate") == 0) stage = new DuplicateStage(values[0]);
+				else if (name.compare("corrupt") == 0) stage = new CorruptStage(values[0], numValues > 1 ? (int) values[1] : 1, numValues > 2 ? (size_t) values[2] : defaultSkip);
+				else if (name.compare("delay") == 0) stage = new DelayStage(values[0], values[1]);
+				else if (name.compare("rate") == 0 && values[0] > 0) stage = new RateStage(values[0], numValues > 1 ? values[1] : 65536, values[2]);
+				else {
+					delete send;
+					return NULL;
+				}
+
+				if (stage != NULL) {
+					stage->setKinds(kinds);
+					send->add(stage);
+				}
+			}
+			return send;
+		}
+};
+
+
+//Transport that runs everything sent and received through impairment pipelines on the way to and from another transport.
+//Datagrams held back by a stage keep being let go on time, even while this side is waiting on a receive.
+class ImpairedTransport : public Transport {
+	private:
+		Transport* inner;
+		ImpairmentPipeline *sending, *receiving;
+		//Tells what kind each datagram is, so stages can be limited to some kinds
+		int (*classify)(char*, size_t);
+
+		//Datagrams that made it through the receive pipeline but haven't been handed out yet
+		list<Impaired*> arrived;
+		char* scratch;
+
+		//The timeout asked for by the user, and the last one actually set on the inner transport
+		double timeout, innerTimeout;
+
+		//Sends whatever came out of the send pipeline
+		void sendAll(list<Impaired*>& out) {
+			for (list<Impaired*>::iterator i = out.begin(); i != out.end(); i++) {
+				inner->queue((*i)->data, (*i)->length);
+				deleteImpaired(*i);
+			}
+			out.clear();
+		}
+
+		//Lets go of everything due in both directions
+		void pump(double now) {
+			list<Impaired*> out;
+			if (sending != NULL) {
+				sending->release(now, out);
+				sendAll(out);
+				inner->flush();
+			}
+			if (receiving != NULL) receiving->release(now, arrived);
+		}
+
+		//Sets the inner transport's timeout, skipping the call if it's already set that way
+		void setInnerTimeout(double seconds) {
+			if (seconds == innerTimeout) return;
+			innerTimeout = seconds;
+			int whole = (int) seconds, micro = (int) ((seconds - whole) * 1e6);
+			//0 means forever to the transports, so never round a real wait down to it
+			if (seconds > 0 && whole == 0 && micro == 0) micro = 1;
+			inner->setTimeout(whole, micro);
+		}
+
+	public:
+		//Either pipeline can be NULL to leave that direction alone. The pipelines belong to this object from now on.
+		ImpairedTransport(Transport* carrier, ImpairmentPipeline* sendPipeline, ImpairmentPipeline* receivePipeline, int (*classifier)(char*, size_t)) {
+			inner = carrier;
+			sending = sendPipeline;
+			receiving = receivePipeline;
+			classify = classifier;
+			scratch = new char[GRO_BUFFER_SIZE];
+			timeout = 0;
+			//Nothing is known about the inner transport's timeout yet, so the first wait always sets it
+			innerTimeout = -1;
+		}
+
+		ssize_t receive(char* saveHere, size_t bytes) {
+			double now = impairmentClock(), deadline = timeout > 0 ? now + timeout : INFINITY;
+
+			while (true) {
+				pump(now);
+				if (!arrived.empty()) {
+					Impaired* datagram = arrived.front();
+					arrived.pop_front();
+					size_t copied = datagram->length < bytes ? datagram->length : bytes;
+					memcpy(saveHere, datagram->data, copied);
+					deleteImpaired(datagram);
+					return copied;
+				}
+				if (now >= deadline) return -1;
+
+				//Wait for the next datagram, but wake up in time to let go of anything held
+				double wake = deadline;
+				if (sending != NULL && sending->nextDue() < wake) wake = sending->nextDue();
+				if (receiving != NULL && receiving->nextDue() < wake) wake = receiving->nextDue();
+				setInnerTimeout(wake == INFINITY ? 0 : wake - now);
+
+				ssize_t got = inner->receive(scratch, GRO_BUFFER_SIZE);
+				now = impairmentClock();
+				//The inner transport's own clock says the whole timeout is up (it may not run on real time, like a simulated link)
+				if (got < 0 && wake == deadline) {
+					pump(now);
+					if (arrived.empty()) return -1;
+				}
+				if (got >= 0) {
+					Impaired* datagram = newImpaired(scratch, got, classify(scratch, got));
+					if (receiving != NULL) receiving->push(datagram, now, arrived);
+					else arrived.push_back(datagram);
+				}
+			}
+		}
+
+		ssize_t send(char* data, size_t bytes) {
+			if (!queue(data, bytes)) return -1;
+			return flush() ? bytes : -1;
+		}
+
+		bool queue(char* data, size_t bytes) {
+			Impaired* datagram = newImpaired(data, bytes, classify(data, bytes));
+			if (sending == NULL) {
+				bool send = inner->queue(datagram->data, datagram->length);
+				deleteImpaired(datagram);
+				return send;
+			}
+
+			list<Impaired*> out;
+			double now = impairmentClock();
+			sending->release(now, out);
+			sending->push(datagram, now, out);
+			sendAll(out);
+			return true;
+		}
+
+		bool flush() {
+			return inner->flush();
+		}
+
+		bool setTimeout(int fullSeconds, int plusMicroSeconds) {
+			if (fullSeconds < 0 || plusMicroSeconds < 0) return false;
+			timeout = fullSeconds + plusMicroSeconds / 1e6;
+			return true;
+		}
+
+		bool setOffload(bool enable) {
+			return inner->setOffload(enable);
+		}
+
+		void setOtherSidePort(int port) {
+			inner->setOtherSidePort(port);
+		}
+
+		void setCumulativeAcks(bool cumulative) {
+			inner->setCumulativeAcks(cumulative);
+		}
+
+		int pathLimit() {
+			return inner->pathLimit();
+		}
+
+		bool setProbing(bool enable) {
+			return inner->setProbing(enable);
+		}
+
+		int sizeError() {
+			return inner->sizeError();
+		}
+
+		bool setBuffers(int bytes, int* receiving, int* sending) {
+			return inner->setBuffers(bytes, receiving, sending);
+		}
+
+		long bufferDrops() {
+			return inner->bufferDrops();
+		}
+
+		int setBusyPoll(bool enable) {
+			return inner->setBusyPoll(enable);
+		}
+
+		double now() {
+			return inner->now();
+		}
+
+		//Anything still held on the way out is sent before closing, so a delay never turns into a loss
+		~ImpairedTransport() {
+			if (sending != NULL) {
+				list<Impaired*> out;
+				sending->drain(out);
+				sendAll(out);
+				inner->flush();
+				delete sending;
+			}
+			if (receiving != NULL) {
+				receiving->drain(arrived);
+				delete receiving;
+			}
+			for (list<Impaired*>::iterator i = arrived.begin(); i != arrived.end(); i++) deleteImpaired(*i);
+			delete[] scratch;
+			delete inner;
+		}
+};
@@ -0,0 +1,516 @@
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+
+//Resumable transfers. The receiving side keeps a journal next to the file it writes: a bitmap with a bit for every block of
+//RESUME_BLOCK bytes, set once that block is written, kept in a file mapped into memory so it survives the process dying.
+//If a transfer gets cut off, the next one for the same file asks for the bitmap before it reads anything, and only sends
+//the blocks the other side doesn't have yet, seeking past the rest.
+//The journal file is the journal header, then the bitmap (lowest bit of each byte first):
+//	magic     the 8 bytes of JOURNAL_MAGIC
+//	source    the identity of the sending side's file (8 bytes, see sourceIdentity)
+//	size      how long the file is (8 bytes)
+//	block     how long its blocks are (4 bytes), then 4 bytes that are always 0
+//What the sending side sends goes through the protocols exactly like a file would, so they don't need to know about it:
+//	header    the 8 bytes of RESUME_MAGIC, the identity of the file (8 bytes), how long it is (8 bytes), how long its blocks are (4 bytes)
+//	run       RESUME_RUN_DATA (1 byte), where in the file it starts (8 bytes), how long it is (4 bytes), then that many bytes of the file
+//	hole      RESUME_RUN_HOLE (1 byte), where in the file it starts (8 bytes), how long it is (4 bytes)
+//A hole stands for blocks that are nothing but zeroes (see Sparse.cpp), which the receiving side punches out of the file
+//instead of being sent them. Runs of data are a block long, holes up to RESUME_MAX_RUN blocks, and both always start on a
+//block and end on one (or at the end of the file). Anything in neither is already there.
+//Numbers go lowest byte first.
+#define JOURNAL_MAGIC "GBNJRN01"
+#define JOURNAL_HEADER_BYTES 32
+#define RESUME_MAGIC "GBNRSM01"
+#define RESUME_MAGIC_BYTES 8
+#define RESUME_HEADER_BYTES (RESUME_MAGIC_BYTES + 20)
+#define RESUME_RUN_BYTES 13
+#define RESUME_RUN_DATA 0
+#define RESUME_RUN_HOLE 1
+
+//How long the blocks the journal keeps track of are, and how many of them go in one hole at most
+#define RESUME_BLOCK 65536
+#define RESUME_MAX_RUN 1024
+
+//Works out an identity for the file open as "file" from its size, inode and when it was last changed, so a journal left by
+//a transfer of another file (or of this one before it changed) is never taken for this one's. Its size goes in "size".
+//Returns false if it isn't a regular file, which can't be resumed.
+static bool sourceIdentity(FILE* file, uint64_t* identity, uint64_t* size) {
+	struct stat status;
+	if (fstat(fileno(file), &status) != 0 || !S_ISREG(status.st_mode)) return false;
+	uint64_t fields[4] = {(uint64_t) status.st_size, (uint64_t) status.st_ino, (uint64_t) status.st_mtim.tv_sec, (uint64_t) status.st_mtim.tv_nsec};
+	char bytes[32];
+	for (int i = 0; i < 4; i++) putFixed64(bytes + 8 * i, fields[i]);
+	FileDigest digest(DIGEST_XXH64);
+	digest.add(bytes, sizeof(bytes));
+	unsigned char sum[8];
+	digest.finish(sum);
+	*identity = readLittle64(sum);
+	*size = status.st_size;
+	return true;
+}
+
+
+//The receiving side's journal of which blocks of the file it already has
+class ResumeJournal {
+	private:
+		string path;
+		int descriptor;
+		//The journal file mapped into memory (NULL if it isn't, because it doesn't hold a journal yet), and how much of it
+		unsigned char* mapped;
+		size_t mappedLength;
+		uint64_t source, size;
+		int blockSize;
+		long long blocks, held;
+
+		ResumeJournal(const char* where, int file) {
+			path = where;
+			descriptor = file;
+			mapped = NULL;
+			mappedLength = 0;
+			source = size = 0;
+			blockSize = RESUME_BLOCK;
+			blocks = held = 0;
+		}
+
+		void unmap() {
+			if (mapped != NULL) munmap(mapped, mappedLength);
+			mapped = NULL;
+			mappedLength = 0;
+			blocks = held = 0;
+		}
+
+		//Maps the whole journal file. Returns false if it couldn't be.
+		bool map(size_t length) {
+			void* at = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+			if (at == MAP_FAILED) return false;
+			mapped = (unsigned char*) at;
+			mappedLength = length;
+			return true;
+		}
+
+		//Takes up the journal already in the file, if there's one that makes sense
+		void load() {
+			struct stat status;
+			if (fstat(descriptor, &status) != 0 || status.st_size < JOURNAL_HEADER_BYTES || !map(status.st_size)) return;
+			source = readLittle64(mapped + 8);
+			size = readLittle64(mapped + 16);
+			blockSize = readLittle32(mapped + 24);
+			if (memcmp(mapped, JOURNAL_MAGIC, 8) != 0 || blockSize < 1 || mappedLength != JOURNAL_HEADER_BYTES + bitmapBytes(size, blockSize)) {
+				unmap();
+				return;
+			}
+			blocks = (size + blockSize - 1) / blockSize;
+			for (long long i = 0; i < blocks; i++) held += holds(i);
+		}
+
+		static size_t bitmapBytes(uint64_t bytes, int block) {
+			return ((bytes + block - 1) / block + 7) / 8;
+		}
+
+	public:
+		//Opens the journal at the given path, making it if there isn't one. Returns NULL if it couldn't be opened.
+		static ResumeJournal* open(const char* where) {
+			int file = ::open(where, O_RDWR | O_CREAT, 0644);
+			if (file == -1) return NULL;
+			ResumeJournal* send = new ResumeJournal(where, file);
+			send->load();
+			return send;
+		}
+
+		~ResumeJournal() {
+			unmap();
+			if (descriptor != -1) close(descriptor);
+		}
+
+		//Makes sure the journal is for the given file, of "bytes" bytes in blocks of "block", starting it over with no blocks
+		//held if it was for anything else. Returns false if the journal file couldn't be changed.
+		bool reset(uint64_t identity, uint64_t bytes, int block) {
+			if (mapped != NULL && identity == source && bytes == size && block == blockSize) return true;
+			unmap();
+			size_t length = JOURNAL_HEADER_BYTES + bitmapBytes(bytes, block);
+			if (descriptor == -1 || ftruncate(descriptor, 0) != 0 || ftruncate(descriptor, length) != 0 || !map(length)) return false;
+			putFixed64((char*) mapped + 8, identity);
+			putFixed64((char*) mapped + 16, bytes);
+			putFixed64((char*) mapped + 24, block);
+			memcpy(mapped, JOURNAL_MAGIC, 8);
+			source = identity;
+			size = bytes;
+			blockSize = block;
+			blocks = (bytes + block - 1) / block;
+			return true;
+		}
+
+		bool holds(long long block) {
+			return mapped[JOURNAL_HEADER_BYTES + block / 8] & (1 << (block % 8));
+		}
+
+		//Notes that the given block is in the file, which has to be so already (and not just in a stdio buffer)
+		void mark(long long block) {
+			if (mapped == NULL || block < 0 || block >= blocks || holds(block)) return;
+			mapped[JOURNAL_HEADER_BYTES + block / 8] |= 1 << (block % 8);
+			held++;
+		}
+
+		//Returns the bitmap, and how long it is in "length". NULL if the journal doesn't hold one yet.
+		const unsigned char* getBitmap(size_t* length) {
+			*length = mapped == NULL ? 0 : mappedLength - JOURNAL_HEADER_BYTES;
+			return mapped == NULL ? NULL : mapped + JOURNAL_HEADER_BYTES;
+		}
+
+		//Returns how long the given block is
+		int blockLength(long long block) {
+			return block == blocks - 1 ? size - block * blockSize : blockSize;
+		}
+
+		//Returns how many bytes of the file the journal says are there
+		long long heldBytes() {
+			return held == 0 ? 0 : held * blockSize - (holds(blocks - 1) ? blockSize - blockLength(blocks - 1) : 0);
+		}
+
+		//Returns true once every block of the file is there
+		bool isComplete() {
+			return mapped != NULL && held == blocks;
+		}
+
+		uint64_t getSource() {
+			return source;
+		}
+
+		uint64_t getSize() {
+			return size;
+		}
+
+		int getBlockSize() {
+			return blockSize;
+		}
+
+		//Writes the bitmap out to the journal file
+		void sync() {
+			if (mapped != NULL) msync(mapped, mappedLength, MS_SYNC);
+		}
+
+		//Gets rid of the journal file, once it's no longer wanted
+		void remove() {
+			unmap();
+			if (descriptor != -1) close(descriptor);
+			descriptor = -1;
+			unlink(path.c_str());
+		}
+};
+
+
+//Reads the sending side's file as the runs the receiving side is still missing, for a resumed transfer
+class ResumeReader {
+	private:
+		int descriptor;
+		uint64_t size;
+		int blockSize;
+		long long blocks;
+		//The receiving side's bitmap of the blocks it has. Anything past its end is taken to be missing.
+		vector<unsigned char> held;
+		HoleMap* holes;
+		//The header or start of a run being passed on, and how much of it has been, and how much of the run's data is left
+		char head[RESUME_HEADER_BYTES];
+		int headLength, headSent;
+		long long next, left;
+		//The block read into "chunk" (-1 for none), and how long it is
+		char* chunk;
+		long long loaded;
+		int loadedLength;
+		long long skippedBytes, holeBytes;
+		bool failed;
+
+		bool holds(long long block) {
+			return (size_t) block / 8 < held.size() && (held[block / 8] & (1 << (block % 8)));
+		}
+
+		int blockLength(long long index) {
+			return index == blocks - 1 ? size - index * blockSize : blockSize;
+		}
+
+		//Reads the given block into "chunk", unless it's there already. Returns false if it couldn't be read.
+		bool load(long long index) {
+			if (loaded == index) return true;
+			loaded = -1;
+			loadedLength = blockLength(index);
+			//The file got shorter since its identity was worked out, which can't be sent as it was
+			if (pread(descriptor, chunk, loadedLength, (off_t) index * blockSize) != loadedLength) return false;
+			loaded = index;
+			return true;
+		}
+
+		void putRun(int kind, uint64_t start, uint64_t length) {
+			head[0] = (char) kind;
+			putFixed64(head + 1, start);
+			for (int i = 0; i < 4; i++) head[9 + i] = (char) (length >> (8 * i));
+			headLength = RESUME_RUN_BYTES;
+			headSent = 0;
+		}
+
+		//Starts the next run, skipping any blocks the other side has: a block of data, or a hole for the blocks after it that
+		//are nothing but zeroes, whether the file system keeps them as a hole or not. Returns false once there are none left.
+		bool startRun() {
+			long long first = -1;
+			uint64_t hole = 0;
+			while (next < blocks && (first == -1 || next - first < RESUME_MAX_RUN)) {
+				if (holds(next)) {
+					if (first != -1) break;
+					next++;
+					continue;
+				}
+				uint64_t start = (uint64_t) next * blockSize;
+				int length = blockLength(next);
+				if ((uint64_t) holes->holeEnd(start) < start + length) {
+					if (!load(next)) {
+						failed = true;
+						return false;
+					}
+					//A block of data waits in "chunk" for the hole before it to go first
+					if (!allZero(chunk, length)) {
+						if (first != -1) break;
+						putRun(RESUME_RUN_DATA, start, length);
+						left = length;
+						next++;
+						return true;
+					}
+				}
+				if (first == -1) first = next;
+				hole += length;
+				next++;
+			}
+			if (first == -1) return false;
+			putRun(RESUME_RUN_HOLE, (uint64_t) first * blockSize, hole);
+			holeBytes += hole;
+			return true;
+		}
+
+	public:
+		//Reads from "source", the file whose identity and size are given, skipping the blocks "bitmap" (of "length" bytes,
+		//NULL for none) says the other side has, in blocks of "block". The file isn't owned by the reader.
+		ResumeReader(FILE* source, uint64_t identity, uint64_t bytes, int block, const unsigned char* bitmap, size_t length) {
+			descriptor = fileno(source);
+			size = bytes;
+			blockSize = block;
+			blocks = (bytes + block - 1) / block;
+			if (bitmap != NULL) held.assign(bitmap, bitmap + length);
+			holes = new HoleMap(descriptor, bytes);
+			chunk = new char[block];
+			loaded = -1;
+			loadedLength = 0;
+			memcpy(head, RESUME_MAGIC, RESUME_MAGIC_BYTES);
+			putFixed64(head + RESUME_MAGIC_BYTES, identity);
+			putFixed64(head + RESUME_MAGIC_BYTES + 8, bytes);
+			for (int i = 0; i < 4; i++) head[RESUME_MAGIC_BYTES + 16 + i] = (char) (block >> (8 * i));
+			headLength = RESUME_HEADER_BYTES;
+			headSent = 0;
+			next = left = 0;
+			skippedBytes = holeBytes = 0;
+			for (long long i = 0; i < blocks; i++) {
+				if (holds(i)) skippedBytes += blockLength(i);
+			}
+			failed = false;
+		}
+
+		~ResumeReader() {
+			delete holes;
+			delete[] chunk;
+		}
+
+		//Reads up to "room" bytes of what's to be sent into "to". Returns how many were read, 0 at the end and -1 if the
+		//file couldn't be read.
+		ssize_t read(char* to, size_t room) {
+			size_t send = 0;
+			while (send < room) {
+				if (headSent < headLength) {
+					size_t taken = headLength - headSent < (int) (room - send) ? headLength - headSent : room - send;
+					memcpy(to + send, head + headSent, taken);
+					headSent += taken;
+					send += taken;
+					continue;
+				}
+				//A new run's start goes before any of its data
+				if (left == 0) {
+					if (!startRun()) break;
+					continue;
+				}
+				size_t taken = room - send < (size_t) left ? room - send : left;
+				memcpy(to + send, chunk + loadedLength - left, taken);
+				send += taken;
+				left -= taken;
+			}
+			return failed && send == 0 ? -1 : send;
+		}
+
+		//Returns how many bytes of the file were skipped because the other side already had them
+		long long getSkippedBytes() {
+			return skippedBytes;
+		}
+
+		//Returns how many bytes of the file went as holes
+		long long getHoleBytes() {
+			return holeBytes;
+		}
+};
+
+
+//Writes what a ResumeReader sent into the receiving side's file, noting each block in the journal once it's written.
+//Anything that doesn't start with RESUME_MAGIC isn't a resumed transfer, and is written from the start as it is.
+class ResumeWriter {
+	private:
+		FILE* output;
+		ResumeJournal* journal;
+		char head[RESUME_HEADER_BYTES];
+		int headLength;
+		bool started, plain, broken;
+		uint64_t size;
+		int blockSize;
+		//Where the next byte of the run being written goes, how much of the run is left, and the first block of it not noted
+		uint64_t position;
+		long long left, pending;
+		//How much of the file was already there when the header came, how much has been written since, and how much of
+		//that came as holes
+		long long heldBytes, writtenBytes, holeBytes;
+
+		//Acts on the header, once all of it is there. Returns false if it makes no sense.
+		bool takeHeader() {
+			uint64_t identity = getFixed64(head + RESUME_MAGIC_BYTES);
+			size = getFixed64(head + RESUME_MAGIC_BYTES + 8);
+			blockSize = readLittle32((unsigned char*) head + RESUME_MAGIC_BYTES + 16);
+			if (blockSize < 1 || blockSize > 1 << 30 || size > (uint64_t) INT64_MAX) return false;
+			if (!journal->reset(identity, size, blockSize) || ftruncate(fileno(output), size) != 0) return false;
+			heldBytes = journal->heldBytes();
+			return true;
+		}
+
+		//Acts on the start of a run or hole, once all of it is there. Returns false if it makes no sense.
+		bool takeRun() {
+			uint64_t start = getFixed64(head + 1);
+			left = readLittle32((unsigned char*) head + 9);
+			if (start % blockSize != 0 || start >= size || left == 0 || (uint64_t) left > size - start) return false;
+			if (left % blockSize != 0 && start + left != size) return false;
+			position = start;
+			pending = start / blockSize;
+			if (head[0] == RESUME_RUN_DATA) return fseeko(output, start, SEEK_SET) == 0;
+			if (head[0] != RESUME_RUN_HOLE || !punchHole(output, start, left)) return false;
+			position += left;
+			writtenBytes += left;
+			holeBytes += left;
+			left = 0;
+			markWritten();
+			return true;
+		}
+
+		//Notes every block of the run that's been written in full in the journal, once it's really in the file
+		void markWritten() {
+			long long done = position == size ? (position + blockSize - 1) / blockSize : position / blockSize;
+			if (done <= pending) return;
+			//A block the file didn't really take mustn't be marked, or resuming would skip it
+			if (fflush(output) != 0) {
+				broken = true;
+				return;
+			}
+			while (pending < done) journal->mark(pending++);
+		}
+
+	public:
+		//Writes into "file" and keeps track of it in "keep", neither of them owned by the writer
+		ResumeWriter(FILE* file, ResumeJournal* keep) {
+			output = file;
+			journal = keep;
+			headLength = 0;
+			started = plain = broken = false;
+			size = 0;
+			blockSize = RESUME_BLOCK;
+			position = 0;
+			left = pending = 0;
+			heldBytes = writtenBytes = holeBytes = 0;
+		}
+
+		//Starts writing the file from the start as it is, for a transfer that isn't resumed, which leaves no use for the journal
+		void startPlain() {
+			plain = true;
+			journal->remove();
+			if (ftruncate(fileno(output), 0) != 0) broken = true;
+			fseeko(output, 0, SEEK_SET);
+		}
+
+		//Takes the next bytes of what was sent. Returns false once it's turned out not to make sense, or the file won't take it.
+		bool write(const char* data, size_t length) {
+			if (plain) {
+				if (fwrite(data, 1, length, output) != length) broken = true;
+				return !broken;
+			}
+			while (length > 0 && !broken) {
+				if (!started) {
+					head[headLength] = *data++;
+					length--;
+					if (headLength < RESUME_MAGIC_BYTES && head[headLength] != RESUME_MAGIC[headLength]) {
+						startPlain();
+						if (fwrite(head, 1, headLength + 1, output) != (size_t) headLength + 1 || fwrite(data, 1, length, output) != length) broken = true;
+						return !broken;
+					}
+					if (++headLength == RESUME_HEADER_BYTES) {
+						started = true;
+						headLength = 0;
+						broken = !takeHeader();
+					}
+					continue;
+				}
+				if (left > 0) {
+					size_t taken = length < (size_t) left ? length : left;
+					if (fwrite(data, 1, taken, output) != taken) broken = true;
+					position += taken;
+					left -= taken;
+					writtenBytes += taken;
+					data += taken;
+					length -= taken;
+					markWritten();
+					continue;
+				}
+				head[headLength++] = *data++;
+				length--;
+				if (headLength == RESUME_RUN_BYTES) {
+					headLength = 0;
+					broken = !takeRun();
+				}
+			}
+			return !broken;
+		}
+
+		//Flushes the file and the journal, once nothing more is coming, and gets rid of the journal if the file is all there.
+		//Returns true if it is (or this wasn't a resumed transfer at all), and the file took all of it.
+		//If nothing came, everything is left as it was.
+		bool finish() {
+			if (fflush(output) != 0 || ferror(output)) broken = true;
+			if (!started) return plain && !broken;
+			if (broken || !journal->isComplete()) {
+				journal->sync();
+				return false;
+			}
+			journal->remove();
+			return true;
+		}
+
+		//Returns how many bytes of the file were already there, and didn't need sending
+		long long getHeldBytes() {
+			return heldBytes;
+		}
+
+		//Returns how many bytes of the file were written this time, holes included
+		long long getWrittenBytes() {
+			return writtenBytes;
+		}
+
+		//Returns how many bytes of the file came as holes this time
+		long long getHoleBytes() {
+			return holeBytes;
+		}
+
+		//Returns true if what came started with RESUME_MAGIC
+		bool isResumed() {
+			return started;
+		}
+};
@@ -65,7 +65,7 @@ class LinkedList {
         Packet removeFirst() {
             Packet send;
             if (size == 0) {
-                send.content == NULL;
+                send.content = NULL;
                 send.id = -3;
                 send.length = 0;
             }
@@ -77,7 +77,10 @@ class LinkedList {
                 if (newFirst != NULL) {
                     newFirst->setBack(NULL);
                     first = newFirst;
-                }   
+                }
+                else {
+                    first = last = NULL;
+                }
             }
             size = size < 1 ? 0 : size-1;
             return send;
@@ -172,7 +175,11 @@ class LinkedList {
             }
 
 
-            if ((size = index) < 1) first = NULL;
+            if ((size = index) < 1) first = last = NULL;
+            else {
+                last = first;
+                while (last->getNext() != NULL) last = last->getNext();
+            }
         }
 
         //Returns the size of the array. Enough said.
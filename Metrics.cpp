@@ -0,0 +1,419 @@
+#include <vector>
+#include <math.h>
+
+
+//What a transfer's time can be spent on. Anything not listed (the protocol's own bookkeeping) is the rest of the elapsed time.
+#define TIME_WAITING 0	//Waiting on the other side: reading packets, acks and ready signals
+#define TIME_SENDING 1	//Handing datagrams to the transport
+#define TIME_WRITING 2	//Writing received data to the file
+#define TIME_READING 3	//Reading data to send from the file
+#define TIME_PACKING 4	//Waiting on the packer for packets to send (see Compress.cpp)
+#define TIME_UNPACKING 5	//Unpacking packets that arrived packed
+#define NUM_TIMES 6
+
+//Everything counted during a transfer. Each side only fills in the ones that make sense for it.
+#define COUNT_PACKETS_SENT 0			//Every packet sent, originals and retransmissions
+#define COUNT_BYTES_SENT 1
+#define COUNT_PACKETS_RETRANSMITTED 2	//Packets sent again after having been sent once already
+#define COUNT_BYTES_RETRANSMITTED 3
+#define COUNT_PACKETS_RECEIVED 4		//Every packet that arrived, usable or not
+#define COUNT_BYTES_RECEIVED 5
+#define COUNT_PACKETS_DELIVERED 6		//Packets that made it: acked on the sending side, written to the file on the receiving side
+#define COUNT_BYTES_DELIVERED 7
+#define COUNT_DUPLICATES 8				//Packets that arrived again after already being received, and were thrown away
+#define COUNT_OUT_OF_WINDOW 9			//Packets that arrived for ids the receiver wasn't expecting yet
+#define COUNT_CHECKSUM_FAILURES 10		//Packets that arrived with data that didn't match their checksum
+#define COUNT_MALFORMED 11				//Packets whose header made no sense
+#define COUNT_ACKS_SENT 12
+#define COUNT_ACKS_RECEIVED 13
+#define COUNT_ROUNDS 14				//Rounds of packets, acks and returned acks
+#define COUNT_PARITY_SENT 15			//Parity packets sent (see Fec.cpp)
+#define COUNT_PARITY_RECEIVED 16		//Parity packets that arrived intact and in the round they were sent in
+#define COUNT_PACKETS_REBUILT 17		//Lost packets rebuilt from parity, without waiting for them to be sent again
+#define COUNT_UNRECOVERABLE 18			//Lost packets the parity couldn't rebuild, because others in their group were lost too
+#define COUNT_PACKETS_PACKED 19		//Packets sent packed, which came out smaller than their data
+#define COUNT_BYTES_SAVED 20			//How much smaller those packets were than their data
+#define COUNT_DELTA_LITERAL 21			//Bytes of the file that went in a delta as they are (see Delta.cpp)
+#define COUNT_DELTA_COPIED 22			//Bytes of the file a delta left for the receiving side to copy from its old copy
+#define COUNT_SIGNATURE_BYTES 23		//Bytes of block signatures the receiving side sent for a delta, and the sending side received
+#define COUNT_RESUMED_BYTES 24			//Bytes of the file a resumed transfer didn't send, because the receiving side already had them
+#define COUNT_HOLE_BYTES 25			//Bytes of the file sent as holes, because they were nothing but zeroes (see Sparse.cpp)
+#define COUNT_DEDUP_BYTES 26			//Bytes of the file a deduplicated transfer didn't send, because the receiving side had them stored
+						//or they came earlier in the file (see Dedup.cpp)
+#define COUNT_DEDUP_QUERY_BYTES 27		//Bytes of dedup queries and answers the sending side sent and received
+#define COUNT_BUNDLE_FILES 28			//Files of a bundle sent in full, or written in full on the receiving side (see Bundle.cpp)
+#define COUNT_BUNDLE_BYTES 29			//Bytes of those files
+#define COUNT_PROBES_SENT 30			//Probes of the path sent by a side picking its own packet size
+#define COUNT_PROBES_ANSWERED 31		//Those the other side answered, which got there whole
+#define COUNT_SIZE_ERRORS 32			//Size errors the path sent back during the transfer, each of which had the path probed again
+#define COUNT_BUFFER_DROPS 33			//Datagrams that got to this side but were dropped from its full receive buffer, which the
+						//protocol can't tell from loss on the way (see Transport::bufferDrops)
+#define NUM_COUNTS 34
+
+//A histogram of times splits each power of two microseconds into HISTOGRAM_STEPS buckets, up to 2^32 microseconds.
+//The last bucket holds anything longer.
+#define HISTOGRAM_STEPS 4
+#define HISTOGRAM_BUCKETS (32 * HISTOGRAM_STEPS)
+
+
+//Names of the counts and times, as they appear in the JSON
+static const char* countNames[NUM_COUNTS] = {
+	"packets_sent", "bytes_sent", "packets_retransmitted", "bytes_retransmitted", "packets_received", "bytes_received",
+	"packets_delivered", "bytes_delivered", "duplicates", "out_of_window", "checksum_failures", "malformed",
+	"acks_sent", "acks_received", "rounds", "parity_sent", "parity_received", "packets_rebuilt", "packets_unrecoverable",
+	"packets_packed", "bytes_saved", "delta_literal_bytes", "delta_copied_bytes", "signature_bytes",
+	"resumed_bytes", "hole_bytes", "dedup_bytes", "dedup_query_bytes",
+	"bundle_files", "bundle_bytes", "probes_sent", "probes_answered", "size_errors",
+	"buffer_drops"
+};
+static const char* timeNames[NUM_TIMES] = {"waiting_s", "sending_s", "writing_s", "reading_s", "packing_s", "unpacking_s"};
+
+
+//Times of something that keeps happening (like a packet's round trip), kept in a histogram, which the percentiles come from
+class TimeHistogram {
+	private:
+		long count, buckets[HISTOGRAM_BUCKETS];
+		double total, least, most;
+
+		//Returns the top of the given bucket, in seconds
+		double bucketTop(int bucket) {
+			return ldexp(1e-6, bucket / HISTOGRAM_STEPS) * (1 + (bucket % HISTOGRAM_STEPS + 1) / (double) HISTOGRAM_STEPS);
+		}
+
+	public:
+		TimeHistogram() {
+			count = 0;
+			for (int i = 0; i < HISTOGRAM_BUCKETS; i++) buckets[i] = 0;
+			total = most = 0;
+			least = INFINITY;
+		}
+
+		//Records one time, in seconds
+		void add(double seconds) {
+			if (seconds < 0) return;
+			count++;
+			total += seconds;
+			if (seconds < least) least = seconds;
+			if (seconds > most) most = seconds;
+
+			//frexp splits it into a power of two and a fraction from 0.5 to 1, which picks the step within that power
+			int bucket = 0, power;
+			double micro = seconds * 1e6;
+			if (micro >= 1) {
+				double fraction = frexp(micro, &power);
+				bucket = (power - 1) * HISTOGRAM_STEPS + (int) ((fraction * 2 - 1) * HISTOGRAM_STEPS);
+				if (bucket >= HISTOGRAM_BUCKETS) bucket = HISTOGRAM_BUCKETS - 1;
+			}
+			buckets[bucket]++;
+		}
+
+		long samples() {
+			return count;
+		}
+
+		//Estimates the given fraction (0-1) of the times, in seconds.
+		//It's the top of the bucket that fraction falls in, so never more than a bucket's width off.
+		double percentile(double fraction) {
+			if (count == 0) return 0;
+			long target = (long) ceil(count * fraction), seen = 0;
+			for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+				seen += buckets[i];
+				if (seen >= target && seen > 0) {
+					double top = bucketTop(i);
+					return top < most ? top : most;
+				}
+			}
+			return most;
+		}
+
+		//Writes the summary as a JSON object, in milliseconds. "full" adds every bucket that got anything.
+		void writeJSON(FILE* out, bool full) {
+			fprintf(out, "{\"samples\": %ld, \"min_ms\": %.3f, \"mean_ms\": %.3f, \"max_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f",
+				count, count > 0 ? least * 1e3 : 0, count > 0 ? total / count * 1e3 : 0, most * 1e3,
+				percentile(0.5) * 1e3, percentile(0.9) * 1e3, percentile(0.99) * 1e3);
+			if (full) {
+				//Only the buckets that got anything, each given by the top of its range
+				fprintf(out, ", \"histogram_us\": [");
+				for (int i = 0, written = 0; i < HISTOGRAM_BUCKETS; i++) {
+					if (buckets[i] == 0) continue;
+					fprintf(out, "%s{\"below\": %.0f, \"count\": %ld}", written++ == 0 ? "" : ", ", bucketTop(i) * 1e6, buckets[i]);
+				}
+				fprintf(out, "]");
+			}
+			fprintf(out, "}");
+		}
+};
+
+
+//Everything recorded about one side of a transfer: what was sent and received, where the time went,
+//how the goodput changed over the transfer, and how long acks took to come back.
+//Times come from the transport's clock, so a transfer over a simulated link is measured in simulated time.
+//It can write itself out as JSON every so often during the transfer, and once more when the transfer is done.
+class TransferMetrics {
+	private:
+		//The protocol ("gbn" or "sr") and which side this is ("client" or "server")
+		string mode, role;
+
+		//Where the time comes from. Only used until the transfer is finished.
+		Transport* clock;
+		double started, finished;
+
+		long counts[NUM_COUNTS];
+		double times[NUM_TIMES];
+
+		//How long packets took to be heard back about, and how long each round took, from the end of the one before
+		//(or the start, for the first)
+		TimeHistogram rtts, rounds;
+		double lastRound;
+
+		//Bytes delivered so far, sampled once per interval
+		vector<double> sampleTimes;
+		vector<long> sampleBytes;
+		double sampleInterval, lastSample;
+
+		//Where the reports go (NULL for nowhere), how often one is written during the transfer (0 for only at the end),
+		//and what had been delivered as of the last one, for the goodput since then
+		FILE* reportOut;
+		double reportInterval, lastReport;
+		long lastReportBytes;
+		
+		//The file digest this side worked out, and how it compared with the other side's (DIGEST_...). digestName is empty if there's none.
+		string digestName, digestValue;
+		int digestResult;
+		
+		//The most data a packet can hold, whether it was picked from the path, and the longest datagram known to get across
+		//whole (0 if nothing's known)
+		int packetSize, pathBytes;
+		bool autoSize;
+
+		//What the buffers were sized for, and the sizes the kernel gave the receive and send buffers (0 if they weren't sized)
+		int bufferAsked, receiveBuffer, sendBuffer;
+
+		//What the transport had counted of buffer drops when the transfer started
+		long dropsBefore;
+
+		//What the low latency mode turned on (BUSY_..., 0 if it's off), and the CPU it pinned the protocols to (-1 for none)
+		int busyMode, pinnedCpu;
+
+		//Brings the count of buffer drops up to what the transport has seen
+		void readDrops() {
+			counts[COUNT_BUFFER_DROPS] = clock->bufferDrops() - dropsBefore;
+		}
+
+		//Writes everything recorded so far as a single line of JSON.
+		//The final report also has the goodput over time and the full round trip histogram.
+		void writeJSON(FILE* out, double at, bool final) {
+			//Both sides of a transfer can share one file, so hold on to it until the whole line is out
+			flockfile(out);
+			double elapsed = at - started;
+			fprintf(out, "{\"mode\": \"%s\", \"role\": \"%s\", \"final\": %s, \"elapsed_s\": %.6f",
+				mode.c_str(), role.c_str(), final ? "true" : "false", elapsed);
+
+			for (int i = 0; i < NUM_COUNTS; i++) fprintf(out, ", \"%s\": %ld", countNames[i], counts[i]);
+			fprintf(out, ", \"packets_original\": %ld, \"bytes_original\": %ld",
+				counts[COUNT_PACKETS_SENT] - counts[COUNT_PACKETS_RETRANSMITTED], counts[COUNT_BYTES_SENT] - counts[COUNT_BYTES_RETRANSMITTED]);
+
+			//Of the lost packets the parity knew about, how many it brought back
+			long rebuilt = counts[COUNT_PACKETS_REBUILT], missed = rebuilt + counts[COUNT_UNRECOVERABLE];
+			if (counts[COUNT_PARITY_RECEIVED] > 0) fprintf(out, ", \"recovery_rate\": %.4f", missed > 0 ? (double) rebuilt / missed : 1.0);
+			//How much bigger the data sent was than what went out for it
+			long packedTo = counts[COUNT_BYTES_SENT] - counts[COUNT_BYTES_SAVED];
+			if (counts[COUNT_PACKETS_PACKED] > 0) fprintf(out, ", \"compression_ratio\": %.3f", packedTo > 0 ? (double) counts[COUNT_BYTES_SENT] / packedTo : 1.0);
+
+			fprintf(out, ", \"packet\": {\"bytes\": %d, \"auto\": %s, \"path_bytes\": %d}", packetSize, autoSize ? "true" : "false", pathBytes);
+			if (bufferAsked > 0) fprintf(out, ", \"buffers\": {\"asked\": %d, \"receive\": %d, \"send\": %d}", bufferAsked, receiveBuffer, sendBuffer);
+			if (busyMode != 0) fprintf(out, ", \"low_latency\": {\"kernel_busy_poll\": %s, \"cpu\": %d}", busyMode & BUSY_KERNEL ? "true" : "false", pinnedCpu);
+
+			fprintf(out, ", \"time\": {");
+			for (int i = 0; i < NUM_TIMES; i++) fprintf(out, "%s\"%s\": %.6f", i == 0 ? "" : ", ", timeNames[i], times[i]);
+			fprintf(out, "}");
+
+			fprintf(out, ", \"goodput_mbs\": %.3f", elapsed > 0 ? counts[COUNT_BYTES_DELIVERED] / elapsed / 1e6 : 0);
+			if (!final) {
+				double since = at - lastReport;
+				fprintf(out, ", \"recent_goodput_mbs\": %.3f", since > 0 ? (counts[COUNT_BYTES_DELIVERED] - lastReportBytes) / since / 1e6 : 0);
+			}
+
+			fprintf(out, ", \"rtt\": ");
+			rtts.writeJSON(out, final);
+			fprintf(out, ", \"round\": ");
+			rounds.writeJSON(out, final);
+
+			if (final) {
+				//Goodput over each sampling interval, in order
+				fprintf(out, ", \"goodput\": [");
+				for (size_t i = 0; i < sampleTimes.size(); i++) {
+					double from = i == 0 ? started : sampleTimes[i-1];
+					long bytes = sampleBytes[i] - (i == 0 ? 0 : sampleBytes[i-1]);
+					double span = sampleTimes[i] - from;
+					fprintf(out, "%s{\"t\": %.3f, \"bytes\": %ld, \"mbs\": %.3f}", i == 0 ? "" : ", ",
+						sampleTimes[i] - started, sampleBytes[i], span > 0 ? bytes / span / 1e6 : 0);
+				}
+				fprintf(out, "]");
+				
+				if (digestName.length() > 0) {
+					fprintf(out, ", \"digest\": {\"algorithm\": \"%s\", \"value\": \"%s\", \"result\": \"%s\"}", digestName.c_str(), digestValue.c_str(),
+						digestResult == DIGEST_MATCH ? "match" : digestResult == DIGEST_MISMATCH ? "mismatch" : "unchecked");
+				}
+			}
+			fprintf(out, "}\n");
+			fflush(out);
+			funlockfile(out);
+		}
+
+	public:
+		//mode and role are only used to label the output. The transport is where the time comes from, and what was dropped
+		//from its receive buffer.
+		TransferMetrics(const char* protocol, const char* side, Transport* timeSource) {
+			mode = protocol;
+			role = side;
+			clock = timeSource;
+			started = lastSample = lastReport = lastRound = clock->now();
+			finished = -1;
+			for (int i = 0; i < NUM_COUNTS; i++) counts[i] = 0;
+			for (int i = 0; i < NUM_TIMES; i++) times[i] = 0;
+			sampleInterval = 1;
+			reportOut = NULL;
+			reportInterval = 0;
+			lastReportBytes = 0;
+			digestResult = DIGEST_UNCHECKED;
+			packetSize = pathBytes = 0;
+			autoSize = false;
+			bufferAsked = receiveBuffer = sendBuffer = 0;
+			dropsBefore = clock->bufferDrops();
+			busyMode = 0;
+			pinnedCpu = -1;
+		}
+
+		//Writes the metrics to the given file as JSON lines: one every "interval" seconds during the transfer
+		//(0 for none), and a final one when it's done. The goodput is sampled at the same interval when there is one.
+		void setReport(FILE* out, double interval) {
+			reportOut = out;
+			reportInterval = interval > 0 ? interval : 0;
+			if (interval > 0) sampleInterval = interval;
+		}
+
+		//Returns the current time in seconds, by the transfer's clock
+		double now() {
+			return finished >= 0 ? finished : clock->now();
+		}
+
+		//Adds the time since "since" (a value from now()) to what was spent on the given thing (TIME_WAITING, ...)
+		void addTime(int kind, double since) {
+			times[kind] += now() - since;
+		}
+
+		//Adds to one of the counts (COUNT_DUPLICATES, ...)
+		void count(int kind, long amount) {
+			counts[kind] += amount;
+		}
+
+		void count(int kind) {
+			counts[kind]++;
+		}
+
+		long get(int kind) {
+			return counts[kind];
+		}
+
+		double getTime(int kind) {
+			return times[kind];
+		}
+
+		//Returns how long the transfer took, or has taken so far
+		double elapsed() {
+			return now() - started;
+		}
+
+		//Records a packet going out, original or not
+		void sent(int bytes, bool retransmission) {
+			counts[COUNT_PACKETS_SENT]++;
+			counts[COUNT_BYTES_SENT] += bytes;
+			if (retransmission) {
+				counts[COUNT_PACKETS_RETRANSMITTED]++;
+				counts[COUNT_BYTES_RETRANSMITTED] += bytes;
+			}
+		}
+
+		//Records a packet that made it to the other side for good
+		void delivered(int bytes) {
+			counts[COUNT_PACKETS_DELIVERED]++;
+			counts[COUNT_BYTES_DELIVERED] += bytes;
+		}
+
+		//Records the file digest this side worked out (by the named algorithm, in hex) and how it compared with the other side's
+		void setDigest(const char* algorithm, const char* value, int result) {
+			digestName = algorithm;
+			digestValue = value;
+			digestResult = result;
+		}
+
+		//Records the most data a packet can hold, whether it was picked from the path, and the longest datagram known to get
+		//across whole (0 if nothing's known)
+		void setPacketSize(int size, bool automatic, int path) {
+			packetSize = size;
+			autoSize = automatic;
+			pathBytes = path;
+		}
+
+		//Records the size the buffers were asked to be, and the sizes of the receive and send buffers after
+		void setBuffers(int asked, int receiving, int sending) {
+			bufferAsked = asked;
+			receiveBuffer = receiving;
+			sendBuffer = sending;
+		}
+
+		//Records what the low latency mode turned on (BUSY_..., 0 if it's off), and the CPU it pinned the protocols to (-1 for none)
+		void setLowLatency(int busy, int cpu) {
+			busyMode = busy;
+			pinnedCpu = cpu;
+		}
+
+		//Records how long it took to hear back about a packet, in seconds
+		void rtt(double seconds) {
+			rtts.add(seconds);
+		}
+
+		//Returns the given fraction (0-1) of how long the rounds took so far, in seconds (see TimeHistogram::percentile)
+		double roundTime(double fraction) {
+			return rounds.percentile(fraction);
+		}
+
+		//Marks the end of a round. This is where the round is timed, the goodput gets sampled and the periodic reports get written.
+		void endRound() {
+			counts[COUNT_ROUNDS]++;
+			readDrops();
+			double at = now();
+			rounds.add(at - lastRound);
+			lastRound = at;
+			if (at - lastSample >= sampleInterval) {
+				sampleTimes.push_back(at);
+				sampleBytes.push_back(counts[COUNT_BYTES_DELIVERED]);
+				lastSample = at;
+			}
+			if (reportOut != NULL && reportInterval > 0 && at - lastReport >= reportInterval) {
+				writeJSON(reportOut, at, false);
+				lastReport = at;
+				lastReportBytes = counts[COUNT_BYTES_DELIVERED];
+			}
+		}
+
+		//Marks the transfer as done, stopping the clock and writing the final report.
+		//Nothing after this touches the transport, so it's safe to keep this around once the transport is gone.
+		void finish() {
+			if (finished >= 0) return;
+			readDrops();
+			finished = clock->now();
+			clock = NULL;
+			if (sampleTimes.empty() || sampleTimes.back() < finished) {
+				sampleTimes.push_back(finished);
+				sampleBytes.push_back(counts[COUNT_BYTES_DELIVERED]);
+			}
+			if (reportOut != NULL) writeJSON(reportOut, finished, true);
+		}
+
+		//Writes the final report to the given file. Only makes sense once the transfer is finished.
+		void write(FILE* out) {
+			writeJSON(out, now(), true);
+		}
+};
@@ -0,0 +1,428 @@
+#include <unordered_map>
+
+
+//Multicast sends a file to many receivers at once. The sending side sends each datagram once, to a group that every
+//receiving side has joined, and hears back from each receiver on its own. The protocols still talk to a single other
+//side, so the sending side's transport merges what the receivers send back into what one receiver would have sent:
+//	acks   selective repeat's go up once every receiver has acked the packet in the same exchange, each ack's number
+//	       (see Wire.cpp) telling it apart from an ack for an earlier packet with the same id. Go-back-N's are
+//	       cumulative, so what goes up is the ack of the receiver furthest behind, once it moves on (or again, whenever
+//	       a receiver with nothing new acks its last packet again, in case the one that went up got lost).
+//	nacks  go straight up, since any receiver missing a packet means it has to go out again
+//	ready  an exchange goes up once every receiver has got to it, so no phase ends before the slowest receiver's does
+//	hello  the answers go up once every receiver has answered, with only what all of them agreed to
+//	fin    the answers go up once every receiver has answered, with a digest that doesn't match the sender's if any didn't
+//Everything the sending side sends goes to the whole group, so a packet lost by any receiver goes out again to all of
+//them, and the ones that already had it throw the copy away. What a receiver can only be asked on its own (a delta's
+//signatures, a journal, what's in a block store) can't be merged, so those transfers need a transport to one receiver.
+//Every receiver has to be running before the sending side starts, since it waits on all of them.
+
+//How many receivers a sending side can wait on (each one is a bit of a mask)
+#define MULTICAST_MAX_RECEIVERS 64
+//How many routers multicast datagrams can cross. One keeps them on the local network.
+#define MULTICAST_TTL 1
+
+
+//Saves the address of the network interface multicast goes through in "address": "localhost" for this machine only,
+//or the address of an interface ("0.0.0.0" lets the routing table pick). Returns false if it isn't an address.
+bool multicastInterface(string* name, in_addr* address) {
+	if (name->compare("localhost") == 0) {
+		address->s_addr = htonl(INADDR_LOOPBACK);
+		return true;
+	}
+	return inet_aton(name->c_str(), address) != 0;
+}
+
+
+//The sending side of multicast, which sends to the group and merges what the receivers send back (see above)
+class MulticastSender : public Transport {
+	private:
+		//The socket file descriptor, the group everything is sent to, and the address of the interface it goes out through
+		int sockfd;
+		sockaddr_in group;
+		in_addr through;
+
+		//How long receive waits, in milliseconds (-1 for forever)
+		int timeoutMilliseconds;
+
+		//How many datagrams the kernel has said it dropped from the full receive buffer (see watchDrops)
+		long dropped;
+
+		//The receivers heard from so far, in the order they were first heard from, how many there are to hear from,
+		//and a mask with a bit for each of them
+		sockaddr_in members[MULTICAST_MAX_RECEIVERS];
+		int memberCount, receivers;
+		uint64_t everyone;
+
+		//Whether acks are cumulative (see setCumulativeAcks)
+		bool cumulative;
+
+		//Selective repeat: which receivers have acked each packet in this exchange, by the packet's number
+		//(or -1 - its id, for an ack without one). It's emptied whenever this side starts a new exchange.
+		unordered_map<long long, uint64_t> ackedBy;
+
+		//Go-back-N: the number and id of the furthest packet each receiver has acked (-1 before any),
+		//and the furthest the acks that went up have reached
+		long long furthest[MULTICAST_MAX_RECEIVERS], passedAck;
+		int furthestId[MULTICAST_MAX_RECEIVERS];
+
+		//The last ready exchange each receiver got to, the last one that went up, and the last one this side started
+		unsigned char readyAt[MULTICAST_MAX_RECEIVERS], passedReady, sentReady;
+
+		//Hello answers: which receivers have answered, and what all of them agreed to
+		uint64_t helloFrom;
+		char agreed[WIRE_HELLO_BYTES];
+
+		//Fin answers: which receivers have answered, this side's own fin (for its digest), and the answer that goes up
+		//once they all have, which is one whose digest doesn't match this side's if there is one
+		uint64_t finFrom;
+		char ownFin[WIRE_MAX_FIN], finAnswer[WIRE_MAX_FIN];
+		size_t ownFinLength, finAnswerLength;
+		bool finDiffers;
+
+		//Returns true if ready exchange "tag" comes after "than", counting round the 256 of them
+		static bool laterExchange(unsigned char tag, unsigned char than) {
+			return (signed char) (tag - than) > 0;
+		}
+
+		//Returns the index of the receiver at the given address, or -1 if it isn't one.
+		//Anyone not heard from before is taken as a receiver, until all of them have been heard from.
+		int memberOf(sockaddr_in* address) {
+			for (int i = 0; i < memberCount; i++) {
+				if (members[i].sin_addr.s_addr == address->sin_addr.s_addr && members[i].sin_port == address->sin_port) return i;
+			}
+			if (memberCount == receivers) return -1;
+			members[memberCount] = *address;
+			return memberCount++;
+		}
+
+		//Merges an ack from the given receiver, writing what goes up to "out".
+		//Returns how long that is, or 0 if nothing goes up yet.
+		size_t mergeAck(int from, char* frame, size_t length, char* out) {
+			int id;
+			long long number;
+			if (!getAck(frame, length, &id, &number)) return 0;
+			if (wireType(frame, length) == WIRE_NACK) {
+				memcpy(out, frame, length);
+				return length;
+			}
+
+			if (cumulative && number >= 0) {
+				bool nothingNew = number <= furthest[from];
+				if (!nothingNew) {
+					furthest[from] = number;
+					furthestId[from] = id;
+				}
+				if (memberCount < receivers) return 0;
+				int slowest = 0;
+				for (int i = 1; i < receivers; i++) {
+					if (furthest[i] < furthest[slowest]) slowest = i;
+				}
+				if (furthest[slowest] < 0 || (furthest[slowest] <= passedAck && !nothingNew)) return 0;
+				passedAck = furthest[slowest];
+				return putAck(out, WIRE_ACK, furthestId[slowest], passedAck);
+			}
+
+			uint64_t voters = ackedBy[number >= 0 ? number : -1 - (long long) id] |= 1ull << from;
+			if (voters != everyone) return 0;
+			memcpy(out, frame, length);
+			return length;
+		}
+
+		//Merges a ready signal from the given receiver, writing what goes up to "out".
+		//Returns how long that is, or 0 if nothing goes up yet.
+		size_t mergeReady(int from, char* frame, size_t length, char* out) {
+			if (length < WIRE_READY_BYTES) return 0;
+			unsigned char tag = frame[1];
+			if (laterExchange(tag, readyAt[from])) readyAt[from] = tag;
+
+			//An exchange that already went up is only a receiver asking for an answer again
+			if (!laterExchange(tag, passedReady)) {
+				memcpy(out, frame, WIRE_READY_BYTES);
+				return WIRE_READY_BYTES;
+			}
+			if (memberCount < receivers) return 0;
+			unsigned char slowest = readyAt[0];
+			for (int i = 1; i < receivers; i++) {
+				if (laterExchange(slowest, readyAt[i])) slowest = readyAt[i];
+			}
+			if (!laterExchange(slowest, passedReady)) return 0;
+
+			//Some of the receivers may still want an answer, so this always asks for one
+			passedReady = slowest;
+			out[0] = wireFlags(WIRE_READY);
+			out[1] = (char) slowest;
+			out[2] = 1;
+			return WIRE_READY_BYTES;
+		}
+
+		//Merges the answer to a hello from the given receiver, writing what goes up to "out".
+		//Returns how long that is, or 0 if nothing goes up yet.
+		size_t mergeHello(int from, char* frame, size_t length, char* out) {
+			if (length < WIRE_HELLO_BYTES) return 0;
+			//Every byte past whether an answer is wanted is a mask, a size or a codec that's 0 when refused,
+			//so what all of them agreed to is what's left after ANDing them together
+			if (helloFrom == 0) memcpy(agreed, frame, WIRE_HELLO_BYTES);
+			for (int i = 2; i < WIRE_HELLO_BYTES; i++) agreed[i] &= frame[i];
+			helloFrom |= 1ull << from;
+			if (helloFrom != everyone) return 0;
+			helloFrom = 0;
+			memcpy(out, agreed, WIRE_HELLO_BYTES);
+			return WIRE_HELLO_BYTES;
+		}
+
+		//Merges the answer to a fin from the given receiver, writing what goes up to "out".
+		//Returns how long that is, or 0 if nothing goes up yet.
+		size_t mergeFin(int from, char* frame, size_t length, char* out) {
+			if (!wireFinValid(frame, length)) return 0;
+			bool differs = length != ownFinLength || memcmp(frame + 2, ownFin + 2, length - 2) != 0;
+			if (finFrom == 0 || (differs && !finDiffers)) {
+				memcpy(finAnswer, frame, length);
+				finAnswerLength = length;
+				finDiffers = differs;
+			}
+			finFrom |= 1ull << from;
+			if (finFrom != everyone) return 0;
+			finFrom = 0;
+			memcpy(out, finAnswer, finAnswerLength);
+			return finAnswerLength;
+		}
+
+		//Keeps track of what this side sends: a new ready exchange ends the acks of the one before,
+		//and a fin carries the digest the receivers' answers are compared with
+		void watch(char* data, size_t bytes) {
+			int type = wireType(data, bytes);
+			if (type == WIRE_READY && bytes >= WIRE_READY_BYTES && laterExchange(data[1], sentReady)) {
+				sentReady = data[1];
+				ackedBy.clear();
+			}
+			if (type == WIRE_FIN && wireFinValid(data, bytes) && data[1] == FIN_REQUEST) {
+				memcpy(ownFin, data, bytes);
+				ownFinLength = bytes;
+			}
+		}
+
+		//Constructor. This should only be invoked via the static method getInstance, seen at the bottom of the class.
+		MulticastSender(int sock, sockaddr_in* groupInfo, in_addr* interfaceAddress, int receiverCount) {
+			sockfd = sock;
+			group = *groupInfo;
+			through = *interfaceAddress;
+			timeoutMilliseconds = -1;
+			dropped = 0;
+			memberCount = 0;
+			receivers = receiverCount;
+			everyone = receivers == 64 ? ~0ull : (1ull << receivers) - 1;
+			cumulative = false;
+			passedAck = -1;
+			for (int i = 0; i < receivers; i++) {
+				furthest[i] = -1;
+				furthestId[i] = 0;
+				readyAt[i] = 0;
+			}
+			passedReady = sentReady = 0;
+			helloFrom = finFrom = 0;
+			ownFinLength = finAnswerLength = 0;
+			finDiffers = false;
+		}
+
+	public:
+		//Obtains the next datagram that goes up, after merging (see above). Anything from outside the group's receivers
+		//is ignored, as is anything that doesn't go up yet, and the timeout covers the whole wait.
+		ssize_t receive(char* saveHere, size_t bytes) {
+			double deadline = now() + timeoutMilliseconds / 1000.0;
+			char frame[MAX_DATAGRAM], merged[WIRE_MAX_FIN + WIRE_MAX_ACK];
+			while (true) {
+				int wait = timeoutMilliseconds < 0 ? -1 : (int) ((deadline - now()) * 1000 + 0.5);
+				if (wait < 0 && timeoutMilliseconds >= 0) wait = 0;
+				struct pollfd watching;
+				watching.fd = sockfd;
+				watching.events = POLLIN;
+				if (poll(&watching, 1, wait) < 1) return -1;
+
+				sockaddr_in address;
+				socklen_t addressSize = sizeof(address);
+				ssize_t got = receiveCounting(sockfd, frame, sizeof(frame), MSG_DONTWAIT, &address, &addressSize, &dropped);
+				if (got < 0) continue;
+				int from = memberOf(&address);
+				if (from == -1) continue;
+
+				size_t length;
+				int type = wireType(frame, got);
+				if (type == WIRE_ACK || type == WIRE_NACK) length = mergeAck(from, frame, got, merged);
+				else if (type == WIRE_READY) length = mergeReady(from, frame, got, merged);
+				else if (type == WIRE_HELLO && got > 1 && !frame[1]) length = mergeHello(from, frame, got, merged);
+				else if (type == WIRE_FIN && got > 1 && frame[1] == FIN_ANSWER) length = mergeFin(from, frame, got, merged);
+				//Anything else goes up as it is
+				else {
+					size_t copied = (size_t) got < bytes ? got : bytes;
+					memcpy(saveHere, frame, copied);
+					return copied;
+				}
+				if (length == 0) continue;
+				size_t copied = length < bytes ? length : bytes;
+				memcpy(saveHere, merged, copied);
+				return copied;
+			}
+		}
+
+		//Sends a single datagram to the whole group
+		ssize_t send(char* data, size_t bytes) {
+			watch(data, bytes);
+			return sendto(sockfd, data, bytes, 0, (sockaddr*) &group, sizeof(group));
+		}
+
+		bool setTimeout(int fullSeconds, int plusMicroSeconds) {
+			timeoutMilliseconds = fullSeconds == 0 && plusMicroSeconds == 0 ? -1 : fullSeconds * 1000 + (plusMicroSeconds + 999) / 1000;
+			return true;
+		}
+
+		void setCumulativeAcks(bool cumulativeAcks) {
+			cumulative = cumulativeAcks;
+		}
+
+		//Probes would be answered by every receiver, and can't be merged, so this only goes by the route to the group
+		int pathLimit() {
+			return routeLimit(&group, through.s_addr == htonl(INADDR_ANY) ? NULL : &through);
+		}
+
+		bool setBuffers(int bytes, int* receiving, int* sending) {
+			*receiving = growBuffer(sockfd, SO_RCVBUF, bytes);
+			*sending = growBuffer(sockfd, SO_SNDBUF, bytes);
+			return true;
+		}
+
+		//Only counts what was dropped on the way back from the receivers. Each receiver counts its own.
+		long bufferDrops() {
+			return dropped;
+		}
+
+		//Destructor. Closes the socket it contained.
+		~MulticastSender() {
+			close(sockfd);
+		}
+
+		//Given a group address and port, the address of the interface to send through (see multicastInterface),
+		//and how many receivers there are, this function creates a socket that sends to the group and wraps it.
+		//Returns the address of the object if successful, or NULL if not.
+		static MulticastSender* getInstance(string* groupIp, string* interface, int port, int receivers) {
+			sockaddr_in groupInfo;
+			memset(&groupInfo, 0, sizeof(groupInfo));
+			groupInfo.sin_family = AF_INET;
+			groupInfo.sin_port = htons(port);
+			in_addr through;
+			if (receivers < 1 || receivers > MULTICAST_MAX_RECEIVERS || inet_aton(groupIp->c_str(), &groupInfo.sin_addr) == 0 || !IN_MULTICAST(ntohl(groupInfo.sin_addr.s_addr)) || !multicastInterface(interface, &through)) return NULL;
+
+			int sock = socket(AF_INET, SOCK_DGRAM, 0);
+			if (sock < 0) return NULL;
+
+			//Receivers on this machine should hear it too, and it should go out through the interface asked for
+			int ttl = MULTICAST_TTL, loop = 1;
+			if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 || (through.s_addr != htonl(INADDR_ANY) && setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &through, sizeof(through)) < 0)) {
+				close(sock);
+				return NULL;
+			}
+			watchDrops(sock);
+			return new MulticastSender(sock, &groupInfo, &through, receivers);
+		}
+};
+
+
+//The receiving side of multicast, which joins the group and answers whoever sends to it.
+//It answers from a socket of its own, so the sending side can tell its receivers apart, even on the same machine.
+class MulticastReceiver : public Transport {
+	private:
+		//The socket that's joined the group, and the one answers go out on
+		int listenfd, replyfd;
+
+		//The sending side, once it's been heard from
+		sockaddr_in sender;
+		bool heard;
+
+		//How many datagrams the kernel has said it dropped from the group socket's full receive buffer (see watchDrops)
+		long dropped;
+
+		//Constructor. This should only be invoked via the static method getInstance, seen at the bottom of the class.
+		MulticastReceiver(int listenSock, int replySock) {
+			listenfd = listenSock;
+			replyfd = replySock;
+			memset(&sender, 0, sizeof(sender));
+			heard = false;
+			dropped = 0;
+		}
+
+	public:
+		ssize_t receive(char* saveHere, size_t bytes) {
+			sockaddr_in address;
+			socklen_t addressSize = sizeof(address);
+			ssize_t send = receiveCounting(listenfd, saveHere, bytes, 0, &address, &addressSize, &dropped);
+			if (send >= 0) {
+				sender = address;
+				heard = true;
+			}
+			return send;
+		}
+
+		//Sends a single datagram to the sending side. Nothing can go until it's been heard from.
+		ssize_t send(char* data, size_t bytes) {
+			if (!heard) return -1;
+			return sendto(replyfd, data, bytes, 0, (sockaddr*) &sender, sizeof(sender));
+		}
+
+		bool setTimeout(int fullSeconds, int plusMicroSeconds) {
+			struct timeval time;
+			time.tv_sec = fullSeconds;
+			time.tv_usec = plusMicroSeconds;
+			return setsockopt(listenfd, SOL_SOCKET, SO_RCVTIMEO, &time, sizeof(time)) >= 0;
+		}
+
+		//Everything comes in on the group socket, and goes out on the reply socket
+		bool setBuffers(int bytes, int* receiving, int* sending) {
+			*receiving = growBuffer(listenfd, SO_RCVBUF, bytes);
+			*sending = growBuffer(replyfd, SO_SNDBUF, bytes);
+			return true;
+		}
+
+		long bufferDrops() {
+			return dropped;
+		}
+
+		//Destructor. Closes both sockets, which leaves the group.
+		~MulticastReceiver() {
+			close(listenfd);
+			close(replyfd);
+		}
+
+		//Given a group address and port and the address of the interface to join it on (see multicastInterface),
+		//this function joins the group and wraps the sockets. Any number of receivers can join on the same machine.
+		//Returns the address of the object if successful, or NULL if not.
+		static MulticastReceiver* getInstance(string* groupIp, string* interface, int port) {
+			sockaddr_in groupInfo;
+			memset(&groupInfo, 0, sizeof(groupInfo));
+			groupInfo.sin_family = AF_INET;
+			groupInfo.sin_port = htons(port);
+			struct ip_mreq membership;
+			if (inet_aton(groupIp->c_str(), &groupInfo.sin_addr) == 0 || !IN_MULTICAST(ntohl(groupInfo.sin_addr.s_addr)) || !multicastInterface(interface, &membership.imr_interface)) return NULL;
+			membership.imr_multiaddr = groupInfo.sin_addr;
+
+			int listenSock = socket(AF_INET, SOCK_DGRAM, 0);
+			if (listenSock < 0) return NULL;
+			int replySock = socket(AF_INET, SOCK_DGRAM, 0);
+			if (replySock < 0) {
+				close(listenSock);
+				return NULL;
+			}
+
+			//Bound to the group itself, with the port shared, so each receiver gets its own copy of everything sent to the
+			//group and nothing else. Other groups joined on this machine with the same port are left out too.
+			int flag = 1, none = 0;
+			if (setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0 || bind(listenSock, (const sockaddr*) &groupInfo, sizeof(groupInfo)) < 0 || setsockopt(listenSock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+				close(listenSock);
+				close(replySock);
+				return NULL;
+			}
+			setsockopt(listenSock, IPPROTO_IP, IP_MULTICAST_ALL, &none, sizeof(none));
+			watchDrops(listenSock);
+
+			return new MulticastReceiver(listenSock, replySock);
+		}
+};
@@ -0,0 +1,358 @@
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+#include <math.h>
+
+
+//The settings of a simulated link. Every setting applies to each direction separately.
+typedef struct LinkSettings {
+	//Bytes per second the link can carry (0 for unlimited), and the one-way propagation delay in seconds
+	double bandwidth, delay;
+	//Extra delay added to each datagram, uniformly picked between 0 and this many seconds.
+	//Datagrams can arrive out of order if this is larger than the time between them.
+	double jitter;
+	//How many bytes can wait to go out on the link before new datagrams are dropped (0 for unlimited)
+	long queueBytes;
+	//The chance of any one datagram being lost on the way
+	double loss;
+	//Seeds the random numbers used for jitter and loss, so the same seed always gives the same run
+	unsigned long seed;
+	//If nothing at all gets delivered for this many virtual seconds, the transfer is declared stalled (0 for never).
+	//A lost ready signal can leave both sides waiting on each other for good, and this catches that.
+	double stallTime;
+	//The longest IP packet the link carries, headers and all (0 for any length). Anything longer sent with don't fragment
+	//set is lost, and its sender told why, like an ICMP "fragmentation needed" from a router on the way.
+	int mtu;
+	//The MTU changes to laterMtu this many seconds in, like a route moving (unless laterMtu is 0)
+	double mtuChangeAt;
+	int laterMtu;
+	//The link stops for good once its clock reaches this many seconds (0 for never), with nothing at or after it
+	//delivered, as if the process had been killed then. The clock only moves on virtual events, so the same settings and
+	//seed always stop at the same point of the transfer.
+	double cutAt;
+} LinkSettings;
+
+//A datagram that's on its way across the simulated link
+typedef struct InFlight {
+	//When it arrives, and the order it was sent in (to break ties the same way every time)
+	double arrival;
+	long order;
+	vector<char>* data;
+} InFlight;
+
+//Orders datagrams so the one arriving first is on top of the priority queue
+struct ArrivesLater {
+	bool operator()(const InFlight& a, const InFlight& b) const {
+		return a.arrival != b.arrival ? a.arrival > b.arrival : a.order > b.order;
+	}
+};
+
+
+//An in-process link between two endpoints (0 and 1) that runs on a virtual clock.
+//Time only moves forward when both endpoints are waiting on a receive, and then it jumps straight to the next
+//arrival or timeout. Nothing ever really sleeps, so a transfer that would take hours takes as long as the CPU work,
+//and the same settings and seed always give the same result.
+class SimulatedLink {
+	private:
+		LinkSettings settings;
+
+		mutex lock;
+		condition_variable changed;
+
+		//The virtual time, in seconds since the link was made
+		double clock;
+
+		//When something was last delivered, whether the link has given up on the transfer, and whether it's reached cutAt
+		double lastDelivery;
+		bool stalled, cut;
+
+		//Per-endpoint state. inbox holds datagrams headed to that endpoint.
+		//waiting/deadline describe a receive in progress (the deadline is infinite for no timeout).
+		//closed is set once an endpoint is done with the link for good.
+		priority_queue<InFlight, vector<InFlight>, ArrivesLater> inbox[2];
+		bool waiting[2], closed[2];
+		double deadline[2];
+
+		//Per-direction state, indexed by the sending endpoint.
+		//linkFreeAt is when the sender's side of the link finishes putting out everything already given to it.
+		double linkFreeAt[2];
+		SeededRandom* random[2];
+		long sentOrder;
+
+		//The longest datagram the sender has been told the link takes (0 until it's told anything), which is what it cuts
+		//longer datagrams down to, and the same from a size error it hasn't picked up yet (see sizeError)
+		int toldLimit[2], unheardLimit[2];
+
+		//Totals for the report
+		long delivered[2], deliveredBytes[2], lostRandomly[2], lostToQueue[2], fragmented[2], tooLong[2];
+
+		//Returns true if the given endpoint is waiting on something that has already happened (a datagram or its timeout)
+		bool ready(int endpoint) {
+			return (!inbox[endpoint].empty() && inbox[endpoint].top().arrival <= clock) || deadline[endpoint] <= clock;
+		}
+
+		//Returns true if the given endpoint has nothing to do until time moves on.
+		//An endpoint that was just woken up but hasn't run yet doesn't count, or the clock could run past it.
+		bool stuck(int endpoint) {
+			return closed[endpoint] || (waiting[endpoint] && !ready(endpoint));
+		}
+
+		//When both endpoints are waiting, jumps the clock to the next thing that can happen:
+		//either a datagram arriving for someone who's waiting, or someone's timeout running out.
+		//Must be called with the lock held.
+		void advance() {
+			if (!stuck(0) || !stuck(1)) return;
+
+			double next = INFINITY;
+			for (int e = 0; e < 2; e++) {
+				if (closed[e]) continue;
+				if (!inbox[e].empty() && inbox[e].top().arrival < next) next = inbox[e].top().arrival;
+				if (deadline[e] < next) next = deadline[e];
+			}
+
+			//If nothing is ever going to happen again, both sides are waiting forever on each other.
+			//Time out whoever is waiting instead of hanging.
+			if (next == INFINITY) {
+				for (int e = 0; e < 2; e++) {
+					if (waiting[e]) deadline[e] = clock;
+				}
+			}
+			else if (settings.cutAt > 0 && next >= settings.cutAt) {
+				clock = settings.cutAt;
+				cut = true;
+			}
+			else if (next > clock) {
+				clock = next;
+			}
+
+			if (settings.stallTime > 0 && clock - lastDelivery > settings.stallTime) stalled = true;
+			changed.notify_all();
+		}
+
+	public:
+		SimulatedLink(LinkSettings linkSettings) {
+			settings = linkSettings;
+			clock = lastDelivery = 0;
+			stalled = cut = false;
+			sentOrder = 0;
+			for (int e = 0; e < 2; e++) {
+				waiting[e] = closed[e] = false;
+				deadline[e] = INFINITY;
+				linkFreeAt[e] = 0;
+				random[e] = new SeededRandom(settings.seed * 2 + e);
+				delivered[e] = deliveredBytes[e] = lostRandomly[e] = lostToQueue[e] = fragmented[e] = tooLong[e] = 0;
+				toldLimit[e] = unheardLimit[e] = 0;
+			}
+		}
+
+		//Puts a datagram on the link from the given endpoint to the other one.
+		//It's never refused, but it can be dropped by the link just like on a real network.
+		//A datagram longer than the sender has been told the link takes goes in fragments that long, unless it's a probe,
+		//which always goes whole. Anything else that's too long for the link is lost, and the sender told.
+		void send(int from, char* data, size_t bytes, bool probe) {
+			unique_lock<mutex> guard(lock);
+
+			int mtu = settings.laterMtu > 0 && clock >= settings.mtuChangeAt ? settings.laterMtu : settings.mtu, pieces = 1;
+			if (!probe && toldLimit[from] > 0 && bytes > (size_t) toldLimit[from]) {
+				pieces = (bytes + toldLimit[from] - 1) / toldLimit[from];
+				fragmented[from]++;
+			}
+			else if (mtu > 0 && bytes + UDP_IP_HEADERS > (size_t) mtu) {
+				tooLong[from]++;
+				toldLimit[from] = unheardLimit[from] = mtu - UDP_IP_HEADERS;
+				return;
+			}
+
+			//What's still waiting to go out on this side of the link
+			double start = linkFreeAt[from] > clock ? linkFreeAt[from] : clock;
+			double backlog = settings.bandwidth > 0 ? (start - clock) * settings.bandwidth : 0;
+			if (settings.queueBytes > 0 && backlog + bytes > settings.queueBytes) {
+				lostToQueue[from]++;
+				return;
+			}
+
+			//Once it gets its turn, it takes size/bandwidth to put on the link, and then the delay to cross it
+			double departure = start + (settings.bandwidth > 0 ? bytes / settings.bandwidth : 0);
+			linkFreeAt[from] = departure;
+
+			//A datagram that went in fragments is lost if any of them is
+			bool lost = false;
+			for (int i = 0; i < pieces && settings.loss > 0; i++) lost = random[from]->uniform() < settings.loss || lost;
+			if (lost) {
+				lostRandomly[from]++;
+				return;
+			}
+
+			InFlight datagram;
+			datagram.arrival = departure + settings.delay + (settings.jitter > 0 ? random[from]->uniform() * settings.jitter : 0);
+			datagram.order = sentOrder++;
+			datagram.data = new vector<char>(data, data + bytes);
+			inbox[1 - from].push(datagram);
+		}
+
+		//Gets the next datagram that has arrived for the given endpoint, waiting (in virtual time) if there isn't one.
+		//timeout is in seconds, and 0 means wait forever.
+		//Once the link has stalled or been cut this never returns, and whoever is running the simulation should check
+		//hasStalled() and wasCut() instead.
+		//Returns the number of bytes saved, or -1 if the timeout ran out first.
+		ssize_t receive(int to, char* saveHere, size_t bytes, double timeout) {
+			unique_lock<mutex> guard(lock);
+			deadline[to] = timeout > 0 ? clock + timeout : INFINITY;
+
+			while (inbox[to].empty() || inbox[to].top().arrival > clock) {
+				if (stalled || cut) {
+					waiting[to] = true;
+					changed.wait(guard);
+					continue;
+				}
+
+				if (deadline[to] <= clock) {
+					waiting[to] = false;
+					deadline[to] = INFINITY;
+					return -1;
+				}
+
+				waiting[to] = true;
+				advance();
+				//advance may have already moved the clock to exactly what we were waiting for
+				if (!inbox[to].empty() && inbox[to].top().arrival <= clock) break;
+				if (deadline[to] <= clock) continue;
+				changed.wait(guard);
+			}
+			waiting[to] = false;
+			deadline[to] = INFINITY;
+
+			InFlight datagram = inbox[to].top();
+			inbox[to].pop();
+
+			size_t copied = datagram.data->size() < bytes ? datagram.data->size() : bytes;
+			memcpy(saveHere, datagram.data->data(), copied);
+			delete datagram.data;
+
+			delivered[1 - to]++;
+			deliveredBytes[1 - to] += copied;
+			lastDelivery = clock;
+			return copied;
+		}
+
+		//Marks the given endpoint as done with the link, so the other one isn't held back waiting on it.
+		void close(int endpoint) {
+			unique_lock<mutex> guard(lock);
+			closed[endpoint] = true;
+			waiting[endpoint] = false;
+			while (!inbox[endpoint].empty()) {
+				delete inbox[endpoint].top().data;
+				inbox[endpoint].pop();
+			}
+			advance();
+		}
+
+		//Returns the longest datagram the given endpoint has been told the link takes, or 0 if it hasn't been told anything
+		int pathLimit(int endpoint) {
+			unique_lock<mutex> guard(lock);
+			return toldLimit[endpoint];
+		}
+
+		//Returns the longest datagram the last size error sent to the given endpoint said the link takes, if it hasn't
+		//already been picked up, or 0
+		int sizeError(int endpoint) {
+			unique_lock<mutex> guard(lock);
+			int send = unheardLimit[endpoint];
+			unheardLimit[endpoint] = 0;
+			return send;
+		}
+
+		//Returns the current virtual time in seconds
+		double now() {
+			unique_lock<mutex> guard(lock);
+			return clock;
+		}
+
+		//Returns true if the link has given up on the transfer, in which case both endpoints are stuck for good
+		bool hasStalled() {
+			unique_lock<mutex> guard(lock);
+			return stalled;
+		}
+
+		//Returns true if the clock has reached cutAt, in which case both endpoints are stuck for good
+		bool wasCut() {
+			unique_lock<mutex> guard(lock);
+			return cut;
+		}
+
+		//Writes a short summary of what the link did, for the given endpoint as the sender
+		void report(FILE* out, int from) {
+			unique_lock<mutex> guard(lock);
+			fprintf(out, "datagrams delivered: %ld (%ld bytes), lost randomly: %ld, lost to a full queue: %ld",
+				delivered[from], deliveredBytes[from], lostRandomly[from], lostToQueue[from]);
+			if (settings.mtu > 0 || settings.laterMtu > 0) fprintf(out, ", sent in fragments: %ld, too long: %ld", fragmented[from], tooLong[from]);
+			fprintf(out, "\n");
+		}
+
+		~SimulatedLink() {
+			for (int e = 0; e < 2; e++) {
+				delete random[e];
+				while (!inbox[e].empty()) {
+					delete inbox[e].top().data;
+					inbox[e].pop();
+				}
+			}
+		}
+};
+
+
+//Transport for one endpoint of a simulated link
+class SimTransport : public Transport {
+	private:
+		SimulatedLink* link;
+		int endpoint;
+		double timeout;
+		bool probing;
+
+	public:
+		SimTransport(SimulatedLink* simulated, int side) {
+			link = simulated;
+			endpoint = side;
+			timeout = 0;
+			probing = false;
+		}
+
+		ssize_t receive(char* saveHere, size_t bytes) {
+			return link->receive(endpoint, saveHere, bytes, timeout);
+		}
+
+		ssize_t send(char* data, size_t bytes) {
+			link->send(endpoint, data, bytes, probing);
+			return bytes;
+		}
+
+		int pathLimit() {
+			int told = link->pathLimit(endpoint);
+			return told > 0 ? told : MAX_DATAGRAM;
+		}
+
+		bool setProbing(bool enable) {
+			probing = enable;
+			return true;
+		}
+
+		int sizeError() {
+			return link->sizeError(endpoint);
+		}
+
+		bool setTimeout(int fullSeconds, int plusMicroSeconds) {
+			if (fullSeconds < 0 || plusMicroSeconds < 0) return false;
+			timeout = fullSeconds + plusMicroSeconds / 1e6;
+			return true;
+		}
+
+		double now() {
+			return link->now();
+		}
+
+		//The link belongs to whoever made it, this only lets the other side know we're gone.
+		~SimTransport() {
+			link->close(endpoint);
+		}
+};
@@ -2,20 +2,30 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 
 
 using namespace std;
 
 //The header that includes all necessary data
 //For the receiver to preempt for the actual packet data.
+//This is what parseData reads off the wire, not how it's sent (see Wire.cpp). The length isn't sent at all,
+//it's however much of the datagram is left after the header.
 typedef struct Header {
 	int id, length;
-	short checksum;
+	uint32_t checksum;
+	//How the checksum was worked out (INTEGRITY_...)
+	int integrity;
+	//The packet's number counted from the start of the file, or -1 if it didn't come with one (see Wire.cpp)
+	long long number;
 } Header;
 
 //A struct used to better handle complete packet data.
@@ -23,12 +33,23 @@ typedef struct Header {
 //The bool "secured" is true if the packet was successfully transmitted
 typedef struct Packet {
 	int id, length;
-	short checksum;
+	//The checksum the packet came with, and the integrity algorithm (INTEGRITY_...) it was worked out with
+	uint32_t checksum;
+	int integrity;
+	//The sending side's number for the packet, counted from the start of the file. Unlike the id it never comes round again.
+	long long number;
 	//Transmitted indicates whether or not the data was sent in any way. Dropped, corrupted, normal, doesn't matter
 	//Secured indicates whether or not the data was not only sent, but confirmed to have been received uncorrupted.
 	//Terminated indicates (if true) that this packet has been rendered unnecessary and should not be sent for any reason.
 	bool transmitted, secured, terminated;
 	char* content;
+	//The sending side's packed copy of the data (see Compress.cpp): "codec" is what it was packed with, or CODEC_NONE
+	//if it's sent as it is, and packedLength how long the packed copy is. "packed" is NULL until first needed.
+	int codec, packedLength;
+	char* packed;
+	//When the packet was first sent, for timing how long its ack takes. -1 once that's been timed, or if it can't be
+	//(an ack for a retransmitted packet could be for any of the copies sent).
+	double sentAt;
 } Packet;
 
 
@@ -36,128 +57,1802 @@ void shiftWindow(int shiftValue, int windowSize, int sequenceRange, Packet* pack
 bool feignError(int id, int numDrops, int* drops, int windowSize, int sequenceRange, int lowID, bool* alreadyDone); //Determines if an error should be simulated based on the given data
 short inetChecksum(char* bytes, int length); //Creates a checksum value to determine the integrity of the given data
 
+#include "Crc32c.cpp"
+#include "Digest.cpp"
+#include "Wire.cpp"
+#include "Fec.cpp"
+#include "Compress.cpp"
+#include "Delta.cpp"
+#include "Sparse.cpp"
+#include "Journal.cpp"
+#include "Dedup.cpp"
+#include "Bundle.cpp"
+#include "Transport.cpp"
+#include "Multicast.cpp"
+#include "Impairment.cpp"
+#include "Simulator.cpp"
+#include "Metrics.cpp"
+#include "Trace.cpp"
+#include "Window.cpp"
+
+
+//How many timeouts in a row exchangeReady puts up with before giving up on the other side
+#define READY_ATTEMPTS 8
+
+//How many signatures datagrams the receiving side of a delta sends for each request
+#define SIGNATURE_BURST 32
+
+//How many journal datagrams the receiving side of a resumed transfer sends for each request, and what's added to the path
+//of the file it writes for the path of its journal
+#define JOURNAL_BURST 32
+#define JOURNAL_SUFFIX ".journal"
+
+//How many dedup queries the sending side of a deduplicated transfer has out at once
+#define DEDUP_BURST 32
+
+//How many timeouts the sending side of a stream waits, at most, for the window it's loading to fill before it sends what
+//it has. The other side gives up after READY_ATTEMPTS of them without hearing anything, so this has to stay well short of that.
+#define STREAM_WAIT_TIMEOUTS 2
+
+//Given as the packet size, this has the read-writer pick one from the path to the other side (see probePath),
+//and the most data a packet can hold, which is what one picking its own makes room for
+#define PACKET_SIZE_AUTO 0
+#define PACKET_SIZE_MAX (MAX_DATAGRAM - WIRE_MAX_DATA_HEADER)
+
+//The usual link MTUs, which the first round of probes tries, how many more rounds there are at most, how many probes go in
+//each, and how close to the longest datagram that gets through they have to come before they stop
+static const int probeLadder[] = {65535, 9000, 4352, 1500, 1492, 1280, 576};
+#define PROBE_ROUNDS 3
+#define PROBE_BURST 8
+#define PROBE_PRECISION 16
+//The longest datagram every IPv4 host has to take, which packets are made to fit if no probe gets through
+#define PROBE_FLOOR (576 - UDP_IP_HEADERS)
+
+//How many windows of datagrams the socket buffers are made to hold (see fitBuffers): the one coming in, and the next
+//starting to while the last of it is still being read
+#define BUFFER_WINDOWS 2
+
 
 //Class made for handling reading and writing through datagram sockets
+//The datagrams themselves are carried by a Transport, which is a UDP socket unless asked otherwise.
 class SocketReadWriter {
 	private:
-		//The socket file descriptor
-		int sockfd;
+		//Whatever carries the datagrams to the other side
+		Transport* transport;
 	
 		//The array of bytes acting as the buffer, as well as the length of said buffer.
-		int bufferSize;
+		//packetBytes is how much of it the packet in it takes up, header and all, and packetSize the most data a packet can hold.
+		//There's room for the longest datagram of the wire format, which is a parity datagram.
+		int bufferSize, packetBytes, packetSize;
 		char* buffer;
+		
+		//The data of the packet in the buffer as it was before packing, which is what parity is worked out from
+		//(NULL if the buffer was filled some other way)
+		char* rawData;
+		int rawLength;
+		
+		//Set when awaitPacket left a packet in the buffer for the next getPacket
+		bool packetHeld;
+		
+		//Datagrams smaller than a packet are read in here first, so nothing bigger gets cut down to a size it isn't
+		char* incoming;
+		
+		//Timeout currently in use, kept so that anything wrapped around the transport later can be given the same one
+		int timeoutSeconds, timeoutMicroSeconds;
+		
+		//Every ready signal belongs to a numbered exchange. readyTag is the last exchange this side finished,
+		//and peerWaiting is set once the other side has started the next one (ending whatever phase this side is in).
+		unsigned char readyTag;
+		bool peerWaiting;
+		
+		//Set once the other side has said the transfer is over
+		bool peerFinished;
+		
+		//The integrity algorithms this side is willing to use (1 << INTEGRITY_...), and the one packets are sent with
+		int allowedIntegrity, integrity;
+		
+		//The file digests this side is willing to work out (1 << DIGEST_...), and the digest of the file going by
+		//(NULL if none was agreed on). ownDigest is what it came to once the file was done (ownDigestLength is 0 until then),
+		//peerDigest the one the other side sent in its fin (peerDigestAlgorithm is -1 if it sent none),
+		//and digestResult how the two compared (DIGEST_...).
+		int allowedDigests;
+		FileDigest* digest;
+		unsigned char ownDigest[DIGEST_MAX_BYTES], peerDigest[DIGEST_MAX_BYTES];
+		char ownDigestHex[2 * DIGEST_MAX_BYTES + 1];
+		int ownDigestLength, peerDigestAlgorithm, digestResult;
+		
+		//How many packets go in each parity group (0 for no parity), and what builds the parity on the sending side
+		//or keeps it on the receiving side (whichever this side turns out to be, NULL otherwise). parityFrame is where
+		//the sending side puts each parity datagram.
+		int parityGroup;
+		ParityEncoder* encoder;
+		ParityDecoder* decoder;
+		char* parityFrame;
+		
+		//The codec the sending side asked to pack packets with (CODEC_...), how many threads to pack on, and what packs them
+		//once the other side agreed (NULL otherwise). The receiving side unpacks with "unpacker", made once it's needed.
+		int wantedCodec, packThreads;
+		PacketPacker* packer;
+		Codec* unpacker;
+		
+		//Delta transfers (see Delta.cpp). The receiving side's old copy of the file ("basis", NULL if it has none) and the
+		//signatures of its blocks, whether the sending side wants to send a delta, and whether the hello settled on one.
+		//deltaFile is the file deltaSource or deltaSink wrapped, which gets an encoder or decoder on the first read or write
+		//(deltaStarted), and deltaResult is how putting the file back together went (DIGEST_...).
+		FILE* basis;
+		BlockSignatures* signatures;
+		bool wantDelta, deltaAgreed, deltaStarted;
+		FILE* deltaFile;
+		DeltaEncoder* deltaEncoder;
+		DeltaDecoder* deltaDecoder;
+		int deltaResult;
+		
+		//Resumed transfers (see Journal.cpp). The receiving side's journal of the blocks it has (NULL if it keeps none),
+		//whether the sending side wants to resume, and whether the hello settled on it. resumeFile is the file resumeSource or
+		//resumeSink wrapped, which gets a reader or writer on the first read or write (resumeStarted), and resumeComplete
+		//says whether the receiving side's file was all there once it was closed.
+		ResumeJournal* journal;
+		bool wantResume, resumeAgreed, resumeStarted, resumeComplete;
+		FILE* resumeFile;
+		ResumeReader* resumeReader;
+		ResumeWriter* resumeWriter;
+
+		//Sparse transfers (see Sparse.cpp). Whether the sending side wants to send holes, whether the receiving side can
+		//make them (it can once it writes through sparseSink), and whether the hello settled on it. sparseFile is the file
+		//sparseSource or sparseSink wrapped, which gets a reader or writer on the first read or write (sparseStarted), and
+		//sparseResult is how putting the file back together from the holes went (DIGEST_...).
+		bool wantSparse, acceptSparse, sparseAgreed, sparseStarted;
+		FILE* sparseFile;
+		SparseReader* sparseReader;
+		SparseWriter* sparseWriter;
+		int sparseResult;
+
+		//Deduplicated transfers (see Dedup.cpp). The receiving side's block store (NULL if it has none), whether the sending
+		//side wants to deduplicate, and whether the hello settled on it. dedupFile is the file dedupSource or dedupSink
+		//wrapped, which gets a reader or writer on the first read or write (dedupStarted), and dedupResult is how putting
+		//the file back together went (DIGEST_...).
+		BlockStore* store;
+		bool wantDedup, dedupAgreed, dedupStarted;
+		FILE* dedupFile;
+		DedupReader* dedupReader;
+		DedupWriter* dedupWriter;
+		int dedupResult;
+
+		//Bundles of files (see Bundle.cpp). The sending side wants to send one once it reads through bundleSource, and the
+		//receiving side can take one once it writes through bundleSink, into bundleDirectory on bundleWriters threads.
+		//The reader is made when the source is, and the writer on the first write (bundleStarted).
+		bool wantBundle, acceptBundle, bundleAgreed, bundleStarted, bundleOpen;
+		string bundleDirectory;
+		int bundleWriters;
+		BundleReader* bundleReader;
+		BundleWriter* bundleWriter;
+		
+		//Set once the hello has settled on numbering packets (see Wire.cpp), and how many the sending side has numbered so far
+		bool numberAgreed;
+		long long numberedPackets;
+		
+		//Set if the file is a stream, like a pipe or a socket, rather than something with a size (see setStreaming)
+		bool streaming;
+		
+		//Whether this side picks its packet size from the path rather than being given one (see probePath), the longest
+		//datagram known to get across whole (on the sending side what its probes found, on the receiving side the longest
+		//probe it answered, 0 before any), and the most data the other side's packets can hold, from its answers to them
+		bool autoSize;
+		int pathBytes, peerRoom;
+		
+		//What the low latency mode turned on (BUSY_..., 0 for nothing), and the CPU it pinned the protocols to (-1 for none)
+		int busyMode, pinnedCpu;
+		
+		//The metrics of the transfer in progress (NULL if there isn't one), and where new ones should report to
+		TransferMetrics* metrics;
+		FILE* metricsOut;
+		double metricsInterval;
+		
+		//Where packet events are traced (NULL for nowhere), and the side and protocol to label them with
+		TraceRing* tracer;
+		int traceSide;
+		bool traceGbn;
+		
+		//Sends a ready signal for the given exchange. "wantReply" asks the other side to answer it.
+		bool sendReady(unsigned char tag, bool wantReply) {
+			char frame[WIRE_READY_BYTES] = {wireFlags(WIRE_READY), (char) tag, (char) wantReply};
+			return sendData(frame, WIRE_READY_BYTES);
+		}
+		
+		//Deals with a ready signal that showed up while reading something else.
+		//Returns true if it means the other side is done with the current phase.
+		bool handleReady(char* frame) {
+			unsigned char tag = frame[1];
+			if (tag == (unsigned char) (readyTag + 1)) {
+				peerWaiting = true;
+				return true;
+			}
+			//The other side never heard this side's answer to the last exchange, so answer again
+			if (tag == readyTag && frame[2]) sendReady(readyTag, false);
+			return false;
+		}
+		
+		//Sends a fin signal for the given stage of the exchange (FIN_...), with this side's digest of the file unless it's closing
+		bool sendFin(int stage) {
+			char frame[WIRE_MAX_FIN] = {wireFlags(WIRE_FIN), (char) stage, (char) FIN_NO_DIGEST};
+			size_t length = WIRE_FIN_BYTES;
+			if (stage != FIN_CLOSE && ownDigestLength > 0) {
+				frame[2] = (char) digest->getAlgorithm();
+				memcpy(frame + WIRE_FIN_BYTES, ownDigest, ownDigestLength);
+				length += ownDigestLength;
+			}
+			return sendData(frame, length);
+		}
+		
+		//Deals with a fin signal from the other side, keeping the digest it came with.
+		//It isn't answered until everything the other side sent is written (see answerFin).
+		void handleFin(char* frame) {
+			peerFinished = true;
+			keepPeerDigest(frame);
+		}
+		
+		//Keeps the digest that came with the given fin, if it has one
+		void keepPeerDigest(char* frame) {
+			unsigned char algorithm = frame[2];
+			if (algorithm == FIN_NO_DIGEST) return;
+			peerDigestAlgorithm = algorithm;
+			memcpy(peerDigest, frame + WIRE_FIN_BYTES, digestLengths[algorithm]);
+		}
+		
+		//Finishes this side's digest of the file, if there is one and it isn't finished already
+		void finishDigest() {
+			if (digest == NULL || ownDigestLength > 0) return;
+			ownDigestLength = digest->finish(ownDigest);
+			FileDigest::toHex(ownDigest, ownDigestLength, ownDigestHex);
+		}
+		
+		//Compares the two sides' digests, once both are in, and reports how that went to the metrics
+		void compareDigests() {
+			if (ownDigestLength == 0 || peerDigestAlgorithm != digest->getAlgorithm()) digestResult = DIGEST_UNCHECKED;
+			else digestResult = memcmp(ownDigest, peerDigest, ownDigestLength) == 0 ? DIGEST_MATCH : DIGEST_MISMATCH;
+			if (metrics != NULL && ownDigestLength > 0) metrics->setDigest(digestNames[digest->getAlgorithm()], getDigest(), digestResult);
+		}
+		
+		//Sends a hello offering the given integrity algorithms, file digests, parity group size, codec, delta, resuming,
+		//holes, deduplicating, a bundle and numbered packets. "wantReply" asks the other side to pick one of each.
+		bool sendHello(bool wantReply, int offered, int digests, int group, int codec, bool delta, bool resume, bool sparse, bool dedup,
+			bool bundle, bool numbers) {
+			char frame[WIRE_HELLO_BYTES] = {wireFlags(WIRE_HELLO), (char) wantReply, (char) offered, (char) digests, (char) group, (char) codec,
+				(char) delta, (char) resume, (char) sparse, (char) dedup, (char) bundle, (char) numbers};
+			return sendData(frame, WIRE_HELLO_BYTES);
+		}
+		
+		//Deals with a hello from the other side: picks the best integrity algorithm both sides are willing to use
+		//(or the internet checksum, if there isn't one) and the best file digest (or none), takes whatever parity and
+		//codec are offered, takes a delta if there's a basis to apply it to, resumes if it keeps a journal, takes holes if it
+		//writes through sparseSink, deduplicates if it has a block store, takes a bundle if it writes through bundleSink,
+		//checks packet numbers if they're offered, and answers with them.
+		//A hello sent again only gets the same answer again, since the digest may already be under way.
+		void handleHello(char* frame) {
+			if (!frame[1]) return;
+			int picked = bestIntegrity(frame[2] & allowedIntegrity);
+			integrity = picked == -1 ? INTEGRITY_INET : picked;
+			int pickedDigest = bestDigest(frame[3] & allowedDigests);
+			if (digest == NULL && pickedDigest != -1) digest = new FileDigest(pickedDigest);
+			int group = (unsigned char) frame[4];
+			if (decoder == NULL && group > 0 && group <= WIRE_MAX_GROUP) {
+				parityGroup = group;
+				decoder = new ParityDecoder(packetSize);
+			}
+			int codec = (unsigned char) frame[5] < NUM_CODECS ? frame[5] : CODEC_NONE;
+			deltaAgreed = frame[6] && signatures != NULL;
+			resumeAgreed = frame[7] && journal != NULL;
+			sparseAgreed = frame[8] && acceptSparse;
+			dedupAgreed = frame[9] && store != NULL;
+			bundleAgreed = frame[10] && acceptBundle;
+			numberAgreed = frame[11];
+			sendHello(false, 1 << integrity, digest == NULL ? 0 : 1 << digest->getAlgorithm(), decoder == NULL ? 0 : parityGroup, codec, deltaAgreed,
+				resumeAgreed, sparseAgreed, dedupAgreed, bundleAgreed, numberAgreed);
+		}
+		
+		//Returns how much data the datagrams this side sends other than packets can carry, to be no longer than a packet.
+		//On a receiving side picking its packet size from the path, that's as much as the longest probe it answered,
+		//since its own room for packets is only what it takes in.
+		int answerRoom() {
+			return autoSize && pathBytes > WIRE_MAX_DATA_HEADER ? pathBytes - WIRE_MAX_DATA_HEADER : packetSize;
+		}
+		
+		//Returns how many signatures go in each signatures datagram, so that it's no longer than a data datagram
+		int signatureRecords() {
+			int send = (answerRoom() - WIRE_MAX_SIGNATURE_HEADER) / DELTA_SIGNATURE_BYTES;
+			return send < 1 ? 1 : send;
+		}
+		
+		//Answers a request for the signatures of this side's basis with SIGNATURE_BURST signatures datagrams, from the block asked for on
+		void handleSignatureRequest(char* frame, size_t length) {
+			unsigned int first;
+			if (signatures == NULL || wireType(frame, length) != WIRE_SIGNATURE_REQUEST || getVarint(frame + 1, length - 1, &first) == 0) return;
+			int records = signatureRecords(), count = signatures->getCount();
+			char chunk[WIRE_MAX_SIGNATURE_HEADER + records * DELTA_SIGNATURE_BYTES + WIRE_SIGNATURE_CHECK_BYTES];
+			//Even past the last block, one datagram goes out, so a basis with no blocks at all still gets an answer
+			for (int i = 0; i == 0 || (i < SIGNATURE_BURST && first < (unsigned int) count); i++, first += records) {
+				int used = putSignatureHeader(chunk, first, count, signatures->getBlockSize(), signatures->getLastLength());
+				used += signatures->put(chunk + used, first, records);
+				uint32_t check = crc32c(chunk + 1, used - 1);
+				for (int j = 0; j < WIRE_SIGNATURE_CHECK_BYTES; j++) chunk[used++] = (char) (check >> (8 * j));
+				sendData(chunk, used);
+				if (metrics != NULL) metrics->count(COUNT_SIGNATURE_BYTES, used);
+			}
+		}
+		
+		//Asks for the signatures of the other side's basis from the given block on
+		bool sendSignatureRequest(int first) {
+			char frame[1 + WIRE_MAX_VARINT];
+			frame[0] = wireFlags(WIRE_SIGNATURE_REQUEST);
+			return sendData(frame, 1 + putVarint(frame + 1, first));
+		}
+		
+		//Fetches the signatures of the other side's basis, for the sending side of a delta, a burst at a time. Once the last
+		//of a burst is in, the next is asked for from the first block still missing, and so is anything lost, after a timeout.
+		//Returns NULL if nothing came in READY_ATTEMPTS timeouts in a row. Otherwise it returns the signatures, which can be
+		//missing some if the other side stopped answering, and are the caller's to delete.
+		BlockSignatures* fetchSignatures() {
+			BlockSignatures* send = NULL;
+			int asked = 0;
+			sendSignatureRequest(asked);
+			for (int misses = 0; misses < READY_ATTEMPTS;) {
+				ssize_t bytesRead = transport->receive(incoming, GRO_BUFFER_SIZE);
+				if (bytesRead == -1) {
+					if (++misses < READY_ATTEMPTS) sendSignatureRequest(asked = send == NULL ? 0 : send->firstMissing(0));
+					continue;
+				}
+				if (wireType(incoming, bytesRead) != WIRE_SIGNATURES) continue;
+				int first, count, blockSize, lastLength;
+				int used = getSignatureHeader(incoming, bytesRead, &first, &count, &blockSize, &lastLength);
+				if (used == 0 || blockSize < 1 || blockSize > DELTA_MAX_BLOCK || lastLength > blockSize) continue;
+				if (send == NULL) send = new BlockSignatures(blockSize, count, lastLength);
+				if (blockSize != send->getBlockSize() || count != send->getCount() || lastLength != send->getLastLength()) continue;
+				
+				int records = (bytesRead - used - WIRE_SIGNATURE_CHECK_BYTES) / DELTA_SIGNATURE_BYTES;
+				send->get(incoming + used, records, first);
+				if (metrics != NULL) metrics->count(COUNT_SIGNATURE_BYTES, bytesRead);
+				misses = 0;
+				if (send->isComplete()) break;
+				if (first + records >= count || first + records >= asked + SIGNATURE_BURST * records) sendSignatureRequest(asked = send->firstMissing(0));
+			}
+			return send;
+		}
+		
+		//Gives the wrapped file an encoder or decoder, if a delta was agreed on, on its first read or write
+		void startDelta() {
+			deltaStarted = true;
+			if (!deltaAgreed) return;
+			if (basis != NULL) {
+				deltaDecoder = new DeltaDecoder(deltaFile, basis, signatures);
+				return;
+			}
+			//Even without any signatures a delta can still be sent, as nothing but literals
+			BlockSignatures* fetched = fetchSignatures();
+			deltaEncoder = new DeltaEncoder(deltaFile, fetched != NULL ? fetched : new BlockSignatures(DELTA_MIN_BLOCK, 0, 0));
+		}
+		
+		//Reports how the delta went once the wrapped file is closed, and drops its encoder or decoder
+		void endDelta() {
+			long literal = 0, copied = 0;
+			if (deltaEncoder != NULL) {
+				literal = deltaEncoder->getLiteralBytes();
+				copied = deltaEncoder->getCopiedBytes();
+				delete deltaEncoder;
+				deltaEncoder = NULL;
+			}
+			if (deltaDecoder != NULL) {
+				literal = deltaDecoder->getLiteralBytes();
+				copied = deltaDecoder->getCopiedBytes();
+				deltaResult = deltaDecoder->finish();
+				if (deltaResult == DIGEST_MISMATCH) LOG_ERROR("The file couldn't be put back together from the delta\n");
+				delete deltaDecoder;
+				deltaDecoder = NULL;
+			}
+			if (metrics != NULL) {
+				metrics->count(COUNT_DELTA_LITERAL, literal);
+				metrics->count(COUNT_DELTA_COPIED, copied);
+			}
+			deltaStarted = false;
+		}
+		
+		//fopencookie functions for the files deltaSource and deltaSink wrap, whose cookie is the read-writer
+		static ssize_t readDelta(void* cookie, char* data, size_t bytes) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			if (!sock->deltaStarted) sock->startDelta();
+			if (sock->deltaEncoder == NULL) return fread(data, 1, bytes, sock->deltaFile);
+			return sock->deltaEncoder->read(data, bytes);
+		}
+		
+		static ssize_t writeDelta(void* cookie, const char* data, size_t bytes) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			if (!sock->deltaStarted) sock->startDelta();
+			if (sock->deltaDecoder == NULL) return fwrite(data, 1, bytes, sock->deltaFile);
+			//Once the decoder's broken, nothing more is kept, and the protocol's check of each write has to hear so
+			return sock->deltaDecoder->write(data, bytes) ? bytes : 0;
+		}
+		
+		static int closeDelta(void* cookie) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			sock->endDelta();
+			int send = fclose(sock->deltaFile);
+			sock->deltaFile = NULL;
+			return send;
+		}
+		
+		//Answers a request for the bitmap of this side's journal with JOURNAL_BURST journal datagrams, from the byte asked for on.
+		//The journal is started over first if it's for any file but the one asked about.
+		void handleJournalRequest(char* frame, size_t length) {
+			uint64_t identity, bytes;
+			int blockSize;
+			unsigned int first;
+			if (journal == NULL || !getJournalRequest(frame, length, &identity, &bytes, &blockSize, &first) || blockSize < 1) return;
+			if (!journal->reset(identity, bytes, blockSize)) return;
+			size_t total;
+			const unsigned char* bitmap = journal->getBitmap(&total);
+			unsigned int room = answerRoom() > WIRE_MAX_JOURNAL_HEADER ? answerRoom() - WIRE_MAX_JOURNAL_HEADER : 1;
+			char chunk[WIRE_MAX_JOURNAL_HEADER + room + WIRE_FRAME_CHECK_BYTES];
+			//Even past the end of the bitmap, one datagram goes out, so an empty file still gets an answer
+			for (int i = 0; i == 0 || (i < JOURNAL_BURST && first < total); i++, first += room) {
+				int used = putJournalHeader(chunk, identity, first, total);
+				size_t taken = first >= total ? 0 : total - first < room ? total - first : room;
+				if (taken > 0) memcpy(chunk + used, bitmap + first, taken);
+				used = putFrameCheck(chunk, used + taken);
+				sendData(chunk, used);
+			}
+		}
+		
+		//Asks for the bitmap of the other side's journal from the given byte on, for the file with the given identity and size
+		bool sendJournalRequest(uint64_t identity, uint64_t size, unsigned int first) {
+			char frame[WIRE_MAX_JOURNAL_REQUEST];
+			return sendData(frame, putJournalRequest(frame, identity, size, RESUME_BLOCK, first));
+		}
+		
+		//Fetches the bitmap of the other side's journal into "bitmap", for the sending side of a resumed transfer, a burst
+		//at a time, just like fetchSignatures. Anything that never came in is left as 0, meaning the block gets sent again.
+		//Returns false if the bitmap isn't all there.
+		bool fetchJournal(uint64_t identity, uint64_t size, vector<unsigned char>* bitmap) {
+			size_t total = ((size + RESUME_BLOCK - 1) / RESUME_BLOCK + 7) / 8, received = 0;
+			bitmap->assign(total, 0);
+			vector<bool> got(total, false);
+			unsigned int asked = 0;
+			sendJournalRequest(identity, size, asked);
+			for (int misses = 0; misses < READY_ATTEMPTS;) {
+				ssize_t bytesRead = transport->receive(incoming, GRO_BUFFER_SIZE);
+				if (bytesRead == -1) {
+					if (++misses == READY_ATTEMPTS) break;
+					for (asked = 0; asked < total && got[asked]; asked++);
+					sendJournalRequest(identity, size, asked);
+					continue;
+				}
+				uint64_t source;
+				unsigned int first, whole;
+				int used = getJournalHeader(incoming, bytesRead, &source, &first, &whole);
+				if (used == 0 || source != identity || whole != total || first > total) continue;
+				size_t length = bytesRead - used - WIRE_FRAME_CHECK_BYTES;
+				if (length > total - first) continue;
+				for (size_t i = 0; i < length; i++) {
+					(*bitmap)[first + i] = incoming[used + i];
+					if (!got[first + i]) received++;
+					got[first + i] = true;
+				}
+				misses = 0;
+				if (received == total) return true;
+				if (first + length >= total || first + length >= asked + JOURNAL_BURST * length) {
+					for (asked = 0; asked < total && got[asked]; asked++);
+					sendJournalRequest(identity, size, asked);
+				}
+			}
+			return false;
+		}
+		
+		//Gives the wrapped file a reader or writer on its first read or write. The receiving side always gets a writer, which
+		//writes the file from the start if resuming wasn't agreed on. The sending side only gets a reader if it was, and the
+		//file is one that can be resumed.
+		void startResume() {
+			resumeStarted = true;
+			if (journal != NULL) {
+				resumeWriter = new ResumeWriter(resumeFile, journal);
+				if (!resumeAgreed) resumeWriter->startPlain();
+				return;
+			}
+			uint64_t identity, size;
+			if (!resumeAgreed || !sourceIdentity(resumeFile, &identity, &size)) return;
+			vector<unsigned char> bitmap;
+			if (!fetchJournal(identity, size, &bitmap)) LOG_INFO("Only got part of the other side's journal, so some of the file may be sent again\n");
+			resumeReader = new ResumeReader(resumeFile, identity, size, RESUME_BLOCK, bitmap.empty() ? NULL : &bitmap[0], bitmap.size());
+		}
+		
+		//Reports how much of the file resuming (and the holes in it) saved once the wrapped file is closed, and drops its
+		//reader or writer
+		void endResume() {
+			long skipped = 0, holes = 0;
+			if (resumeReader != NULL) {
+				skipped = resumeReader->getSkippedBytes();
+				holes = resumeReader->getHoleBytes();
+				delete resumeReader;
+				resumeReader = NULL;
+			}
+			if (resumeWriter != NULL) {
+				resumeComplete = resumeWriter->finish();
+				skipped = resumeWriter->getHeldBytes();
+				holes = resumeWriter->getHoleBytes();
+				delete resumeWriter;
+				resumeWriter = NULL;
+			}
+			if (metrics != NULL) {
+				metrics->count(COUNT_RESUMED_BYTES, skipped);
+				metrics->count(COUNT_HOLE_BYTES, holes);
+			}
+			resumeStarted = false;
+		}
+		
+		//fopencookie functions for the files resumeSource and resumeSink wrap, whose cookie is the read-writer
+		static ssize_t readResume(void* cookie, char* data, size_t bytes) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			if (!sock->resumeStarted) sock->startResume();
+			if (sock->resumeReader == NULL) return fread(data, 1, bytes, sock->resumeFile);
+			return sock->resumeReader->read(data, bytes);
+		}
+		
+		static ssize_t writeResume(void* cookie, const char* data, size_t bytes) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			if (!sock->resumeStarted) sock->startResume();
+			//A write the file didn't take must fail, so the protocol stops rather than acking what isn't kept
+			return sock->resumeWriter->write(data, bytes) ? bytes : 0;
+		}
+		
+		static int closeResume(void* cookie) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			//A receiving side that never got anything still has to start the file over, unless it's waiting to be resumed
+			if (!sock->resumeStarted && sock->journal != NULL && !sock->resumeAgreed) sock->startResume();
+			sock->endResume();
+			int send = fclose(sock->resumeFile);
+			sock->resumeFile = NULL;
+			return send;
+		}
+		
+		//Returns how many keys go in each dedup query, so that it's no longer than a data datagram
+		int dedupKeys() {
+			int send = (answerRoom() - WIRE_MAX_DEDUP_HEADER) / DEDUP_KEY_BYTES;
+			return send < 1 ? 1 : send;
+		}
+		
+		//Answers a dedup query with which of the blocks it asks about this side's store has. Those are then kept for the
+		//rest of the transfer.
+		void handleDedupQuery(char* frame, size_t length) {
+			unsigned int first;
+			int count;
+			int used = store == NULL ? 0 : getDedupQuery(frame, length, &first, &count);
+			if (used == 0) return;
+			unsigned char stored[(count + 7) / 8 + 1];
+			memset(stored, 0, sizeof(stored));
+			for (int i = 0; i < count; i++) {
+				if (store->has(frame + used + i * DEDUP_KEY_BYTES)) stored[i / 8] |= 1 << (i % 8);
+			}
+			char answer[WIRE_MAX_DEDUP_HEADER + sizeof(stored) + WIRE_FRAME_CHECK_BYTES];
+			sendData(answer, putDedupAnswer(answer, first, count, stored));
+		}
+		
+		//Sends the dedup query for the given keys, "records" at a time, with the given number
+		bool sendDedupQuery(const char* keys, int count, int query, int records) {
+			char frame[WIRE_MAX_DEDUP_HEADER + records * DEDUP_KEY_BYTES + WIRE_FRAME_CHECK_BYTES];
+			int first = query * records, many = count - first < records ? count - first : records;
+			int length = putDedupQuery(frame, first, keys + first * DEDUP_KEY_BYTES, many);
+			if (metrics != NULL) metrics->count(COUNT_DEDUP_QUERY_BYTES, length);
+			return sendData(frame, length);
+		}
+		
+		//Asks the other side which of the reader's blocks its store has, and notes those in the reader, for the sending side
+		//of a deduplicated transfer. Up to DEDUP_BURST queries are out at a time, each answered by one answer, and any that
+		//haven't been answered are sent again after a timeout. Returns false if the other side stopped answering before
+		//they all were, in which case the blocks it wasn't asked about are sent as data.
+		bool fetchDedup(DedupReader* reader) {
+			int count, records = dedupKeys();
+			const char* keys = reader->getKeys(&count);
+			int queries = (count + records - 1) / records, answered = 0, lowest = 0, sent = 0;
+			vector<bool> got(queries, false);
+			for (int misses = 0; answered < queries && misses < READY_ATTEMPTS;) {
+				for (; sent < queries && sent < lowest + DEDUP_BURST; sent++) sendDedupQuery(keys, count, sent, records);
+				ssize_t bytesRead = transport->receive(incoming, GRO_BUFFER_SIZE);
+				if (bytesRead == -1) {
+					if (++misses == READY_ATTEMPTS) break;
+					for (int i = lowest; i < sent; i++) {
+						if (!got[i]) sendDedupQuery(keys, count, i, records);
+					}
+					continue;
+				}
+				unsigned int first;
+				int many;
+				int used = getDedupAnswer(incoming, bytesRead, &first, &many);
+				if (used == 0 || first % records != 0 || first >= (unsigned int) count || many != (count - (int) first < records ? count - (int) first : records)) continue;
+				if (metrics != NULL) metrics->count(COUNT_DEDUP_QUERY_BYTES, bytesRead);
+				int query = first / records;
+				if (got[query]) continue;
+				got[query] = true;
+				answered++;
+				misses = 0;
+				for (int i = 0; i < many; i++) {
+					if (incoming[used + i / 8] & (1 << (i % 8))) reader->setStored(first + i);
+				}
+				while (lowest < queries && got[lowest]) lowest++;
+			}
+			return answered == queries;
+		}
+		
+		//Gives the wrapped file a reader or writer on its first read or write, if deduplicating was agreed on. The sending
+		//side only gets a reader if its file is a regular file, and the keys of its blocks are worked out and asked about first.
+		void startDedup() {
+			dedupStarted = true;
+			if (!dedupAgreed) return;
+			if (store != NULL) {
+				dedupWriter = new DedupWriter(dedupFile, store);
+				return;
+			}
+			if ((dedupReader = DedupReader::open(dedupFile)) == NULL) return;
+			if (!fetchDedup(dedupReader)) LOG_INFO("Only heard which of some blocks the other side has, so some may be sent again\n");
+		}
+		
+		//Reports how much of the file deduplicating saved once the wrapped file is closed, and drops its reader or writer
+		void endDedup() {
+			long saved = 0;
+			if (dedupReader != NULL) {
+				saved = dedupReader->getSavedBytes();
+				delete dedupReader;
+				dedupReader = NULL;
+			}
+			if (dedupWriter != NULL) {
+				dedupResult = dedupWriter->finish();
+				saved = dedupWriter->getSavedBytes();
+				if (dedupResult == DIGEST_MISMATCH) LOG_ERROR("The file couldn't be put back together from the blocks sent and stored\n");
+				delete dedupWriter;
+				dedupWriter = NULL;
+			}
+			if (metrics != NULL) metrics->count(COUNT_DEDUP_BYTES, saved);
+			dedupStarted = false;
+		}
+		
+		//fopencookie functions for the files dedupSource and dedupSink wrap, whose cookie is the read-writer
+		static ssize_t readDedup(void* cookie, char* data, size_t bytes) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			if (!sock->dedupStarted) sock->startDedup();
+			if (sock->dedupReader == NULL) return fread(data, 1, bytes, sock->dedupFile);
+			return sock->dedupReader->read(data, bytes);
+		}
+		
+		static ssize_t writeDedup(void* cookie, const char* data, size_t bytes) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			if (!sock->dedupStarted) sock->startDedup();
+			if (sock->dedupWriter == NULL) return fwrite(data, 1, bytes, sock->dedupFile);
+			//Once the writer's broken, so is every write after it
+			return sock->dedupWriter->write(data, bytes) ? bytes : 0;
+		}
+		
+		static int closeDedup(void* cookie) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			sock->endDedup();
+			int send = fclose(sock->dedupFile);
+			sock->dedupFile = NULL;
+			return send;
+		}
+		
+		//Gives the wrapped file a reader or writer on its first read or write, if holes were agreed on
+		void startSparse() {
+			sparseStarted = true;
+			if (!sparseAgreed) return;
+			if (acceptSparse) sparseWriter = new SparseWriter(sparseFile);
+			else sparseReader = new SparseReader(sparseFile);
+		}
+		
+		//Reports how much of the file went as holes, and how putting it back together went, once the wrapped file is closed,
+		//and drops its reader or writer. Returns false if what came couldn't be written or didn't put the file back together.
+		bool endSparse() {
+			bool send = true;
+			long holes = 0;
+			if (sparseReader != NULL) {
+				holes = sparseReader->getHoleBytes();
+				delete sparseReader;
+				sparseReader = NULL;
+			}
+			if (sparseWriter != NULL) {
+				sparseResult = sparseWriter->finish();
+				send = sparseResult != DIGEST_MISMATCH;
+				holes = sparseWriter->getHoleBytes();
+				if (!send) LOG_ERROR("The file couldn't be put back together from the holes sent\n");
+				delete sparseWriter;
+				sparseWriter = NULL;
+			}
+			if (metrics != NULL) metrics->count(COUNT_HOLE_BYTES, holes);
+			sparseStarted = false;
+			return send;
+		}
+		
+		//fopencookie functions for the files sparseSource and sparseSink wrap, whose cookie is the read-writer
+		static ssize_t readSparse(void* cookie, char* data, size_t bytes) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			if (!sock->sparseStarted) sock->startSparse();
+			if (sock->sparseReader == NULL) return fread(data, 1, bytes, sock->sparseFile);
+			return sock->sparseReader->read(data, bytes);
+		}
+		
+		static ssize_t writeSparse(void* cookie, const char* data, size_t bytes) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			if (!sock->sparseStarted) sock->startSparse();
+			if (sock->sparseWriter == NULL) return fwrite(data, 1, bytes, sock->sparseFile);
+			//A broken writer keeps nothing more, which the protocol has to hear from the write
+			return sock->sparseWriter->write(data, bytes) ? bytes : 0;
+		}
+		
+		static int closeSparse(void* cookie) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			bool written = sock->endSparse();
+			int send = fclose(sock->sparseFile);
+			sock->sparseFile = NULL;
+			return written ? send : EOF;
+		}
+		
+		//Reports how many of the bundle's files went once what bundleSource or bundleSink returned is closed, and drops its
+		//reader or writer. Returns false if what came couldn't be written.
+		bool endBundle() {
+			bool send = true;
+			long files = 0, bytes = 0;
+			if (bundleReader != NULL) {
+				files = bundleReader->getFiles();
+				bytes = bundleReader->getBytes();
+				if (bundleReader->getSkipped() > 0) LOG_ERROR(bundleReader->getSkipped() << " things in the bundle were left out, since they weren't files or directories, or sent empty, since they couldn't be read\n");
+				delete bundleReader;
+				bundleReader = NULL;
+			}
+			if (bundleWriter != NULL) {
+				send = bundleWriter->finish();
+				files = bundleWriter->getFiles();
+				bytes = bundleWriter->getBytes();
+				if (!send) LOG_ERROR("The bundle didn't make sense or stopped short, or " << bundleWriter->getFailures() << " of its files couldn't be written\n");
+				delete bundleWriter;
+				bundleWriter = NULL;
+			}
+			if (metrics != NULL) {
+				metrics->count(COUNT_BUNDLE_FILES, files);
+				metrics->count(COUNT_BUNDLE_BYTES, bytes);
+			}
+			bundleOpen = bundleStarted = false;
+			return send;
+		}
+		
+		//fopencookie functions for what bundleSource and bundleSink return, whose cookie is the read-writer. A source can
+		//only be read from once the hello has settled on a bundle, since a directory can't be sent any other way.
+		static ssize_t readBundle(void* cookie, char* data, size_t bytes) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			if (!sock->bundleAgreed) {
+				if (!sock->bundleStarted) LOG_ERROR("The other side can't take a bundle of files\n");
+				sock->bundleStarted = true;
+				return -1;
+			}
+			return sock->bundleReader->read(data, bytes);
+		}
+		
+		static ssize_t writeBundle(void* cookie, const char* data, size_t bytes) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			if (!sock->bundleStarted) {
+				sock->bundleStarted = true;
+				sock->bundleWriter = new BundleWriter(sock->bundleDirectory.c_str(), sock->bundleWriters);
+			}
+			sock->bundleWriter->write(data, bytes);
+			return bytes;
+		}
+		
+		static int closeBundle(void* cookie) {
+			SocketReadWriter* sock = (SocketReadWriter*) cookie;
+			return sock->endBundle() ? 0 : EOF;
+		}
+		
+		//Keeps a parity datagram that arrived, if parity was agreed on, to rebuild lost packets from later (see rebuildPackets)
+		void handleParity(char* frame, size_t length) {
+			if (decoder != NULL && decoder->add(frame, length, readyTag) && metrics != NULL) metrics->count(COUNT_PARITY_RECEIVED);
+		}
+		
+		//Queues the parity datagram of the group the sending side has built so far, and starts the next group
+		bool queueParity() {
+			int first = encoder->firstId(), count = encoder->size();
+			int length = encoder->finish(parityFrame, readyTag);
+			if (metrics != NULL) metrics->count(COUNT_PARITY_SENT);
+			trace(TRACE_PARITY, first, -1, count, length);
+			return transport->queue(parityFrame, length);
+		}
+		
+		//Does the actual work of sendPacket
+		bool queuePacket() {
+			bool send = transport->queue(buffer, packetBytes);
+			int id;
+			if (encoder == NULL || rawData == NULL || wireId(buffer, packetBytes, &id) == 0) return send;
+			if (encoder->add(id, rawData, rawLength)) send = queueParity() && send;
+			return send;
+		}
+		
+		//Answers a probe that arrived whole (see probePath) with how long it was and how much data this side's packets can
+		//hold, keeping the longest so far
+		void handleProbe(char* frame, size_t length) {
+			unsigned int size;
+			if (!getProbe(frame, length, &size)) return;
+			if ((int) size > pathBytes) pathBytes = size;
+			if (metrics != NULL) metrics->setPacketSize(packetSize, autoSize, pathBytes);
+			char answer[WIRE_MAX_PROBE_ANSWER];
+			sendData(answer, putProbeAnswer(answer, size, packetSize));
+		}
+		
+		//Returns the most a datagram adds to the data of a packet: the longest header a data datagram can have, or a
+		//parity datagram's if parity was agreed
+		int datagramOverhead() {
+			if (parityGroup == 0) return WIRE_MAX_DATA_HEADER;
+			return 3 + parityGroup * WIRE_MAX_VARINT + WIRE_MAX_VARINT + WIRE_PARITY_CHECK_BYTES;
+		}
+		
+		//Makes packets as long as fits in a datagram "datagram" bytes long, whatever they go out in, but no longer than the
+		//other side's packets can hold, if it said
+		void fitPackets(int datagram) {
+			int room = datagram - datagramOverhead();
+			if (peerRoom > 0 && room > peerRoom) room = peerRoom;
+			packetSize = room < 1 ? 1 : room;
+			if (metrics != NULL) metrics->setPacketSize(packetSize, autoSize, pathBytes);
+		}
+		
+		//Finds the longest datagram that gets to the other side whole, up to "upper", and makes packets fit it.
+		//The first round of probes tries "upper" and each of the usual link MTUs below it, twice over, since a lost probe looks
+		//just like one too long for the path. Then up to PROBE_ROUNDS rounds try lengths spread evenly between the longest
+		//answered and the shortest lost, unless the path sent back a size error saying what it takes, which is tried instead.
+		//Each round waits for answers until a timeout. A transport that can't keep datagrams whole isn't probed, and packets
+		//are made to fit what it says the path takes, and if no probe gets through at all, they're made to fit PROBE_FLOOR.
+		void probePath(int upper) {
+			if (!transport->setProbing(true)) {
+				fitPackets(upper);
+				return;
+			}
+			int sizes[PROBE_BURST], count = 0, longest = 0, lost = upper + 1;
+			sizes[count++] = upper;
+			for (int i = 0; i < (int) (sizeof(probeLadder) / sizeof(probeLadder[0])); i++) {
+				if (probeLadder[i] - UDP_IP_HEADERS < upper) sizes[count++] = probeLadder[i] - UDP_IP_HEADERS;
+			}
+			for (int round = 0; ; round++) {
+				int answered = sendProbes(sizes, count, round == 0 ? 2 : 1);
+				if (answered > longest) longest = answered;
+				for (int i = 0; i < count; i++) {
+					if (sizes[i] > longest && sizes[i] < lost) lost = sizes[i];
+				}
+				int told = transport->sizeError();
+				if (told > 0 && told < lost) lost = told + 1;
+				if (round == PROBE_ROUNDS || longest == 0 || lost - longest <= PROBE_PRECISION) break;
+				
+				count = 0;
+				if (told > longest && told < lost) sizes[count++] = told;
+				else {
+					int step = (lost - longest) / (PROBE_BURST + 1);
+					for (int i = 1; i <= PROBE_BURST; i++) sizes[count++] = longest + i * (step < 1 ? 1 : step);
+				}
+			}
+			transport->setProbing(false);
+			//Any size error still to come is a probe's
+			transport->sizeError();
+			pathBytes = longest;
+			fitPackets(longest > 0 ? longest : PROBE_FLOOR);
+		}
+		
+		//Sends a probe of each of the given lengths, "copies" times over, and waits for answers until they're all in or
+		//a timeout. Returns the longest that was answered, or 0 if none was.
+		int sendProbes(int* sizes, int count, int copies) {
+			char* frame = new char[MAX_DATAGRAM];
+			for (int copy = 0; copy < copies; copy++) {
+				for (int i = 0; i < count; i++) {
+					sendData(frame, putProbe(frame, sizes[i]));
+					if (metrics != NULL) metrics->count(COUNT_PROBES_SENT);
+				}
+			}
+			delete[] frame;
+			
+			int send = 0;
+			bool answered[count];
+			memset(answered, 0, sizeof(answered));
+			for (int waiting = count; waiting > 0;) {
+				ssize_t bytesRead = transport->receive(incoming, GRO_BUFFER_SIZE);
+				if (bytesRead == -1) break;
+				int found = classifyDatagram(incoming, bytesRead);
+				//The other side may still be missing an answer to the last exchange
+				if (found == KIND_READY) handleReady(incoming);
+				unsigned int size, room;
+				if (found != KIND_PROBE || !getProbeAnswer(incoming, bytesRead, &size, &room)) continue;
+				peerRoom = room;
+				if ((int) size > send) send = size;
+				for (int i = 0; i < count; i++) {
+					if (sizes[i] != (int) size || answered[i]) continue;
+					answered[i] = true;
+					waiting--;
+					if (metrics != NULL) metrics->count(COUNT_PROBES_ANSWERED);
+				}
+			}
+			return send;
+		}
+		
+		//Basic method for reading data from a connection. All other reading methods should use this.
+		//Only datagrams of the given kind are saved, and anything else that shows up is skipped over.
+		//How many bytes were saved goes in "length", unless it's NULL.
+		//Returns true if data was successfully obtained, false if a timeout happened instead
+		//(or the other side signalled ready, meaning there's nothing more to read until exchangeReady is called,
+		//or that it's finished).
+		bool readData(char* saveHere, size_t bytes, int kind, size_t* length) {
+			if (metrics == NULL) return receiveKind(saveHere, bytes, kind, length);
+			
+			double start = metrics->now();
+			bool send = receiveKind(saveHere, bytes, kind, length);
+			metrics->addTime(TIME_WAITING, start);
+			return send;
+		}
+		
+		//Does the actual work of readData
+		bool receiveKind(char* saveHere, size_t bytes, int kind, size_t* length) {
+			if (peerWaiting || peerFinished) return false;
+			
+			//A whole packet can go straight to where it's headed, anything smaller goes through "incoming"
+			bool direct = bytes >= (size_t) bufferSize;
+			char* landing = direct ? saveHere : incoming;
+			size_t room = direct ? bytes : GRO_BUFFER_SIZE;
+			
+			while (true) {
+				ssize_t bytesRead = transport->receive(landing, room);
+				if (bytesRead == -1) return false;
+				
+				int found = classifyDatagram(landing, bytesRead);
+				if (found == KIND_READY) {
+					if (handleReady(landing)) return false;
+					continue;
+				}
+				if (found == KIND_FIN) {
+					handleFin(landing);
+					return false;
+				}
+				if (found == KIND_HELLO) {
+					handleHello(landing);
+					continue;
+				}
+				if (found == KIND_PARITY) {
+					handleParity(landing, bytesRead);
+					continue;
+				}
+				if (found == KIND_SIGNATURES) {
+					handleSignatureRequest(landing, bytesRead);
+					continue;
+				}
+				if (found == KIND_JOURNAL) {
+					handleJournalRequest(landing, bytesRead);
+					continue;
+				}
+				if (found == KIND_DEDUP) {
+					handleDedupQuery(landing, bytesRead);
+					continue;
+				}
+				if (found == KIND_PROBE) {
+					handleProbe(landing, bytesRead);
+					continue;
+				}
+				if (found != kind) continue;
+				
+				size_t saved = (size_t) bytesRead < bytes ? bytesRead : bytes;
+				if (!direct) memcpy(saveHere, landing, saved);
+				if (length != NULL) *length = saved;
+				return true;
+			}
+		}
+		
+		//Basic method for writing data through a connection. All other writing methods should use this.
+		//Returns true if the transfer was successful, false if something blocked it.
+		bool sendData(char* data, size_t bytes) {
+			if (metrics == NULL) return transport->send(data, bytes) == (ssize_t) bytes;
+			
+			double start = metrics->now();
+			bool send = transport->send(data, bytes) == (ssize_t) bytes;
+			metrics->addTime(TIME_SENDING, start);
+			return send;
+		}
+		
+		//Puts impairment pipelines around the transport. Either one can be NULL.
+		void wrapTransport(ImpairmentPipeline* sendPipeline, ImpairmentPipeline* receivePipeline) {
+			transport = new ImpairedTransport(transport, sendPipeline, receivePipeline, classifyDatagram);
+			transport->setTimeout(timeoutSeconds, timeoutMicroSeconds);
+		}
+		
+		//Constructor. This should only be invoked via the static methods at the bottom of the class.
+		SocketReadWriter(Transport* carrier, int bufferLength, int seconds, int microSeconds) {
+			transport = carrier;
+			//Allocate a buffer of appropriate size. One picking its own packet size makes room for the longest it could pick.
+			autoSize = bufferLength == PACKET_SIZE_AUTO;
+			packetSize = autoSize ? PACKET_SIZE_MAX : bufferLength;
+			pathBytes = peerRoom = 0;
+			busyMode = 0;
+			pinnedCpu = -1;
+			buffer = new char[bufferSize = (packetSize + WIRE_MAX_PARITY_HEADER + WIRE_PARITY_CHECK_BYTES)];
+			packetBytes = 0;
+			rawData = NULL;
+			rawLength = 0;
+			packetHeld = false;
+			incoming = new char[GRO_BUFFER_SIZE];
+			timeoutSeconds = seconds;
+			timeoutMicroSeconds = microSeconds;
+			readyTag = 0;
+			peerWaiting = peerFinished = false;
+			allowedIntegrity = ALL_INTEGRITY;
+			integrity = INTEGRITY_INET;
+			allowedDigests = ALL_DIGESTS;
+			digest = NULL;
+			ownDigestLength = 0;
+			peerDigestAlgorithm = -1;
+			digestResult = DIGEST_UNCHECKED;
+			parityGroup = 0;
+			encoder = NULL;
+			decoder = NULL;
+			parityFrame = NULL;
+			wantedCodec = CODEC_NONE;
+			packThreads = 0;
+			packer = NULL;
+			unpacker = NULL;
+			basis = NULL;
+			signatures = NULL;
+			wantDelta = deltaAgreed = deltaStarted = false;
+			deltaFile = NULL;
+			deltaEncoder = NULL;
+			deltaDecoder = NULL;
+			deltaResult = DIGEST_UNCHECKED;
+			journal = NULL;
+			wantResume = resumeAgreed = resumeStarted = resumeComplete = false;
+			resumeFile = NULL;
+			resumeReader = NULL;
+			resumeWriter = NULL;
+			wantSparse = acceptSparse = sparseAgreed = sparseStarted = false;
+			sparseFile = NULL;
+			sparseReader = NULL;
+			sparseWriter = NULL;
+			sparseResult = DIGEST_UNCHECKED;
+			store = NULL;
+			wantDedup = dedupAgreed = dedupStarted = false;
+			dedupFile = NULL;
+			dedupReader = NULL;
+			dedupWriter = NULL;
+			dedupResult = DIGEST_UNCHECKED;
+			wantBundle = acceptBundle = bundleAgreed = bundleStarted = bundleOpen = false;
+			bundleWriters = 0;
+			bundleReader = NULL;
+			bundleWriter = NULL;
+			streaming = false;
+			numberAgreed = false;
+			numberedPackets = 0;
+			metrics = NULL;
+			metricsOut = NULL;
+			metricsInterval = 0;
+			tracer = NULL;
+			traceSide = TRACE_SERVER;
+			traceGbn = false;
+		}
 	
-		//The details of the other side of the connection, as well as how large the  is.
-		sockaddr_in *destination, *home;
-		socklen_t destSize, homeSize;
+	public:
+		//Obtains an integer from the connection, returning it instead of saving it to the buffer
+		//NOTE: If this function returns -3, that's a timeout indicator, not a real result.
+		//The integer travels as the id of an ack.
+		int getInt() {
+			char frame[WIRE_MAX_ACK];
+			size_t length;
+			while (readData(frame, sizeof(frame), KIND_ACK, &length)) {
+				int send;
+				//Nacks are skipped, since nothing here asks for them yet
+				if (wireType(frame, length) != WIRE_ACK || wireId(frame, length, &send) == 0) continue;
+				if (metrics != NULL) metrics->count(COUNT_ACKS_RECEIVED);
+				return send;
+			}
+			return -3;
+		}
+		
+		//Sends an given integer through the connection instead of using the buffer data
+		//Returns true if successful, false if timed out
+		bool sendInt(int value) {
+			if (metrics != NULL) metrics->count(COUNT_ACKS_SENT);
+			char frame[WIRE_MAX_ACK];
+			return sendData(frame, putAck(frame, WIRE_ACK, value, -1));
+		}
+		
+		//Sends an ack for the packet with the given id and number, for the receiving side. The number only goes with it
+		//once the hello has settled on numbering packets, which lets a multicast sender tell whose ack is for which packet
+		//(see Multicast.cpp). Returns true if successful, false if timed out
+		bool sendAck(int id, long long number) {
+			if (metrics != NULL) metrics->count(COUNT_ACKS_SENT);
+			char frame[WIRE_MAX_ACK];
+			return sendData(frame, putAck(frame, WIRE_ACK, id, numberAgreed ? number : -1));
+		}
+		
+		//Shortcut function for calculating packet checksum
+		short checksum() {
+			return inetChecksum(buffer, bufferSize);
+		}
+
+		
+		//Trades ready signals with the other side, so each knows the other is done with the phase they were in.
+		//Both sides have to call this at the same point. A signal lost on the way is sent again after every timeout,
+		//and if the other side missed this side's answer to an exchange, it gets answered again during later reads.
+		//Returns true once the other side is ready, false if it stayed quiet for READY_ATTEMPTS timeouts in a row.
+		bool exchangeReady() {
+			if (metrics == NULL) return tradeReady();
+			
+			double start = metrics->now();
+			bool send = tradeReady();
+			metrics->addTime(TIME_WAITING, start);
+			return send;
+		}
+		
+		//Does the actual work of exchangeReady
+		bool tradeReady() {
+			unsigned char next = readyTag + 1;
+			
+			if (peerFinished) return false;
+			
+			//If the other side already signalled, it only needs to hear back, not to answer
+			sendReady(next, !peerWaiting);
+			for (int misses = 0; !peerWaiting;) {
+				ssize_t bytesRead = transport->receive(incoming, GRO_BUFFER_SIZE);
+				if (bytesRead == -1) {
+					if (++misses == READY_ATTEMPTS) return false;
+					sendReady(next, true);
+					continue;
+				}
+				int found = classifyDatagram(incoming, bytesRead);
+				//The other side is finished, so there's nothing left to be ready for
+				if (found == KIND_FIN) {
+					handleFin(incoming);
+					return false;
+				}
+				if (found == KIND_HELLO) handleHello(incoming);
+				if (found == KIND_SIGNATURES) handleSignatureRequest(incoming, bytesRead);
+				if (found == KIND_JOURNAL) handleJournalRequest(incoming, bytesRead);
+				if (found == KIND_DEDUP) handleDedupQuery(incoming, bytesRead);
+				if (found == KIND_PROBE) handleProbe(incoming, bytesRead);
+				if (found != KIND_READY) continue;
+				
+				unsigned char tag = incoming[1];
+				if (tag == next) {
+					if (incoming[2]) sendReady(next, false);
+					break;
+				}
+				//The other side already finished this exchange and is waiting on the one after it
+				if (tag == (unsigned char) (next + 1)) {
+					readyTag = next;
+					peerWaiting = true;
+					return true;
+				}
+				if (tag == readyTag && incoming[2]) sendReady(readyTag, false);
+			}
+			readyTag = next;
+			peerWaiting = false;
+			return true;
+		}
+		
+		//Returns true if the other side has already signalled ready for the next exchange
+		bool otherSideReady() {
+			return peerWaiting;
+		}
+		
+		//Tells the other side the transfer is over, so it can stop without waiting to time out, and waits for it to agree.
+		//The fin carries this side's digest of the file, and the answer the other side's, so once it returns true
+		//getDigestResult says whether the file got there intact.
+		//A fin lost on the way is sent again after every timeout, and any ready signal the other side is still missing
+		//an answer to gets answered meanwhile.
+		//Returns true once the other side agrees, false if it stayed quiet for READY_ATTEMPTS timeouts in a row.
+		bool finish() {
+			if (metrics == NULL) return tradeFin();
+			
+			double start = metrics->now();
+			bool send = tradeFin();
+			metrics->addTime(TIME_WAITING, start);
+			return send;
+		}
+		
+		//Does the actual work of finish
+		bool tradeFin() {
+			finishDigest();
+			sendFin(FIN_REQUEST);
+			for (int misses = 0; misses < READY_ATTEMPTS;) {
+				ssize_t bytesRead = transport->receive(incoming, GRO_BUFFER_SIZE);
+				if (bytesRead == -1) {
+					if (++misses < READY_ATTEMPTS) sendFin(FIN_REQUEST);
+					continue;
+				}
+				int found = classifyDatagram(incoming, bytesRead);
+				if (found == KIND_FIN && incoming[1] == FIN_ANSWER) {
+					keepPeerDigest(incoming);
+					compareDigests();
+					sendFin(FIN_CLOSE);
+					return true;
+				}
+				if (found == KIND_READY) handleReady(incoming);
+			}
+			return false;
+		}
+		
+		//Answers the other side's fin, for the receiving side to call once everything has been written, with this side's
+		//digest of what was written. The answer is sent again whenever the fin is, in case it got lost, until the other side
+		//says it heard it or stays quiet for READY_ATTEMPTS timeouts in a row. Does nothing if the other side never sent a fin.
+		//Returns how the two sides' digests compared (DIGEST_...).
+		int answerFin() {
+			if (metrics == NULL) return lingerFin();
+			
+			double start = metrics->now();
+			int send = lingerFin();
+			metrics->addTime(TIME_WAITING, start);
+			return send;
+		}
+		
+		//Does the actual work of answerFin
+		int lingerFin() {
+			if (!peerFinished) return digestResult;
+			finishDigest();
+			compareDigests();
+			sendFin(FIN_ANSWER);
+			for (int misses = 0; misses < READY_ATTEMPTS;) {
+				ssize_t bytesRead = transport->receive(incoming, GRO_BUFFER_SIZE);
+				if (bytesRead == -1) {
+					misses++;
+					continue;
+				}
+				if (classifyDatagram(incoming, bytesRead) != KIND_FIN) continue;
+				if (incoming[1] == FIN_CLOSE) break;
+				if (incoming[1] == FIN_REQUEST) sendFin(FIN_ANSWER);
+			}
+			return digestResult;
+		}
+		
+		//Returns true if the other side has said the transfer is over
+		bool otherSideFinished() {
+			return peerFinished;
+		}
+		
+		//Sets which integrity algorithms (1 << INTEGRITY_...) this side is willing to check packets with.
+		//Everything is allowed unless this is called. Returns false if the set is empty or names one that doesn't exist.
+		bool setIntegrity(int allowed) {
+			if (allowed <= 0 || (allowed & ~ALL_INTEGRITY) != 0) return false;
+			allowedIntegrity = allowed;
+			return true;
+		}
+		
+		//Sets which file digests (1 << DIGEST_...) this side is willing to work out. Everything is allowed unless this is called,
+		//and 0 turns the digest off. Returns false if the set names one that doesn't exist.
+		bool setDigests(int allowed) {
+			if (allowed < 0 || (allowed & ~ALL_DIGESTS) != 0) return false;
+			allowedDigests = allowed;
+			return true;
+		}
+		
+		//Adds the next bytes of the file to this side's digest of it: the sending side as it reads the file,
+		//the receiving side as it writes it, in order. Does nothing if no digest was agreed on.
+		void digestData(const char* data, size_t length) {
+			if (digest != NULL) digest->add(data, length);
+		}
+		
+		//Returns how this side's digest of the file compared with the other side's (DIGEST_...). It's DIGEST_UNCHECKED until
+		//the fin exchange is done, and for good if either side had no digest.
+		int getDigestResult() {
+			return digestResult;
+		}
+		
+		//Returns this side's finished digest of the file in hex, or NULL if there isn't one (yet)
+		const char* getDigest() {
+			return ownDigestLength == 0 ? NULL : ownDigestHex;
+		}
+		
+		//Returns the file digest (DIGEST_...) agreed on, or -1 if there's none
+		int getDigestAlgorithm() {
+			return digest == NULL ? -1 : digest->getAlgorithm();
+		}
+		
+		//Sets how many packets go in each parity group, for the sending side to call before agreeIntegrity: after every
+		//"group" packets sent (and at the end of each round, for a group left unfinished), a parity packet follows,
+		//from which the other side can rebuild any one of the group that got lost (see Fec.cpp and rebuildPackets).
+		//That adds 1/group to what's sent. 0 turns parity off, which is how it starts.
+		//Returns false if the group size is out of range (above WIRE_MAX_GROUP).
+		bool setParity(int group) {
+			if (group < 0 || group > WIRE_MAX_GROUP) return false;
+			parityGroup = group;
+			return true;
+		}
 		
-		//Basic method for reading data from a connection. All other reading methods should use this.
-		//Returns true if data was successfully obtained, false if a timeout happened instead.
-		bool readData(char* saveHere, size_t bytes) {
-			size_t bytesRead = 0;
-			while (bytesRead < bytes) {
-
-                ssize_t bytesThisTime = recvfrom(sockfd, saveHere + bytesRead, bytes - bytesRead, 0,(sockaddr*) destination, &destSize);
-				if (bytesThisTime == -1) return false;
-
-                bytesRead += bytesThisTime;
-				
-				//If that wasn't everything that was expected, let the sender know this object is ready for more.
-				if (bytesRead < bytes) {
-					signalReady();
-		        }
-			}
+		//Sets the codec (CODEC_...) the sending side packs packets with, for it to call before agreeIntegrity, and how many
+		//worker threads to pack on (0 packs each packet as it's sent). Packing only starts once the other side agrees to it.
+		//Returns false if there's no such codec.
+		bool setCompression(int codec, int threads) {
+			if (codec < 0 || codec >= NUM_CODECS || threads < 0) return false;
+			wantedCodec = codec;
+			packThreads = threads;
 			return true;
 		}
 		
-		//Basic method for writing data through a connection. All other writing methods should use this.
-		//Returns true if the transfer was successful, false if something blocked it.
-		bool sendData(char* data, size_t bytes) {
-			size_t bytesSent = 0;
-			while (bytesSent < bytes) {
-				ssize_t bytesThisTime = sendto(sockfd, data + bytesSent, bytes - bytesSent, 0, (sockaddr*) destination, destSize);
-
-                if (bytesThisTime == -1) return false;
-
-                bytesSent += bytesThisTime;
+		//Returns the codec (CODEC_...) packets are packed with, once agreed on with the other side (CODEC_NONE if they aren't)
+		int getCompression() {
+			return packer == NULL ? CODEC_NONE : packer->getCodec();
+		}
+		
+		//Starts packing the given packets with the agreed codec, for the sending side to call once their data is read in.
+		//Their packed copies are waited on as each is sent (see setPacket). Does nothing if no codec was agreed on.
+		void packPackets(Packet* packets, int count) {
+			if (packer != NULL) packer->pack(packets, count);
+		}
+		
+		//Waits for any packing packPackets started to finish, for the sending side to call before freeing the packets
+		void finishPacking() {
+			if (packer != NULL) packer->finish();
+		}
+		
+		//Gives the receiving side an old copy of the file (its "basis"), for the sending side to send a delta against if it
+		//asks to (see setDelta and Delta.cpp). The signatures of its blocks, "blockSize" bytes long (0 picks a size from the
+		//file's), are worked out here, and the file then belongs to the read-writer, which reads blocks from it as the delta
+		//asks. Returns false, leaving the file with the caller, if it couldn't be read or the block size is above DELTA_MAX_BLOCK.
+		bool setBasis(FILE* old, int blockSize) {
+			if (old == NULL || blockSize < 0 || blockSize > DELTA_MAX_BLOCK) return false;
+			BlockSignatures* made = BlockSignatures::fromFile(old, blockSize);
+			if (made == NULL) return false;
+			if (basis != NULL) fclose(basis);
+			if (signatures != NULL) delete signatures;
+			basis = old;
+			signatures = made;
+			return true;
+		}
+		
+		//Has the sending side offer to send a delta in the hello, for it to call before agreeIntegrity. It only does if the
+		//other side has a basis (see setBasis), and the file still has to be read through deltaSource for it to happen.
+		void setDelta(bool enable) {
+			wantDelta = enable;
+		}
+		
+		//Returns true if the hello settled on sending the file as a delta
+		bool getDelta() {
+			return deltaAgreed;
+		}
+		
+		//Wraps the file the sending side reads, so what the protocols read is a delta against the other side's basis if one
+		//was agreed on, and the file as it is if not. The signatures are fetched on the first read, which comes after
+		//agreeIntegrity. Only one file can be wrapped at a time, and closing what's returned closes the file.
+		//Returns NULL if it couldn't be wrapped.
+		FILE* deltaSource(FILE* file) {
+			cookie_io_functions_t functions = {readDelta, NULL, NULL, closeDelta};
+			return wrapDelta(file, "rb", functions);
+		}
+		
+		//Wraps the file the receiving side writes, so that a delta written to it is put back together from the basis, and
+		//anything else is written as it is. Only one file can be wrapped at a time, and closing what's returned closes the
+		//file and settles getDeltaResult. Returns NULL if it couldn't be wrapped.
+		FILE* deltaSink(FILE* file) {
+			cookie_io_functions_t functions = {NULL, writeDelta, NULL, closeDelta};
+			return wrapDelta(file, "wb", functions);
+		}
+		
+		//Does the actual work of deltaSource and deltaSink
+		FILE* wrapDelta(FILE* file, const char* mode, cookie_io_functions_t functions) {
+			if (file == NULL || deltaFile != NULL) return NULL;
+			FILE* send = fopencookie(this, mode, functions);
+			if (send != NULL) deltaFile = file;
+			deltaStarted = false;
+			return send;
+		}
+		
+		//Returns how putting the file back together from a delta went on the receiving side (DIGEST_...), once the file
+		//deltaSink wrapped is closed. It's DIGEST_UNCHECKED if the file didn't come as a delta.
+		int getDeltaResult() {
+			return deltaResult;
+		}
+		
+		//Opens the file the receiving side writes, at "path", for a transfer that can be resumed if it gets cut off, keeping a
+		//journal of the blocks written at the same path with JOURNAL_SUFFIX added (see Journal.cpp). Unlike fopen with "wb",
+		//the file is only emptied once it turns out the other side isn't resuming, and if it is, only what's missing gets written.
+		//The journal goes once the file is all there. Closing what's returned closes the file and settles getResumeComplete.
+		//A delta can't be resumed. Returns NULL if the file or its journal couldn't be opened.
+		FILE* resumeSink(const char* path) {
+			if (resumeFile != NULL || journal != NULL) return NULL;
+			int descriptor = open(path, O_RDWR | O_CREAT, 0644);
+			FILE* file = descriptor == -1 ? NULL : fdopen(descriptor, "r+b");
+			if (file == NULL) {
+				if (descriptor != -1) close(descriptor);
+				return NULL;
+			}
+			string journalPath = string(path) + JOURNAL_SUFFIX;
+			if ((journal = ResumeJournal::open(journalPath.c_str())) == NULL) {
+				fclose(file);
+				return NULL;
+			}
+			cookie_io_functions_t functions = {NULL, writeResume, NULL, closeResume};
+			return wrapResume(file, "wb", functions);
+		}
+		
+		//Has the sending side offer to resume the transfer in the hello, for it to call before agreeIntegrity. It only does if
+		//the other side keeps a journal (see resumeSink), and the file still has to be read through resumeSource for it to happen.
+		void setResume(bool enable) {
+			wantResume = enable;
+		}
+		
+		//Returns true if the hello settled on resuming the transfer
+		bool getResume() {
+			return resumeAgreed;
+		}
+		
+		//Wraps the file the sending side reads, so that only the blocks the other side's journal says it doesn't have yet get
+		//sent, if resuming was agreed on. The journal is fetched on the first read, which comes after agreeIntegrity. The file
+		//has to be a regular file for that, and anything else is read as it is. Only one file can be wrapped at a time, and
+		//closing what's returned closes the file. Returns NULL if it couldn't be wrapped.
+		FILE* resumeSource(FILE* file) {
+			cookie_io_functions_t functions = {readResume, NULL, NULL, closeResume};
+			return wrapResume(file, "rb", functions);
+		}
+		
+		//Does the actual work of resumeSource and resumeSink
+		FILE* wrapResume(FILE* file, const char* mode, cookie_io_functions_t functions) {
+			if (file == NULL || resumeFile != NULL) return NULL;
+			FILE* send = fopencookie(this, mode, functions);
+			if (send != NULL) resumeFile = file;
+			resumeStarted = false;
+			return send;
+		}
+		
+		//Returns true if the file resumeSink wrapped was all there once it was closed, whether or not it was resumed.
+		//If it wasn't, its journal is still there, and the next transfer of the same file picks up where this one stopped.
+		bool getResumeComplete() {
+			return resumeComplete;
+		}
+		
+		//Has the sending side offer to send holes in the hello, for it to call before agreeIntegrity. It only does if the
+		//other side writes through sparseSink, and the file still has to be read through sparseSource for it to happen.
+		void setSparse(bool enable) {
+			wantSparse = enable;
+		}
+		
+		//Returns true if the hello settled on sending holes
+		bool getSparse() {
+			return sparseAgreed;
+		}
+		
+		//Returns how putting the file back together from holes went on the receiving side (DIGEST_...), once the file
+		//sparseSink wrapped is closed. It's DIGEST_UNCHECKED if the file didn't come sparse.
+		int getSparseResult() {
+			return sparseResult;
+		}
+		
+		//Wraps the file the sending side reads, so that its holes, and any blocks of SPARSE_BLOCK bytes that are nothing but
+		//zeroes, go as hole records if holes were agreed on (see Sparse.cpp). A resumed transfer leaves out zeroes on its own,
+		//so there's no need to wrap the same file with resumeSource too, and a delta can't be sent this way.
+		//Only one file can be wrapped at a time, and closing what's returned closes the file. Returns NULL if it couldn't be wrapped.
+		FILE* sparseSource(FILE* file) {
+			cookie_io_functions_t functions = {readSparse, NULL, NULL, closeSparse};
+			return wrapSparse(file, "rb", functions);
+		}
+		
+		//Wraps the file the receiving side writes, so that holes that come are left by seeking past them, which makes them
+		//holes in the file too, and anything else is written as it is. Closing what's returned closes the file.
+		//Returns NULL if it couldn't be wrapped.
+		FILE* sparseSink(FILE* file) {
+			cookie_io_functions_t functions = {NULL, writeSparse, NULL, closeSparse};
+			FILE* send = wrapSparse(file, "wb", functions);
+			if (send != NULL) acceptSparse = true;
+			return send;
+		}
+		
+		//Does the actual work of sparseSource and sparseSink
+		FILE* wrapSparse(FILE* file, const char* mode, cookie_io_functions_t functions) {
+			if (file == NULL || sparseFile != NULL) return NULL;
+			FILE* send = fopencookie(this, mode, functions);
+			if (send != NULL) sparseFile = file;
+			sparseStarted = false;
+			return send;
+		}
+		
+		//Gives the receiving side a store of blocks from files it was sent before, in the given directory, holding up to
+		//"bytes" bytes of them, for the sending side to leave those blocks out if it asks to (see setDedup and Dedup.cpp).
+		//The same store can be used by any number of transfers, one after another, whatever their files are called.
+		//Returns false if it couldn't be opened (see BlockStore::open).
+		bool setBlockStore(const char* directory, long long bytes) {
+			if (store != NULL) return false;
+			store = BlockStore::open(directory, bytes);
+			return store != NULL;
+		}
+		
+		//Has the sending side offer to deduplicate blocks in the hello, for it to call before agreeIntegrity. It only does
+		//if the other side has a block store (see setBlockStore), and the file still has to be read through dedupSource for it to happen.
+		void setDedup(bool enable) {
+			wantDedup = enable;
+		}
+		
+		//Returns true if the hello settled on deduplicating blocks
+		bool getDedup() {
+			return dedupAgreed;
+		}
+		
+		//Wraps the file the sending side reads, so that blocks the other side has stored, and blocks that come more than once,
+		//aren't sent again, if deduplicating was agreed on. The file has to be a regular file for that, and its whole content
+		//is read once before anything is sent, to work out the keys of its blocks. Anything else is read as it is.
+		//Only one file can be wrapped at a time, and closing what's returned closes the file. Returns NULL if it couldn't be wrapped.
+		FILE* dedupSource(FILE* file) {
+			cookie_io_functions_t functions = {readDedup, NULL, NULL, closeDedup};
+			return wrapDedup(file, "rb", functions);
+		}
+		
+		//Opens the file the receiving side writes, at "path", for a deduplicated transfer, which needs to read back from it.
+		//Blocks that come as data are kept in the store. Closing what's returned closes the file and settles getDedupResult.
+		//Returns NULL if it couldn't be opened.
+		FILE* dedupSink(const char* path) {
+			if (dedupFile != NULL) return NULL;
+			FILE* file = fopen(path, "w+b");
+			cookie_io_functions_t functions = {NULL, writeDedup, NULL, closeDedup};
+			FILE* send = wrapDedup(file, "wb", functions);
+			if (send == NULL && file != NULL) fclose(file);
+			return send;
+		}
+		
+		//Does the actual work of dedupSource and dedupSink
+		FILE* wrapDedup(FILE* file, const char* mode, cookie_io_functions_t functions) {
+			if (file == NULL || dedupFile != NULL) return NULL;
+			FILE* send = fopencookie(this, mode, functions);
+			if (send != NULL) dedupFile = file;
+			dedupStarted = false;
+			return send;
+		}
+		
+		//Returns how putting the file back together went on the receiving side of a deduplicated transfer (DIGEST_...), once
+		//the file dedupSink opened is closed. It's DIGEST_UNCHECKED if the file didn't come deduplicated.
+		int getDedupResult() {
+			return dedupResult;
+		}
+		
+		//Returns something for the sending side to read, which sends everything in the directory at "path" (or the one file
+		//there) as a bundle, for it to call before agreeIntegrity, since it offers a bundle in the hello. Only the other side
+		//agreeing to take one lets it be read (see bundleSink). Closing what's returned drops the bundle.
+		//Returns NULL if there's nothing at "path" that can be sent, or a bundle is already open.
+		FILE* bundleSource(const char* path) {
+			if (bundleOpen || (bundleReader = BundleReader::open(path)) == NULL) return NULL;
+			cookie_io_functions_t functions = {readBundle, NULL, NULL, closeBundle};
+			FILE* send = fopencookie(this, "rb", functions);
+			if (send == NULL) {
+				delete bundleReader;
+				bundleReader = NULL;
+				return NULL;
+			}
+			wantBundle = bundleOpen = true;
+			bundleStarted = false;
+			return send;
+		}
+		
+		//Returns something for the receiving side to write to, which takes a bundle and writes its files out into the
+		//directory at "path", on "writers" threads at once (0 to write them as they come in). The directory is made if it
+		//isn't there. A file sent on its own
+		//is written to BUNDLE_PLAIN_NAME in the directory. Closing what's returned waits for every file to be written.
+		//Returns NULL if the directory can't be made, or a bundle is already open.
+		FILE* bundleSink(const char* path, int writers) {
+			struct stat status;
+			if (bundleOpen || ((mkdir(path, 0755) != 0 && errno != EEXIST) || stat(path, &status) != 0 || !S_ISDIR(status.st_mode))) return NULL;
+			cookie_io_functions_t functions = {NULL, writeBundle, NULL, closeBundle};
+			FILE* send = fopencookie(this, "wb", functions);
+			if (send == NULL) return NULL;
+			bundleDirectory = path;
+			bundleWriters = writers;
+			acceptBundle = bundleOpen = true;
+			bundleStarted = false;
+			return send;
+		}
+		
+		//Returns true if the hello settled on sending a bundle
+		bool getBundle() {
+			return bundleAgreed;
+		}
+		
+		//Returns how long the files bundleSource found were altogether, or 0 if there's no bundle source
+		uint64_t getBundleBytes() {
+			return bundleReader == NULL ? 0 : bundleReader->getTotalBytes();
+		}
+		
+		//Has this side treat its file as a stream, like standard input or output, a pipe or a socket, whose size isn't known
+		//until it ends. The sending side reads it with readStream, so a short read is only the end of the file if the stream
+		//says so, and packets go out as soon as there's data for them instead of once the window is full.
+		//The receiving side flushes the file after every round, so whatever reads from it gets the data as it comes.
+		//Call it before the transfer. Neither side has to tell the other.
+		void setStreaming(bool enable) {
+			streaming = enable;
+		}
+		
+		//Returns true if this side treats its file as a stream
+		bool getStreaming() {
+			return streaming;
+		}
+		
+		//Returns when the sending side of a stream should stop waiting for the window it's about to load to fill, in seconds
+		//on the monotonic clock (see readStream). -1 if it never has to, because there's no timeout for the other side to run out of.
+		double streamDeadline() {
+			if (timeoutSeconds == 0 && timeoutMicroSeconds == 0) return -1;
+			struct timespec time;
+			clock_gettime(CLOCK_MONOTONIC, &time);
+			return time.tv_sec + time.tv_nsec / 1e9 + STREAM_WAIT_TIMEOUTS * (timeoutSeconds + timeoutMicroSeconds / 1e6);
+		}
+		
+		//Reads up to "room" bytes of a stream into "to", for the sending side. It keeps reading until it has them all, the
+		//stream ends, or the deadline (from streamDeadline) passes, and then returns however many it got, which can be none.
+		//"ended" is set once there's nothing more to come, whether the stream was closed or couldn't be read any more.
+		//The stream is read straight from its descriptor, so nothing should have been read from it through the FILE before.
+		int readStream(FILE* file, char* to, int room, double deadline, bool* ended) {
+			*ended = false;
+			int descriptor = fileno(file);
+			//Something with no descriptor of its own, like a wrapped file, can only be read like any other file
+			if (descriptor < 0) {
+				int send = fread(to, 1, room, file);
+				*ended = send < room;
+				return send;
+			}
+			
+			int send = 0;
+			while (send < room) {
+				int wait = -1;
+				if (deadline >= 0) {
+					struct timespec time;
+					clock_gettime(CLOCK_MONOTONIC, &time);
+					double left = deadline - (time.tv_sec + time.tv_nsec / 1e9);
+					wait = left <= 0 ? 0 : (int) (left * 1000) + 1;
+				}
+				struct pollfd waiting;
+				waiting.fd = descriptor;
+				waiting.events = POLLIN;
+				waiting.revents = 0;
+				int found = poll(&waiting, 1, wait);
+				if (found < 0 && errno == EINTR) continue;
+				//The stream's gone quiet, so what's been read so far has to do
+				if (found == 0) break;
 				
-				//If not everything sent, wait for the receiver to be ready
-				if (bytesSent < bytes) {
-					waitReady();
+				ssize_t got = found < 0 ? -1 : read(descriptor, to + send, room - send);
+				if (got > 0) send += got;
+				else if (got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+				else {
+					if (got < 0) LOG_ERROR("Couldn't read the stream: " << strerror(errno) << "\n");
+					*ended = true;
+					break;
 				}
 			}
-			return true;
+			return send;
 		}
 		
-		//Constructor. This should only be invoked via the static method getInstance, seen at the bottom of the class.
-		SocketReadWriter(int sock,  sockaddr_in* connectionInfo, sockaddr_in* localInfo, int bufferLength) {
-			//Save the socket filedescriptor
-			sockfd = sock;
-			//Allocate a buffer of appropriate size.
-			buffer = new char[bufferSize = (bufferLength + sizeof(Header))];
-			
-			//Get address info and size of the destination
-			destination = connectionInfo;
-			destSize = sizeof(*destination);
+		//Returns how many packets go in each parity group, once agreed on with the other side (0 for no parity)
+		int getParityGroup() {
+			return parityGroup;
+		}
+		
+		//Rebuilds the packets in the window that got lost this round from the parity that came with them, for the receiving
+		//side to call once a round's packets are in. Only a packet that's the only one missing from its group can be rebuilt.
+		//Rebuilt packets are marked transmitted, with their data and checksum filled in, just as if they'd arrived.
+		//"firstNumber" is the number of the packet in the window's first slot (see PacketChecks::fits).
+		//Does nothing if parity wasn't agreed on. Returns how many packets were rebuilt.
+		int rebuildPackets(Packet* window, int windowSize, long long firstNumber) {
+			if (decoder == NULL) return 0;
+			if (decoder->size() == 0) return 0;
+			int rebuilt[windowSize];
+			long unrecoverable = 0;
+			int send = decoder->rebuild(window, windowSize, integrity, rebuilt, &unrecoverable);
+			if (metrics != NULL) {
+				metrics->count(COUNT_PACKETS_REBUILT, send);
+				metrics->count(COUNT_UNRECOVERABLE, unrecoverable);
+			}
+			for (int i = 0; i < send; i++) trace(TRACE_REBUILT, window[rebuilt[i]].id, firstNumber + rebuilt[i], rebuilt[i], window[rebuilt[i]].length);
+			return send;
+		}
+		
+		//Agrees with the other side on how packets are checked, for the sending side to call before it sends anything.
+		//It offers every algorithm allowed by setIntegrity, and the other side picks one. The file digest is agreed on
+		//at the same time, from those allowed by setDigests, and so are parity, packing, a delta, resuming, holes,
+		//deduplicating and a bundle, if setParity, setCompression, setDelta, setResume, setSparse, setDedup and
+		//bundleSource asked for them. A hello lost on the way is sent again after every timeout. If the other side never answers (for example, because it's too old to know how),
+		//the internet checksum is used, if allowed.
+		//Returns the algorithm (INTEGRITY_...) packets will be sent with from now on.
+		int agreeIntegrity() {
+			if (metrics == NULL) return tradeHello();
 			
-			//Also save the local information, in case it's necessary to keep in memory.
-			home = localInfo;
-			homeSize = sizeof(*home);
+			double start = metrics->now();
+			int send = tradeHello();
+			metrics->addTime(TIME_WAITING, start);
+			return send;
 		}
-	
-	public:
-		//Obtains an integer from the connection, returning it instead of saving it to the buffer
-		//NOTE: If this function returns -3, that's a timeout indicator, not a real result.
-		int getInt() {
-			int send;
-			bool worked = readData((char*) &send, sizeof(send));
-			return worked ? send : -3;
+		
+		//Does the actual work of agreeIntegrity
+		int tradeHello() {
+			//Each transfer numbers its packets from the start of its own file
+			numberedPackets = 0;
+			sendHello(true, allowedIntegrity, allowedDigests, parityGroup, wantedCodec, wantDelta, wantResume, wantSparse, wantDedup, wantBundle, true);
+			for (int misses = 0; misses < READY_ATTEMPTS;) {
+				ssize_t bytesRead = transport->receive(incoming, GRO_BUFFER_SIZE);
+				if (bytesRead == -1) {
+					if (++misses < READY_ATTEMPTS) {
+						sendHello(true, allowedIntegrity, allowedDigests, parityGroup, wantedCodec, wantDelta, wantResume, wantSparse, wantDedup,
+							wantBundle, true);
+					}
+					continue;
+				}
+				if (classifyDatagram(incoming, bytesRead) != KIND_HELLO || incoming[1]) continue;
+				
+				int picked = bestIntegrity(incoming[2] & allowedIntegrity);
+				if (picked == -1) continue;
+				int pickedDigest = bestDigest(incoming[3] & allowedDigests);
+				if (digest == NULL && pickedDigest != -1) digest = new FileDigest(pickedDigest);
+				//Parity only goes out if the other side agreed to the same group size
+				if (parityGroup > 0 && (unsigned char) incoming[4] == parityGroup && encoder == NULL) {
+					encoder = new ParityEncoder(parityGroup, packetSize);
+					parityFrame = new char[bufferSize];
+				}
+				if (encoder == NULL) parityGroup = 0;
+				//And packing only if it agreed to the codec
+				if (wantedCodec != CODEC_NONE && incoming[5] == wantedCodec && packer == NULL) packer = new PacketPacker(wantedCodec, packetSize, packThreads);
+				//And a delta only if it has a basis
+				deltaAgreed = wantDelta && incoming[6];
+				//And resuming only if it keeps a journal
+				resumeAgreed = wantResume && incoming[7];
+				//And holes only if it can make them
+				sparseAgreed = wantSparse && incoming[8];
+				//And deduplicating only if it has a block store
+				dedupAgreed = wantDedup && incoming[9];
+				//And a bundle only if it writes into a directory
+				bundleAgreed = wantBundle && incoming[10];
+				//Packets are always numbered, if the other side checks them
+				numberAgreed = incoming[11];
+				//Now that the other side is known to be listening, the path to it can be probed
+				if (autoSize) probePath(transport->pathLimit());
+				return integrity = picked;
+			}
+			parityGroup = 0;
+			if (autoSize) fitPackets(transport->pathLimit());
+			return integrity = allowedIntegrity & (1 << INTEGRITY_INET) ? INTEGRITY_INET : bestIntegrity(allowedIntegrity);
 		}
 		
-		//Sends an given integer through the connection instead of using the buffer data
-		//Returns true if successful, false if timed out
-		bool sendInt(int value) {
-			return sendData((char*) &value, sizeof(value));
+		//Returns the integrity algorithm (INTEGRITY_...) packets are sent with
+		int getIntegrity() {
+			return integrity;
 		}
 		
-		//Shortcut function for calculating packet checksum
-		short checksum() {
-			return inetChecksum(buffer, bufferSize);
+		//Returns the most data a packet can hold. On a side made to pick its own packet size (with PACKET_SIZE_AUTO), that's
+		//the longest it could pick, which the receiving side goes on taking, until the sending side probes the path in
+		//agreeIntegrity and makes its packets fit that.
+		int getPacketSize() {
+			return packetSize;
 		}
-
-
-		//Gets a header from the socket and returns its value
-		//NOTE: if this header has an ID of -3, that's a timeout indicator, not a real header.
-		Header getHeader() {
-			Header send;
-			if (!readData((char*) &send, sizeof(send))) send.id = send.length = -3;
-			return send;
+		
+		//Returns the longest datagram known to get across whole (see probePath), or 0 if nothing's known
+		int getPathBytes() {
+			return pathBytes;
 		}
-
-		//Sends a header with the given id. All other data is calculated from what is already inside this class
-		//Returns true if successful, false if timed out
-		bool sendHeader(int id) {
-			Header head;
-			head.id = id;
-			head.length = bufferSize;
-			head.checksum = checksum();
-
-			return sendData((char*) &head, sizeof(head));
+		
+		//Returns how much data a packet meant to hold "wanted" bytes can hold now. That's only ever less on a sending side
+		//picking its own packet size, once it has probed the path, or once the path has sent back a size error saying it
+		//shrank, which has it probe again. The packets already loaded go out in fragments (see Transport::setProbing).
+		int fitPacket(int wanted) {
+			int told = autoSize ? transport->sizeError() : 0;
+			if (told > 0) {
+				if (metrics != NULL) metrics->count(COUNT_SIZE_ERRORS);
+				double start = metrics == NULL ? 0 : metrics->now();
+				probePath(told);
+				if (metrics != NULL) metrics->addTime(TIME_WAITING, start);
+			}
+			return autoSize && packetSize < wanted ? packetSize : wanted;
 		}
-
 		
-		//Deliberately stalls execution until given a single byte, to indicate that the other side is ready to receive info.
-		//Returns true if successful, false if timed out
-		bool waitReady() {
-			char c = '\0';
-			return readData(&c, 1);
+		//Makes the transport's buffers big enough for BUFFER_WINDOWS windows of "windowSize" datagrams with packets of the
+		//current size, since a window is the most either side ever has on its way to the other. Anything more than the
+		//buffers hold is dropped by the kernel, which the protocols can only take for loss (see Transport::bufferDrops).
+		//The kernel caps the buffers at net.core.rmem_max and wmem_max, which is logged, and they're never made smaller.
+		//The protocols call this once the packet size is settled, and the sizes go in the metrics.
+		void fitBuffers(int windowSize) {
+			long wanted = (long) BUFFER_WINDOWS * windowSize * (packetSize + datagramOverhead());
+			int bytes = wanted > INT_MAX / 2 ? INT_MAX / 2 : (int) wanted, receiving, sending;
+			if (!transport->setBuffers(bytes, &receiving, &sending)) return;
+			if (receiving < bytes || sending < bytes) LOG_INFO("Asked for " << bytes << " byte socket buffers, and the kernel only gave " << receiving << " to receive and " << sending << " to send\n");
+			if (metrics != NULL) metrics->setBuffers(bytes, receiving, sending);
 		}
-	
-		//Gives a single byte to the other side, indicating that this side is ready to receive info.
-		//Returns true if successful, false if timed out
-		bool signalReady() {
-			char c = '\0';
-			return sendData(&c, 1);
+		
+		//Returns true if the hello settled on numbering packets (see Wire.cpp)
+		bool getNumbered() {
+			return numberAgreed;
+		}
+		
+		//Returns the number of the next packet the sending side loads from its file, counting from 0 at the start of it
+		long long numberPacket() {
+			return numberedPackets++;
 		}
 		
 		//Copies the data currently in the buffer and returns it as a newly allocated char array.
@@ -166,27 +1861,68 @@ class SocketReadWriter {
 		//Make sure to free the returned array once you are done with it.
 		char* getCopyofData(int* length){ 
 			char* send = new char[bufferSize];
-
-			for (int i = 0; i < bufferSize; i++) {
-				send[i] = buffer[i];
-			}
+			memcpy(send, buffer, bufferSize);
 			if (length != NULL) *length = bufferSize;
 			return send;
 		}
 		
 		
-		char* parseData(Header* head, int sequenceRange) {
-			*head = *((Header*) buffer);
+		//Reads the packet in the buffer, saving its header at "head" and returning a newly allocated copy of its data,
+		//unpacked if it came packed (the header's length is then that of the unpacked data).
+		//Returns NULL if it's logically impossible for this to be an intact packet.
+		//Check the data against the header's checksum with the checks' sum, which is of the unpacked data.
+		//The transfers read packets as they were agreed on in the hello (see PacketChecks), and anything checked some other
+		//way than that is as good as malformed.
+		template <class Checks> char* parseData(Checks checks, Header* head, int sequenceRange) {
+			head->id = head->length = -1;
+			head->number = -1;
+			head->integrity = wireIntegrity(wireType(buffer, packetBytes));
+			bool packed = wirePacked(wireType(buffer, packetBytes));
+			int used = wireId(buffer, packetBytes, &head->id);
+			if (used > 0 && checks.NUMBERED) {
+				uint64_t number;
+				int more = getVarint64(buffer + used, packetBytes - used, &number);
+				if (more == 0 || number >> 63) return NULL;
+				head->number = (long long) number;
+				used += more;
+			}
+			if (used == 0 || head->integrity != checks.INTEGRITY || used + checks.BYTES + (packed ? 1 : 0) > packetBytes) return NULL;
+			if (checks.NUMBERED) wireMixNumber(buffer + used, checks.INTEGRITY, head->number);
+			head->checksum = getChecksum(buffer + used, checks.INTEGRITY);
+			used += checks.BYTES;
+			head->length = packetBytes - used;
 			
 			//If it's logically impossible for this to be an intact packet, don't return anything.
-			if (head->id < 0 || head->id >= sequenceRange || head->length < 0 || head->length > (bufferSize - sizeof(Header))) return NULL;
+			if (head->id < 0 || head->id >= sequenceRange || head->length > packetSize) return NULL;
+			if (packed) return unpackData(head, used);
 			
 			char* send = new char[head->length];
+			memcpy(send, buffer + used, head->length);
 			
-			for (int s = 0, i = sizeof(Header); s < head->length; s++) {
-				send[s] = buffer[i++];
+			return send;
+		}
+		
+		//Reads the packet in the buffer as above, however this side has agreed to check them
+		char* parseData(Header* head, int sequenceRange) {
+			return runWithChecks(integrity, numberAgreed, [&](auto checks) {
+				return parseData(checks, head, sequenceRange);
+			});
+		}
+		
+		//Unpacks the packed data in the buffer, which starts with its codec at "used", for parseData.
+		//Data that doesn't unpack is no use at all, and NULL is returned for it just like for anything else that's malformed.
+		char* unpackData(Header* head, int used) {
+			int codec = (unsigned char) buffer[used];
+			if (unpacker == NULL) unpacker = new Codec();
+			char* send = new char[packetSize > 0 ? packetSize : 1];
+			double start = metrics == NULL ? 0 : metrics->now();
+			int length = unpacker->unpack(codec, buffer + used + 1, packetBytes - used - 1, send, packetSize);
+			if (metrics != NULL) metrics->addTime(TIME_UNPACKING, start);
+			if (length < 0) {
+				delete[] send;
+				return NULL;
 			}
-			
+			head->length = length;
 			return send;
 		}
 		
@@ -199,141 +1935,345 @@ class SocketReadWriter {
 				buffer = length == 0 ? NULL : new char[length];
                 bufferSize = length;
 			}
-			if (data != NULL) {
-				for (int i = 0; i < length; i++) {
-					buffer[i] = data[i];
-				}
-			}
+			if (data != NULL) memcpy(buffer, data, length);
+			packetBytes = length;
+			rawData = NULL;
 		}
 		
-		void setPacket(char* data, int length, int id) {
-			Header* header = (Header*) buffer;
-			header->length = length;
-			header->id = id;
-			header->checksum = inetChecksum(data, length);
+		//Puts a packet with the given data, id and number (see numberPacket) in the buffer, ready for sendPacket.
+		//It's checked as agreed on in the hello (see agreeIntegrity), which the transfers settle on once (see PacketChecks).
+		template <class Checks> void setPacket(Checks checks, char* data, int length, int id, long long number) {
+			buffer[0] = wireFlags(wireDataType(Checks::INTEGRITY, false));
+			int used = putPacketHeader(checks, id, number);
+			used += putChecksum(buffer + used, Checks::INTEGRITY, checks.sum(data, length));
+			if (Checks::NUMBERED) wireMixNumber(buffer + used - Checks::BYTES, Checks::INTEGRITY, number);
 			
-			char* spot = (char*) (header + 1);
+			memcpy(buffer + used, data, length);
+			packetBytes = used + length;
+			rawData = data;
+			rawLength = length;
+		}
+		
+		//Puts a packet in the buffer as above, however this side has agreed to check them
+		void setPacket(char* data, int length, int id, long long number) {
+			runWithChecks(integrity, numberAgreed, [&](auto checks) {
+				setPacket(checks, data, length, id, number);
+			});
+		}
+		
+		//Puts the id of a data datagram in the buffer, after its flags, followed by its number if numbers were agreed on.
+		//Returns how far into the buffer the checksum goes.
+		template <class Checks> int putPacketHeader(Checks checks, int id, long long number) {
+			int send = 1 + putVarint(buffer + 1, id);
+			if (checks.NUMBERED) send += putVarint64(buffer + send, (uint64_t) number);
+			return send;
+		}
+		
+		//Puts the given packet in the buffer, ready for sendPacket, packed if packPackets got it smaller.
+		//Waits for it to be packed first, if it's still being packed.
+		template <class Checks> void setPacket(Checks checks, Packet* pack) {
+			if (packer != NULL) {
+				if (metrics == NULL) packer->wait(pack);
+				else {
+					double start = metrics->now();
+					packer->wait(pack);
+					metrics->addTime(TIME_PACKING, start);
+				}
+			}
+			if (packer == NULL || pack->codec == CODEC_NONE) {
+				setPacket(checks, pack->content, pack->length, pack->id, pack->number);
+				return;
+			}
 			
-			for (int i = 0; i < length; i++) {
-				spot[i] = data[i];
+			buffer[0] = wireFlags(wireDataType(Checks::INTEGRITY, true));
+			int used = putPacketHeader(checks, pack->id, pack->number);
+			used += putChecksum(buffer + used, Checks::INTEGRITY, checks.sum(pack->content, pack->length));
+			if (Checks::NUMBERED) wireMixNumber(buffer + used - Checks::BYTES, Checks::INTEGRITY, pack->number);
+			buffer[used++] = (char) pack->codec;
+			memcpy(buffer + used, pack->packed, pack->packedLength);
+			packetBytes = used + pack->packedLength;
+			rawData = pack->content;
+			rawLength = pack->length;
+			if (metrics != NULL) {
+				metrics->count(COUNT_PACKETS_PACKED);
+				metrics->count(COUNT_BYTES_SAVED, pack->length - pack->packedLength - 1);
 			}
 		}
 
-		//Reads from the socket and loads the data into the buffer
+		//Reads from the socket and loads the data into the buffer (unless awaitPacket already did)
 		//Returns true if successful, false if timed out
 		bool getPacket() {
-			return readData(buffer, bufferSize);
+			if (packetHeld) {
+				packetHeld = false;
+				return true;
+			}
+			size_t length;
+			if (!readData(buffer, bufferSize, KIND_DATA, &length)) return false;
+			packetBytes = length;
+			return true;
+		}
+		
+		//Waits for the first packet of a transfer, for the receiving side to call before it settles on how packets are checked,
+		//since the hello that settles that comes ahead of them. The packet is left in the buffer for the next getPacket.
+		//Gives up after "attempts" timeouts in a row, or once the other side says it's ready or finished.
+		//Returns how many timeouts it waited through, for the caller to count towards giving up.
+		int awaitPacket(int attempts) {
+			int send = 0;
+			for (; send < attempts && !peerWaiting && !peerFinished; send++) {
+				if (getPacket()) {
+					packetHeld = true;
+					break;
+				}
+			}
+			return send;
 		}
 		
-		//Takes the data in the buffer and sends it through the socket.
+		//Takes the data in the buffer and sends it through the socket, followed by the parity of its group if that fills the group.
+		//If offload is on, the packet is only queued, and goes out on the next flushPackets (or any other send/read).
 		//Returns true if successful, false if timed out
 		bool sendPacket() {
-			return sendData(buffer, bufferSize);
+			if (metrics == NULL) return queuePacket();
+			
+			double start = metrics->now();
+			bool send = queuePacket();
+			metrics->addTime(TIME_SENDING, start);
+			return send;
+		}
+		
+		//Sends every packet queued by sendPacket, and the parity of any group left unfinished, since the round is over.
+		//Sending itself does nothing more if offload is off.
+		//Returns true if everything was sent, false if not.
+		bool flushPackets() {
+			if (metrics == NULL) return (encoder == NULL || encoder->size() == 0 || queueParity()) && transport->flush();
+			
+			double start = metrics->now();
+			bool send = (encoder == NULL || encoder->size() == 0 || queueParity()) && transport->flush();
+			metrics->addTime(TIME_SENDING, start);
+			return send;
+		}
+		
+		//Turns segmentation offload (UDP_SEGMENT on send, UDP_GRO on receive) on or off.
+		//Anything the kernel refuses simply stays off, in which case queued packets are still batched with sendmmsg.
+		//Returns true if the kernel accepted at least part of the offload.
+		bool setOffload(bool enable) {
+			return transport->setOffload(enable);
+		}
+		
+		//Turns the low latency mode on or off. While it's on, waiting on the other side busy polls the transport instead of
+		//sleeping until something comes in (see Transport::setBusyPoll), which saves the time it takes to be woken up, on
+		//every round. If "cpu" isn't -1, the calling thread, which should be the one the protocols run on, is pinned to that
+		//CPU too, so it isn't moved off its caches. Spinning takes CPU time from anything sharing the CPU, so this is only
+		//worth it for a side with one to spare. Returns false if the transport can't busy poll or the thread couldn't be pinned.
+		bool setLowLatency(bool enable, int cpu) {
+			busyMode = transport->setBusyPoll(enable);
+			bool send = !enable || busyMode != 0;
+			if (enable && cpu >= 0) {
+				cpu_set_t cpus;
+				CPU_ZERO(&cpus);
+				CPU_SET(cpu, &cpus);
+				if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0) pinnedCpu = cpu;
+				else send = false;
+			}
+			if (busyMode == BUSY_SPINNING) LOG_DEBUG("Only this side spins, without the kernel polling the device for it (SO_BUSY_POLL needs CAP_NET_ADMIN, and shared memory has none)\n");
+			if (metrics != NULL) metrics->setLowLatency(busyMode, pinnedCpu);
+			return send;
 		}
 
 
 		//Configures the timeout of the socket, given a time in full seconds plus additional microseconds
 		//Returns true if successful, false if not.
 		bool setTimeout(int fullSeconds, int plusMicroSeconds) {
-			struct timeval time;
-			time.tv_sec = fullSeconds;
-			time.tv_usec = plusMicroSeconds;
-			return setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO,&time,sizeof(time)) >= 0;
+			if (!transport->setTimeout(fullSeconds, plusMicroSeconds)) return false;
+			timeoutSeconds = fullSeconds;
+			timeoutMicroSeconds = plusMicroSeconds;
+			return true;
+		}
+		
+		//Runs everything sent and/or received from now on through impairment stages, described as in ImpairmentPipeline::parse.
+		//Either description can be NULL or empty to leave that direction alone. Corruption leaves packet headers alone unless told otherwise.
+		//Returns true if successful, false if a description couldn't be understood (in which case nothing changes).
+		bool setImpairment(string* sendDescription, string* receiveDescription) {
+			ImpairmentPipeline *sending = NULL, *receiving = NULL;
+			if (sendDescription != NULL && sendDescription->length() > 0) {
+				if ((sending = ImpairmentPipeline::parse(sendDescription, WIRE_SKIP_HEADER)) == NULL) return false;
+			}
+			if (receiveDescription != NULL && receiveDescription->length() > 0) {
+				if ((receiving = ImpairmentPipeline::parse(receiveDescription, WIRE_SKIP_HEADER)) == NULL) {
+					if (sending != NULL) delete sending;
+					return false;
+				}
+			}
+			if (sending != NULL || receiving != NULL) wrapTransport(sending, receiving);
+			return true;
+		}
+		
+		//Sets up the old style of error simulation: received datagrams of the given kind are dropped.
+		//numDrops of -1 drops about one of them per window at random, otherwise each id listed in "drops" is dropped once.
+		void simulateDrops(int numDrops, int* drops, int kind, int windowSize) {
+			if (numDrops == 0 || (numDrops > 0 && drops == NULL)) return;
+			
+			ImpairmentStage* stage;
+			if (numDrops == -1) stage = new LossStage(1.0 / (windowSize < 2 ? 25 : windowSize));
+			else stage = new IdDropStage(numDrops, drops);
+			stage->setKinds(1 << kind);
+			
+			ImpairmentPipeline* receiving = new ImpairmentPipeline(1);
+			receiving->add(stage);
+			wrapTransport(NULL, receiving);
+		}
+		
+		//Sets where the metrics of every transfer started from now on are written, as JSON lines (see TransferMetrics).
+		//"interval" is how many seconds apart the reports during a transfer are, or 0 for only one at the end.
+		//NULL means they aren't written anywhere, but are still returned by the protocol functions.
+		void reportMetrics(FILE* out, double interval) {
+			metricsOut = out;
+			metricsInterval = interval;
+		}
+		
+		//Starts recording the metrics of a transfer. mode ("gbn" or "sr") and role ("client" or "server") label the output.
+		//Everything this object sends and receives is timed until finishMetrics is called.
+		TransferMetrics* startMetrics(const char* mode, const char* role) {
+			if (metrics != NULL) finishMetrics();
+			traceGbn = strcmp(mode, "gbn") == 0;
+			traceSide = strcmp(role, "client") == 0 ? TRACE_CLIENT : TRACE_SERVER;
+			//Go-back-N's acks are cumulative, which matters to a transport merging the acks of several receivers
+			transport->setCumulativeAcks(traceGbn);
+			metrics = new TransferMetrics(mode, role, transport);
+			metrics->setReport(metricsOut, metricsInterval);
+			metrics->setPacketSize(packetSize, autoSize, pathBytes);
+			metrics->setLowLatency(busyMode, pinnedCpu);
+			return metrics;
+		}
+		
+		//Stops recording, writes the final report, and returns the metrics, which now belong to the caller.
+		TransferMetrics* finishMetrics() {
+			TransferMetrics* send = metrics;
+			metrics = NULL;
+			if (send != NULL) send->finish();
+			return send;
+		}
+		
+		//Records every packet event from now on in the given ring (see TraceRing), or stops if it's NULL.
+		//The ring isn't owned by this object, and can be shared with the other side when both run in one process.
+		void setTrace(TraceRing* ring) {
+			tracer = ring;
+		}
+		
+		//Records a packet event (TRACE_SEND, ...) if tracing is on. The side and protocol are the ones given to startMetrics.
+		void trace(int event, int seq, long long number, int slot, int bytes) {
+			if (tracer != NULL) tracer->add(transport->now(), event, traceSide, traceGbn, seq, number, slot, bytes);
+		}
+		
+		//Tells what kind of datagram this is (KIND_DATA, KIND_ACK, ...) from its flags byte.
+		//Nacks count as acks, and signals of the wrong size (or anything from another version) as nothing at all.
+		static int classifyDatagram(char* data, size_t length) {
+			switch (wireType(data, length)) {
+				case WIRE_DATA:
+				case WIRE_DATA_CRC32C:
+				case WIRE_DATA_PACKED:
+				case WIRE_DATA_CRC32C_PACKED: return KIND_DATA;
+				case WIRE_ACK:
+				case WIRE_NACK: return KIND_ACK;
+				case WIRE_READY: return length == WIRE_READY_BYTES ? KIND_READY : KIND_OTHER;
+				case WIRE_FIN: return wireFinValid(data, length) ? KIND_FIN : KIND_OTHER;
+				case WIRE_HELLO: return length == WIRE_HELLO_BYTES ? KIND_HELLO : KIND_OTHER;
+				case WIRE_PARITY: return KIND_PARITY;
+				case WIRE_SIGNATURES:
+				case WIRE_SIGNATURE_REQUEST: return KIND_SIGNATURES;
+				case WIRE_JOURNAL: return KIND_JOURNAL;
+				case WIRE_DEDUP: return KIND_DEDUP;
+				case WIRE_PROBE: return KIND_PROBE;
+				default: return KIND_OTHER;
+			}
 		}
 	
-		//Destructor. Closes the socket it contained and frees any dynamically allocated data.
+		//Destructor. Closes the transport it contained and frees any dynamically allocated data.
 		~SocketReadWriter() {
-			close(sockfd);
+			if (metrics != NULL) delete finishMetrics();
+			if (digest != NULL) delete digest;
+			if (encoder != NULL) delete encoder;
+			if (decoder != NULL) delete decoder;
+			if (parityFrame != NULL) delete[] parityFrame;
+			if (packer != NULL) delete packer;
+			if (unpacker != NULL) delete unpacker;
+			if (deltaEncoder != NULL) delete deltaEncoder;
+			if (deltaDecoder != NULL) delete deltaDecoder;
+			if (signatures != NULL) delete signatures;
+			if (basis != NULL) fclose(basis);
+			if (resumeReader != NULL) delete resumeReader;
+			if (resumeWriter != NULL) delete resumeWriter;
+			if (journal != NULL) delete journal;
+			if (sparseReader != NULL) delete sparseReader;
+			if (sparseWriter != NULL) delete sparseWriter;
+			if (dedupReader != NULL) delete dedupReader;
+			if (dedupWriter != NULL) delete dedupWriter;
+			if (store != NULL) delete store;
+			if (bundleReader != NULL) delete bundleReader;
+			if (bundleWriter != NULL) delete bundleWriter;
+			delete transport;
 			if (buffer != NULL) delete[] buffer;
-			delete destination;
-			delete home;
+			delete[] incoming;
 		}
 
 
 		//Changes the port that this object will expect from the other side of the connection.
 		//You should generally ONLY use this if you're doing a LOCALHOST run.
 		void setOtherSidePort(int port) {
-			destination->sin_port = htons(port);
+			transport->setOtherSidePort(port);
 		}
 		
-		//Given an ip address, a port, and a default buffer size, this function
+		//Given an ip address, a port, and a default buffer size (or PACKET_SIZE_AUTO, to pick one from the path), this function
 		//creates a SocketReadWriter object. Returns the address of the object if successful, or NULL if not.
 		static SocketReadWriter* getInstance(string* ip, int port, int bufferSize, int timeoutSeconds, int timeoutMicroSeconds) {
-				if (bufferSize < 1 || timeoutMicroSeconds < 0 || timeoutMicroSeconds < 0) return NULL;
-
-				//If the user said to do localhost, just do that.
-				bool local = ip->compare("localhost") == 0;
-				
-				//The connectionInfo will be the info used to send data. localInfo will be used for socket binding.
-				sockaddr_in *connectionInfo = new sockaddr_in(), *localInfo = new sockaddr_in();
-				connectionInfo->sin_family = localInfo->sin_family = AF_INET;
-				
-				//Parse the ip of the other side from that string (or just do localhost), returning null if it fails
-				if ((connectionInfo->sin_addr.s_addr = local ? htonl(INADDR_ANY) : inet_addr(ip->c_str())) < 0) {
-					delete connectionInfo;
-					delete localInfo;
-					return NULL;
-				}
-				
-				//The local info will set up itself, no input from the user.
-				//First, get the name of the host
-				char host[256];
-				int hostname = gethostname(host, sizeof(host));
-	
-				//Then, get the information of said host as something we can use.
-				struct hostent* host_entry = gethostbyname(host); 
-	
-				//And then, get the ip address as a string
-				char* myIp = inet_ntoa(*((struct in_addr*) host_entry->h_addr_list[0]));
-				
-	
-				//And then turn that string into the value we need to work (unless we're doing localhost anyway)
-				localInfo->sin_addr.s_addr = local ? htonl(INADDR_ANY) : inet_addr(myIp);
-				
-				//Now the ip address is set for socket binding later
-				
-				
-				//Now, add the port for both the destination and the local structs
-				connectionInfo->sin_port = localInfo->sin_port = htons(port);
-				
-				//Try to make a socket. If it fails, stop
-				int sock = socket(AF_INET, SOCK_DGRAM, 0);
-				if (sock < 0) {
-					delete connectionInfo;
-					delete localInfo;
-					return NULL;
-				}
-
-
-				//If the user specified a timeout interval, attempt to set it up. If it fails, stop.
-				if (timeoutSeconds > 0 || timeoutMicroSeconds > 0) {
-					struct timeval time;
-					time.tv_sec = timeoutSeconds;
-					time.tv_usec = timeoutMicroSeconds;
-					if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,&time,sizeof(time)) < 0) {
-   						close(sock);
-						delete connectionInfo;
-						delete localInfo;
-						return NULL;
-					}
-				}
+				if (bufferSize < PACKET_SIZE_AUTO || timeoutSeconds < 0 || timeoutMicroSeconds < 0) return NULL;
 				
-				
-				//Bind the socket with our local info. If that fails, stop
-				if (bind(sock,(const sockaddr*) localInfo, sizeof(*localInfo)) < 0) {
-					close(sock);
-					delete connectionInfo;
-					delete localInfo;
-					return NULL;
-				}
-				
-				//If everything worked, return a new instance of the read-writer
-				return new SocketReadWriter(sock, connectionInfo, localInfo, bufferSize);
+				UdpTransport* carrier = UdpTransport::getInstance(ip, port, timeoutSeconds, timeoutMicroSeconds);
+				return carrier == NULL ? NULL : new SocketReadWriter(carrier, bufferSize, timeoutSeconds, timeoutMicroSeconds);
 		}
 
 		static SocketReadWriter* getInstance(string* ip, int port, int bufferSize) {
 			return getInstance(ip, port, bufferSize, 0, 0);
 		}
+		
+		//Creates a SocketReadWriter that talks to another process on this machine through shared memory instead of UDP.
+		//The side started first (the server) should pass true for "creator", and will wait here until the other side joins.
+		//Both sides use the same port number, which only serves to match them up.
+		//Returns the address of the object if successful, or NULL if not.
+		static SocketReadWriter* getSharedMemoryInstance(int port, bool creator, int bufferSize, int timeoutSeconds, int timeoutMicroSeconds) {
+			if (bufferSize < PACKET_SIZE_AUTO || timeoutSeconds < 0 || timeoutMicroSeconds < 0) return NULL;
+			
+			ShmTransport* carrier = creator ? ShmTransport::create(port) : ShmTransport::join(port);
+			if (carrier == NULL) return NULL;
+			carrier->setTimeout(timeoutSeconds, timeoutMicroSeconds);
+			return new SocketReadWriter(carrier, bufferSize, timeoutSeconds, timeoutMicroSeconds);
+		}
+		
+		//Creates a SocketReadWriter for either side of a multicast transfer to the given group and port (see Multicast.cpp),
+		//through the network interface with the given address ("localhost" for this machine only). The sending side says how
+		//many receivers it sends to, and each receiving side passes 0, joining the group. Start the receivers first.
+		//Returns the address of the object if successful, or NULL if not.
+		static SocketReadWriter* getMulticastInstance(string* group, string* interface, int port, int receivers, int bufferSize, int timeoutSeconds,
+			int timeoutMicroSeconds) {
+			if (receivers < 0 || bufferSize < PACKET_SIZE_AUTO || timeoutSeconds < 0 || timeoutMicroSeconds < 0) return NULL;
+			
+			Transport* carrier;
+			if (receivers == 0) carrier = MulticastReceiver::getInstance(group, interface, port);
+			else carrier = MulticastSender::getInstance(group, interface, port, receivers);
+			if (carrier == NULL) return NULL;
+			carrier->setTimeout(timeoutSeconds, timeoutMicroSeconds);
+			return new SocketReadWriter(carrier, bufferSize, timeoutSeconds, timeoutMicroSeconds);
+		}
+		
+		//Creates a SocketReadWriter for one endpoint (0 or 1) of a simulated link. Timeouts run on the link's virtual clock.
+		//The link isn't owned by the read-writer, so delete it only once both endpoints are gone.
+		//Returns the address of the object if successful, or NULL if not.
+		static SocketReadWriter* getSimulatedInstance(SimulatedLink* link, int endpoint, int bufferSize, int timeoutSeconds, int timeoutMicroSeconds) {
+			if (link == NULL || endpoint < 0 || endpoint > 1 || bufferSize < PACKET_SIZE_AUTO || timeoutSeconds < 0 || timeoutMicroSeconds < 0) return NULL;
+			
+			SimTransport* carrier = new SimTransport(link, endpoint);
+			carrier->setTimeout(timeoutSeconds, timeoutMicroSeconds);
+			return new SocketReadWriter(carrier, bufferSize, timeoutSeconds, timeoutMicroSeconds);
+		}
 
 };
 
@@ -342,41 +2282,6 @@ class SocketReadWriter {
 
 
 
-//Rotates the packets of the window a given amount of times.
-//Then changes the ID numbers to match the new order
-void shiftWindow(int shiftValue, int windowSize, int sequenceRange, Packet* packets) {
-	//No point in shifting if we're not actually supposed to do it.
-	if (shiftValue == 0) return;
-	
-	//If not every packet was successful, rearrange the ones that were to the back.
-	//(Up until the first unsuccessful one is at the start of the array)
-	if (shiftValue != windowSize) {
-		
-		for (int i = 0, last = windowSize - 1; i < shiftValue; i++) {
-			Packet pack = packets[0];
-		
-			for (int j = 1; j < windowSize; j++) {
-				packets[j-1] = packets[j];
-			}
-		
-			packets[last] = pack;
-		}
-		
-		//Update the id numbers according to their new positions
-		for (int i = 1; i < windowSize; i++) {
-			packets[i].id = (packets[i-1].id + 1) % sequenceRange;
-		}
-	}
-	//If all of them were successful, we can just update the indicators instead of actually moving the packets
-	else {
-		for (int i = 0; i < windowSize; i++) {
-			packets[i].id = (packets[i].id + windowSize) % sequenceRange;
-			packets[i].secured = packets[i].transmitted = false;
-			packets[i].checksum = -1;
-		}
-	}
-}
-
 //Determines if an error with a given pacet should be simulated. This can be used for either dropping acks or packets
 //id is the id number of the packet (or ack) currently being checked
 //numDrops is the number of ids listed in the array "drops". A value of -1 triggers random generation instead of a lookup of the list.
@@ -390,7 +2295,7 @@ bool feignError(int id, int numDrops, int* drops, int windowSize, int sequenceRa
 	//If we're supposed to generate a random number
 	if (numDrops == -1) {
 		//Generate an ID number within the bounds of the current window
-		int randID = ((rand() % (windowSize < 2 ? 25 : windowSize)) + lowID) % sequenceRange;
+		int randID = wireIdAdvance(lowID, rand() % (windowSize < 2 ? 25 : windowSize), sequenceRange);
 		return id == randID;
 	}
 	//If we're actually supposed to look for an id in the list, do so
@@ -412,25 +2317,31 @@ bool feignError(int id, int numDrops, int* drops, int windowSize, int sequenceRa
 //You'll know if a packet kept its integrity if the short the sender gave
 //Is the same as the short the receiver calculates.
 short inetChecksum(char* bytes, int length) {
-	//All one's complement addition results will be put here
-	unsigned short send = 0;
-	
-	if (bytes == NULL) return send;
-	//For every byte in the given array
-	for (int i = 0, shortSize = sizeof(send), key = 1 << (shortSize * 8); i < length; i += shortSize) {
+	if (bytes == NULL) return 0;
+
+	//One's complement addition doesn't care about order or grouping, so instead of adding a short at a time
+	//we add 8 bytes at a time into a bigger sum, and fold it back down to a short at the end.
+	//(Every carry out of the top is worth 1, the same as a carry out of a short.)
+	unsigned long long sum = 0, carries = 0;
+	int i = 0;
+	for (; i + 8 <= length; i += 8) {
+		unsigned long long next;
+		memcpy(&next, bytes + i, 8);
+		sum += next;
+		carries += sum < next;
+	}
+	//Whatever's left goes in a short at a time, with a lone last byte padded out by a 0 like before
+	for (; i < length; i += 2) {
 		unsigned short next = 0;
-		char* nextBytes = (char*) &next;
-		//Parse a short's worth of bytes into a variable 
-		//(letting bytes of 0 be placeholders if there aren't enough "real" bytes left for an entire short.)
-		for (int j = 0; j < shortSize && (j + i) < length; j++) {
-			nextBytes[j] = bytes[j + i];
-		}
-		//Do one's complement addition, adding any carryover to the least significant bit
-		int sum = ((int) send) + next;
-		if (sum & key) sum++;
-		//Condense back into a short now that overflow is handled
-		send = sum & (key-1);
+		memcpy(&next, bytes + i, i + 1 < length ? 2 : 1);
+		sum += next;
+		carries += sum < next;
 	}
+
+	//Fold the carries and then the 64 bit sum down into a short, adding any carryover to the least significant bit
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32) + carries;
+	while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+
 	//Invert the bits and return whatever results
-	return ~send;
-}
\ No newline at end of file
+	return ~((unsigned short) sum);
+}
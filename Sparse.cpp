@@ -0,0 +1,473 @@
+#include <vector>
+#include <sys/stat.h>
+#include <fcntl.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+
+//Sparse transfers. Disk images and preallocated files are mostly zeroes, and sent as they are every block of nothing costs
+//a packet. The sending side skips the holes the file system keeps for its file (found with SEEK_DATA and SEEK_HOLE), and
+//the blocks that are all zeroes anyway, and sends each run of them as a short hole record instead, which the receiving side
+//makes by seeking past it, so the file it writes has the same holes.
+//What the sending side sends goes through the protocols exactly like a file would, so they don't need to know about it:
+//	magic   the 8 bytes of SPARSE_MAGIC
+//	data    SPARSE_DATA (1 byte), how long it is (varint, up to SPARSE_MAX_DATA), then that many bytes of the file
+//	hole    SPARSE_HOLE (1 byte), how many bytes of zeroes it stands for (8 bytes, lowest byte first)
+//	end     SPARSE_END (1 byte), then the XXH64 of the whole file as the sending side read it, holes and all (8 bytes)
+//Zeroes are looked for SPARSE_BLOCK bytes at a time, in blocks lined up with the start of the file like the file system's.
+//The end is there so the file put back together from the holes can be checked, since the file digest both sides trade is
+//of what went through the protocols.
+#define SPARSE_MAGIC "GBNSPR01"
+#define SPARSE_MAGIC_BYTES 8
+#define SPARSE_DATA 0
+#define SPARSE_HOLE 1
+#define SPARSE_END 2
+#define SPARSE_HOLE_BYTES 9
+#define SPARSE_END_BYTES 9
+#define SPARSE_BLOCK 4096
+#define SPARSE_MAX_DATA 65536
+
+//There are three ways of looking for zeroes, all giving the same answer. Which one allZero uses is picked the first time
+//it's called, from what the processor can do:
+//	allZeroPlain  8 bytes at a time. Works anywhere.
+//	allZeroSse2   64 bytes at a time, in four 16 byte registers, which every x86-64 processor can do
+//	allZeroAvx2   128 bytes at a time, in four 32 byte registers
+//Each of them stops at the first part that isn't all zeroes, so a block of data is usually given up on straight away.
+
+//Returns true if every one of the given bytes is zero, 8 at a time
+static bool allZeroPlain(const char* data, size_t length) {
+	uint64_t any = 0;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t next;
+		memcpy(&next, data + i, 8);
+		if ((any |= next) != 0) return false;
+	}
+	for (; i < length; i++) any |= (unsigned char) data[i];
+	return any == 0;
+}
+
+#if defined(__x86_64__)
+//Returns true if every one of the given bytes is zero, 64 at a time with SSE2
+static bool allZeroSse2(const char* data, size_t length) {
+	size_t i = 0;
+	for (; i + 64 <= length; i += 64) {
+		const __m128i* next = (const __m128i*) (data + i);
+		__m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(next), _mm_loadu_si128(next + 1)),
+			_mm_or_si128(_mm_loadu_si128(next + 2), _mm_loadu_si128(next + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF) return false;
+	}
+	return allZeroPlain(data + i, length - i);
+}
+
+//Returns true if every one of the given bytes is zero, 128 at a time with AVX2
+__attribute__((target("avx2")))
+static bool allZeroAvx2(const char* data, size_t length) {
+	size_t i = 0;
+	for (; i + 128 <= length; i += 128) {
+		const __m256i* next = (const __m256i*) (data + i);
+		__m256i any = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(next), _mm256_loadu_si256(next + 1)),
+			_mm256_or_si256(_mm256_loadu_si256(next + 2), _mm256_loadu_si256(next + 3)));
+		if (!_mm256_testz_si256(any, any)) return false;
+	}
+	//What's left is done here too, since going on to the SSE2 version with the upper halves of the registers in use
+	//costs more than the whole block
+	for (; i + 32 <= length; i += 32) {
+		__m256i next = _mm256_loadu_si256((const __m256i*) (data + i));
+		if (!_mm256_testz_si256(next, next)) return false;
+	}
+	unsigned char any = 0;
+	for (; i < length; i++) any |= (unsigned char) data[i];
+	return any == 0;
+}
+#endif
+
+//Returns the fastest version this processor can run
+static bool (*allZeroPick())(const char*, size_t) {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? allZeroAvx2 : allZeroSse2;
+#else
+	return allZeroPlain;
+#endif
+}
+
+//Returns true if every one of the given bytes is zero
+bool allZero(const char* data, size_t length) {
+	static bool (*version)(const char*, size_t) = allZeroPick();
+	return version(data, length);
+}
+
+
+//Makes "length" bytes of the file open as "file", from "offset" on, a hole, throwing away whatever was there: with
+//fallocate where the file system can punch holes, and by writing zeroes over it where it can't. The file's position is
+//left anywhere. Returns false if neither worked.
+static bool punchHole(FILE* file, off_t offset, off_t length) {
+	fflush(file);
+	if (fallocate(fileno(file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) return true;
+	if (fseeko(file, offset, SEEK_SET) != 0) return false;
+	static const char zeroes[SPARSE_BLOCK] = {0};
+	while (length > 0) {
+		size_t taken = length < SPARSE_BLOCK ? length : SPARSE_BLOCK;
+		if (fwrite(zeroes, 1, taken, file) != taken) return false;
+		length -= taken;
+	}
+	return true;
+}
+
+
+//Adds "length" bytes of zeroes to the given digest, for a hole
+static void digestZeroes(FileDigest* digest, uint64_t length) {
+	static const char zeroes[SPARSE_BLOCK] = {0};
+	while (length > 0) {
+		size_t taken = length < SPARSE_BLOCK ? length : SPARSE_BLOCK;
+		digest->add(zeroes, taken);
+		length -= taken;
+	}
+}
+
+
+//Finds the holes the file system keeps for a file, with SEEK_DATA and SEEK_HOLE, for reading it with pread (they move the
+//descriptor's position). A file system that doesn't keep track of holes, or a file that isn't a regular file, has none.
+class HoleMap {
+	private:
+		int descriptor;
+		off_t size;
+		//What the last look found: from "from" up to "data" is a hole, and from "data" up to "hole" isn't
+		off_t from, data, hole;
+
+	public:
+		//Finds the holes in the file open as "file" (-1 for none), which is "bytes" bytes long
+		HoleMap(int file, off_t bytes) {
+			descriptor = file;
+			size = bytes;
+			from = data = hole = 0;
+		}
+
+		//Returns where the hole "start" is in ends, which is "start" itself if it isn't in one
+		off_t holeEnd(off_t start) {
+			if (descriptor == -1 || start >= size) return start;
+			if (start < from || start >= hole) {
+				off_t at = lseek(descriptor, start, SEEK_DATA);
+				//Nothing but hole from here to the end
+				if (at == -1 && errno == ENXIO) at = size;
+				off_t after = at == -1 || at >= size ? size : lseek(descriptor, at, SEEK_HOLE);
+				if (at == -1 || after == -1) {
+					descriptor = -1;
+					return start;
+				}
+				from = start;
+				data = at;
+				hole = after;
+			}
+			return start < data ? data : start;
+		}
+};
+
+
+//Reads the sending side's file as data and hole records, for a sparse transfer
+class SparseReader {
+	private:
+		FILE* file;
+		//The file's descriptor, which it's read from with pread, or -1 if it isn't a regular file and is read with fread
+		int descriptor;
+		off_t position;
+		HoleMap* holes;
+		char* chunk;
+		//What's been worked out to send and not passed on yet, and how much of it has been
+		vector<char> out;
+		size_t outSent;
+		//How many bytes of zeroes have been found since the last data, not yet sent as a hole
+		long long hole;
+		long long holeBytes, dataBytes;
+		bool ended, failed;
+		//Of everything read from the file, for the end
+		FileDigest* digest;
+
+		void putHole() {
+			if (hole == 0) return;
+			char record[SPARSE_HOLE_BYTES];
+			record[0] = SPARSE_HOLE;
+			putFixed64(record + 1, hole);
+			out.insert(out.end(), record, record + SPARSE_HOLE_BYTES);
+			holeBytes += hole;
+			hole = 0;
+		}
+
+		void putData(const char* data, size_t length) {
+			char record[1 + WIRE_MAX_VARINT];
+			record[0] = SPARSE_DATA;
+			int used = 1 + putVarint(record + 1, length);
+			out.insert(out.end(), record, record + used);
+			out.insert(out.end(), data, data + length);
+			dataBytes += length;
+		}
+
+		void putEnd() {
+			char record[SPARSE_END_BYTES];
+			record[0] = SPARSE_END;
+			digest->finish((unsigned char*) record + 1);
+			out.insert(out.end(), record, record + SPARSE_END_BYTES);
+		}
+
+		//Reads the next part of the file, skipping any hole it starts in, and works out what goes out for it.
+		//Returns false once there's nothing left.
+		bool fill() {
+			off_t skip = holes->holeEnd(position);
+			hole += skip - position;
+			digestZeroes(digest, skip - position);
+			position = skip;
+			//Parts end on a block, so that the blocks looked at are lined up with the file system's
+			size_t wanted = SPARSE_MAX_DATA - position % SPARSE_BLOCK;
+			ssize_t got = descriptor != -1 ? pread(descriptor, chunk, wanted, position) : (ssize_t) fread(chunk, 1, wanted, file);
+			if (got <= 0) {
+				failed = got < 0 || (descriptor == -1 && ferror(file));
+				ended = true;
+				//Zeroes at the end of the file still have to be there
+				putHole();
+				if (!failed) putEnd();
+				return !out.empty();
+			}
+			//The end's digest is of the file as it is, zeroes and all
+			digest->add(chunk, got);
+			//Each run of blocks with anything in them goes out as one data record, in between the holes
+			ssize_t dataStart = -1;
+			for (ssize_t i = 0; i < got;) {
+				ssize_t piece = SPARSE_BLOCK - (position + i) % SPARSE_BLOCK;
+				if (piece > got - i) piece = got - i;
+				if (allZero(chunk + i, piece)) {
+					if (dataStart != -1) putData(chunk + dataStart, i - dataStart);
+					dataStart = -1;
+					hole += piece;
+				} else if (dataStart == -1) {
+					putHole();
+					dataStart = i;
+				}
+				i += piece;
+			}
+			if (dataStart != -1) putData(chunk + dataStart, got - dataStart);
+			position += got;
+			return true;
+		}
+
+	public:
+		//Reads from "source", which isn't owned by the reader
+		SparseReader(FILE* source) {
+			file = source;
+			struct stat status;
+			bool regular = fstat(fileno(source), &status) == 0 && S_ISREG(status.st_mode);
+			descriptor = regular ? fileno(source) : -1;
+			position = 0;
+			holes = new HoleMap(descriptor, regular ? status.st_size : 0);
+			chunk = new char[SPARSE_MAX_DATA];
+			out.assign(SPARSE_MAGIC, SPARSE_MAGIC + SPARSE_MAGIC_BYTES);
+			outSent = 0;
+			hole = holeBytes = dataBytes = 0;
+			ended = failed = false;
+			digest = new FileDigest(DIGEST_XXH64);
+		}
+
+		~SparseReader() {
+			delete holes;
+			delete[] chunk;
+			delete digest;
+		}
+
+		//Reads up to "room" bytes of what's to be sent into "to". Returns how many were read, 0 at the end and -1 if the
+		//file couldn't be read.
+		ssize_t read(char* to, size_t room) {
+			size_t send = 0;
+			while (send < room) {
+				if (outSent < out.size()) {
+					size_t taken = out.size() - outSent < room - send ? out.size() - outSent : room - send;
+					memcpy(to + send, &out[outSent], taken);
+					outSent += taken;
+					send += taken;
+					continue;
+				}
+				out.clear();
+				outSent = 0;
+				if (ended || !fill()) break;
+			}
+			return failed && send == 0 ? -1 : send;
+		}
+
+		//Returns how many bytes of the file went as holes
+		long long getHoleBytes() {
+			return holeBytes;
+		}
+
+		//Returns how many bytes of the file went as data
+		long long getDataBytes() {
+			return dataBytes;
+		}
+};
+
+
+//Writes what a SparseReader sent into the receiving side's file, seeking past the holes.
+//Anything that doesn't start with SPARSE_MAGIC isn't a sparse transfer, and is written as it is.
+class SparseWriter {
+	private:
+		FILE* output;
+		//The magic or start of a record being taken in, and how much of it has been
+		char head[SPARSE_MAGIC_BYTES + SPARSE_HOLE_BYTES];
+		int headLength;
+		bool started, plain, broken, ended;
+		//Whether holes can be left by seeking (or have to be written as zeroes), and how long the file was to start with,
+		//since anything already there has to be punched out of a hole instead
+		bool seekable;
+		off_t oldSize;
+		//How long the file is so far, and how much of the data record being written is left
+		uint64_t position;
+		long long left;
+		long long holeBytes, dataBytes;
+		//Of everything put in the file, holes and all, and how that compared with the sending side's (DIGEST_...)
+		FileDigest* digest;
+		int result;
+
+		//Leaves a hole of "length" bytes. Returns false if it couldn't.
+		bool skip(uint64_t length) {
+			if (length > (uint64_t) INT64_MAX - position) return false;
+			holeBytes += length;
+			digestZeroes(digest, length);
+			if (seekable) {
+				if ((off_t) position < oldSize) {
+					off_t end = (off_t) (position + length) < oldSize ? position + length : oldSize;
+					if (!punchHole(output, position, end - position)) return false;
+				}
+				position += length;
+				return fseeko(output, position, SEEK_SET) == 0;
+			}
+			static const char zeroes[SPARSE_BLOCK] = {0};
+			while (length > 0) {
+				size_t taken = length < SPARSE_BLOCK ? length : SPARSE_BLOCK;
+				if (fwrite(zeroes, 1, taken, output) != taken) return false;
+				position += taken;
+				length -= taken;
+			}
+			return true;
+		}
+
+		//Acts on the start of a record once enough of it is there to. Returns false if it makes no sense.
+		bool takeRecord() {
+			if (head[0] == SPARSE_HOLE) {
+				if (headLength < SPARSE_HOLE_BYTES) return true;
+				headLength = 0;
+				return skip(getFixed64(head + 1));
+			}
+			if (head[0] == SPARSE_END) {
+				if (headLength < SPARSE_END_BYTES) return true;
+				headLength = 0;
+				unsigned char sum[8];
+				digest->finish(sum);
+				result = memcmp(sum, head + 1, 8) == 0 ? DIGEST_MATCH : DIGEST_MISMATCH;
+				ended = true;
+				return true;
+			}
+			if (head[0] != SPARSE_DATA) return false;
+			unsigned int length;
+			if (getVarint(head + 1, headLength - 1, &length) == 0) return headLength - 1 < WIRE_MAX_VARINT;
+			headLength = 0;
+			left = length;
+			return length > 0 && length <= SPARSE_MAX_DATA;
+		}
+
+	public:
+		//Writes into "file", which isn't owned by the writer
+		SparseWriter(FILE* file) {
+			output = file;
+			headLength = 0;
+			started = plain = broken = ended = false;
+			struct stat status;
+			seekable = fstat(fileno(file), &status) == 0 && S_ISREG(status.st_mode);
+			oldSize = seekable ? status.st_size : 0;
+			position = 0;
+			left = 0;
+			holeBytes = dataBytes = 0;
+			digest = new FileDigest(DIGEST_XXH64);
+			result = DIGEST_UNCHECKED;
+		}
+
+		~SparseWriter() {
+			delete digest;
+		}
+
+		//Takes the next bytes of what was sent. Returns false once it's turned out not to make sense, or the file won't take it.
+		bool write(const char* data, size_t length) {
+			if (plain) {
+				if (fwrite(data, 1, length, output) != length) broken = true;
+				return !broken;
+			}
+			while (length > 0 && !broken) {
+				if (!started) {
+					head[headLength] = *data++;
+					length--;
+					if (head[headLength] != SPARSE_MAGIC[headLength]) {
+						plain = true;
+						if (fwrite(head, 1, headLength + 1, output) != (size_t) headLength + 1 || fwrite(data, 1, length, output) != length) broken = true;
+						return !broken;
+					}
+					if (++headLength == SPARSE_MAGIC_BYTES) {
+						started = true;
+						headLength = 0;
+					}
+					continue;
+				}
+				if (left > 0) {
+					size_t taken = length < (size_t) left ? length : left;
+					if (fwrite(data, 1, taken, output) != taken) broken = true;
+					else digest->add(data, taken);
+					position += taken;
+					left -= taken;
+					dataBytes += taken;
+					data += taken;
+					length -= taken;
+					continue;
+				}
+				//Nothing can come after the end
+				if (ended) broken = true;
+				else {
+					head[headLength++] = *data++;
+					length--;
+					broken = !takeRecord();
+				}
+			}
+			return !broken;
+		}
+
+		//Flushes the file once nothing more is coming, making it as long as what was sent, which it isn't yet if it ended
+		//in a hole. Returns how putting the file back together went: DIGEST_MATCH if it's the same as the sending side's,
+		//DIGEST_MISMATCH if it isn't, what was sent didn't make sense or was cut short, or the file wouldn't take it, and
+		//DIGEST_UNCHECKED if this wasn't a sparse transfer at all.
+		int finish() {
+			//Something too short to hold the whole magic was a file like any other
+			if (!started && !plain && headLength > 0) {
+				if (fwrite(head, 1, headLength, output) != (size_t) headLength) broken = true;
+				plain = true;
+			}
+			if (fflush(output) != 0 || ferror(output)) broken = true;
+			struct stat status;
+			if (!broken && started && seekable && fstat(fileno(output), &status) == 0 && (uint64_t) status.st_size != position) {
+				if (ftruncate(fileno(output), position) != 0) broken = true;
+			}
+			if (broken) return DIGEST_MISMATCH;
+			if (!started) return DIGEST_UNCHECKED;
+			return !ended ? DIGEST_MISMATCH : result;
+		}
+
+		//Returns how many bytes of the file came as holes
+		long long getHoleBytes() {
+			return holeBytes;
+		}
+
+		//Returns how many bytes of the file came as data
+		long long getDataBytes() {
+			return dataBytes;
+		}
+
+		//Returns true if what came started with SPARSE_MAGIC
+		bool isSparse() {
+			return started;
+		}
+};
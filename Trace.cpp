@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include <atomic>
+
+
+//How much the protocols print, picked at compile time (for example "g++ -D LOG_LEVEL=3 ...").
+//Anything above the chosen level isn't just skipped, it's never compiled in, so it costs nothing at all.
+#define LOG_LEVEL_NONE 0	//Nothing
+#define LOG_LEVEL_ERROR 1	//Only when something goes wrong, like the other side going quiet
+#define LOG_LEVEL_INFO 2	//Plus the start and end of each transfer
+#define LOG_LEVEL_DEBUG 3	//Plus every packet, ack and round, and the window after every round
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+//Each of these takes anything that can follow "cout <<", for example LOG_DEBUG("Sending packet of id " << id << "\n").
+//None of them flush, so end lines with "\n" rather than endl.
+//They print to logStream, which is cout unless a side's file is standard output (see setLogStream).
+//Where the logs go
+static ostream* logStream = &cout;
+
+//Sends the logs somewhere else, like cerr when the side's file is standard output, so they don't end up in the data
+void setLogStream(ostream* to) {
+	logStream = to;
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(message) (*logStream << message)
+#else
+#define LOG_ERROR(message) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(message) (*logStream << message)
+#else
+#define LOG_INFO(message) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(message) (*logStream << message)
+#else
+#define LOG_DEBUG(message) ((void) 0)
+#endif
+
+
+//What a trace record can say happened. The sequence number, packet number, slot and byte count mean the same thing for all
+//of them (the packet's id, its number counted from the start of the file, its index in the window, and how much data it held),
+//except where noted. The number is -1 wherever the side can't tell which packet it was, like for a damaged one.
+#define TRACE_START 0			//A side started a transfer. seq is the sequence range, slot the window size, bytes the packet size.
+#define TRACE_SEND 1			//A packet was sent for the first time
+#define TRACE_RETRANSMIT 2		//A packet was sent again
+#define TRACE_ACK_RECEIVED 3	//An ack came in for the packet
+#define TRACE_SECURED 4			//The sender knows the packet made it, and is done with it
+#define TRACE_ACK_RETURNED 5	//The sender returned a copy of the ack
+#define TRACE_RECEIVE 6			//A packet arrived intact and was taken
+#define TRACE_DUPLICATE 7		//A packet arrived again after already being received
+#define TRACE_OUT_OF_WINDOW 8	//A packet arrived that the receiver wasn't expecting yet
+#define TRACE_CORRUPT 9			//A packet arrived with data that didn't match its checksum
+#define TRACE_ACK_SENT 10		//The receiver sent an ack for the packet
+#define TRACE_WRITE 11			//The receiver wrote the packet to the file
+#define TRACE_ROUND 12			//A round ended. seq is the number of the round.
+#define TRACE_LOST 13			//Records were lost because the ring filled up before it could be written out. bytes is how many.
+#define TRACE_END 14			//A side finished its transfer
+#define TRACE_PARITY 15			//A parity packet was sent. seq is the id of the first packet it covers, slot how many it covers.
+#define TRACE_REBUILT 16		//A lost packet was rebuilt from parity, and taken as if it had arrived
+#define NUM_TRACE_EVENTS 17
+
+//Which side a record came from
+#define TRACE_SERVER 0
+#define TRACE_CLIENT 1
+
+//A trace file starts with this, followed by TraceRecords one after another, in the byte order of the machine that wrote it
+#define TRACE_MAGIC "GBNTRC02"
+
+//Only traceAnalyze prints these
+[[maybe_unused]] static const char* traceEventNames[NUM_TRACE_EVENTS] = {
+	"start", "send", "retransmit", "ack_received", "secured", "ack_returned", "receive", "duplicate",
+	"out_of_window", "corrupt", "ack_sent", "write", "round", "lost", "end", "parity", "rebuilt"
+};
+
+//One event. Every record is the same size, so a trace can be read without any parsing.
+typedef struct TraceRecord {
+	//Nanoseconds by the clock of whichever side recorded it (since boot on a real transport, since the start on a simulated one)
+	uint64_t time;
+	//The packet's number, which unlike its id never comes round again, so records about the same packet can be matched up
+	int64_t number;
+	int32_t seq, slot, bytes;
+	//What happened (TRACE_SEND, ...), which side it happened on, and which protocol that side runs (1 for GBN, 0 for SR)
+	uint8_t event, side, gbn, unused;
+} TraceRecord;
+
+
+//A fixed-size ring of trace records that any number of threads can add to without locking, written out to a file in batches.
+//Adding a record only claims a spot with one atomic increment and fills it in, so it's cheap enough to do for every packet.
+//Once the ring is half full, whoever adds the next record writes out everything finished so far. If records come in faster
+//than that, the oldest are overwritten, and a TRACE_LOST record says how many went missing.
+class TraceRing {
+	private:
+		FILE* out;
+		TraceRecord* records;
+		//stamps[i] is one more than the number of the record last finished in spot i (0 while one is being filled in),
+		//so a reader can tell whether a spot holds the record it expects, one that isn't finished yet, or one that replaced it
+		atomic<uint64_t>* stamps;
+		uint64_t mask;
+
+		//The number of the next record to hand out, and of the next one to write to the file
+		atomic<uint64_t> head;
+		uint64_t tail;
+		//Set while someone is writing records out, so only one thread ever does
+		atomic_flag draining;
+		long lost;
+
+		//Writes out every finished record, in order, up to the first one that isn't finished yet
+		void drain() {
+			if (draining.test_and_set(memory_order_acquire)) return;
+			uint64_t end = head.load(memory_order_acquire);
+			long missing = 0;
+			while (tail < end) {
+				uint64_t stamp = stamps[tail & mask].load(memory_order_acquire);
+				if (stamp < tail + 1) break;
+				//Overwritten before it could be written out
+				if (stamp > tail + 1) {
+					missing++;
+					tail++;
+					continue;
+				}
+				TraceRecord record = records[tail & mask];
+				//Check nothing started replacing it while it was being copied
+				atomic_thread_fence(memory_order_acquire);
+				if (stamps[tail & mask].load(memory_order_relaxed) != tail + 1) {
+					missing++;
+					tail++;
+					continue;
+				}
+				fwrite(&record, sizeof(record), 1, out);
+				tail++;
+			}
+			if (missing > 0) {
+				lost += missing;
+				TraceRecord record;
+				memset(&record, 0, sizeof(record));
+				record.event = TRACE_LOST;
+				record.number = -1;
+				record.bytes = (int32_t) missing;
+				fwrite(&record, sizeof(record), 1, out);
+			}
+			draining.clear(memory_order_release);
+		}
+
+		TraceRing(FILE* file, int capacityBits) {
+			out = file;
+			mask = (1ULL << capacityBits) - 1;
+			records = new TraceRecord[mask + 1];
+			stamps = new atomic<uint64_t>[mask + 1];
+			for (uint64_t i = 0; i <= mask; i++) stamps[i].store(0, memory_order_relaxed);
+			head.store(0);
+			tail = 0;
+			draining.clear();
+			lost = 0;
+		}
+
+	public:
+		//Adds a record with the given time (in seconds, from the recording side's clock)
+		void add(double time, int event, int side, bool gbn, int seq, long long packetNumber, int slot, int bytes) {
+			uint64_t claimed = head.fetch_add(1, memory_order_relaxed);
+			TraceRecord* record = records + (claimed & mask);
+			//Mark the spot as being filled in first, so a reader copying the record that was there can tell
+			stamps[claimed & mask].store(0, memory_order_relaxed);
+			atomic_thread_fence(memory_order_release);
+			record->time = time > 0 ? (uint64_t) (time * 1e9) : 0;
+			record->seq = seq;
+			record->number = packetNumber;
+			record->slot = slot;
+			record->bytes = bytes;
+			record->event = event;
+			record->side = side;
+			record->gbn = gbn;
+			record->unused = 0;
+			stamps[claimed & mask].store(claimed + 1, memory_order_release);
+
+			if (((claimed + 1) & (mask >> 1)) == 0) drain();
+		}
+
+		//Writes out everything recorded so far. Only call this once nothing else is adding records.
+		void flush() {
+			drain();
+			fflush(out);
+		}
+
+		//Returns how many records were lost because the ring filled up
+		long getLost() {
+			return lost;
+		}
+
+		//Creates a ring holding 2^capacityBits records that writes to the given file (which belongs to the ring from now on).
+		//Returns the ring, or NULL if the size makes no sense or the file couldn't be written to.
+		static TraceRing* getInstance(FILE* file, int capacityBits) {
+			if (file == NULL || capacityBits < 2 || capacityBits > 30) return NULL;
+			if (fwrite(TRACE_MAGIC, 1, 8, file) != 8) return NULL;
+			return new TraceRing(file, capacityBits);
+		}
+
+		//Writes out whatever is left and closes the file
+		~TraceRing() {
+			flush();
+			fclose(out);
+			delete[] records;
+			delete[] stamps;
+		}
+};
@@ -0,0 +1,1043 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include <linux/errqueue.h>
+#include <sched.h>
+#include <stdint.h>
+#include <atomic>
+
+
+//The largest payload a single UDP datagram (or one segmented super-buffer) can carry
+#define MAX_DATAGRAM 65507
+//Room for a coalesced receive, which can't be larger than one datagram's worth of IP payload
+#define GRO_BUFFER_SIZE 65536
+//The most segments the kernel will cut a single super-buffer into
+#define MAX_SEGMENTS 64
+//What the IP and UDP headers add to a datagram, which an MTU counts and the datagram's own length doesn't
+#define UDP_IP_HEADERS 28
+
+//What setBusyPoll turned on: spinning on the transport instead of sleeping until something comes in, and the kernel
+//polling the network device for it too (SO_BUSY_POLL)
+#define BUSY_SPINNING 1
+#define BUSY_KERNEL 2
+//Busy polling tries this many times before it starts sleeping between tries, at first. It tries longer after waits that
+//spinning ended, down to BUSY_MIN_SPINS after ones it didn't, so a side that mostly waits on something slow gives the CPU
+//up sooner. It gives the CPU up for a moment every BUSY_YIELD_EVERY tries, so whatever it's waiting on can run on the
+//same one, and once it's sleeping it sleeps twice as long each time, up to BUSY_MAX_SLEEP_MICROSECONDS.
+#define BUSY_MIN_SPINS 64
+#define BUSY_MAX_SPINS 65536
+#define BUSY_YIELD_EVERY 32
+#define BUSY_MAX_SLEEP_MICROSECONDS 1000
+//How long the kernel polls the device when a busy socket has nothing (SO_BUSY_POLL)
+#define BUSY_POLL_MICROSECONDS 50
+//How many datagrams a busy UDP receive reads at once
+#define BUSY_BATCH 16
+
+
+//Returns the longest datagram the kernel thinks gets to the given address without being cut into fragments: the MTU of
+//the route there (or what ICMP has said of the path since), less the IP and UDP headers, or MAX_DATAGRAM if it can't say.
+//Multicast picks its route by the interface it goes out through, which "interface" gives (NULL for anything else).
+//Only a connected socket can be asked, so this connects one of its own.
+int routeLimit(sockaddr_in* to, in_addr* interface) {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0), mtu = 0;
+	if (sock < 0) return MAX_DATAGRAM;
+	if (interface != NULL) setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, interface, sizeof(*interface));
+	socklen_t length = sizeof(mtu);
+	if (connect(sock, (sockaddr*) to, sizeof(*to)) < 0 || getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &length) < 0) mtu = 0;
+	close(sock);
+	return mtu > UDP_IP_HEADERS && mtu - UDP_IP_HEADERS < MAX_DATAGRAM ? mtu - UDP_IP_HEADERS : MAX_DATAGRAM;
+}
+
+//Grows one of a socket's buffers (SO_RCVBUF or SO_SNDBUF) to "bytes", unless it's that big already, and returns its size after.
+//The kernel doubles what it's asked for, to cover its own bookkeeping, and won't go past net.core.rmem_max (or wmem_max)
+//before doubling. Sizes here are what it's asked for, so half what it reports.
+int growBuffer(int sock, int option, int bytes) {
+	int size = 0;
+	socklen_t length = sizeof(size);
+	if (getsockopt(sock, SOL_SOCKET, option, &size, &length) < 0) return 0;
+	if (size / 2 >= bytes) return size / 2;
+	setsockopt(sock, SOL_SOCKET, option, &bytes, sizeof(bytes));
+	getsockopt(sock, SOL_SOCKET, option, &size, &length);
+	return size / 2;
+}
+
+//Has the kernel say, with every datagram read from the socket, how many it's dropped so far because they came in while
+//the receive buffer was full (SO_RXQ_OVFL). Returns true if it will.
+bool watchDrops(int sock) {
+	int on = 1;
+	return setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == 0;
+}
+
+//Waits before busy polling tries again, after "tries" tries that found nothing, of which the first "spins" go straight on
+//(see BUSY_MIN_SPINS)
+void busyBackoff(int tries, int spins) {
+	if (tries < spins) {
+		if (tries % BUSY_YIELD_EVERY == BUSY_YIELD_EVERY - 1) sched_yield();
+		return;
+	}
+	int shift = tries - spins < 10 ? tries - spins : 10, sleep = 1 << shift;
+	usleep(sleep < BUSY_MAX_SLEEP_MICROSECONDS ? sleep : BUSY_MAX_SLEEP_MICROSECONDS);
+}
+
+//Works out how many tries busy polling goes on spinning for next time, when "tries" found something this time
+int busyAdapt(int spins, int tries) {
+	if (tries < spins) return spins * 2 < BUSY_MAX_SPINS ? spins * 2 : BUSY_MAX_SPINS;
+	return spins / 2 > BUSY_MIN_SPINS ? spins / 2 : BUSY_MIN_SPINS;
+}
+
+//Keeps the count of dropped datagrams that came with a received message at "dropped", if there was one
+void readDrops(struct msghdr* message, long* dropped) {
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(message); cmsg != NULL; cmsg = CMSG_NXTHDR(message, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL) continue;
+		uint32_t count;
+		memcpy(&count, CMSG_DATA(cmsg), sizeof(count));
+		*dropped = count;
+	}
+}
+
+//Reads a datagram just like recvfrom, also keeping the count of dropped datagrams that comes with it (see watchDrops)
+ssize_t receiveCounting(int sock, char* saveHere, size_t bytes, int flags, sockaddr_in* from, socklen_t* fromSize, long* dropped) {
+	char control[CMSG_SPACE(sizeof(uint32_t))];
+	struct iovec vector;
+	vector.iov_base = saveHere;
+	vector.iov_len = bytes;
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_name = from;
+	message.msg_namelen = *fromSize;
+	message.msg_iov = &vector;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	ssize_t send = recvmsg(sock, &message, flags);
+	if (send < 0) return send;
+	*fromSize = message.msg_namelen;
+	readDrops(&message, dropped);
+	return send;
+}
+
+
+//Base class for whatever actually carries datagrams between the two sides.
+//SocketReadWriter only ever talks to one of these, so the protocols run the same over any of them.
+class Transport {
+	public:
+		//Obtains a single datagram. Any bytes past "bytes" are discarded.
+		//Returns the number of bytes saved, or -1 if a timeout happened instead.
+		virtual ssize_t receive(char* saveHere, size_t bytes) = 0;
+
+		//Sends a single datagram right away.
+		//Returns the number of bytes sent, or -1 if something blocked it.
+		virtual ssize_t send(char* data, size_t bytes) = 0;
+
+		//Queues a datagram to be sent on the next flush. Transports that can't batch just send it.
+		//Returns true if successful, false if not.
+		virtual bool queue(char* data, size_t bytes) {
+			return send(data, bytes) != -1;
+		}
+
+		//Sends everything queued so far. Returns true if successful, false if not.
+		virtual bool flush() {
+			return true;
+		}
+
+		//Configures how long receive waits, given a time in full seconds plus additional microseconds.
+		//A time of 0 means wait forever. Returns true if successful, false if not.
+		virtual bool setTimeout(int fullSeconds, int plusMicroSeconds) = 0;
+
+		//Turns on any batching/offload the transport supports. Returns true if anything was turned on.
+		virtual bool setOffload(bool enable) {
+			return false;
+		}
+
+		//Changes the port that the other side of the connection is expected on, for transports that have ports.
+		virtual void setOtherSidePort(int port) {}
+
+		//Says whether the other side's acks each cover every packet before them too (go-back-N's do), for transports
+		//that merge the acks of several receivers into one (see Multicast.cpp)
+		virtual void setCumulativeAcks(bool cumulative) {}
+
+		//Returns the longest datagram that gets to the other side whole, as far as the transport knows (for UDP, what the
+		//kernel knows of the path), or MAX_DATAGRAM if it has no idea
+		virtual int pathLimit() {
+			return MAX_DATAGRAM;
+		}
+
+		//Turns probing on or off. While it's on, every datagram goes whole or not at all, whatever the transport knows of
+		//the path, so a probe too long for the path is lost rather than cut into fragments. Once it's off, datagrams that
+		//fit what's known go whole again, so the path shrinking shows up in sizeError.
+		//Returns false if the transport can't keep datagrams whole, in which case probing tells nothing.
+		virtual bool setProbing(bool enable) {
+			return false;
+		}
+
+		//Returns the longest datagram the path said it takes, in a size error it sent back since this was last called
+		//(for UDP, an ICMP "fragmentation needed"), or 0 if none came
+		virtual int sizeError() {
+			return 0;
+		}
+
+		//Asks for buffers that hold "bytes" of datagrams each way, for transports that have them (buffers already that
+		//big are left alone), and says how big they are now at "receiving" and "sending".
+		//Returns false if the transport has no buffers to size.
+		virtual bool setBuffers(int bytes, int* receiving, int* sending) {
+			return false;
+		}
+
+		//Turns busy polling on or off. While it's on, receive never sleeps in the kernel waiting for a datagram, which takes
+		//a while to wake up from, but keeps trying without blocking (see BUSY_MIN_SPINS), so it answers sooner at the cost
+		//of the CPU time spent spinning. Returns what was turned on (BUSY_...), 0 if the transport can't.
+		virtual int setBusyPoll(bool enable) {
+			return 0;
+		}
+
+		//Returns how many datagrams have reached this side since the transport was made, only to be dropped because its
+		//receive buffer was full, as far as it knows (0 if it can't tell). The protocols can only take those for loss.
+		virtual long bufferDrops() {
+			return 0;
+		}
+
+		//Returns the current time in seconds, by whatever clock this transport's timeouts run on
+		virtual double now() {
+			struct timespec time;
+			clock_gettime(CLOCK_MONOTONIC, &time);
+			return time.tv_sec + time.tv_nsec / 1e9;
+		}
+
+		virtual ~Transport() {}
+};
+
+
+//Transport over a datagram socket. This is the one used for any normal transfer.
+class UdpTransport : public Transport {
+	private:
+		//The socket file descriptor
+		int sockfd;
+
+		//The details of the other side of the connection, as well as how large the  is.
+		sockaddr_in *destination, *home;
+		socklen_t destSize, homeSize;
+
+		//Segmentation offload state. When offload is on, queue holds packets instead of sending them,
+		//and consecutive packets of the same size go out as one super-buffer with UDP_SEGMENT set.
+		//gsoWorks/groWorks record whether the kernel actually accepted each half of the offload.
+		bool offload, gsoWorks, groWorks;
+
+		//The queue of packets waiting for flush, laid out back to back.
+		//queueLengths holds the length of every packet in the queue, in order.
+		char* sendQueue;
+		int* queueLengths;
+		int queueCount, queueBytes;
+
+		//Received super-buffers are kept here and handed out one segment at a time.
+		//pendingSegment is the size of each segment, pendingAt/pendingEnd mark what hasn't been handed out yet of the one
+		//in pendingBuffer, which is groBuffer or one of the busy batch.
+		char *groBuffer, *pendingBuffer;
+		int pendingSegment, pendingAt, pendingEnd;
+
+		//Busy polling (see setBusyPoll): whether it's on, the datagrams the last read brought in (BUSY_BATCH slots of
+		//GRO_BUFFER_SIZE, with their headers), how many there were and which is next, how long receive waits (0 for
+		//forever), and how many tries it spins for
+		bool busy;
+		char* batchBuffer;
+		struct mmsghdr batch[BUSY_BATCH];
+		struct iovec batchVectors[BUSY_BATCH];
+		sockaddr_in batchFrom[BUSY_BATCH];
+		char batchControl[BUSY_BATCH][CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t))];
+		int batchCount, batchNext, spins;
+		double waitSeconds;
+
+		//Set once setProbing has asked for the errors the path sends back (IP_RECVERR), and the longest datagram the
+		//shortest of the size errors among them allowed, since sizeError was last called (0 for none)
+		bool watchingErrors;
+		int sizeLimit;
+
+		//How many datagrams the kernel has said it dropped from the full receive buffer (see watchDrops)
+		long dropped;
+
+		//Reads every error waiting on the socket's error queue, keeping what any size error says the path takes.
+		//Returns true if there were any, in which case a receive or send that failed did so because of them.
+		bool readErrors() {
+			bool send = false;
+			char data[1], control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(sockaddr_in))];
+			while (true) {
+				struct iovec vector;
+				vector.iov_base = data;
+				vector.iov_len = sizeof(data);
+
+				struct msghdr message;
+				memset(&message, 0, sizeof(message));
+				message.msg_iov = &vector;
+				message.msg_iovlen = 1;
+				message.msg_control = control;
+				message.msg_controllen = sizeof(control);
+				if (recvmsg(sockfd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return send;
+				send = true;
+
+				for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+					if (cmsg->cmsg_level != IPPROTO_IP || cmsg->cmsg_type != IP_RECVERR) continue;
+					struct sock_extended_err error;
+					memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+					//The MTU the path allows comes with the error, counting the headers
+					int limit = (int) error.ee_info - UDP_IP_HEADERS;
+					if (error.ee_errno == EMSGSIZE && limit > 0 && (sizeLimit == 0 || limit < sizeLimit)) sizeLimit = limit;
+				}
+			}
+		}
+
+		//Hands out the next segment of the last coalesced receive
+		ssize_t popSegment(char* saveHere, size_t bytes) {
+			int length = pendingEnd - pendingAt < pendingSegment ? pendingEnd - pendingAt : pendingSegment;
+			size_t copied = (size_t) length < bytes ? length : bytes;
+			memcpy(saveHere, pendingBuffer + pendingAt, copied);
+			pendingAt += length;
+			return copied;
+		}
+
+		//Starts handing out the given datagram of the busy batch, which with GRO on can be several glued together
+		ssize_t startBatched(int index, char* saveHere, size_t bytes) {
+			struct msghdr* message = &batch[index].msg_hdr;
+			int received = batch[index].msg_len, segment = received;
+			for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(message); cmsg != NULL; cmsg = CMSG_NXTHDR(message, cmsg)) {
+				if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+			}
+			readDrops(message, &dropped);
+			memcpy(destination, batchFrom + index, sizeof(*destination));
+			destSize = message->msg_namelen;
+
+			pendingBuffer = batchBuffer + (size_t) index * GRO_BUFFER_SIZE;
+			pendingSegment = segment < 1 ? received : segment;
+			pendingAt = 0;
+			pendingEnd = received;
+			return popSegment(saveHere, bytes);
+		}
+
+		//Receives with busy polling: hands out the rest of the last batch, or reads as many datagrams as have come in
+		//without blocking, trying again (see busyBackoff) until something has or the timeout is up
+		ssize_t receiveBusy(char* saveHere, size_t bytes) {
+			if (batchNext < batchCount) {
+				batchNext++;
+				return startBatched(batchNext - 1, saveHere, bytes);
+			}
+
+			double deadline = waitSeconds > 0 ? now() + waitSeconds : 0;
+			for (int tries = 0;; tries++) {
+				for (int i = 0; i < BUSY_BATCH; i++) {
+					batch[i].msg_hdr.msg_namelen = sizeof(batchFrom[i]);
+					batch[i].msg_hdr.msg_controllen = sizeof(batchControl[i]);
+				}
+				int got = recvmmsg(sockfd, batch, BUSY_BATCH, MSG_DONTWAIT, NULL);
+				if (got > 0) {
+					spins = busyAdapt(spins, tries);
+					batchCount = got;
+					batchNext = 1;
+					return startBatched(0, saveHere, bytes);
+				}
+				//An error from the path fails it too, which isn't a timeout (see receive)
+				if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && !(watchingErrors && readErrors())) return -1;
+				if (deadline > 0 && now() > deadline) {
+					errno = EAGAIN;
+					return -1;
+				}
+				busyBackoff(tries, spins);
+			}
+		}
+
+		//Sends the given bytes of the queue as one super-buffer.
+		//Every packet but the last must be "segment" bytes long, which is what the kernel expects.
+		//Returns true if the kernel took it, false if it refused the segmentation.
+		bool sendSegmented(int offset, int bytes, int segment) {
+			char control[CMSG_SPACE(sizeof(uint16_t))];
+			memset(control, 0, sizeof(control));
+			struct iovec vector;
+			vector.iov_base = sendQueue + offset;
+			vector.iov_len = bytes;
+
+			struct msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = destination;
+			message.msg_namelen = destSize;
+			message.msg_iov = &vector;
+			message.msg_iovlen = 1;
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+
+			struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t size = segment;
+			memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+
+			return sendmsg(sockfd, &message, 0) == bytes;
+		}
+
+		//Sends "count" queued packets starting at the given index one datagram apiece, batched into as few
+		//system calls as sendmmsg allows. Used when segmentation isn't available or isn't worth it.
+		bool sendBatched(int first, int count, int offset) {
+			struct mmsghdr messages[count];
+			struct iovec vectors[count];
+			memset(messages, 0, sizeof(messages));
+
+			for (int i = 0; i < count; i++) {
+				vectors[i].iov_base = sendQueue + offset;
+				vectors[i].iov_len = queueLengths[first + i];
+				offset += queueLengths[first + i];
+
+				messages[i].msg_hdr.msg_name = destination;
+				messages[i].msg_hdr.msg_namelen = destSize;
+				messages[i].msg_hdr.msg_iov = vectors + i;
+				messages[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			for (int sent = 0; sent < count;) {
+				int sentThisTime = sendmmsg(sockfd, messages + sent, count - sent, 0);
+				if (sentThisTime < 1 && watchingErrors && readErrors()) continue;
+				if (sentThisTime < 1) return false;
+				sent += sentThisTime;
+			}
+			return true;
+		}
+
+		//Constructor. This should only be invoked via the static method getInstance, seen at the bottom of the class.
+		UdpTransport(int sock, sockaddr_in* connectionInfo, sockaddr_in* localInfo) {
+			//Save the socket filedescriptor
+			sockfd = sock;
+
+			//Get address info and size of the destination
+			destination = connectionInfo;
+			destSize = sizeof(*destination);
+
+			//Also save the local information, in case it's necessary to keep in memory.
+			home = localInfo;
+			homeSize = sizeof(*home);
+
+			//Offload starts off, and nothing is allocated for it until it's asked for.
+			offload = gsoWorks = groWorks = false;
+			sendQueue = groBuffer = pendingBuffer = NULL;
+			queueLengths = NULL;
+			queueCount = queueBytes = 0;
+			pendingSegment = pendingAt = pendingEnd = 0;
+
+			//So does busy polling
+			busy = false;
+			batchBuffer = NULL;
+			batchCount = batchNext = 0;
+			spins = BUSY_MIN_SPINS;
+			waitSeconds = 0;
+			watchingErrors = false;
+			sizeLimit = 0;
+			dropped = 0;
+		}
+
+	public:
+		//Obtains a single datagram, either the next segment of a coalesced receive or a fresh one from the socket.
+		ssize_t receive(char* saveHere, size_t bytes) {
+			//Anything still queued has to be on the wire before we wait on the other side.
+			if (queueCount > 0) flush();
+
+			//If a previous receive was coalesced, finish handing out its segments first.
+			if (pendingAt < pendingEnd) {
+				return popSegment(saveHere, bytes);
+			}
+			if (busy) return receiveBusy(saveHere, bytes);
+
+			//Once errors from the path are kept, one coming in fails the receive too. That isn't a timeout, so it waits on.
+			if (!groWorks) {
+				ssize_t received = receiveCounting(sockfd, saveHere, bytes, 0, destination, &destSize, &dropped);
+				while (received == -1 && watchingErrors && readErrors()) received = receiveCounting(sockfd, saveHere, bytes, 0, destination, &destSize, &dropped);
+				return received;
+			}
+
+			//With GRO on, one receive can be several datagrams glued together, so read into the big buffer
+			//and check the control message for the size of each segment.
+			char control[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t))];
+			struct iovec vector;
+			vector.iov_base = groBuffer;
+			vector.iov_len = GRO_BUFFER_SIZE;
+
+			struct msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = destination;
+			message.msg_namelen = destSize;
+			message.msg_iov = &vector;
+			message.msg_iovlen = 1;
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+
+			ssize_t received = recvmsg(sockfd, &message, 0);
+			while (received == -1 && watchingErrors && readErrors()) received = recvmsg(sockfd, &message, 0);
+			if (received == -1) return -1;
+			destSize = message.msg_namelen;
+			readDrops(&message, &dropped);
+			pendingBuffer = groBuffer;
+
+			//If no segment size came with it, this is a lone datagram
+			int segment = received;
+			for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+				if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+					memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+				}
+			}
+
+			pendingSegment = segment < 1 ? received : segment;
+			pendingAt = 0;
+			pendingEnd = received;
+			return popSegment(saveHere, bytes);
+		}
+
+		ssize_t send(char* data, size_t bytes) {
+			//Keep everything in order, queued packets go before this data.
+			if (queueCount > 0) flush();
+			ssize_t sent = sendto(sockfd, data, bytes, 0, (sockaddr*) destination, destSize);
+			//An error from the path can fail a send too, and the datagram is worth another try once it's read
+			if (sent == -1 && watchingErrors && readErrors()) sent = sendto(sockfd, data, bytes, 0, (sockaddr*) destination, destSize);
+			return sent;
+		}
+
+		//If offload is on, the packet is only queued, and goes out on the next flush (or any other send/receive).
+		bool queue(char* data, size_t bytes) {
+			if (!offload || bytes > MAX_DATAGRAM) return send(data, bytes) != -1;
+
+			//Make room if this packet won't fit in the current super-buffer
+			if (queueCount == MAX_SEGMENTS || queueBytes + bytes > MAX_DATAGRAM) {
+				if (!flush()) return false;
+			}
+
+			memcpy(sendQueue + queueBytes, data, bytes);
+			queueLengths[queueCount++] = bytes;
+			queueBytes += bytes;
+			return true;
+		}
+
+		//Sends every queued packet. Runs of consecutive packets of the same size (plus a shorter one at the end)
+		//are sent as one segmented super-buffer. If the kernel refuses, segmentation is turned off for good
+		//and the packets are sent individually instead.
+		bool flush() {
+			bool send = true;
+
+			for (int first = 0, offset = 0; first < queueCount;) {
+				//Find the end of this run of same-sized packets
+				int segment = queueLengths[first], last = first + 1, bytes = segment;
+				while (last < queueCount && queueLengths[last] == segment) bytes += queueLengths[last++];
+				if (last < queueCount && queueLengths[last] < segment) bytes += queueLengths[last++];
+
+				bool sent = false;
+				if (gsoWorks && last - first > 1) {
+					sent = sendSegmented(offset, bytes, segment);
+					//These mean the kernel (or the device under it) can't segment, not that the send failed.
+					if (!sent && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+						gsoWorks = false;
+					}
+				}
+				if (!sent) sent = sendBatched(first, last - first, offset);
+
+				send = send && sent;
+				offset += bytes;
+				first = last;
+			}
+
+			queueCount = queueBytes = 0;
+			return send;
+		}
+
+		bool setTimeout(int fullSeconds, int plusMicroSeconds) {
+			struct timeval time;
+			time.tv_sec = fullSeconds;
+			time.tv_usec = plusMicroSeconds;
+			waitSeconds = fullSeconds + plusMicroSeconds / 1e6;
+			return setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO,&time,sizeof(time)) >= 0;
+		}
+
+		//Reads up to BUSY_BATCH datagrams at once with recvmmsg, and asks the kernel to poll the device as well
+		//(SO_BUSY_POLL), which it only lets a process with CAP_NET_ADMIN ask for beyond net.core.busy_read.
+		//Anything already read is still handed out once it's turned off.
+		int setBusyPoll(bool enable) {
+			int micro = enable ? BUSY_POLL_MICROSECONDS : 0;
+			bool kernel = setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &micro, sizeof(micro)) == 0;
+			busy = enable;
+			if (!enable) return 0;
+
+			if (batchBuffer == NULL) {
+				batchBuffer = new char[(size_t) BUSY_BATCH * GRO_BUFFER_SIZE];
+				memset(batch, 0, sizeof(batch));
+				for (int i = 0; i < BUSY_BATCH; i++) {
+					batchVectors[i].iov_base = batchBuffer + (size_t) i * GRO_BUFFER_SIZE;
+					batchVectors[i].iov_len = GRO_BUFFER_SIZE;
+					batch[i].msg_hdr.msg_name = batchFrom + i;
+					batch[i].msg_hdr.msg_iov = batchVectors + i;
+					batch[i].msg_hdr.msg_iovlen = 1;
+					batch[i].msg_hdr.msg_control = batchControl[i];
+				}
+			}
+			//The timeout set when the socket was made is only on the socket
+			struct timeval time;
+			socklen_t length = sizeof(time);
+			if (getsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &time, &length) == 0) waitSeconds = time.tv_sec + time.tv_usec / 1e6;
+			return BUSY_SPINNING | (kernel ? BUSY_KERNEL : 0);
+		}
+
+		//Turns segmentation offload (UDP_SEGMENT on send, UDP_GRO on receive) on or off.
+		//The kernel is asked for each half separately, and anything it refuses simply stays off,
+		//in which case queued packets are still batched with sendmmsg.
+		bool setOffload(bool enable) {
+			int flag = enable ? 1 : 0, zero = 0;
+
+			if (!enable) {
+				if (queueCount > 0) flush();
+				if (groWorks) setsockopt(sockfd, SOL_UDP, UDP_GRO, &flag, sizeof(flag));
+				offload = gsoWorks = groWorks = false;
+				return false;
+			}
+
+			if (sendQueue == NULL) {
+				sendQueue = new char[MAX_DATAGRAM];
+				queueLengths = new int[MAX_SEGMENTS];
+			}
+			if (groBuffer == NULL) groBuffer = new char[GRO_BUFFER_SIZE];
+
+			//A segment size of 0 on the socket means "only when a message asks for it", so this just checks support
+			gsoWorks = setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+			groWorks = setsockopt(sockfd, SOL_UDP, UDP_GRO, &flag, sizeof(flag)) == 0;
+			offload = true;
+
+			return gsoWorks || groWorks;
+		}
+
+		//You should generally ONLY use this if you're doing a LOCALHOST run.
+		void setOtherSidePort(int port) {
+			destination->sin_port = htons(port);
+		}
+
+		int pathLimit() {
+			return routeLimit(destination, NULL);
+		}
+
+		//Probing sets don't fragment on everything and ignores the path MTU the kernel knows (IP_PMTUDISC_PROBE).
+		//Once it's done, the kernel sets don't fragment on whatever fits the path MTU it knows and cuts up anything longer
+		//(IP_PMTUDISC_WANT), so packets loaded before the path shrank still get there. The errors the path sends back
+		//are kept from the first call on.
+		bool setProbing(bool enable) {
+			int on = 1, discovery = enable ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+			if (!watchingErrors) watchingErrors = setsockopt(sockfd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on)) == 0;
+			return watchingErrors && setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &discovery, sizeof(discovery)) == 0;
+		}
+
+		int sizeError() {
+			if (watchingErrors) readErrors();
+			int send = sizeLimit;
+			sizeLimit = 0;
+			return send;
+		}
+
+		bool setBuffers(int bytes, int* receiving, int* sending) {
+			*receiving = growBuffer(sockfd, SO_RCVBUF, bytes);
+			*sending = growBuffer(sockfd, SO_SNDBUF, bytes);
+			return true;
+		}
+
+		long bufferDrops() {
+			return dropped;
+		}
+
+		//Destructor. Closes the socket it contained and frees any dynamically allocated data.
+		~UdpTransport() {
+			if (queueCount > 0) flush();
+			close(sockfd);
+			if (sendQueue != NULL) delete[] sendQueue;
+			if (queueLengths != NULL) delete[] queueLengths;
+			if (groBuffer != NULL) delete[] groBuffer;
+			if (batchBuffer != NULL) delete[] batchBuffer;
+			delete destination;
+			delete home;
+		}
+
+		//Given an ip address and a port, this function creates a bound datagram socket and wraps it.
+		//Returns the address of the object if successful, or NULL if not.
+		static UdpTransport* getInstance(string* ip, int port, int timeoutSeconds, int timeoutMicroSeconds) {
+				//If the user said to do localhost, just do that.
+				bool local = ip->compare("localhost") == 0;
+
+				//The connectionInfo will be the info used to send data. localInfo will be used for socket binding.
+				sockaddr_in *connectionInfo = new sockaddr_in(), *localInfo = new sockaddr_in();
+				connectionInfo->sin_family = localInfo->sin_family = AF_INET;
+
+				//Parse the ip of the other side from that string (or just do localhost), returning null if it fails
+				if ((connectionInfo->sin_addr.s_addr = local ? htonl(INADDR_ANY) : inet_addr(ip->c_str())) < 0) {
+					delete connectionInfo;
+					delete localInfo;
+					return NULL;
+				}
+
+				//The local info will set up itself, no input from the user.
+				//First, get the name of the host
+				char host[256];
+				int hostname = gethostname(host, sizeof(host));
+
+				//Then, get the information of said host as something we can use.
+				struct hostent* host_entry = hostname == 0 ? gethostbyname(host) : NULL;
+
+				//Without either, there's no ip address to bind to
+				if (host_entry == NULL) {
+					delete connectionInfo;
+					delete localInfo;
+					return NULL;
+				}
+
+				//And then, get the ip address as a string
+				char* myIp = inet_ntoa(*((struct in_addr*) host_entry->h_addr_list[0]));
+
+
+				//And then turn that string into the value we need to work (unless we're doing localhost anyway)
+				localInfo->sin_addr.s_addr = local ? htonl(INADDR_ANY) : inet_addr(myIp);
+
+				//Now the ip address is set for socket binding later
+
+
+				//Now, add the port for both the destination and the local structs
+				connectionInfo->sin_port = localInfo->sin_port = htons(port);
+
+				//Try to make a socket. If it fails, stop
+				int sock = socket(AF_INET, SOCK_DGRAM, 0);
+				if (sock < 0) {
+					delete connectionInfo;
+					delete localInfo;
+					return NULL;
+				}
+
+
+				//If the user specified a timeout interval, attempt to set it up. If it fails, stop.
+				if (timeoutSeconds > 0 || timeoutMicroSeconds > 0) {
+					struct timeval time;
+					time.tv_sec = timeoutSeconds;
+					time.tv_usec = timeoutMicroSeconds;
+					if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,&time,sizeof(time)) < 0) {
+   						close(sock);
+						delete connectionInfo;
+						delete localInfo;
+						return NULL;
+					}
+				}
+
+
+				//Bind the socket with our local info. If that fails, stop
+				if (bind(sock,(const sockaddr*) localInfo, sizeof(*localInfo)) < 0) {
+					close(sock);
+					delete connectionInfo;
+					delete localInfo;
+					return NULL;
+				}
+
+				//Datagrams the kernel drops from a full receive buffer look just like loss, so have it count them.
+				//An older kernel without the count still works, it just can't tell.
+				watchDrops(sock);
+
+				//If everything worked, return a new instance of the transport
+				return new UdpTransport(sock, connectionInfo, localInfo);
+		}
+};
+
+
+//How many bytes each direction of a shared memory connection can have in flight
+#define SHM_RING_BYTES (8 << 20)
+//How long a sender waits for room in a full ring before dropping the datagram, like a full socket buffer would
+#define SHM_FULL_WAIT_MICROSECONDS 200000
+//Marks the rest of the ring as unused, so the next record starts back at the beginning
+#define SHM_WRAP 0xFFFFFFFFu
+
+//One direction of a shared memory connection. Only one side ever writes to it and only the other reads.
+//Records are a 4-byte length followed by the datagram, each padded out to 8 bytes.
+typedef struct ShmRing {
+	//Total bytes ever written (head) and ever read (tail). Their difference is what's in the ring.
+	std::atomic<uint64_t> head, tail;
+	//Futex words. "posted" is bumped whenever a record is added, "freed" whenever one is taken out.
+	//The waiting flags let each side skip the wake-up call when nobody is asleep.
+	std::atomic<uint32_t> posted, freed, readerWaiting, writerWaiting;
+	//Datagrams the writer dropped because the ring was full
+	std::atomic<uint32_t> dropped;
+	char data[SHM_RING_BYTES];
+} ShmRing;
+
+//Waits on a shared futex word as long as it still holds "expected", for at most the given time (NULL for forever)
+static void futexWait(std::atomic<uint32_t>* word, uint32_t expected, struct timespec* time) {
+	syscall(SYS_futex, (uint32_t*) word, FUTEX_WAIT, expected, time, NULL, 0);
+}
+
+//Wakes everything waiting on a shared futex word
+static void futexWake(std::atomic<uint32_t>* word) {
+	syscall(SYS_futex, (uint32_t*) word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+
+//Transport over a pair of ring buffers in shared memory, for two processes on the same machine.
+//The memory is a memfd made by the side that's started first (the server), and handed to the other side
+//over a local unix socket named after the port, so both sides are set up with the same port number as UDP.
+class ShmTransport : public Transport {
+	private:
+		//The whole mapping, and the two rings inside it
+		void* region;
+		ShmRing *incoming, *outgoing;
+
+		//How long receive waits. Zero means forever, just like SO_RCVTIMEO.
+		struct timespec timeout;
+
+		//Whether receive busy polls the ring before sleeping on it (see setBusyPoll), and how many tries it spins for
+		bool busy;
+		int spins;
+
+		//Constructor. This should only be invoked via the static methods at the bottom of the class.
+		ShmTransport(void* mapped, bool creator) {
+			region = mapped;
+			ShmRing* rings = (ShmRing*) mapped;
+			//The creator writes to the first ring and reads the second, the other side does the opposite.
+			outgoing = rings + (creator ? 0 : 1);
+			incoming = rings + (creator ? 1 : 0);
+			timeout.tv_sec = timeout.tv_nsec = 0;
+			busy = false;
+			spins = BUSY_MIN_SPINS;
+		}
+
+		//Gives the name of the unix socket used to hand over the memfd for a given port.
+		//The leading 0 puts it in the abstract namespace, so nothing is left on disk.
+		static socklen_t rendezvousName(int port, sockaddr_un* address) {
+			memset(address, 0, sizeof(*address));
+			address->sun_family = AF_UNIX;
+			int length = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "GBN_SR.%d", port);
+			return offsetof(sockaddr_un, sun_path) + 1 + length;
+		}
+
+		//Rounds a record up to where the next one starts
+		static uint64_t recordSpace(size_t bytes) {
+			return (sizeof(uint32_t) + bytes + 7) & ~((uint64_t) 7);
+		}
+
+	public:
+		ssize_t receive(char* saveHere, size_t bytes) {
+			ShmRing* ring = incoming;
+
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += timeout.tv_sec;
+			deadline.tv_nsec += timeout.tv_nsec;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+
+			uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+			//Busy polling watches the ring for a while before sleeping on it
+			if (busy) {
+				int tries = 0;
+				while (ring->head.load(std::memory_order_acquire) == tail && tries < spins) busyBackoff(tries++, spins);
+				spins = busyAdapt(spins, tries);
+			}
+			//Until something shows up, sleep on the posted counter
+			while (ring->head.load(std::memory_order_acquire) == tail) {
+				ring->readerWaiting.store(1);
+				uint32_t posted = ring->posted.load();
+				if (ring->head.load() != tail) break;
+
+				if (timeout.tv_sec == 0 && timeout.tv_nsec == 0) {
+					futexWait(&ring->posted, posted, NULL);
+				}
+				else {
+					struct timespec now, left;
+					clock_gettime(CLOCK_MONOTONIC, &now);
+					left.tv_sec = deadline.tv_sec - now.tv_sec;
+					left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+					if (left.tv_nsec < 0) {
+						left.tv_sec--;
+						left.tv_nsec += 1000000000;
+					}
+					if (left.tv_sec < 0) {
+						ring->readerWaiting.store(0);
+						return -1;
+					}
+					futexWait(&ring->posted, posted, &left);
+				}
+			}
+			ring->readerWaiting.store(0);
+
+			//Skip over the wasted space at the end of the ring if the record was wrapped around
+			uint32_t length;
+			memcpy(&length, ring->data + tail % SHM_RING_BYTES, sizeof(length));
+			if (length == SHM_WRAP) {
+				tail += SHM_RING_BYTES - tail % SHM_RING_BYTES;
+				memcpy(&length, ring->data, sizeof(length));
+			}
+
+			size_t copied = length < bytes ? length : bytes;
+			memcpy(saveHere, ring->data + tail % SHM_RING_BYTES + sizeof(length), copied);
+
+			ring->tail.store(tail + recordSpace(length), std::memory_order_release);
+			ring->freed.fetch_add(1);
+			if (ring->writerWaiting.load()) futexWake(&ring->freed);
+
+			return copied;
+		}
+
+		ssize_t send(char* data, size_t bytes) {
+			ShmRing* ring = outgoing;
+			if (bytes > MAX_DATAGRAM) return -1;
+
+			uint64_t head = ring->head.load(std::memory_order_relaxed);
+			uint64_t space = recordSpace(bytes), untilEnd = SHM_RING_BYTES - head % SHM_RING_BYTES;
+			//A record never straddles the end of the ring, so it might cost the rest of the ring as well
+			uint64_t needed = space > untilEnd ? untilEnd + space : space;
+
+			//If there's no room, give the reader a moment to catch up, then drop it like a full socket would
+			bool waited = false;
+			while (head + needed - ring->tail.load(std::memory_order_acquire) > SHM_RING_BYTES) {
+				if (waited) {
+					ring->writerWaiting.store(0);
+					ring->dropped.fetch_add(1);
+					return bytes;
+				}
+				ring->writerWaiting.store(1);
+				uint32_t freed = ring->freed.load();
+				if (head + needed - ring->tail.load() <= SHM_RING_BYTES) break;
+				struct timespec wait = {0, SHM_FULL_WAIT_MICROSECONDS * 1000};
+				futexWait(&ring->freed, freed, &wait);
+				waited = true;
+			}
+			ring->writerWaiting.store(0);
+
+			if (space > untilEnd) {
+				uint32_t wrap = SHM_WRAP;
+				memcpy(ring->data + head % SHM_RING_BYTES, &wrap, sizeof(wrap));
+				head += untilEnd;
+			}
+
+			uint32_t length = bytes;
+			memcpy(ring->data + head % SHM_RING_BYTES, &length, sizeof(length));
+			memcpy(ring->data + head % SHM_RING_BYTES + sizeof(length), data, bytes);
+
+			ring->head.store(head + space, std::memory_order_release);
+			ring->posted.fetch_add(1);
+			if (ring->readerWaiting.load()) futexWake(&ring->posted);
+
+			return bytes;
+		}
+
+		bool setTimeout(int fullSeconds, int plusMicroSeconds) {
+			if (fullSeconds < 0 || plusMicroSeconds < 0) return false;
+			timeout.tv_sec = fullSeconds + plusMicroSeconds / 1000000;
+			timeout.tv_nsec = (plusMicroSeconds % 1000000) * 1000L;
+			return true;
+		}
+
+		//Waking up from the futex is what busy polling saves here. There's no device for the kernel to poll.
+		int setBusyPoll(bool enable) {
+			busy = enable;
+			return enable ? BUSY_SPINNING : 0;
+		}
+
+		//The ring is this side's receive buffer, and the other side counts what it couldn't fit in it
+		long bufferDrops() {
+			return incoming->dropped.load();
+		}
+
+		//Destructor. Unmaps the shared memory. The memfd itself goes away once both sides are done with it.
+		~ShmTransport() {
+			munmap(region, 2 * sizeof(ShmRing));
+		}
+
+
+		//Makes the shared memory and waits for the other side to come pick it up.
+		//Returns the address of the object if successful, or NULL if not.
+		static ShmTransport* create(int port) {
+			int memory = memfd_create("GBN_SR", 0);
+			if (memory < 0) return NULL;
+
+			void* mapped = ftruncate(memory, 2 * sizeof(ShmRing)) < 0 ? MAP_FAILED : mmap(NULL, 2 * sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+			if (mapped == MAP_FAILED) {
+				close(memory);
+				return NULL;
+			}
+			//A fresh memfd is all zeroes, which is already an empty pair of rings.
+
+			//Wait for the other side on the rendezvous socket, then pass it the memfd
+			sockaddr_un address;
+			socklen_t addressSize = rendezvousName(port, &address);
+			int listener = socket(AF_UNIX, SOCK_STREAM, 0), other = -1;
+			if (listener >= 0 && bind(listener, (sockaddr*) &address, addressSize) == 0 && listen(listener, 1) == 0) {
+				other = accept(listener, NULL, NULL);
+			}
+
+			bool handedOver = false;
+			if (other >= 0) {
+				char control[CMSG_SPACE(sizeof(int))], tag = 'M';
+				memset(control, 0, sizeof(control));
+				struct iovec vector;
+				vector.iov_base = &tag;
+				vector.iov_len = 1;
+
+				struct msghdr message;
+				memset(&message, 0, sizeof(message));
+				message.msg_iov = &vector;
+				message.msg_iovlen = 1;
+				message.msg_control = control;
+				message.msg_controllen = sizeof(control);
+
+				struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+				cmsg->cmsg_level = SOL_SOCKET;
+				cmsg->cmsg_type = SCM_RIGHTS;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+				memcpy(CMSG_DATA(cmsg), &memory, sizeof(memory));
+
+				handedOver = sendmsg(other, &message, 0) == 1;
+				close(other);
+			}
+			if (listener >= 0) close(listener);
+			close(memory);
+
+			if (!handedOver) {
+				munmap(mapped, 2 * sizeof(ShmRing));
+				return NULL;
+			}
+			return new ShmTransport(mapped, true);
+		}
+
+		//Picks up the shared memory made by the other side for the given port.
+		//Returns the address of the object if successful, or NULL if not.
+		static ShmTransport* join(int port) {
+			sockaddr_un address;
+			socklen_t addressSize = rendezvousName(port, &address);
+			int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (sock < 0) return NULL;
+			if (connect(sock, (sockaddr*) &address, addressSize) < 0) {
+				close(sock);
+				return NULL;
+			}
+
+			char control[CMSG_SPACE(sizeof(int))], tag;
+			struct iovec vector;
+			vector.iov_base = &tag;
+			vector.iov_len = 1;
+
+			struct msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_iov = &vector;
+			message.msg_iovlen = 1;
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+
+			int memory = -1;
+			if (recvmsg(sock, &message, 0) == 1) {
+				struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+				if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+					memcpy(&memory, CMSG_DATA(cmsg), sizeof(memory));
+				}
+			}
+			close(sock);
+			if (memory < 0) return NULL;
+
+			void* mapped = mmap(NULL, 2 * sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+			close(memory);
+			if (mapped == MAP_FAILED) return NULL;
+
+			return new ShmTransport(mapped, false);
+		}
+};
@@ -0,0 +1,153 @@
+//The ids of the sliding window, for both protocols on both sides.
+//Ids wrap round at the sequence range, and how that's worked out is an "id space". The protocol functions are templates
+//over the id space, and runWithIds picks one for the sequence range once, when a transfer starts, so nothing on the packet
+//path decides anything about the range, or divides by it:
+//	MaskedIds<RANGE>  a power of two fixed when compiling, so wrapping round is a mask by a constant
+//	RangeIds          any range, with 64 bit arithmetic so it's right all the way up to the largest int (see wireIdAdvance)
+//Every id space has:
+//	int range()                           the sequence range
+//	int next(int id)                      the id after "id"
+//	int advance(int id, long long count)  the id "count" on from "id" (or back from it, if "count" is negative)
+//	int distance(int from, int to)        how far forward round the range "to" is from "from", from 0 to range() - 1
+
+
+//Ids in a sequence range that's a power of two, fixed when compiling
+template <int RANGE> class MaskedIds {
+	static_assert(RANGE > 1 && (RANGE & (RANGE - 1)) == 0, "A masked sequence range has to be a power of two");
+	static const int MASK = RANGE - 1;
+
+	public:
+		int range() {
+			return RANGE;
+		}
+
+		int next(int id) {
+			return (id + 1) & MASK;
+		}
+
+		int advance(int id, long long count) {
+			return (int) ((id + count) & MASK);
+		}
+
+		int distance(int from, int to) {
+			return (to - from) & MASK;
+		}
+};
+
+//Ids in any sequence range
+class RangeIds {
+	private:
+		int size;
+
+	public:
+		RangeIds(int sequenceRange) {
+			size = sequenceRange;
+		}
+
+		int range() {
+			return size;
+		}
+
+		int next(int id) {
+			return id + 1 == size ? 0 : id + 1;
+		}
+
+		int advance(int id, long long count) {
+			return wireIdAdvance(id, count, size);
+		}
+
+		int distance(int from, int to) {
+			return wireIdDistance(from, to, size);
+		}
+};
+
+//Runs "transfer" with the id space for the given sequence range, and returns what it does. "transfer" takes the id
+//space, whatever its type, so it's made once for each (for example "[&](auto ids) { return selectRepeatOver(..., ids, ...); }").
+//The ranges the drivers use by default (twice the window, for windows of 4 to 512) get masks, and anything else the 64 bit arithmetic.
+template <class Transfer> TransferMetrics* runWithIds(int sequenceRange, Transfer transfer) {
+	switch (sequenceRange) {
+		case 8: return transfer(MaskedIds<8>());
+		case 16: return transfer(MaskedIds<16>());
+		case 32: return transfer(MaskedIds<32>());
+		case 64: return transfer(MaskedIds<64>());
+		case 128: return transfer(MaskedIds<128>());
+		case 256: return transfer(MaskedIds<256>());
+		case 512: return transfer(MaskedIds<512>());
+		case 1024: return transfer(MaskedIds<1024>());
+		default: return transfer(RangeIds(sequenceRange));
+	}
+}
+
+
+//How every packet of a transfer is checked, settled on once the hello is in, so that nothing on the packet path asks:
+//	Check    the integrity algorithm (InetCheck or Crc32cCheck, see Wire.cpp)
+//	NUMBERS  whether packets carry their numbers (see Wire.cpp)
+template <class Check, bool NUMBERS> class PacketChecks {
+	public:
+		static const int INTEGRITY = Check::INTEGRITY;
+		static const int BYTES = Check::BYTES;
+		static const bool NUMBERED = NUMBERS;
+
+		//Returns the checksum of the given data
+		static uint32_t sum(char* data, int length) {
+			return Check::sum(data, length);
+		}
+
+		//Returns true if a packet with the given header can be the one the receiving side expects to be numbered "expected".
+		//It can't if it has a different number, which makes it a copy from another trip round the sequence range that happens
+		//to have the same id. Without numbers, a packet is always taken at its id.
+		static bool fits(Header* head, long long expected) {
+			return !NUMBERED || head->number == expected;
+		}
+};
+
+//Calls "then" with the checks for the given integrity algorithm and numbering, and returns what it does. Like runWithIds,
+//"then" takes them whatever their type, so it's made once for each (for example "[&](auto checks) { return ...; }").
+template <class Then> auto runWithChecks(int integrity, bool numbered, Then then) {
+	if (integrity == INTEGRITY_CRC32C) return numbered ? then(PacketChecks<Crc32cCheck, true>()) : then(PacketChecks<Crc32cCheck, false>());
+	return numbered ? then(PacketChecks<InetCheck, true>()) : then(PacketChecks<InetCheck, false>());
+}
+
+
+//Returns the slot of the window that holds the given id, or windowSize if none does (or it isn't an id at all).
+//The ids of a window always run on from the first slot's (see shiftWindow), so the slot is just how far past that the id is.
+template <class Ids> int windowSlot(Packet* window, int windowSize, int id, Ids ids) {
+	if (id < 0 || id >= ids.range()) return windowSize;
+	int send = ids.distance(window[0].id, id);
+	return send < windowSize ? send : windowSize;
+}
+
+//Rotates the packets of the window a given amount of times.
+//Then changes the ID numbers to match the new order
+template <class Ids> void shiftWindow(int shiftValue, int windowSize, Ids ids, Packet* packets) {
+	//No point in shifting if we're not actually supposed to do it.
+	if (shiftValue == 0) return;
+
+	//If not every packet was successful, rearrange the ones that were to the back.
+	//(Up until the first unsuccessful one is at the start of the array)
+	if (shiftValue != windowSize) {
+		//Rotate in one pass: set aside the packets that go to the back, move the rest up, then put them back in behind.
+		//This used to go one step at a time, which moved the whole window once for every packet shifted.
+		Packet moved[shiftValue];
+		int kept = windowSize - shiftValue;
+		memcpy(moved, packets, sizeof(Packet) * shiftValue);
+		memmove(packets, packets + shiftValue, sizeof(Packet) * kept);
+		memcpy(packets + kept, moved, sizeof(Packet) * shiftValue);
+
+		//Update the id numbers according to their new positions.
+		for (int i = 1; i < windowSize; i++) packets[i].id = ids.next(packets[i-1].id);
+	}
+	//If all of them were successful, we can just update the indicators instead of actually moving the packets
+	else {
+		for (int i = 0; i < windowSize; i++) {
+			packets[i].id = ids.advance(packets[i].id, windowSize);
+			packets[i].secured = packets[i].transmitted = false;
+			packets[i].checksum = -1;
+		}
+	}
+}
+
+//The same, for a sequence range only known when running
+void shiftWindow(int shiftValue, int windowSize, int sequenceRange, Packet* packets) {
+	shiftWindow(shiftValue, windowSize, RangeIds(sequenceRange), packets);
+}
@@ -0,0 +1,584 @@
+//The format of every datagram the two sides trade. Each one starts with a flags byte: the version of the format in the
+//top four bits, and the type of datagram in the bottom four. What follows depends on the type:
+//	data    flags, id, checksum (2 bytes), then the packet's data, which runs to the end of the datagram
+//	crc32c data  flags, id, CRC32C (4 bytes, lowest byte first), then the packet's data
+//	numbered data  either of the above, once the hello has settled on numbering packets, with the packet's number counted
+//	        from the start of the file (varint of up to 64 bits) after the id. The checksum bytes are XORed with the
+//	        CRC32C of the number (see wireMixNumber), so a number that got damaged is caught just like damaged data.
+//	packed data  either of the above, with the packed type, and a codec (1 byte, CODEC_...) before the packet's data, packed by it.
+//	        The checksum is of the data before packing, so it also catches anything unpacking got wrong.
+//	ack     flags, id, then once the hello has settled on numbering packets, the number of the packet acked (varint of up
+//	        to 64 bits), which lets a sender with many receivers tell it from an ack for an earlier packet with the same id
+//	nack    flags, id, then the number of the packet, the same as an ack
+//	ready   flags, number of the exchange (1 byte), whether an answer is wanted (1 byte)
+//	fin     flags, stage (1 byte, FIN_...), digest algorithm (1 byte, DIGEST_..., or FIN_NO_DIGEST), then the digest if there is one
+//	hello   flags, whether an answer is wanted (1 byte), the integrity algorithms on offer (1 bit each, 1 << INTEGRITY_...),
+//	        the file digests on offer (1 bit each, 1 << DIGEST_...), how many packets go in each parity group (1 byte, 0 for none),
+//	        the codec the sender wants to pack packets with (1 byte, CODEC_..., the receiver answering CODEC_NONE if it won't take it),
+//	        whether the sender wants to send a delta (1 byte, the receiver answering 1 only if it has a basis to apply it to),
+//	        whether the sender wants to resume a transfer (1 byte, the receiver answering 1 only if it keeps a journal),
+//	        whether the sender wants to send holes (1 byte, the receiver answering 1 only if it can make them, see Sparse.cpp),
+//	        whether the sender wants to deduplicate blocks (1 byte, the receiver answering 1 only if it has a block store),
+//	        whether the sender wants to send a bundle of files (1 byte, the receiver answering 1 only if it writes into a
+//	        directory, see Bundle.cpp), whether the sender numbers its packets (1 byte, the receiver answering 1 if it
+//	        checks them)
+//	parity  flags, number of the round it was sent in (1 byte), how many packets it covers (1 byte), their ids,
+//	        the XOR of their lengths (varint), the XOR of their data (each padded with zeroes to the longest),
+//	        then a CRC32C of everything after the flags (4 bytes, lowest byte first)
+//	signatures  flags, the first block it covers (varint), how many blocks the basis has (varint), how long they are (varint),
+//	        how long the last one is (varint), the signature of each block it covers (see Delta.cpp),
+//	        then a CRC32C of everything after the flags (4 bytes, lowest byte first)
+//	signature request  flags, the first block whose signature is wanted (varint)
+//	journal request  flags, JOURNAL_REQUEST (1 byte), the identity of the sender's file (8 bytes), how long it is (8 bytes),
+//	        how long its blocks are (varint), the first byte of the journal's bitmap wanted (varint),
+//	        then a CRC32C of everything after the flags (4 bytes, lowest byte first)
+//	journal  flags, JOURNAL_ANSWER (1 byte), the identity of the file it's for (8 bytes), the first byte of the bitmap it
+//	        covers (varint), how long the whole bitmap is (varint), that part of the bitmap,
+//	        then a CRC32C of everything after the flags (4 bytes, lowest byte first)
+//	dedup query  flags, DEDUP_QUERY (1 byte), the number of the first key it holds (varint), then the keys of blocks of the
+//	        sender's file (DEDUP_KEY_BYTES each, see Dedup.cpp), then a CRC32C of everything after the flags (4 bytes, lowest byte first)
+//	dedup answer  flags, DEDUP_ANSWER (1 byte), the number of the first key it answers for (varint), how many it answers
+//	        for (varint), a bitmap with a bit set for each of them the receiver has stored (lowest bit of each byte first),
+//	        then a CRC32C of everything after the flags (4 bytes, lowest byte first)
+//	probe   flags, PROBE_REQUEST (1 byte), how long the whole datagram is (varint), then zeroes out to that length
+//	probe answer  flags, PROBE_ANSWER (1 byte), how long the probe it answers was (varint), then the most data the
+//	        receiver's packets can hold (varint)
+//Numbers of 8 bytes go lowest byte first.
+//The sender offers every integrity algorithm it's willing to use in a hello, and the receiver answers with the one
+//picked from those (see SocketReadWriter::agreeIntegrity). Each data datagram still says which one it was checked with,
+//but a receiver only takes ones checked as agreed (see PacketChecks), and treats anything else as malformed. The file
+//digest is agreed on the same way, and each side's digest of the whole file is traded in the fin exchange at the end
+//(see SocketReadWriter::finish).
+//A parity datagram lets the receiver rebuild any one of the packets it covers that got lost, from the others (see Fec.cpp).
+//Once a delta is agreed on in the hello, the sender asks for the signatures of the receiver's basis, a burst at a time,
+//before it reads the file (see SocketReadWriter::fetchSignatures). A resumed transfer works the same way, with the bitmap of
+//the blocks the receiver's journal says it already has (see Journal.cpp and SocketReadWriter::fetchJournal). A deduplicated
+//transfer asks which blocks the receiver has stored with a dedup query, and gets a dedup answer for each one (see Dedup.cpp and
+//SocketReadWriter::fetchDedup).
+//A sender that picks its packet size from the path sends probes of different lengths after the hello, none of which can be
+//cut into fragments on the way, and the receiver answers each one that arrives whole (see SocketReadWriter::probePath).
+//Ids are varints (unsigned LEB128: 7 bits to a byte, lowest first, the top bit set on every byte but the last), so with a
+//sequence range of up to 128 an id takes one byte, and up to 16384 two. Nothing is padded, and a datagram is only ever
+//as long as what it holds, so the short last packet of a file goes out short.
+//An id only tells a packet apart from the others in the window, so a copy held up on the way for a whole trip round the
+//sequence range would look like the packet that has its id now. A packet's number never comes round again, so the
+//receiver checks it against the number of the slot the id picks, and throws away anything from another trip round.
+//None of it depends on the byte order of either machine. The internet checksum is sent as the bytes it has in memory, which works
+//because the internet checksum comes out byte-swapped on a machine of the other byte order, exactly like the data it
+//sums (see RFC 1071), so both sides always compare the same two bytes.
+//Datagrams of any other version are ignored, so a side that's out of date just looks like it isn't answering.
+#define WIRE_VERSION 1
+
+//The types of datagram
+#define WIRE_DATA 0
+#define WIRE_ACK 1
+#define WIRE_NACK 2		//Reserved for telling the sender a packet needs resending. Neither protocol sends one yet.
+#define WIRE_READY 3
+#define WIRE_FIN 4
+#define WIRE_DATA_CRC32C 5
+#define WIRE_HELLO 6
+#define WIRE_PARITY 7
+#define WIRE_DATA_PACKED 8
+#define WIRE_DATA_CRC32C_PACKED 9
+#define WIRE_SIGNATURES 10
+#define WIRE_SIGNATURE_REQUEST 11
+#define WIRE_JOURNAL 12
+#define WIRE_DEDUP 13
+#define WIRE_PROBE 14
+
+//The ways a packet's data can be checked. The internet checksum is the original one, and what's used with a side
+//that never answers a hello.
+#define INTEGRITY_INET 0
+#define INTEGRITY_CRC32C 1
+#define NUM_INTEGRITY 2
+#define ALL_INTEGRITY ((1 << NUM_INTEGRITY) - 1)
+
+//Only some of the programs print these, so the others mustn't warn that they go unused
+[[maybe_unused]] static const char* integrityNames[NUM_INTEGRITY] = {"inet", "crc32c"};
+
+//The longest a varint for an int can be, and so the longest the start of a data datagram can be
+#define WIRE_MAX_VARINT 5
+#define WIRE_MAX_VARINT64 10
+#define WIRE_MAX_DATA_HEADER (1 + WIRE_MAX_VARINT + WIRE_MAX_VARINT64 + 4 + 1)
+#define WIRE_MAX_ACK (1 + WIRE_MAX_VARINT + WIRE_MAX_VARINT64)
+#define WIRE_READY_BYTES 3
+#define WIRE_FIN_BYTES 3
+#define WIRE_MAX_FIN (WIRE_FIN_BYTES + DIGEST_MAX_BYTES)
+#define WIRE_HELLO_BYTES 12
+
+//The most packets one parity datagram can cover, and so the longest the start of one can be
+#define WIRE_MAX_GROUP 64
+#define WIRE_MAX_PARITY_HEADER (3 + WIRE_MAX_GROUP * WIRE_MAX_VARINT + WIRE_MAX_VARINT)
+#define WIRE_PARITY_CHECK_BYTES 4
+
+//The longest the start of a signatures datagram can be, and how long its CRC32C is
+#define WIRE_MAX_SIGNATURE_HEADER (1 + 4 * WIRE_MAX_VARINT)
+#define WIRE_SIGNATURE_CHECK_BYTES 4
+
+//How long the CRC32C at the end of journal and dedup datagrams is
+#define WIRE_FRAME_CHECK_BYTES 4
+
+//The two kinds of journal datagram, how long a request can be, and how long the start of an answer can be
+#define JOURNAL_REQUEST 0
+#define JOURNAL_ANSWER 1
+#define WIRE_MAX_JOURNAL_REQUEST (2 + 16 + 2 * WIRE_MAX_VARINT + WIRE_FRAME_CHECK_BYTES)
+#define WIRE_MAX_JOURNAL_HEADER (2 + 8 + 2 * WIRE_MAX_VARINT)
+
+//The two kinds of dedup datagram, how long a key is, and how long the start of either can be
+#define DEDUP_QUERY 0
+#define DEDUP_ANSWER 1
+#define DEDUP_KEY_BYTES 16
+#define WIRE_MAX_DEDUP_HEADER (2 + 2 * WIRE_MAX_VARINT)
+
+//The two kinds of probe datagram, and how long an answer can be
+#define PROBE_REQUEST 0
+#define PROBE_ANSWER 1
+#define WIRE_MAX_PROBE_ANSWER (2 + 2 * WIRE_MAX_VARINT)
+
+//The stages of the fin exchange: the sender says it's done, the receiver answers once it has written everything,
+//and the sender says it heard the answer, so the receiver can stop
+#define FIN_REQUEST 0
+#define FIN_ANSWER 1
+#define FIN_CLOSE 2
+#define FIN_NO_DIGEST 0xFF
+
+//Given as a skip to the corruption impairment, this means "leave each datagram's header alone", however long it is
+#define WIRE_SKIP_HEADER ((size_t) -1)
+
+
+//Returns the flags byte for a datagram of the given type
+char wireFlags(int type) {
+	return (char) ((WIRE_VERSION << 4) | type);
+}
+
+//Returns the type of the given datagram (WIRE_DATA, ...), or -1 if it's empty or from another version of the format
+int wireType(char* data, size_t length) {
+	if (length < 1 || ((unsigned char) data[0]) >> 4 != WIRE_VERSION) return -1;
+	return data[0] & 0xF;
+}
+
+//Writes the value as a varint, returning how many bytes it took
+int putVarint(char* to, unsigned int value) {
+	int send = 0;
+	while (value >= 0x80) {
+		to[send++] = (char) (value | 0x80);
+		value >>= 7;
+	}
+	to[send++] = (char) value;
+	return send;
+}
+
+//Reads a varint from the given bytes into "value", returning how many bytes it took,
+//or 0 if it runs past "length" or is longer than any int could need.
+int getVarint(char* from, size_t length, unsigned int* value) {
+	unsigned int send = 0;
+	for (int i = 0; i < WIRE_MAX_VARINT && (size_t) i < length; i++) {
+		unsigned char next = from[i];
+		send |= (unsigned int) (next & 0x7F) << (7 * i);
+		if (next < 0x80) {
+			*value = send;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+//Writes the 64 bit value as a varint, returning how many bytes it took
+int putVarint64(char* to, uint64_t value) {
+	int send = 0;
+	while (value >= 0x80) {
+		to[send++] = (char) (value | 0x80);
+		value >>= 7;
+	}
+	to[send++] = (char) value;
+	return send;
+}
+
+//Reads a varint of up to 64 bits from the given bytes into "value", returning how many bytes it took,
+//or 0 if it runs past "length" or is longer than any 64 bit value could need.
+int getVarint64(char* from, size_t length, uint64_t* value) {
+	uint64_t send = 0;
+	for (int i = 0; i < WIRE_MAX_VARINT64 && (size_t) i < length; i++) {
+		unsigned char next = from[i];
+		send |= (uint64_t) (next & 0x7F) << (7 * i);
+		if (next < 0x80) {
+			*value = send;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+//Returns how many ids on from "from" the id "to" is, going forward round a sequence range, from 0 to range - 1.
+//It's worked out in 64 bits, so it's right even when the range is close to the largest int.
+int wireIdDistance(int from, int to, int range) {
+	long long send = (long long) to - from;
+	return (int) (send < 0 ? send + range : send);
+}
+
+//Returns the id "count" on from "id" round a sequence range (or back from it, if "count" is negative)
+int wireIdAdvance(int id, long long count, int range) {
+	long long send = ((long long) id + count) % range;
+	return (int) (send < 0 ? send + range : send);
+}
+
+//Returns the integrity algorithm a datagram of the given type is checked with, or -1 if it isn't a data datagram
+int wireIntegrity(int type) {
+	if (type == WIRE_DATA || type == WIRE_DATA_PACKED) return INTEGRITY_INET;
+	return type == WIRE_DATA_CRC32C || type == WIRE_DATA_CRC32C_PACKED ? INTEGRITY_CRC32C : -1;
+}
+
+//Returns the type of data datagram that's checked with the given integrity algorithm, and packed if "packed" is true
+int wireDataType(int integrity, bool packed) {
+	if (packed) return integrity == INTEGRITY_CRC32C ? WIRE_DATA_CRC32C_PACKED : WIRE_DATA_PACKED;
+	return integrity == INTEGRITY_CRC32C ? WIRE_DATA_CRC32C : WIRE_DATA;
+}
+
+//Returns true if the given type is a data datagram with packed data
+bool wirePacked(int type) {
+	return type == WIRE_DATA_PACKED || type == WIRE_DATA_CRC32C_PACKED;
+}
+
+//Returns how many bytes the checksum of the given integrity algorithm takes
+int wireChecksumBytes(int integrity) {
+	return integrity == INTEGRITY_CRC32C ? 4 : 2;
+}
+
+//Returns the checksum of the given data, by the given integrity algorithm
+uint32_t packetChecksum(int integrity, char* data, int length) {
+	if (integrity == INTEGRITY_CRC32C) return crc32c(data, length);
+	return (unsigned short) inetChecksum(data, length);
+}
+
+//Writes a checksum of the given integrity algorithm, returning how many bytes it took
+int putChecksum(char* to, int integrity, uint32_t checksum) {
+	if (integrity == INTEGRITY_CRC32C) {
+		for (int i = 0; i < 4; i++) to[i] = (char) (checksum >> (8 * i));
+		return 4;
+	}
+	unsigned short inet = checksum;
+	memcpy(to, &inet, 2);
+	return 2;
+}
+
+//Reads a checksum of the given integrity algorithm
+uint32_t getChecksum(char* from, int integrity) {
+	if (integrity == INTEGRITY_CRC32C) {
+		uint32_t send = 0;
+		for (int i = 0; i < 4; i++) send |= (uint32_t) (unsigned char) from[i] << (8 * i);
+		return send;
+	}
+	unsigned short inet;
+	memcpy(&inet, from, 2);
+	return inet;
+}
+
+//The integrity algorithms as types, for the transfers to settle on one once and check every packet with it without
+//asking which (see PacketChecks in Window.cpp). Given their INTEGRITY, putChecksum, getChecksum and wireMixNumber fold
+//down to the one algorithm.
+class InetCheck {
+	public:
+		static const int INTEGRITY = INTEGRITY_INET;
+		static const int BYTES = 2;
+
+		static uint32_t sum(char* data, int length) {
+			return (unsigned short) inetChecksum(data, length);
+		}
+};
+
+class Crc32cCheck {
+	public:
+		static const int INTEGRITY = INTEGRITY_CRC32C;
+		static const int BYTES = 4;
+
+		static uint32_t sum(char* data, int length) {
+			return crc32c(data, length);
+		}
+};
+
+//XORs the CRC32C of a packet's number (as 8 bytes, lowest first) into the checksum bytes at "field", lowest byte first.
+//Doing it again undoes it. It's done to the bytes rather than the value so that it comes out the same whatever the
+//byte order of either machine, since the internet checksum goes out as the bytes it has in memory.
+void wireMixNumber(char* field, int integrity, uint64_t number) {
+	char bytes[8];
+	for (int i = 0; i < 8; i++) bytes[i] = (char) (number >> (8 * i));
+	uint32_t mix = crc32c(bytes, 8);
+	for (int i = 0; i < wireChecksumBytes(integrity); i++) field[i] ^= (char) (mix >> (8 * i));
+}
+
+//Returns the best integrity algorithm in the given set (1 << INTEGRITY_...), or -1 if it's empty
+int bestIntegrity(int offered) {
+	for (int i = NUM_INTEGRITY - 1; i >= 0; i--) {
+		if (offered & (1 << i)) return i;
+	}
+	return -1;
+}
+
+//Returns true if the given fin is as long as the digest it says it carries makes it
+bool wireFinValid(char* data, size_t length) {
+	if (length < WIRE_FIN_BYTES) return false;
+	unsigned char algorithm = data[2];
+	if (algorithm == FIN_NO_DIGEST) return length == WIRE_FIN_BYTES;
+	return algorithm < NUM_DIGESTS && length == (size_t) (WIRE_FIN_BYTES + digestLengths[algorithm]);
+}
+
+//Writes the start of a parity datagram, up to where the XOR of the data goes, returning how many bytes it took
+int putParityHeader(char* to, unsigned char round, int* ids, int count, unsigned int lengthXor) {
+	to[0] = wireFlags(WIRE_PARITY);
+	to[1] = (char) round;
+	to[2] = (char) count;
+	int send = 3;
+	for (int i = 0; i < count; i++) send += putVarint(to + send, ids[i]);
+	return send + putVarint(to + send, lengthXor);
+}
+
+//Reads the start of a parity datagram, saving what it holds at the given places. Returns how many bytes it took,
+//or 0 if it's cut short, covers no packets or too many, or fails its CRC32C.
+int getParityHeader(char* from, size_t length, unsigned char* round, int* ids, int* count, unsigned int* lengthXor) {
+	if (length < 3 + WIRE_PARITY_CHECK_BYTES) return 0;
+	length -= WIRE_PARITY_CHECK_BYTES;
+	uint32_t check = 0;
+	for (int i = 0; i < WIRE_PARITY_CHECK_BYTES; i++) check |= (uint32_t) (unsigned char) from[length + i] << (8 * i);
+	if (crc32c(from + 1, length - 1) != check) return 0;
+
+	*round = from[1];
+	*count = (unsigned char) from[2];
+	if (*count < 1 || *count > WIRE_MAX_GROUP) return 0;
+	size_t send = 3;
+	for (int i = 0; i < *count; i++) {
+		unsigned int id;
+		int used = getVarint(from + send, length - send, &id);
+		if (used == 0) return 0;
+		ids[i] = (int) id;
+		send += used;
+	}
+	int used = getVarint(from + send, length - send, lengthXor);
+	return used == 0 ? 0 : send + used;
+}
+
+//Writes the start of a signatures datagram, up to where the signatures go, returning how many bytes it took
+int putSignatureHeader(char* to, int first, int count, int blockSize, int lastLength) {
+	to[0] = wireFlags(WIRE_SIGNATURES);
+	int send = 1;
+	send += putVarint(to + send, first);
+	send += putVarint(to + send, count);
+	send += putVarint(to + send, blockSize);
+	return send + putVarint(to + send, lastLength);
+}
+
+//Reads the start of a signatures datagram, saving what it holds at the given places. Returns how many bytes it took,
+//or 0 if it's cut short or fails its CRC32C. The signatures run from there up to the CRC32C.
+int getSignatureHeader(char* from, size_t length, int* first, int* count, int* blockSize, int* lastLength) {
+	if (length < 1 + WIRE_SIGNATURE_CHECK_BYTES) return 0;
+	length -= WIRE_SIGNATURE_CHECK_BYTES;
+	uint32_t check = 0;
+	for (int i = 0; i < WIRE_SIGNATURE_CHECK_BYTES; i++) check |= (uint32_t) (unsigned char) from[length + i] << (8 * i);
+	if (crc32c(from + 1, length - 1) != check) return 0;
+
+	int* fields[4] = {first, count, blockSize, lastLength};
+	size_t send = 1;
+	for (int i = 0; i < 4; i++) {
+		unsigned int value;
+		int used = getVarint(from + send, length - send, &value);
+		if (used == 0 || value > 0x7FFFFFFF) return 0;
+		*fields[i] = (int) value;
+		send += used;
+	}
+	return send;
+}
+
+//Writes the value as 8 bytes, lowest first
+void putFixed64(char* to, uint64_t value) {
+	for (int i = 0; i < 8; i++) to[i] = (char) (value >> (8 * i));
+}
+
+//Reads a value written by putFixed64
+uint64_t getFixed64(char* from) {
+	return readLittle64((unsigned char*) from);
+}
+
+//Appends a CRC32C of everything after the flags to the datagram of "length" bytes at "to", returning how long it is now
+int putFrameCheck(char* to, int length) {
+	uint32_t check = crc32c(to + 1, length - 1);
+	for (int i = 0; i < WIRE_FRAME_CHECK_BYTES; i++) to[length++] = (char) (check >> (8 * i));
+	return length;
+}
+
+//Returns how long the journal or dedup datagram is without its CRC32C, or 0 if it's too short to be one or fails the check
+size_t getFrameCheck(char* from, size_t length) {
+	if (length < 2 + WIRE_FRAME_CHECK_BYTES) return 0;
+	length -= WIRE_FRAME_CHECK_BYTES;
+	uint32_t check = 0;
+	for (int i = 0; i < WIRE_FRAME_CHECK_BYTES; i++) check |= (uint32_t) (unsigned char) from[length + i] << (8 * i);
+	return crc32c(from + 1, length - 1) == check ? length : 0;
+}
+
+//Writes a whole journal request, returning how many bytes it took
+int putJournalRequest(char* to, uint64_t source, uint64_t size, int blockSize, unsigned int first) {
+	to[0] = wireFlags(WIRE_JOURNAL);
+	to[1] = JOURNAL_REQUEST;
+	putFixed64(to + 2, source);
+	putFixed64(to + 10, size);
+	int send = 18;
+	send += putVarint(to + send, blockSize);
+	send += putVarint(to + send, first);
+	return putFrameCheck(to, send);
+}
+
+//Reads a journal request, saving what it holds at the given places.
+//Returns false if it isn't one, is cut short or fails its CRC32C.
+bool getJournalRequest(char* from, size_t length, uint64_t* source, uint64_t* size, int* blockSize, unsigned int* first) {
+	if (wireType(from, length) != WIRE_JOURNAL || (length = getFrameCheck(from, length)) < 18 || from[1] != JOURNAL_REQUEST) return false;
+	*source = getFixed64(from + 2);
+	*size = getFixed64(from + 10);
+	unsigned int block;
+	int used = getVarint(from + 18, length - 18, &block);
+	if (used == 0 || block > 0x7FFFFFFF) return false;
+	*blockSize = (int) block;
+	return getVarint(from + 18 + used, length - 18 - used, first) != 0;
+}
+
+//Writes the start of a journal answer, up to where its part of the bitmap goes, returning how many bytes it took
+int putJournalHeader(char* to, uint64_t source, unsigned int first, unsigned int total) {
+	to[0] = wireFlags(WIRE_JOURNAL);
+	to[1] = JOURNAL_ANSWER;
+	putFixed64(to + 2, source);
+	int send = 10;
+	send += putVarint(to + send, first);
+	return send + putVarint(to + send, total);
+}
+
+//Reads the start of a journal answer, saving what it holds at the given places. Returns how many bytes it took,
+//or 0 if it isn't one, is cut short or fails its CRC32C. Its part of the bitmap runs from there up to the CRC32C.
+int getJournalHeader(char* from, size_t length, uint64_t* source, unsigned int* first, unsigned int* total) {
+	if (wireType(from, length) != WIRE_JOURNAL || (length = getFrameCheck(from, length)) < 10 || from[1] != JOURNAL_ANSWER) return 0;
+	*source = getFixed64(from + 2);
+	int used = getVarint(from + 10, length - 10, first);
+	if (used == 0) return 0;
+	int more = getVarint(from + 10 + used, length - 10 - used, total);
+	return more == 0 ? 0 : 10 + used + more;
+}
+
+//Writes a whole dedup query for "count" keys from "keys", the first of them number "first", returning how many bytes it took
+int putDedupQuery(char* to, unsigned int first, const char* keys, int count) {
+	to[0] = wireFlags(WIRE_DEDUP);
+	to[1] = DEDUP_QUERY;
+	int send = 2 + putVarint(to + 2, first);
+	memcpy(to + send, keys, count * DEDUP_KEY_BYTES);
+	return putFrameCheck(to, send + count * DEDUP_KEY_BYTES);
+}
+
+//Reads the start of a dedup query, saving the number of its first key in "first" and how many keys it holds in "count".
+//Returns how many bytes the start took, which is where the keys begin, or 0 if it isn't one, is cut short or fails its CRC32C.
+int getDedupQuery(char* from, size_t length, unsigned int* first, int* count) {
+	if (wireType(from, length) != WIRE_DEDUP || (length = getFrameCheck(from, length)) < 2 || from[1] != DEDUP_QUERY) return 0;
+	int used = getVarint(from + 2, length - 2, first);
+	if (used == 0 || (length - 2 - used) % DEDUP_KEY_BYTES != 0) return 0;
+	*count = (length - 2 - used) / DEDUP_KEY_BYTES;
+	return 2 + used;
+}
+
+//Writes a whole dedup answer for "count" keys, the first of them number "first", from a bitmap of which are stored,
+//returning how many bytes it took
+int putDedupAnswer(char* to, unsigned int first, int count, const unsigned char* stored) {
+	to[0] = wireFlags(WIRE_DEDUP);
+	to[1] = DEDUP_ANSWER;
+	int send = 2 + putVarint(to + 2, first);
+	send += putVarint(to + send, count);
+	memcpy(to + send, stored, (count + 7) / 8);
+	return putFrameCheck(to, send + (count + 7) / 8);
+}
+
+//Reads the start of a dedup answer, saving the number of the first key it answers for in "first" and how many in "count".
+//Returns how many bytes the start took, which is where the bitmap begins, or 0 if it isn't one, is cut short or fails its CRC32C.
+int getDedupAnswer(char* from, size_t length, unsigned int* first, int* count) {
+	if (wireType(from, length) != WIRE_DEDUP || (length = getFrameCheck(from, length)) < 2 || from[1] != DEDUP_ANSWER) return 0;
+	unsigned int many;
+	int used = getVarint(from + 2, length - 2, first);
+	int more = used == 0 ? 0 : getVarint(from + 2 + used, length - 2 - used, &many);
+	if (more == 0 || many > 0x7FFFFFFF || length - 2 - used - more != (many + 7) / 8) return 0;
+	*count = (int) many;
+	return 2 + used + more;
+}
+
+//Writes a whole probe "length" bytes long, which has to be at least 2 + WIRE_MAX_VARINT, returning "length"
+int putProbe(char* to, int length) {
+	to[0] = wireFlags(WIRE_PROBE);
+	to[1] = PROBE_REQUEST;
+	int used = 2 + putVarint(to + 2, length);
+	memset(to + used, 0, length - used);
+	return length;
+}
+
+//Reads how long the given probe says it is into "size". Returns false if it isn't a probe, or isn't as long as it says,
+//which means it got cut short on the way.
+bool getProbe(char* from, size_t length, unsigned int* size) {
+	if (wireType(from, length) != WIRE_PROBE || length < 3 || from[1] != PROBE_REQUEST) return false;
+	return getVarint(from + 2, length - 2, size) != 0 && *size == length;
+}
+
+//Writes a whole probe answer for a probe "size" bytes long, from a receiver whose packets hold up to "room" bytes of data,
+//returning how many bytes it took
+int putProbeAnswer(char* to, int size, int room) {
+	to[0] = wireFlags(WIRE_PROBE);
+	to[1] = PROBE_ANSWER;
+	int send = 2 + putVarint(to + 2, size);
+	return send + putVarint(to + send, room);
+}
+
+//Reads a probe answer, saving how long the probe it answers was in "size" and the receiver's room in "room".
+//Returns false if it isn't one or is cut short.
+bool getProbeAnswer(char* from, size_t length, unsigned int* size, unsigned int* room) {
+	if (wireType(from, length) != WIRE_PROBE || length < 3 || from[1] != PROBE_ANSWER) return false;
+	int used = getVarint(from + 2, length - 2, size);
+	return used != 0 && getVarint(from + 2 + used, length - 2 - used, room) != 0;
+}
+
+//Reads the id of a data, ack or nack datagram into "id". Returns how many bytes the flags and id take,
+//or 0 if the datagram isn't one of those or is cut short.
+int wireId(char* data, size_t length, int* id) {
+	int type = wireType(data, length);
+	if (wireIntegrity(type) == -1 && type != WIRE_ACK && type != WIRE_NACK) return 0;
+	unsigned int value;
+	int used = getVarint(data + 1, length - 1, &value);
+	if (used == 0) return 0;
+	*id = (int) value;
+	return used + 1;
+}
+
+//Writes an ack or nack (WIRE_ACK or WIRE_NACK) for the given id, followed by the packet's number unless that's -1,
+//returning how many bytes it took
+int putAck(char* to, int type, int id, long long number) {
+	to[0] = wireFlags(type);
+	int send = 1 + putVarint(to + 1, id);
+	if (number >= 0) send += putVarint64(to + send, number);
+	return send;
+}
+
+//Reads the id of an ack or nack into "id", and the number after it into "number", which is -1 if it carries none.
+//Returns false if the datagram isn't one of those or is cut short.
+bool getAck(char* from, size_t length, int* id, long long* number) {
+	int type = wireType(from, length);
+	if (type != WIRE_ACK && type != WIRE_NACK) return false;
+	int used = wireId(from, length, id);
+	if (used == 0) return false;
+	*number = -1;
+	if ((size_t) used == length) return true;
+	uint64_t value;
+	if (getVarint64(from + used, length - used, &value) == 0 || value > (uint64_t) INT64_MAX) return false;
+	*number = (long long) value;
+	return true;
+}
+
+//Returns how many bytes at the start of the datagram are header rather than data.
+//That's everything for anything but a data datagram, and for one too short to hold its header.
+//A numbered packet doesn't say it's numbered, so this stops short of the end of its header. Anything damaged past here
+//is still caught, since the number is checked along with the data.
+size_t wireHeaderLength(char* data, size_t length) {
+	int id;
+	int type = wireType(data, length);
+	int used = wireId(data, length, &id), integrity = wireIntegrity(type);
+	if (integrity == -1 || used == 0) return length;
+	used += wireChecksumBytes(integrity) + (wirePacked(type) ? 1 : 0);
+	return (size_t) used > length ? length : used;
+}
@@ -0,0 +1,730 @@
+//Benchmarks whole GBN and SR transfers over this machine, with no menus in the way.
+//Each run forks a server and a client process, times the transfer, checks the output against the input,
+//and records goodput, retransmissions, CPU time and peak memory for each side, along with the datagrams the kernel dropped from
+//either side's full receive buffer (buffer_drops), which the protocols can't tell from loss on the way. Every option takes a comma
+//separated list, and every combination of them is run, so one command can sweep all the settings at once.
+//
+//Usage: bench.exe [--option value]...
+//	--mode gbn,sr          protocols to run (default sr,gbn)
+//	--transport udp,shm,multicast  what carries the datagrams (default udp). Multicast sends to a group on this machine
+//	                       that several servers have joined, and checks every server's output.
+//	--receivers count      how many servers a multicast run sends to (default 3)
+//	--receive blocking,busy  how both sides wait for datagrams: blocking in the kernel, or busy polling for them, which spends
+//	                       a CPU on each side to cut how long every round takes (default blocking). Multicast only blocks.
+//	                       The round_p50_ms, round_p90_ms and round_p99_ms columns are the client's round times.
+//	--pin-client cpu       the CPU the client busy polls on, -1 for any (default -1)
+//	--pin-server cpu       the CPU the servers busy poll on, -1 for any (default -1)
+//	--integrity inet,crc32c  how packets are checked (default crc32c)
+//	--digest md5,xxh64,none  the digest of the whole file both sides work out and compare at the end (default xxh64)
+//	--parity packets       parity group sizes: a parity packet follows every this many, 0 for none (default 0).
+//	                       How many lost packets were rebuilt from it is in the server's --metrics.
+//	--compress none,lz,deflate  what the client packs each packet with, when that makes it smaller (default none)
+//	--pack-threads count   how many threads the client packs on, 0 for the send loop itself (default 2)
+//	--offload              have UDP send each window as one super-buffer and receive them glued together the same way
+//	                       (UDP_SEGMENT and UDP_GRO), wherever the kernel allows it (default: off)
+//	--packet bytes         packet sizes, or auto to probe the path for one (default 1400). The packet column has the size picked.
+//	--window packets       window sizes (default 32)
+//	--range ids            sequence ranges, 0 for twice the window (default 0)
+//	--loss fraction        chance of losing any one datagram, in each direction (default 0)
+//	--impair description   impairment stages for both directions, after the loss, described as in ImpairmentPipeline::parse,
+//	                       for example "burst=0.01:0.3@data,reorder=0.02,delay=0.005:0.001" (default: none)
+//	--impair-up description    the same, only from the client to the servers
+//	--impair-down description  the same, only from the servers to the client
+//	--size bytes           how much data to send (default 20000000)
+//	--file path            send this file instead of generated data (overrides --size)
+//	--basis path           an old copy of the file for the server to have, so the client sends a delta against it (default: none).
+//	                       How much of the file went as literals is the delta_sent column.
+//	--block bytes          how long the blocks of the old copy are, 0 to pick from its size (default 0)
+//	--stream bytes/s       pipe the file through both sides as a stream instead: a producer writes it into the client's standard
+//	                       input at about this rate (0 for as fast as it can), and the server writes to its standard output,
+//	                       which a consumer copies to the output file (default: off)
+//	--timeout seconds      receive timeout on both sides (default 0.05)
+//	--seed number          seed for the loss (default 1)
+//	--repeat count         how many times to run each combination (default 1)
+//	--limit seconds        give up on a run that takes longer than this (default 120)
+//	--format csv|json      output format (default csv)
+//	--output path          where to write the results (default: standard output)
+//	--metrics path         append each side's detailed metrics to this file as JSON lines (default: none)
+//	--metrics-interval s   how often the metrics are written during a run, 0 for only at the end (default 1)
+//	--trace prefix         trace every packet event of each run to prefix-run-server.trace and prefix-run-client.trace,
+//	                       where run counts up from 1, for traceAnalyze.exe (default: no tracing)
+//	--verbose              keep the protocols' own output
+
+#include "SocketReadWriter.cpp"
+#include "LinkedList.cpp"
+#include <vector>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <time.h>
+
+namespace serverSide {
+#include "server.cpp"
+}
+namespace clientSide {
+#include "client.cpp"
+}
+
+
+//The settings for a single run
+typedef struct BenchSettings {
+	string mode, transport;
+	//How many servers a multicast run sends to (any other transport has one)
+	int receivers;
+	//Whether both sides busy poll for datagrams instead of blocking, and the CPUs they're pinned to when they do (-1 for any)
+	bool busy;
+	int clientCpu, serverCpu;
+	//The integrity algorithm both sides are limited to (INTEGRITY_...)
+	int integrity;
+	//The file digest both sides are limited to (DIGEST_...), or -1 for none
+	int digest;
+	//How many packets the client puts in each parity group (0 for none)
+	int parity;
+	//What the client packs packets with (CODEC_...), and on how many threads
+	int codec, packThreads;
+	//The server's old copy of the file (empty for none), and how long its blocks are (0 to pick from its size)
+	string basis;
+	int blockSize;
+	//Whether UDP asks the kernel for segmentation offload (see SocketReadWriter::setOffload)
+	bool offload;
+	//How fast the file is piped into the client when it's sent as a stream (0 for as fast as possible), or -1 if it isn't
+	double stream;
+	int packetSize, windowSize, sequenceRange;
+	double loss, timeout, limit;
+	//Impairment stages each side runs what it sends through, on top of the loss (empty for none)
+	string impairUp, impairDown;
+	unsigned long seed;
+	bool verbose;
+	//Where each side's metrics go (empty for nowhere), and how often
+	string metrics;
+	double metricsInterval;
+	//Prefix of the trace files (empty for no tracing), and the number of the run in progress
+	string trace;
+	int run;
+} BenchSettings;
+
+//What the client reports back to the parent once its transfer is done
+typedef struct ClientReport {
+	long packetsSent, retransmitted, paritySent;
+	//How much bigger the data sent was than what went out for it (1 if nothing was packed)
+	double compressionRatio;
+	//How much of the file went as literals in a delta (1 if it wasn't sent as one)
+	double deltaSent;
+	double seconds;
+	bool finished;
+	//How the two sides' digests of the file compared (DIGEST_...)
+	int digestResult;
+	//The packet size the client ended up sending, which is only different from the one asked for with auto
+	int packetSize;
+	//Acks the kernel dropped from the client's full receive buffer (see Transport::bufferDrops)
+	long bufferDrops;
+	//How long the client's rounds took, at the median, 90th and 99th percentiles, in seconds
+	double roundP50, roundP90, roundP99;
+} ClientReport;
+
+//Everything recorded for a single run. With several servers, their CPU time is added up, and the peak memory is the largest.
+typedef struct BenchResult {
+	ClientReport client;
+	double clientCpu, serverCpu;
+	long clientRss, serverRss;
+	//Datagrams the kernel dropped from the servers' full receive buffers, added up
+	long serverDrops;
+	bool intact, timedOut;
+} BenchResult;
+
+
+//Returns the wall-clock time in seconds
+double wallTime() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//Splits a comma separated list
+vector<string> splitList(string list) {
+	vector<string> send;
+	size_t start = 0;
+	while (start <= list.length()) {
+		size_t end = list.find(',', start);
+		if (end == string::npos) end = list.length();
+		if (end > start) send.push_back(list.substr(start, end - start));
+		start = end + 1;
+	}
+	return send;
+}
+
+//Makes the read-writer for one side of a run. The server is always set up first, so it creates the shared memory.
+//"receiver" counts the servers of a multicast run from 0 (and is 0 for the client).
+//If the run is being traced, the ring it traces to is saved at "ring" (and NULL otherwise). Delete it once the side is done.
+SocketReadWriter* makeSide(BenchSettings* settings, int port, bool server, int receiver, TraceRing** ring) {
+	int seconds = (int) settings->timeout, microSeconds = (int) ((settings->timeout - seconds) * 1e6);
+	SocketReadWriter* sock;
+	if (settings->transport.compare("shm") == 0) {
+		sock = SocketReadWriter::getSharedMemoryInstance(port, server, settings->packetSize, seconds, microSeconds);
+	}
+	else if (settings->transport.compare("multicast") == 0) {
+		string group = "239.255.0.1", interface = "localhost";
+		sock = SocketReadWriter::getMulticastInstance(&group, &interface, port, server ? 0 : settings->receivers, settings->packetSize, seconds, microSeconds);
+	}
+	else {
+		string ip = "localhost";
+		sock = SocketReadWriter::getInstance(&ip, server ? port : port + 1, settings->packetSize, seconds, microSeconds);
+		if (sock != NULL) sock->setOtherSidePort(server ? port + 1 : port);
+	}
+	if (sock != NULL) {
+		sock->setIntegrity(1 << settings->integrity);
+		sock->setDigests(settings->digest == -1 ? 0 : 1 << settings->digest);
+		if (!server) {
+			sock->setParity(settings->parity);
+			sock->setCompression(settings->codec, settings->packThreads);
+			sock->setDelta(settings->basis.length() > 0);
+		}
+		sock->setStreaming(settings->stream >= 0);
+		if (settings->offload) sock->setOffload(true);
+		if (settings->busy && !sock->setLowLatency(true, server ? settings->serverCpu : settings->clientCpu)) {
+			cerr << "Could not busy poll, or pin the " << (server ? "server" : "client") << " to its CPU\n";
+		}
+	}
+	*ring = NULL;
+	if (sock != NULL && settings->trace.length() > 0) {
+		char path[4096];
+		if (receiver > 0) snprintf(path, sizeof(path), "%s-%d-server%d.trace", settings->trace.c_str(), settings->run, receiver + 1);
+		else snprintf(path, sizeof(path), "%s-%d-%s.trace", settings->trace.c_str(), settings->run, server ? "server" : "client");
+		FILE* file = fopen(path, "wb");
+		if ((*ring = TraceRing::getInstance(file, 16)) == NULL && file != NULL) fclose(file);
+		sock->setTrace(*ring);
+	}
+	if (sock != NULL && settings->metrics.length() > 0) {
+		FILE* metrics = fopen(settings->metrics.c_str(), "a");
+		//Both sides append to the same file, so every report has to go out in a single write
+		if (metrics != NULL) setvbuf(metrics, NULL, _IOFBF, 1 << 20);
+		sock->reportMetrics(metrics, settings->metricsInterval);
+	}
+	string stages = server ? settings->impairDown : settings->impairUp;
+	if (sock == NULL || (settings->loss <= 0 && stages.length() == 0)) return sock;
+
+	//Each side gets its own seed, so the two directions don't lose the same datagrams, and neither do any two servers
+	char description[64];
+	snprintf(description, sizeof(description), "seed=%lu", (settings->seed + receiver * 1000) * 2 + (server ? 0 : 1));
+	string impairment = description;
+	if (settings->loss > 0) {
+		snprintf(description, sizeof(description), ",loss=%g", settings->loss);
+		impairment += description;
+	}
+	if (stages.length() > 0) impairment += "," + stages;
+	sock->setImpairment(&impairment, NULL);
+	return sock;
+}
+
+//Forks a process that copies everything from one descriptor to the other, at about "rate" bytes a second
+//(0 for as fast as it can), and exits once there's nothing left. Returns its pid, or -1 if it couldn't be forked.
+//"unused" is a descriptor the copy has no use for, closed in it so it doesn't keep a pipe open.
+pid_t startCopy(int from, int to, double rate, int unused) {
+	pid_t send = fork();
+	if (send != 0) return send;
+	close(unused);
+	char buffer[65536];
+	double start = wallTime();
+	long copied = 0;
+	ssize_t got;
+	while ((got = read(from, buffer, rate > 0 && rate < sizeof(buffer) ? (size_t) rate : sizeof(buffer))) > 0) {
+		for (ssize_t written = 0; written < got;) {
+			ssize_t wrote = write(to, buffer + written, got - written);
+			if (wrote < 0) _exit(1);
+			written += wrote;
+		}
+		copied += got;
+		//Hold off until the rate has caught up with what's been copied
+		double early = rate > 0 ? start + copied / rate - wallTime() : 0;
+		if (early > 0) usleep((useconds_t) (early * 1e6));
+	}
+	_exit(got < 0 ? 1 : 0);
+}
+
+//Runs the server side of a transfer, writing to "output", then writes how many datagrams its full receive buffer dropped
+//to "reportTo" and exits. "receiver" counts the servers of a multicast run from 0.
+void serverProcess(BenchSettings* settings, int port, int receiver, string output, int reportTo) {
+	if (!settings->verbose) freopen("/dev/null", "w", stdout);
+	TraceRing* ring;
+	SocketReadWriter* sock = makeSide(settings, port, true, receiver, &ring);
+	FILE* file = fopen(output.c_str(), "wb");
+	if (sock == NULL || file == NULL) _exit(1);
+	//A stream goes out through standard output, into a consumer that writes the output file, so the logs can't go there too
+	pid_t consumer = -1;
+	if (settings->stream >= 0) {
+		int toConsumer[2];
+		if (pipe(toConsumer) != 0) _exit(1);
+		consumer = startCopy(toConsumer[0], fileno(file), 0, toConsumer[1]);
+		if (consumer < 0) _exit(1);
+		fclose(file);
+		close(toConsumer[0]);
+		dup2(toConsumer[1], STDOUT_FILENO);
+		close(toConsumer[1]);
+		file = stdout;
+		if (!settings->verbose) freopen("/dev/null", "w", stderr);
+		setLogStream(&cerr);
+	}
+	if (settings->basis.length() > 0) {
+		FILE* basis = fopen(settings->basis.c_str(), "rb");
+		if (basis == NULL || !sock->setBasis(basis, settings->blockSize)) _exit(1);
+		file = sock->deltaSink(file);
+	}
+
+	TransferMetrics* metrics;
+	if (settings->mode.compare("gbn") == 0) metrics = serverSide::GBN(sock, file, settings->packetSize, settings->windowSize, settings->sequenceRange, 0, NULL);
+	else metrics = serverSide::selectRepeat(sock, file, settings->packetSize, settings->windowSize, settings->sequenceRange, 0, NULL);
+
+	long drops = metrics->get(COUNT_BUFFER_DROPS);
+	write(reportTo, &drops, sizeof(drops));
+	delete metrics;
+	delete sock;
+	if (ring != NULL) delete ring;
+	fflush(stdout);
+	if (consumer > 0) waitpid(consumer, NULL, 0);
+	_exit(0);
+}
+
+//Runs the client side of a transfer, sending "input", then writes a report to "reportTo" and exits
+void clientProcess(BenchSettings* settings, int port, string input, int reportTo) {
+	if (!settings->verbose) freopen("/dev/null", "w", stdout);
+	ClientReport report;
+	report.finished = false;
+	report.packetsSent = report.retransmitted = report.paritySent = 0;
+	report.packetSize = settings->packetSize;
+	report.bufferDrops = 0;
+	report.roundP50 = report.roundP90 = report.roundP99 = 0;
+	report.seconds = 0;
+	report.compressionRatio = report.deltaSent = 1;
+	report.digestResult = DIGEST_UNCHECKED;
+
+	//Give the server time to set up before connecting to it
+	usleep(100000);
+	TraceRing* ring = NULL;
+	SocketReadWriter* sock = makeSide(settings, port, false, 0, &ring);
+	FILE* file = fopen(input.c_str(), "rb");
+	//A stream comes in through standard input, from a producer reading the input file
+	pid_t producer = -1;
+	if (file != NULL && settings->stream >= 0) {
+		int fromProducer[2];
+		if (pipe(fromProducer) != 0) _exit(1);
+		producer = startCopy(fileno(file), fromProducer[1], settings->stream, fromProducer[0]);
+		fclose(file);
+		close(fromProducer[1]);
+		dup2(fromProducer[0], STDIN_FILENO);
+		close(fromProducer[0]);
+		file = producer < 0 ? NULL : stdin;
+	}
+	if (sock != NULL && file != NULL && settings->basis.length() > 0) file = sock->deltaSource(file);
+	if (sock != NULL && file != NULL) {
+		double start = wallTime();
+		TransferMetrics* metrics;
+		if (settings->mode.compare("gbn") == 0) metrics = clientSide::GBN(sock, file, settings->packetSize, settings->windowSize, settings->sequenceRange, 0, NULL);
+		else metrics = clientSide::selectRepeat(sock, file, settings->packetSize, settings->windowSize, settings->sequenceRange, 0, NULL);
+		report.seconds = wallTime() - start;
+		report.packetsSent = metrics->get(COUNT_PACKETS_SENT);
+		report.retransmitted = metrics->get(COUNT_PACKETS_RETRANSMITTED);
+		report.paritySent = metrics->get(COUNT_PARITY_SENT);
+		report.bufferDrops = metrics->get(COUNT_BUFFER_DROPS);
+		report.roundP50 = metrics->roundTime(0.5);
+		report.roundP90 = metrics->roundTime(0.9);
+		report.roundP99 = metrics->roundTime(0.99);
+		long packedTo = metrics->get(COUNT_BYTES_SENT) - metrics->get(COUNT_BYTES_SAVED);
+		if (packedTo > 0) report.compressionRatio = (double) metrics->get(COUNT_BYTES_SENT) / packedTo;
+		long literal = metrics->get(COUNT_DELTA_LITERAL), delta = literal + metrics->get(COUNT_DELTA_COPIED);
+		if (delta > 0) report.deltaSent = (double) literal / delta;
+		report.finished = true;
+		report.digestResult = sock->getDigestResult();
+		report.packetSize = sock->getPacketSize();
+		delete metrics;
+		delete sock;
+	}
+	if (ring != NULL) delete ring;
+	if (producer > 0) {
+		kill(producer, SIGTERM);
+		waitpid(producer, NULL, 0);
+	}
+
+	write(reportTo, &report, sizeof(report));
+	fflush(stdout);
+	_exit(report.finished ? 0 : 1);
+}
+
+//Returns true if the two files hold exactly the same bytes
+bool sameFiles(string first, string second) {
+	FILE *a = fopen(first.c_str(), "rb"), *b = fopen(second.c_str(), "rb");
+	bool send = a != NULL && b != NULL;
+	char bufferA[65536], bufferB[65536];
+	while (send) {
+		size_t readA = fread(bufferA, 1, sizeof(bufferA), a), readB = fread(bufferB, 1, sizeof(bufferB), b);
+		send = readA == readB && memcmp(bufferA, bufferB, readA) == 0;
+		if (readA == 0) break;
+	}
+	if (a != NULL) fclose(a);
+	if (b != NULL) fclose(b);
+	return send;
+}
+
+//Returns the path the given server (counted from 0) writes to, when the first one writes to "output"
+string serverOutput(string output, int receiver) {
+	return receiver == 0 ? output : output + "-" + to_string(receiver + 1);
+}
+
+//Runs one transfer with the given settings and fills in the result
+void runOnce(BenchSettings* settings, int port, string input, string output, BenchResult* result) {
+	int reportPipe[2], dropPipe[2];
+	pipe(reportPipe);
+	pipe(dropPipe);
+	//Anything still buffered would otherwise be written out again by all the children
+	fflush(NULL);
+
+	int servers = settings->transport.compare("multicast") == 0 ? settings->receivers : 1;
+	pid_t server[servers];
+	for (int i = 0; i < servers; i++) {
+		server[i] = fork();
+		if (server[i] == 0) serverProcess(settings, port, i, serverOutput(output, i), dropPipe[1]);
+	}
+	close(dropPipe[1]);
+	pid_t client = fork();
+	if (client == 0) clientProcess(settings, port, input, reportPipe[1]);
+	close(reportPipe[1]);
+
+	//Wait for all of them, killing them if the run goes past the limit
+	struct rusage serverUsage[servers], clientUsage;
+	memset(serverUsage, 0, sizeof(serverUsage));
+	memset(&clientUsage, 0, sizeof(clientUsage));
+	bool serverDone[servers], clientDone = false;
+	for (int i = 0; i < servers; i++) serverDone[i] = false;
+	result->timedOut = false;
+	double deadline = wallTime() + settings->limit;
+	while (true) {
+		bool allDone = true;
+		for (int i = 0; i < servers; i++) {
+			if (!serverDone[i]) serverDone[i] = wait4(server[i], NULL, WNOHANG, serverUsage + i) == server[i];
+			allDone = allDone && serverDone[i];
+		}
+		if (!clientDone) clientDone = wait4(client, NULL, WNOHANG, &clientUsage) == client;
+		if (allDone && clientDone) break;
+		if (wallTime() > deadline && !result->timedOut) {
+			result->timedOut = true;
+			for (int i = 0; i < servers; i++) kill(server[i], SIGKILL);
+			kill(client, SIGKILL);
+		}
+		usleep(2000);
+	}
+
+	memset(&result->client, 0, sizeof(result->client));
+	if (read(reportPipe[0], &result->client, sizeof(result->client)) != sizeof(result->client)) result->client.finished = false;
+	close(reportPipe[0]);
+	//Each server that finished wrote its count, and what's there can be read once they're all gone
+	result->serverDrops = 0;
+	for (long drops; read(dropPipe[0], &drops, sizeof(drops)) == sizeof(drops);) result->serverDrops += drops;
+	close(dropPipe[0]);
+
+	result->clientCpu = clientUsage.ru_utime.tv_sec + clientUsage.ru_utime.tv_usec / 1e6 + clientUsage.ru_stime.tv_sec + clientUsage.ru_stime.tv_usec / 1e6;
+	result->clientRss = clientUsage.ru_maxrss;
+	result->serverCpu = 0;
+	result->serverRss = 0;
+	result->intact = !result->timedOut && result->client.finished;
+	for (int i = 0; i < servers; i++) {
+		result->serverCpu += serverUsage[i].ru_utime.tv_sec + serverUsage[i].ru_utime.tv_usec / 1e6 + serverUsage[i].ru_stime.tv_sec + serverUsage[i].ru_stime.tv_usec / 1e6;
+		if (serverUsage[i].ru_maxrss > result->serverRss) result->serverRss = serverUsage[i].ru_maxrss;
+		result->intact = result->intact && sameFiles(input, serverOutput(output, i));
+	}
+}
+
+//Writes the generated input file, following a simple pattern so runs are repeatable. Returns false if it couldn't be written.
+bool writeInput(string path, long size) {
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == NULL) return false;
+	char buffer[65536];
+	for (long position = 0; position < size;) {
+		int count = size - position < (long) sizeof(buffer) ? size - position : sizeof(buffer);
+		for (int i = 0; i < count; i++, position++) {
+			buffer[i] = (char) (position * 31 + (position >> 8));
+		}
+		fwrite(buffer, 1, count, file);
+	}
+	return fclose(file) == 0;
+}
+
+void printHeader(FILE* out, bool json) {
+	if (json) fprintf(out, "[\n");
+	else fprintf(out, "mode,transport,receivers,receive,integrity,digest,parity,compress,packet,window,range,loss,bytes,seconds,goodput_mbs,round_p50_ms,round_p90_ms,round_p99_ms,packets_sent,retransmitted,retransmit_ratio,buffer_drops,parity_sent,compression_ratio,delta_sent,client_cpu_s,server_cpu_s,client_rss_kb,server_rss_kb,intact,digest_match\n");
+}
+
+void printResult(FILE* out, bool json, bool first, BenchSettings* settings, long size, BenchResult* result) {
+	double goodput = result->client.seconds > 0 && result->intact ? size / result->client.seconds / 1e6 : 0;
+	double ratio = result->client.packetsSent > 0 ? (double) result->client.retransmitted / result->client.packetsSent : 0;
+	const char* intact = result->timedOut ? "timeout" : (result->intact ? "yes" : "no");
+	const char* digest = settings->digest == -1 ? "none" : digestNames[settings->digest];
+	int digestResult = result->client.digestResult;
+	const char* digestMatch = digestResult == DIGEST_MATCH ? "yes" : (digestResult == DIGEST_MISMATCH ? "no" : "unchecked");
+	int receivers = settings->transport.compare("multicast") == 0 ? settings->receivers : 1;
+	const char* receive = settings->busy ? "busy" : "blocking";
+	long drops = result->client.bufferDrops + result->serverDrops;
+
+	if (json) {
+		fprintf(out, "%s\t{\"mode\": \"%s\", \"transport\": \"%s\", \"receivers\": %d, \"receive\": \"%s\", \"integrity\": \"%s\", \"digest\": \"%s\", \"parity\": %d, \"compress\": \"%s\", \"packet\": %d, \"window\": %d, \"range\": %d, \"loss\": %g, \"bytes\": %ld, "
+			"\"seconds\": %.4f, \"goodput_mbs\": %.3f, \"round_p50_ms\": %.3f, \"round_p90_ms\": %.3f, \"round_p99_ms\": %.3f, \"packets_sent\": %ld, \"retransmitted\": %ld, \"retransmit_ratio\": %.4f, \"buffer_drops\": %ld, \"parity_sent\": %ld, \"compression_ratio\": %.3f, \"delta_sent\": %.4f, "
+			"\"client_cpu_s\": %.4f, \"server_cpu_s\": %.4f, \"client_rss_kb\": %ld, \"server_rss_kb\": %ld, \"intact\": \"%s\", \"digest_match\": \"%s\"}",
+			first ? "" : ",\n", settings->mode.c_str(), settings->transport.c_str(), receivers, receive, integrityNames[settings->integrity], digest, settings->parity, codecNames[settings->codec], result->client.packetSize,
+			settings->windowSize, settings->sequenceRange, settings->loss, size, result->client.seconds, goodput,
+			result->client.roundP50 * 1e3, result->client.roundP90 * 1e3, result->client.roundP99 * 1e3, result->client.packetsSent,
+			result->client.retransmitted, ratio, drops, result->client.paritySent, result->client.compressionRatio, result->client.deltaSent, result->clientCpu, result->serverCpu,
+			result->clientRss, result->serverRss, intact, digestMatch);
+	}
+	else {
+		fprintf(out, "%s,%s,%d,%s,%s,%s,%d,%s,%d,%d,%d,%g,%ld,%.4f,%.3f,%.3f,%.3f,%.3f,%ld,%ld,%.4f,%ld,%ld,%.3f,%.4f,%.4f,%.4f,%ld,%ld,%s,%s\n",
+			settings->mode.c_str(), settings->transport.c_str(), receivers, receive, integrityNames[settings->integrity], digest, settings->parity, codecNames[settings->codec],
+			result->client.packetSize, settings->windowSize, settings->sequenceRange, settings->loss, size, result->client.seconds, goodput, result->client.roundP50 * 1e3, result->client.roundP90 * 1e3, result->client.roundP99 * 1e3,
+			result->client.packetsSent, result->client.retransmitted, ratio, drops, result->client.paritySent, result->client.compressionRatio, result->client.deltaSent,
+			result->clientCpu, result->serverCpu, result->clientRss, result->serverRss, intact, digestMatch);
+	}
+	fflush(out);
+}
+
+int main(int argc, char** argv) {
+	string modes = "sr,gbn", transports = "udp", receives = "blocking", integrities = "crc32c", digests = "xxh64", parities = "0", codecs = "none", packets = "1400", windows = "32", ranges = "0", losses = "0";
+	string input = "", outputPath = "", format = "csv";
+	long size = 20000000;
+	int repeat = 1;
+
+	BenchSettings settings;
+	settings.timeout = 0.05;
+	settings.limit = 120;
+	settings.seed = 1;
+	settings.verbose = false;
+	settings.offload = false;
+	settings.metrics = "";
+	settings.metricsInterval = 1;
+	settings.trace = "";
+	settings.run = 0;
+	settings.packThreads = 2;
+	settings.blockSize = 0;
+	settings.stream = -1;
+	settings.receivers = 3;
+	settings.clientCpu = settings.serverCpu = -1;
+
+	for (int i = 1; i < argc; i++) {
+		string option = argv[i];
+		if (option.compare("--verbose") == 0) {
+			settings.verbose = true;
+			continue;
+		}
+		if (option.compare("--offload") == 0) {
+			settings.offload = true;
+			continue;
+		}
+		if (i + 1 == argc) {
+			cerr << "Missing value for " << option << endl;
+			return 1;
+		}
+		char* value = argv[++i];
+
+		if (option.compare("--mode") == 0) modes = value;
+		else if (option.compare("--transport") == 0) transports = value;
+		else if (option.compare("--receivers") == 0) settings.receivers = atoi(value);
+		else if (option.compare("--receive") == 0) receives = value;
+		else if (option.compare("--pin-client") == 0) settings.clientCpu = atoi(value);
+		else if (option.compare("--pin-server") == 0) settings.serverCpu = atoi(value);
+		else if (option.compare("--integrity") == 0) integrities = value;
+		else if (option.compare("--digest") == 0) digests = value;
+		else if (option.compare("--parity") == 0) parities = value;
+		else if (option.compare("--compress") == 0) codecs = value;
+		else if (option.compare("--pack-threads") == 0) settings.packThreads = atoi(value);
+		else if (option.compare("--packet") == 0) packets = value;
+		else if (option.compare("--window") == 0) windows = value;
+		else if (option.compare("--range") == 0) ranges = value;
+		else if (option.compare("--loss") == 0) losses = value;
+		else if (option.compare("--impair") == 0) settings.impairUp = settings.impairDown = value;
+		else if (option.compare("--impair-up") == 0) settings.impairUp = value;
+		else if (option.compare("--impair-down") == 0) settings.impairDown = value;
+		else if (option.compare("--size") == 0) size = atol(value);
+		else if (option.compare("--file") == 0) input = value;
+		else if (option.compare("--basis") == 0) settings.basis = value;
+		else if (option.compare("--block") == 0) settings.blockSize = atoi(value);
+		else if (option.compare("--stream") == 0) settings.stream = atof(value);
+		else if (option.compare("--timeout") == 0) settings.timeout = atof(value);
+		else if (option.compare("--seed") == 0) settings.seed = strtoul(value, NULL, 10);
+		else if (option.compare("--repeat") == 0) repeat = atoi(value);
+		else if (option.compare("--limit") == 0) settings.limit = atof(value);
+		else if (option.compare("--format") == 0) format = value;
+		else if (option.compare("--output") == 0) outputPath = value;
+		else if (option.compare("--metrics") == 0) settings.metrics = value;
+		else if (option.compare("--metrics-interval") == 0) settings.metricsInterval = atof(value);
+		else if (option.compare("--trace") == 0) settings.trace = value;
+		else {
+			cerr << "Unknown option " << option << endl;
+			return 1;
+		}
+	}
+	if (settings.timeout <= 0 || repeat < 1) {
+		cerr << "The timeout and repeat count must be positive\n";
+		return 1;
+	}
+	string* impairments[] = {&settings.impairUp, &settings.impairDown};
+	for (int i = 0; i < 2; i++) {
+		ImpairmentPipeline* check = ImpairmentPipeline::parse(impairments[i], WIRE_SKIP_HEADER);
+		if (check == NULL) {
+			cerr << "Could not understand the impairment " << *impairments[i] << endl;
+			return 1;
+		}
+		delete check;
+	}
+	if (settings.receivers < 1 || settings.receivers > MULTICAST_MAX_RECEIVERS) {
+		cerr << "There can be 1 to " << MULTICAST_MAX_RECEIVERS << " receivers\n";
+		return 1;
+	}
+
+
+	//Without a file, make one to send
+	char scratch[] = "/tmp/benchXXXXXX";
+	if (mkdtemp(scratch) == NULL) {
+		cerr << "Could not make a scratch directory\n";
+		return 1;
+	}
+	string generated = string(scratch) + "/input", received = string(scratch) + "/output";
+	if (input.length() == 0) {
+		input = generated;
+		if (!writeInput(input, size)) {
+			cerr << "Could not write the input file\n";
+			return 1;
+		}
+	}
+	else {
+		FILE* file = fopen(input.c_str(), "rb");
+		if (file == NULL) {
+			cerr << "Could not open " << input << endl;
+			return 1;
+		}
+		fseeko(file, 0, SEEK_END);
+		size = ftello(file);
+		fclose(file);
+	}
+
+	FILE* out = outputPath.length() > 0 ? fopen(outputPath.c_str(), "w") : stdout;
+	if (out == NULL) {
+		cerr << "Could not open " << outputPath << endl;
+		return 1;
+	}
+	bool json = format.compare("json") == 0, first = true;
+	printHeader(out, json);
+
+	vector<string> modeList = splitList(modes), transportList = splitList(transports), packetList = splitList(packets);
+	vector<string> windowList = splitList(windows), rangeList = splitList(ranges), lossList = splitList(losses), parityList = splitList(parities);
+	vector<string> receiveList = splitList(receives);
+	for (size_t i = 0; i < receiveList.size(); i++) {
+		if (receiveList[i].compare("blocking") != 0 && receiveList[i].compare("busy") != 0) {
+			cerr << "Unknown way to receive " << receiveList[i] << endl;
+			return 1;
+		}
+	}
+	vector<int> integrityList;
+	vector<string> integrityNameList = splitList(integrities);
+	for (size_t i = 0; i < integrityNameList.size(); i++) {
+		int found = 0;
+		while (found < NUM_INTEGRITY && integrityNameList[i].compare(integrityNames[found]) != 0) found++;
+		if (found == NUM_INTEGRITY) {
+			cerr << "Unknown integrity algorithm " << integrityNameList[i] << endl;
+			return 1;
+		}
+		integrityList.push_back(found);
+	}
+	vector<int> digestList;
+	vector<string> digestNameList = splitList(digests);
+	for (size_t i = 0; i < digestNameList.size(); i++) {
+		int found = 0;
+		while (found < NUM_DIGESTS && digestNameList[i].compare(digestNames[found]) != 0) found++;
+		if (found == NUM_DIGESTS && digestNameList[i].compare("none") != 0) {
+			cerr << "Unknown digest " << digestNameList[i] << endl;
+			return 1;
+		}
+		digestList.push_back(found == NUM_DIGESTS ? -1 : found);
+	}
+	vector<int> codecList;
+	vector<string> codecNameList = splitList(codecs);
+	for (size_t i = 0; i < codecNameList.size(); i++) {
+		int found = 0;
+		while (found < NUM_CODECS && codecNameList[i].compare(codecNames[found]) != 0) found++;
+		if (found == NUM_CODECS) {
+			cerr << "Unknown codec " << codecNameList[i] << endl;
+			return 1;
+		}
+		codecList.push_back(found);
+	}
+	if (settings.packThreads < 0) {
+		cerr << "The number of packing threads can't be negative\n";
+		return 1;
+	}
+	int port = 40000 + getpid() % 10000;
+
+	for (size_t m = 0; m < modeList.size(); m++)
+	for (size_t t = 0; t < transportList.size(); t++)
+	for (size_t b = 0; b < receiveList.size(); b++)
+	for (size_t c = 0; c < integrityList.size(); c++)
+	for (size_t d = 0; d < digestList.size(); d++)
+	for (size_t g = 0; g < parityList.size(); g++)
+	for (size_t z = 0; z < codecList.size(); z++)
+	for (size_t p = 0; p < packetList.size(); p++)
+	for (size_t w = 0; w < windowList.size(); w++)
+	for (size_t r = 0; r < rangeList.size(); r++)
+	for (size_t l = 0; l < lossList.size(); l++) {
+		settings.mode = modeList[m];
+		settings.transport = transportList[t];
+		settings.busy = receiveList[b].compare("busy") == 0;
+		settings.integrity = integrityList[c];
+		settings.digest = digestList[d];
+		settings.parity = atoi(parityList[g].c_str());
+		settings.codec = codecList[z];
+		settings.packetSize = packetList[p].compare("auto") == 0 ? PACKET_SIZE_AUTO : atoi(packetList[p].c_str());
+		settings.windowSize = atoi(windowList[w].c_str());
+		settings.sequenceRange = atoi(rangeList[r].c_str());
+		if (settings.sequenceRange == 0) settings.sequenceRange = settings.windowSize * 2;
+		settings.loss = atof(lossList[l].c_str());
+
+		if ((settings.packetSize < 1 && settings.packetSize != PACKET_SIZE_AUTO) || settings.windowSize < 1 || settings.sequenceRange <= settings.windowSize) {
+			cerr << "Skipping packet " << settings.packetSize << ", window " << settings.windowSize << ", range " << settings.sequenceRange
+				<< ": the sizes must be positive and the range larger than the window\n";
+			continue;
+		}
+		//Selective repeat's acks only carry ids, so an ack the server sends again for a packet the client has moved past
+		//would pass for the packet that took its id, unless the range leaves room for both windows
+		if (settings.mode.compare("gbn") != 0 && settings.sequenceRange < 2 * settings.windowSize) {
+			cerr << "Skipping sr with window " << settings.windowSize << ", range " << settings.sequenceRange << ": it needs a range of at least twice the window\n";
+			continue;
+		}
+		//A delta needs the signatures of one server's old copy, which can't be merged across several (see Multicast.cpp)
+		if (settings.transport.compare("multicast") == 0 && settings.basis.length() > 0) {
+			cerr << "Skipping multicast with --basis: a delta needs a transport to a single server\n";
+			continue;
+		}
+		//Multicast's sockets are left blocking (see Transport::setBusyPoll)
+		if (settings.transport.compare("multicast") == 0 && settings.busy) {
+			cerr << "Skipping multicast with busy receive: it only blocks\n";
+			continue;
+		}
+		if (settings.parity < 0 || settings.parity > WIRE_MAX_GROUP) {
+			cerr << "Skipping parity " << settings.parity << ": groups can be at most " << WIRE_MAX_GROUP << " packets\n";
+			continue;
+		}
+
+		for (int i = 0; i < repeat; i++) {
+			BenchResult result;
+			settings.run++;
+			runOnce(&settings, port, input, received, &result);
+			printResult(out, json, first, &settings, size, &result);
+			first = false;
+			port += 2;
+			//Different repeats shouldn't all lose the same datagrams
+			settings.seed++;
+		}
+		settings.seed -= repeat;
+	}
+
+	if (json) fprintf(out, "\n]\n");
+	if (out != stdout) fclose(out);
+
+	unlink(generated.c_str());
+	for (int i = 0; i < settings.receivers; i++) unlink(serverOutput(received, i).c_str());
+	rmdir(scratch);
+	return 0;
+}
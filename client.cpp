@@ -1,14 +1,19 @@
 
 
 //Uses GO-Back-N to send file data through the socket.
-long* GBN(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropAcks, int* dropAcks);
+TransferMetrics* GBN(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropAcks, int* dropAcks);
 
 //Uses Selective Repeating to write file data to the socket
-long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropAcks, int* dropAcks);
+TransferMetrics* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropAcks, int* dropAcks);
+
+//Do the actual work of GBN and selectRepeat once the hello is in, with ids worked out by the given id space and packets
+//checked by the given checks (see Window.cpp). "send" is the transfer's metrics, already started.
+template <class Ids, class Checks> TransferMetrics* GBNOver(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, Ids ids, Checks checks, TransferMetrics* send);
+template <class Ids, class Checks> TransferMetrics* selectRepeatOver(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, Ids ids, Checks checks, TransferMetrics* send);
 
 
 //Loads packets of data from the file, returning true if the last of the file data has been collected.
-bool packetsFromFile(int startIndex, int windowSize, int packetSize, Packet* packets, FILE* file);
+bool packetsFromFile(int startIndex, int windowSize, int packetSize, Packet* packets, FILE* file, SocketReadWriter* sock);
 
 //returns true if all packets listed have been listed as successfully transferred
 bool allDone(Packet* packets, int windowSize);
@@ -18,35 +23,53 @@ bool allDone(Packet* packets, int windowSize);
 //Uses Selective Repeating to write file data to a socket
 //sock is the read-writer class used to handle socket data
 //file is the file in question
-//packetSize is the size in bytes of each individual packet.
+//packetSize is the size in bytes of each individual packet, or PACKET_SIZE_AUTO to pick it from the path.
 //windowSize indicates how many packets there are in the window
 //sequenceRange is the maximum exclusive bound of the sequence ids (the inclusive min is 0)
 //numDropAcks is the length of the list of ids to drop (dropAcks) as part of error simulation.
-//Returns an array of longs for use in post-function statistsics
-long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropAcks, int* dropAcks) {
+//Returns the metrics of the transfer, which the caller should delete once done with them
+TransferMetrics* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropAcks, int* dropAcks) {
 
-	long* send = new long[4];
-	for (int i = 0; i < 4; i++) {
-		send[i] = 0L;
-	}
+	TransferMetrics* send = sock->startMetrics("sr", "client");
 
 
-	//If error simulation is being used, keep track of which ids have already been dropped, to avoid softlocking the program.
-	bool* alreadyDone = numDropAcks > 0 ? new bool[numDropAcks] : NULL;
-	for (int i = 0; i < numDropAcks; i++) {
-		alreadyDone[i] = false;
-	}
+	//Error simulation drops acks on their way in
+	sock->simulateDrops(numDropAcks, dropAcks, KIND_ACK, windowSize);
+
+	//Agree on how packets get checked before sending any
+	sock->agreeIntegrity();
+	LOG_DEBUG("Checking packets with " << integrityNames[sock->getIntegrity()] << "\n");
+	//A packet size picked from the path is known once the path has been probed, along with everything else
+	if (packetSize == PACKET_SIZE_AUTO) packetSize = sock->getPacketSize();
+	//Then there's room to be made for a window of them
+	sock->fitBuffers(windowSize);
+
+	//Every packet is checked as the hello settled on
+	return runWithChecks(sock->getIntegrity(), sock->getNumbered(), [&](auto checks) {
+		return runWithIds(sequenceRange, [&](auto ids) {
+			return selectRepeatOver(sock, file, packetSize, windowSize, ids, checks, send);
+		});
+	});
+}
 
+//Does the actual work of selectRepeat
+template <class Ids, class Checks> TransferMetrics* selectRepeatOver(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, Ids ids, Checks checks, TransferMetrics* send) {
 	//Initialize the packet structs
-	cout << "Intitializing packets\n";
+	LOG_INFO("Intitializing packets\n");
+	sock->trace(TRACE_START, ids.range(), -1, windowSize, packetSize);
 	Packet packets[windowSize];
 	for (int i = 0; i < windowSize; i++) {
 		Packet* pack = packets + i;
 		pack->secured = pack->transmitted = pack->terminated = false;
-		pack->id = i % sequenceRange;
+		pack->id = ids.advance(0, i);
 		pack->length = packetSize;
 		pack->content = new char[packetSize];
+		pack->packed = NULL;
+		pack->codec = CODEC_NONE;
+		pack->packedLength = 0;
+		pack->number = -1;
 		pack->checksum = -1;
+		pack->sentAt = -1;
 	}
 
 	bool noMoreFileData = false, firstRun = true;
@@ -59,16 +82,20 @@ long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windo
 		
 		//If the variables need to be shifted around (or this is the first run of the cycle) 
 		if (shiftValue > 0 || firstRun) {
-			cout << (firstRun ? "First run through\n" : "Shifting packets\n");
+			LOG_DEBUG((firstRun ? "First run through\n" : "Shifting packets\n"));
 			firstRun = false;
 			//Shift the window however many spaces we need
-			shiftWindow(shiftValue, windowSize, sequenceRange, packets);
-			cout << "Reading from file\n";
+			shiftWindow(shiftValue, windowSize, ids, packets);
+			LOG_DEBUG("Reading from file\n");
 			//Load file data into the appropriate packets (if needed)
 			if (!noMoreFileData) {
 				int start = shiftValue == 0 ? 0 : windowSize-shiftValue;
-				noMoreFileData = packetsFromFile(start, windowSize, packetSize, packets, file);
+				double reading = send->now();
+				noMoreFileData = packetsFromFile(start, windowSize, packetSize, packets, file, sock);
+				send->addTime(TIME_READING, reading);
 			}
+			//If the file ended right at the end of the last window, there's nothing left to send
+			if (noMoreFileData && allDone(packets, windowSize)) break;
 		}
 
 		//For every packet in the window
@@ -80,111 +107,144 @@ long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windo
 			//Prime the read-writer for sending
 			//sock->setData(pack->content, pack->length);
 			//sock->waitReady();
-			sock->setPacket(pack->content, pack->length, pack->id);
+			sock->setPacket(checks, pack);
 			
-			cout << (pack->transmitted ? "Retransmitting" : "Sending") << " packet of id: " << pack->id << endl;
+			LOG_DEBUG((pack->transmitted ? "Retransmitting" : "Sending") << " packet of id: " << pack->id << "\n");
 			
 			//Once ready, send the packet over;
 			if (!sock->sendPacket()) {
-				cout << "Packet of id " << pack->id << " failed\n";
+				LOG_ERROR("Packet of id " << pack->id << " failed\n");
 				continue;
 			}
 
-			if (pack->transmitted) {
-				send[1]++;
-				send[3] += pack->length;
-			}
-
-			send[0]++;
-			send[2] += pack->length;
+			//Only the first copy of a packet can be timed, since there's no telling which copy an ack is for after that
+			send->sent(pack->length, pack->transmitted);
+			pack->sentAt = pack->transmitted ? -1 : send->now();
+			sock->trace(pack->transmitted ? TRACE_RETRANSMIT : TRACE_SEND, pack->id, pack->number, i, pack->length);
 
 			//Indicate that the packet has been sent, but not that it's been verified
 			pack->transmitted = true;
 			
 		}
+		
+		//If offload is on, the window is only queued up so far
+		sock->flushPackets();
 
-		cout << "All packets sent, waiting for server to be ready to send acks\n";
-		while (!sock->waitReady());
-		sock->signalReady();
+		LOG_DEBUG("All packets sent, waiting for server to be ready to send acks\n");
+		if (!sock->exchangeReady()) {
+			LOG_ERROR("Server stopped responding\n");
+			break;
+		}
 
-		cout << "Server ready, waiting for acks\n";
+		LOG_DEBUG("Server ready, waiting for acks\n");
 
-		//The receiver is going to relay the IDs of the successful packets
-		int relayed[windowSize], relaySize = 0, acked;
-		//Until timeout, keep adding ints
+		//The receiver is going to relay the IDs of the successful packets.
+		//Duplicated acks could outnumber the window, so there's room for twice that and anything past it is left for the next round.
+		int relayed[windowSize * 2], relaySize = 0, acked;
+		//Until timeout (or the server is done sending), keep adding ints
 		while ((acked = sock->getInt()) != -3) {
-			//Check to see if we should simulate an error (pretend we failed to get this ack). If not, add it to the list
-			if (!feignError(acked, numDropAcks, dropAcks, windowSize, sequenceRange, packets[0].id, alreadyDone)) {
-				cout << "Obtained ack for packet id " << acked << endl;
-				relayed[relaySize++] = acked;
+			LOG_DEBUG("Obtained ack for packet id " << acked << "\n");
+			if (relaySize < windowSize * 2) relayed[relaySize++] = acked;
+
+			int index = windowSlot(packets, windowSize, acked, ids);
+			//An ack from outside the window is a stale copy, and there's no telling which trip round the range it's from
+			sock->trace(TRACE_ACK_RECEIVED, acked, index < windowSize ? packets[index].number : -1, index < windowSize ? index : -1, index < windowSize ? packets[index].length : 0);
+			if (index < windowSize && packets[index].sentAt >= 0) {
+				send->rtt(send->now() - packets[index].sentAt);
+				packets[index].sentAt = -1;
 			}
 		}
 		//printing window content
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
 				int i = 0;
 				 cout << "Current Window: [";
 				for(i = 0; i < windowSize-1; i++){
 					cout << packets[i].id << ", " ;
 				}
-				cout << packets[windowSize -1].id << "]"<< endl;
+				cout << packets[windowSize -1].id << "]\n";
+#endif
 
-		cout << "Timed out, for waiting for server to be ready for returned acks\n";
+		LOG_DEBUG("Timed out, for waiting for server to be ready for returned acks\n");
 
-		sock->signalReady();
-		while (!sock->waitReady());
+		if (!sock->exchangeReady()) {
+			LOG_ERROR("Server stopped responding\n");
+			break;
+		}
 
-		cout << "Server ready, returning obtained acks\n\n";
+		LOG_DEBUG("Server ready, returning obtained acks\n\n");
 
 		for (int i = 0; i < relaySize; i++) {
-			int index = 0;
-			while (packets[index].id != relayed[i]) index++;
-			packets[index].secured = true;
+			int index = windowSlot(packets, windowSize, relayed[i], ids);
+			//An ack from outside the window is for a packet already secured here, whose returned ack never reached the server.
+			//It's still sent back so the server can finish with that packet.
+			if (index < windowSize && !packets[index].terminated && !packets[index].secured) {
+				packets[index].secured = true;
+				send->delivered(packets[index].length);
+				sock->trace(TRACE_SECURED, relayed[i], packets[index].number, index, packets[index].length);
+			}
 			sock->sendInt(relayed[i]);
+			sock->trace(TRACE_ACK_RETURNED, relayed[i], index < windowSize ? packets[index].number : -1, index < windowSize ? index : -1, 0);
 		} 
 
 		//cout << "Waiting for ready before sending next header\n\n";
 
-		while (!sock->waitReady());
+		if (!sock->exchangeReady()) {
+			LOG_ERROR("Server stopped responding\n");
+			break;
+		}
+		send->endRound();
+		sock->trace(TRACE_ROUND, send->get(COUNT_ROUNDS), -1, -1, 0);
 	}
 
 	//Free the allocated data we no longer need
+	bool completed = noMoreFileData && allDone(packets, windowSize);
+	sock->finishPacking();
 	for (int i = 0; i < windowSize; i++) {
 		if (packets[i].content != NULL) delete[] packets[i].content;
+		if (packets[i].packed != NULL) delete[] packets[i].packed;
 	}
 	
-	//cout << "Sending quit signal\n\n";
-
+	//Tell the server we're done, so it doesn't have to wait to time out
+	if (completed && !sock->finish()) LOG_ERROR("Server never answered the fin\n");
+	if (sock->getDigestResult() == DIGEST_MISMATCH) LOG_ERROR("The server's " << digestNames[sock->getDigestAlgorithm()] << " of the file doesn't match\n");
 
-	//Get rid of error-tracking array we don't need anymore
-	if (alreadyDone != NULL) delete[] alreadyDone;
-	
-	//Send a packet entirely composed of 0's to indicate that we're done.
-	//sock->setData(NULL,0);
-	//sock->sendHeader(0);
-
-	return send;
+	sock->trace(TRACE_END, 0, -1, -1, 0);
+	return sock->finishMetrics();
 }
 
 
-//Loads file data into the window. Returns true if the last of the file data has been read.
-bool packetsFromFile(int startIndex, int windowSize, int packetSize, Packet* packets, FILE* file) {
+//Loads file data into the window, adding it to the read-writer's digest of the file as it goes.
+//Returns true if the last of the file data has been read.
+//If the file is a stream (see setStreaming), a packet holds whatever came in before the window had waited long enough,
+//which may be less than a full packet or nothing at all, and only the stream ending is the end of the file.
+//A packet size picked from the path can shrink along with it, and packets loaded from then on are only as long as it lets them be.
+bool packetsFromFile(int startIndex, int windowSize, int packetSize, Packet* packets, FILE* file, SocketReadWriter* sock) {
+	packetSize = sock->fitPacket(packetSize);
 	int cutoff = windowSize;
 	bool send = false;
+	double deadline = sock->getStreaming() ? sock->streamDeadline() : 0;
 	
 	for (int i = startIndex; i < windowSize; i++) {
 		//load the data into the packet
-		int bytesRead = fread(packets[i].content, 1, packetSize, file);
+		int bytesRead;
+		bool ended;
+		if (sock->getStreaming()) bytesRead = sock->readStream(file, packets[i].content, packetSize, deadline, &ended);
+		else {
+			bytesRead = fread(packets[i].content, 1, packetSize, file);
+			ended = bytesRead < packetSize;
+		}
+		sock->digestData(packets[i].content, bytesRead);
 		
 		//cout << "Read " << bytesRead << "/" << packetSize << " bytes from file, checksum value = " << inetChecksum(packets[i].content, bytesRead) <<"\n";
 		packets[i].secured = packets[i].transmitted = false;
+		packets[i].length = bytesRead;
+		packets[i].number = sock->numberPacket();
 		
-		//If the data was smaller than expected (indicating the file is done being read)
-		if (bytesRead < packetSize) {
+		//If the file is done being read
+		if (ended) {
 			//Close the file
 			fclose(file);
 			
-			//Change the length
-			packets[i].length = bytesRead;
-			
 			//Set the cutoff value to either this index or the next,
 			//Depending on whether or not this packet actually got data
 			cutoff = bytesRead == 0 ? i : i+1;
@@ -198,13 +258,17 @@ bool packetsFromFile(int startIndex, int windowSize, int packetSize, Packet* pac
 	for (int i = cutoff; i < windowSize; i++) {
 		//Free the data that won't be used
 		if (packets[i].content != NULL) delete[] packets[i].content;
-		packets[i].content = NULL;
+		if (packets[i].packed != NULL) delete[] packets[i].packed;
+		packets[i].content = packets[i].packed = NULL;
 		//Pretend the packet has already been sent so it doesn't get used
 		packets[i].secured = packets[i].terminated = true;
 		packets[i].transmitted = false;
 		packets[i].checksum = -1;
 	}
 	
+	//Whatever was read starts getting packed (if packing was agreed on) while the window goes out
+	sock->packPackets(packets + startIndex, cutoff - startIndex);
+	
 	//If we reached the end of the file, send true to indicate that these packets are the last.
 	return send;
 }
@@ -224,34 +288,53 @@ bool allDone(Packet* packets, int windowSize) {
 //Uses GO-Back-N to send file data through a socket.
 //sock is the read-writer class used to handle socket data
 //file is the file in question
-//packetSize is the size in bytes of each individual packet.
+//packetSize is the size in bytes of each individual packet, or PACKET_SIZE_AUTO to pick it from the path.
 //windowSize indicates how many packets there are in the window
 //sequenceRange is the maximum exclusive bound of the sequence ids (the inclusive min is 0)
 //numDropAcks is the length of the list of ids to drop (dropAcks) as part of error simulation.
-//Returns an array of longs for use in post-function statistsics
-long* GBN(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropAcks, int* dropAcks){
-	long* send = new long[4];
-	for (int i = 0; i < 4; i++) {
-		send[i] = 0L;
-	}
+//Returns the metrics of the transfer, which the caller should delete once done with them
+TransferMetrics* GBN(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropAcks, int* dropAcks) {
+	TransferMetrics* send = sock->startMetrics("gbn", "client");
+
+	//Error simulation drops acks on their way in
+	sock->simulateDrops(numDropAcks, dropAcks, KIND_ACK, windowSize);
+
+	//Agree on how packets get checked before sending any
+	sock->agreeIntegrity();
+	LOG_DEBUG("Checking packets with " << integrityNames[sock->getIntegrity()] << "\n");
+	//A packet size picked from the path is known once the path has been probed, along with everything else
+	if (packetSize == PACKET_SIZE_AUTO) packetSize = sock->getPacketSize();
+	//Then there's room to be made for a window of them
+	sock->fitBuffers(windowSize);
+
+	//Every packet is checked as the hello settled on
+	return runWithChecks(sock->getIntegrity(), sock->getNumbered(), [&](auto checks) {
+		return runWithIds(sequenceRange, [&](auto ids) {
+			return GBNOver(sock, file, packetSize, windowSize, ids, checks, send);
+		});
+	});
+}
+
+//Does the actual work of GBN
+template <class Ids, class Checks> TransferMetrics* GBNOver(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, Ids ids, Checks checks, TransferMetrics* send){
+	sock->trace(TRACE_START, ids.range(), -1, windowSize, packetSize);
 	
 	//Initialize packet structs
 	Packet packets[windowSize];
 	for(int i = 0; i < windowSize; i++){
 		packets[i].secured = packets[i].transmitted = packets[i].terminated = false;
-		packets[i].id = i % sequenceRange;
+		packets[i].id = ids.advance(0, i);
 		packets[i].length = packetSize;
 		packets[i].content = new char[packetSize];
+		packets[i].packed = NULL;
+		packets[i].codec = CODEC_NONE;
+		packets[i].packedLength = 0;
+		packets[i].number = -1;
 		packets[i].checksum = -1;
+		packets[i].sentAt = -1;
 
 	}
 
-	//Any ids listed to be dropped are only dropped once per entry. This makes sure no unneeded repeats are made.
-	bool* alreadyDone = numDropAcks < 1 ? NULL : new bool[numDropAcks];
-	for (int i = 0; i < numDropAcks; i++) {
-		alreadyDone[i] = false;
-	}
-
 
     bool first = true, last = false;
 
@@ -265,108 +348,145 @@ long* GBN(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, in
 		//If there are some (or this is the first run)
 		if (shiftValue > 0 || first){
         	first = false;
-			cout << "Shifting window"<< endl;
-        	shiftWindow(shiftValue, windowSize, sequenceRange, packets);
+			LOG_DEBUG("Shifting window\n");
+        	shiftWindow(shiftValue, windowSize, ids, packets);
         	
 			//If the data isn't done, load packets from the file.
 			if (!last){
             	int start = shiftValue == 0 ? 0 : windowSize - shiftValue;
-				cout << "Loading the window" << endl;
-            	last = packetsFromFile(start, windowSize, packetSize, packets, file);
+				LOG_DEBUG("Loading the window\n");
+				double reading = send->now();
+            	last = packetsFromFile(start, windowSize, packetSize, packets, file, sock);
+				send->addTime(TIME_READING, reading);
         	}
+			//Once the file is done, whatever gets shifted to the back holds old data that must never be sent again
+			else {
+				for (int i = windowSize - shiftValue; i < windowSize; i++) packets[i].terminated = true;
+			}
+			//If the file ended right at the end of the last window, there's nothing left to send
+			if (last && allDone(packets, windowSize)) break;
         }
 
-		cout << "Loaded window, sending....\n";
+		LOG_DEBUG("Loaded window, sending....\n");
         for (int i = 0; i < windowSize; i++){
             Packet *pack = packets +i;
             //If a packet has been marked as unneeded, don't send it.
 			if (pack->terminated) continue; 
-			cout << "Sending packet of id " << pack->id << endl;
-            sock->setPacket(pack->content, pack->length, pack->id);
+			LOG_DEBUG("Sending packet of id " << pack->id << "\n");
+            sock->setPacket(checks, pack);
             
 			//Send the header data, then the actual packet
 			//sock->sendHeader(pack->id);
             sock->sendPacket();
 
-			if (pack->transmitted) {
-				send[1]++;
-				send[3] += pack->length;
-			}
-
+			//Only the first copy of a packet can be timed, since there's no telling which copy an ack is for after that
+			send->sent(pack->length, pack->transmitted);
+			pack->sentAt = pack->transmitted ? -1 : send->now();
+			sock->trace(pack->transmitted ? TRACE_RETRANSMIT : TRACE_SEND, pack->id, pack->number, i, pack->length);
 			pack->transmitted = true;
-			send[0]++;
-			send[2] += pack->length;
 
         }
 
+		//If offload is on, the window is only queued up so far
+		sock->flushPackets();
 
-		cout << "Sending done, waiting for server to be ready to send acks\n";
+		LOG_DEBUG("Sending done, waiting for server to be ready to send acks\n");
 
-		while (!sock->waitReady());
-		sock->signalReady();
+		if (!sock->exchangeReady()) {
+			LOG_ERROR("Server stopped responding\n");
+			break;
+		}
 
-		cout << "Server ready, receiving acks\n";
+		LOG_DEBUG("Server ready, receiving acks\n");
 
-		//For every ack we get in return, make sure we don't have to drop it before saving it.
-        int send[windowSize], size = 0, ack;
+		//Save every ack we get in return. Duplicates could outnumber the window, and anything past twice its size is ignored.
+        int acks[windowSize * 2], size = 0, ack;
         while((ack = sock->getInt()) != -3){
-			if (!feignError(ack, numDropAcks, dropAcks, windowSize, sequenceRange, packets[0].id, alreadyDone)) {
-				cout << "Obtained ack of id " << ack << endl;
-            	send[size++] = ack;
+			LOG_DEBUG("Obtained ack of id " << ack << "\n");
+            if (size < windowSize * 2) acks[size++] = ack;
+
+			int point = windowSlot(packets, windowSize, ack, ids);
+			sock->trace(TRACE_ACK_RECEIVED, ack, point < windowSize ? packets[point].number : -1, point < windowSize ? point : -1, point < windowSize ? packets[point].length : 0);
+			if (point < windowSize && packets[point].sentAt >= 0) {
+				send->rtt(send->now() - packets[point].sentAt);
+				packets[point].sentAt = -1;
 			}
         }
 
 
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
 		int i = 0;
 		cout << "Current Window: [";
 		for(i = 0; i < windowSize-1; i++){
 			cout << packets[i].id << ", " ;
 		}
-		cout << packets[windowSize -1].id << "]"<< endl;
+		cout << packets[windowSize -1].id << "]\n";
+#endif
 
-		cout << "Time out, indicating ready to send copy of acks\n";
+		LOG_DEBUG("Time out, indicating ready to send copy of acks\n");
 
-		sock->signalReady();
-		while (!sock->waitReady());
+		if (!sock->exchangeReady()) {
+			LOG_ERROR("Server stopped responding\n");
+			break;
+		}
 
 
-		//For every ack we just got, mark it's packet as secure
+		//Acks are cumulative, so every ack we just got secures its packet and everything before it in the window.
+		//Acks from outside the window are for packets already secured.
         for (int i = 0; i < size; i++) {
-            int point = 0; 
-            while(packets[point].id != send[i]) point++;
-
-			//cout << "INDEX FOR ID " << send[i] << ": " << point << endl;
-            packets[point].secured = true;
+            int point = windowSlot(packets, windowSize, acks[i], ids);
+			if (point == windowSize || !packets[point].transmitted) continue;
+
+			//cout << "INDEX FOR ID " << acks[i] << ": " << point << endl;
+            for (int j = 0; j <= point; j++) {
+				if (!packets[j].secured) {
+					send->delivered(packets[j].length);
+					sock->trace(TRACE_SECURED, packets[j].id, packets[j].number, j, packets[j].length);
+				}
+				packets[j].secured = true;
+			}
 
-			//cout << "Sending copy of " << send[i] << endl;
+			//cout << "Sending copy of " << acks[i] << endl;
            // sock-> sendInt(send[i]);
         }
 
         bool sarad = true;
 
 		//For every packet
-		cout << "Returning copies of acks ";
+		LOG_DEBUG("Returning copies of acks ");
         for(int i = 0; i < windowSize; i++) {
 			//If it's  a secure packet (and we haven't seen a nonsecure packet yet), send its id as a parroted ack
             sarad = sarad && packets[i].secured && packets[i].transmitted;
             if (sarad) {
-				cout << packets[i].id << ", ";
+				LOG_DEBUG(packets[i].id << ", ");
 				sock->sendInt(packets[i].id);
+				sock->trace(TRACE_ACK_RETURNED, packets[i].id, packets[i].number, i, 0);
 				//cout << "Retransmitting packet id" << packets[i].id << endl;
 			}
         }
 
-		cout << "\nWaiting for server to be ready for next cycle\n\n";
-		while (!sock->waitReady());
+		LOG_DEBUG("\nWaiting for server to be ready for next cycle\n\n");
+		if (!sock->exchangeReady()) {
+			LOG_ERROR("Server stopped responding\n");
+			break;
+		}
+		send->endRound();
+		sock->trace(TRACE_ROUND, send->get(COUNT_ROUNDS), -1, -1, 0);
 
     }
 
-	if (alreadyDone != NULL) delete[] alreadyDone;
-
+    bool completed = last && allDone(packets, windowSize);
+	sock->finishPacking();
     for (int i = 0; i < windowSize; i ++){
         if (packets[i].content != NULL) delete[] packets[i].content;
-		cout << "deallocating the packet content" << endl;
+		if (packets[i].packed != NULL) delete[] packets[i].packed;
+		LOG_DEBUG("deallocating the packet content\n");
     }
+
+	//Tell the server we're done, so it doesn't have to wait to time out
+	if (completed && !sock->finish()) LOG_ERROR("Server never answered the fin\n");
+	if (sock->getDigestResult() == DIGEST_MISMATCH) LOG_ERROR("The server's " << digestNames[sock->getDigestAlgorithm()] << " of the file doesn't match\n");
     
-	return send;
+	sock->trace(TRACE_END, 0, -1, -1, 0);
+	return sock->finishMetrics();
 }
@@ -0,0 +1,599 @@
+//Measures the hot-path helpers on their own: the checksum and CRC32C, the file digests, window shifting and slot lookup, error simulation, the packet list,
+//packing/unpacking packets, making a delta, and looking for blocks of zeroes. Each one runs across realistic packet and window sizes, and reports
+//nanoseconds per call and, for anything that walks over bytes, bytes per CPU cycle.
+//The original versions of anything that has since been replaced are kept below, so old and new are
+//always measured side by side, and checked to give the same answers.
+//
+//Usage: microbench.exe [seconds per measurement, default 0.2]
+
+#include "SocketReadWriter.cpp"
+#include "LinkedList.cpp"
+#include <time.h>
+
+namespace clientSide {
+#include "client.cpp"
+}
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+//How long each measurement runs for
+double measureTime = 0.2;
+
+//Results are added up here so the compiler can't throw the work away
+volatile long sink = 0;
+
+
+//The original checksum, which adds up one 16 bit word at a time, a byte at a time
+short inetChecksumBytewise(char* bytes, int length) {
+	unsigned short send = 0;
+
+	if (bytes == NULL) return send;
+	for (int i = 0, shortSize = sizeof(send), key = 1 << (shortSize * 8); i < length; i += shortSize) {
+		unsigned short next = 0;
+		char* nextBytes = (char*) &next;
+		for (int j = 0; j < shortSize && (j + i) < length; j++) {
+			nextBytes[j] = bytes[j + i];
+		}
+		int sum = ((int) send) + next;
+		if (sum & key) sum++;
+		send = sum & (key-1);
+	}
+	return ~send;
+}
+
+//The original window shift, which rotates the window one packet at a time
+void shiftWindowStepwise(int shiftValue, int windowSize, int sequenceRange, Packet* packets) {
+	if (shiftValue == 0) return;
+
+	if (shiftValue != windowSize) {
+		for (int i = 0, last = windowSize - 1; i < shiftValue; i++) {
+			Packet pack = packets[0];
+			for (int j = 1; j < windowSize; j++) {
+				packets[j-1] = packets[j];
+			}
+			packets[last] = pack;
+		}
+		for (int i = 1; i < windowSize; i++) {
+			packets[i].id = (packets[i-1].id + 1) % sequenceRange;
+		}
+	}
+	else {
+		for (int i = 0; i < windowSize; i++) {
+			packets[i].id = (packets[i].id + windowSize) % sequenceRange;
+			packets[i].secured = packets[i].transmitted = false;
+			packets[i].checksum = -1;
+		}
+	}
+}
+
+//shiftWindow with the id space a transfer would pick for the range, which is a mask for the ranges runWithIds knows
+void shiftWindowPicked(int shiftValue, int windowSize, int sequenceRange, Packet* packets) {
+	runWithIds(sequenceRange, [&](auto ids) {
+		shiftWindow(shiftValue, windowSize, ids, packets);
+		return (TransferMetrics*) NULL;
+	});
+}
+
+//The original way of finding an id's slot, by looking through the window for it
+int windowSlotScan(Packet* window, int windowSize, int id) {
+	for (int i = 0; i < windowSize; i++) {
+		if (window[i].id == id) return i;
+	}
+	return windowSize;
+}
+
+
+//Returns the wall-clock time in seconds
+double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//Returns the CPU's cycle counter, or 0 where there isn't one to read
+unsigned long long cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+//Timing for one measurement. start() before the work, and stop() once "ops" calls that each touched "bytes" bytes are done.
+typedef struct Timing {
+	double wall;
+	unsigned long long ticks;
+} Timing;
+
+Timing start() {
+	Timing send;
+	send.ticks = cycles();
+	send.wall = now();
+	return send;
+}
+
+//Prints one line of results. bytes is 0 for anything that isn't about bytes.
+void stop(Timing begin, const char* name, long size, long ops, long bytes) {
+	double elapsed = now() - begin.wall;
+	unsigned long long ticks = cycles() - begin.ticks;
+	char perCycle[32] = "-";
+	if (bytes > 0 && ticks > 0) snprintf(perCycle, sizeof(perCycle), "%.3f", (double) bytes * ops / ticks);
+	printf("%-32s %8ld %12.2f %12s\n", name, size, elapsed * 1e9 / ops, perCycle);
+}
+
+//Works out how many calls fit in the measurement time, given how long a trial run of "trial" calls took
+long scaleOps(long trial, double trialTime) {
+	long send = trialTime > 0 ? (long) (trial * measureTime / trialTime) : trial * 100;
+	return send < 1 ? 1 : send;
+}
+
+//Measures adding a packet's worth of data to each file digest, the way both sides do for every packet they read or write
+void benchDigest(char* data, int size) {
+	//Both have to give the standard answers first
+	const char* expected[NUM_DIGESTS] = {"900150983cd24fb0d6963f7d28e17f72", "44bc2cf5ad770999"};
+	for (int d = 0; d < NUM_DIGESTS; d++) {
+		FileDigest check(d);
+		check.add("abc", 3);
+		unsigned char digest[DIGEST_MAX_BYTES];
+		char hex[2 * DIGEST_MAX_BYTES + 1];
+		FileDigest::toHex(digest, check.finish(digest), hex);
+		if (strcmp(hex, expected[d]) != 0) {
+			printf("%s gives the wrong digest of \"abc\"\n", digestNames[d]);
+			exit(1);
+		}
+	}
+
+	for (int d = 0; d < NUM_DIGESTS; d++) {
+		FileDigest digest(d);
+		double trialStart = now();
+		for (int i = 0; i < 1000; i++) digest.add(data, size);
+		long ops = scaleOps(1000, now() - trialStart);
+
+		char name[32];
+		snprintf(name, sizeof(name), "digest (%s)", digestNames[d]);
+		Timing begin = start();
+		for (long i = 0; i < ops; i++) digest.add(data, size);
+		stop(begin, name, size, ops, size);
+		unsigned char out[DIGEST_MAX_BYTES];
+		sink += digest.finish(out) + out[0];
+	}
+}
+
+//Times packing and unpacking a packet of log-like text with each codec, after checking that it comes back the same
+void benchCodecs(int size) {
+	char* text = new char[size];
+	for (int i = 0; i < size; i++) text[i] = "2026-10-19 08:03:11,INFO,host7,req=183467,latency_ms=41.27,status=200\n"[(i + i / 71 * 13) % 71];
+	char* packed = new char[size];
+	char* unpacked = new char[size];
+	Codec codec;
+
+	for (int c = CODEC_LZ; c < NUM_CODECS; c++) {
+		//A packet too short to hold any repeats doesn't get any smaller, so there's nothing to time
+		int length = codec.pack(c, text, size, packed, size);
+		if (length == 0) continue;
+		if (codec.unpack(c, packed, length, unpacked, size) != size || memcmp(text, unpacked, size) != 0) {
+			printf("%s doesn't give back what it packed\n", codecNames[c]);
+			exit(1);
+		}
+
+		double trialStart = now();
+		for (int i = 0; i < 100; i++) sink += codec.pack(c, text, size, packed, size);
+		long ops = scaleOps(100, now() - trialStart);
+		char name[32];
+		snprintf(name, sizeof(name), "pack (%s, %.1fx)", codecNames[c], (double) size / length);
+		Timing begin = start();
+		for (long i = 0; i < ops; i++) sink += codec.pack(c, text, size, packed, size);
+		stop(begin, name, size, ops, size);
+
+		trialStart = now();
+		for (int i = 0; i < 100; i++) sink += codec.unpack(c, packed, length, unpacked, size);
+		ops = scaleOps(100, now() - trialStart);
+		snprintf(name, sizeof(name), "unpack (%s)", codecNames[c]);
+		begin = start();
+		for (long i = 0; i < ops; i++) sink += codec.unpack(c, packed, length, unpacked, size);
+		stop(begin, name, size, ops, size);
+	}
+	delete[] text;
+	delete[] packed;
+	delete[] unpacked;
+}
+
+//Times making a delta of "size" bytes, against an old copy that's the same ("matching") or has nothing in common.
+//With nothing in common the weak checksum is rolled and looked up at every byte, which is as slow as it gets.
+void benchDelta(char* data, int size, bool matching) {
+	char* old = new char[size];
+	for (int i = 0; i < size; i++) old[i] = matching ? data[i] : (char) (data[i] * 7 + 1);
+	FILE* basis = fmemopen(old, size, "rb");
+	BlockSignatures* signatures = BlockSignatures::fromFile(basis, 0);
+	fclose(basis);
+	char* stream = new char[size + size / 8 + 64];
+
+	long ops = 0;
+	Timing begin = start();
+	double until = now() + measureTime;
+	do {
+		FILE* file = fmemopen(data, size, "rb");
+		BlockSignatures* copy = new BlockSignatures(*signatures);
+		DeltaEncoder encoder(file, copy);
+		sink += encoder.read(stream, size + size / 8 + 64);
+		fclose(file);
+		ops++;
+	} while (now() < until);
+	stop(begin, matching ? "delta (all matching)" : "delta (nothing matching)", size, ops, size);
+
+	delete signatures;
+	delete[] stream;
+	delete[] old;
+}
+
+//Fills a window of packets the way the sender would have it
+void fillWindow(Packet* packets, int windowSize, int sequenceRange) {
+	for (int i = 0; i < windowSize; i++) {
+		packets[i].id = i % sequenceRange;
+		packets[i].length = 1400;
+		packets[i].checksum = -1;
+		packets[i].secured = packets[i].transmitted = packets[i].terminated = false;
+		packets[i].content = packets[i].packed = NULL;
+		packets[i].codec = CODEC_NONE;
+		packets[i].packedLength = 0;
+		packets[i].integrity = INTEGRITY_INET;
+		packets[i].number = i;
+		packets[i].sentAt = -1;
+	}
+}
+
+
+void benchChecksum(char* data, int size) {
+	//The two versions have to agree before their speed means anything
+	if (inetChecksum(data, size) != inetChecksumBytewise(data, size)) {
+		printf("inetChecksum disagrees with the original for %d bytes\n", size);
+		exit(1);
+	}
+
+	short (*versions[])(char*, int) = {inetChecksum, inetChecksumBytewise};
+	const char* names[] = {"inetChecksum", "inetChecksum (original)"};
+	for (int v = 0; v < 2; v++) {
+		double trialStart = now();
+		for (int i = 0; i < 1000; i++) sink += versions[v](data, size);
+		long ops = scaleOps(1000, now() - trialStart);
+
+		Timing begin = start();
+		for (long i = 0; i < ops; i++) sink += versions[v](data, size);
+		stop(begin, names[v], size, ops, size);
+	}
+}
+
+//Measures every version of CRC32C this processor can run, next to each other and to inetChecksum above
+void benchCrc32c(char* data, int size) {
+	uint32_t (*versions[3])(uint32_t, const char*, size_t) = {crc32cTable, NULL, NULL};
+	const char* names[] = {"crc32c (slicing-by-8)", "crc32c (sse4.2)", "crc32c (sse4.2 + pclmul)"};
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) versions[1] = crc32cHardware;
+	if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) versions[2] = crc32cInterleaved;
+#endif
+
+	//Every version has to agree with the tables (and the tables with the standard check value) first
+	if (crc32c("123456789", 9) != 0xE3069283) {
+		printf("crc32c gives the wrong check value\n");
+		exit(1);
+	}
+	for (int v = 1; v < 3; v++) {
+		if (versions[v] != NULL && versions[v](0xFFFFFFFF, data, size) != crc32cTable(0xFFFFFFFF, data, size)) {
+			printf("%s disagrees with the tables for %d bytes\n", names[v], size);
+			exit(1);
+		}
+	}
+
+	for (int v = 0; v < 3; v++) {
+		if (versions[v] == NULL) continue;
+		double trialStart = now();
+		for (int i = 0; i < 1000; i++) sink += versions[v](0xFFFFFFFF, data, size);
+		long ops = scaleOps(1000, now() - trialStart);
+
+		Timing begin = start();
+		for (long i = 0; i < ops; i++) sink += versions[v](0xFFFFFFFF, data, size);
+		stop(begin, names[v], size, ops, size);
+	}
+}
+
+//Measures every version of allZero this processor can run on a block of nothing but zeroes, which is the worst case, as
+//every byte has to be looked at
+void benchAllZero(int size) {
+	bool (*versions[3])(const char*, size_t) = {allZeroPlain, NULL, NULL};
+	const char* names[] = {"allZero (plain)", "allZero (sse2)", "allZero (avx2)"};
+#if defined(__x86_64__)
+	versions[1] = allZeroSse2;
+	if (__builtin_cpu_supports("avx2")) versions[2] = allZeroAvx2;
+#endif
+	char* zeroes = new char[size + 1];
+	memset(zeroes, 0, size + 1);
+
+	//Every version has to notice a single byte that isn't zero, wherever it is (every byte near the ends, where the
+	//leftovers are, and a spread of them in between)
+	for (int v = 0; v < 3; v++) {
+		if (versions[v] == NULL) continue;
+		bool right = versions[v](zeroes, size);
+		for (int at = 0; at < size && right; at += at < 256 || at >= size - 256 ? 1 : 61) {
+			zeroes[at] = 1;
+			right = !versions[v](zeroes, size) && versions[v](zeroes, at);
+			zeroes[at] = 0;
+		}
+		if (!right) {
+			printf("%s is wrong for %d bytes\n", names[v], size);
+			exit(1);
+		}
+	}
+
+	for (int v = 0; v < 3; v++) {
+		if (versions[v] == NULL) continue;
+		double trialStart = now();
+		for (int i = 0; i < 1000; i++) sink += versions[v](zeroes, size);
+		long ops = scaleOps(1000, now() - trialStart);
+
+		Timing begin = start();
+		for (long i = 0; i < ops; i++) sink += versions[v](zeroes, size);
+		stop(begin, names[v], size, ops, size);
+	}
+	delete[] zeroes;
+}
+
+void benchShiftWindow(int windowSize, int shiftValue) {
+	int sequenceRange = windowSize * 2;
+	Packet packets[windowSize], masked[windowSize], original[windowSize];
+	fillWindow(packets, windowSize, sequenceRange);
+	fillWindow(masked, windowSize, sequenceRange);
+	fillWindow(original, windowSize, sequenceRange);
+	for (int i = 0; i < windowSize; i++) packets[i].length = masked[i].length = original[i].length = i;
+
+	shiftWindow(shiftValue, windowSize, sequenceRange, packets);
+	shiftWindowPicked(shiftValue, windowSize, sequenceRange, masked);
+	shiftWindowStepwise(shiftValue, windowSize, sequenceRange, original);
+	for (int i = 0; i < windowSize; i++) {
+		if (packets[i].id != original[i].id || packets[i].length != original[i].length) {
+			printf("shiftWindow disagrees with the original for window %d, shift %d\n", windowSize, shiftValue);
+			exit(1);
+		}
+		if (masked[i].id != original[i].id || masked[i].length != original[i].length) {
+			printf("shiftWindow (masked) disagrees with the original for window %d, shift %d\n", windowSize, shiftValue);
+			exit(1);
+		}
+	}
+
+	void (*versions[])(int, int, int, Packet*) = {shiftWindowPicked, shiftWindow, shiftWindowStepwise};
+	const char* names[] = {"shiftWindow (masked)", "shiftWindow", "shiftWindow (original)"};
+	char name[64];
+	for (int v = 0; v < 3; v++) {
+		double trialStart = now();
+		for (int i = 0; i < 100; i++) versions[v](shiftValue, windowSize, sequenceRange, packets);
+		long ops = scaleOps(100, now() - trialStart);
+
+		snprintf(name, sizeof(name), "%s by %d", names[v], shiftValue);
+		Timing begin = start();
+		for (long i = 0; i < ops; i++) versions[v](shiftValue, windowSize, sequenceRange, packets);
+		stop(begin, name, windowSize, ops, 0);
+		sink += packets[0].id;
+	}
+}
+
+void benchWindowSlot(int windowSize) {
+	Packet packets[windowSize];
+	fillWindow(packets, windowSize, windowSize * 2);
+	//Every id in the range once, so half are in the window and half aren't
+	int range = windowSize * 2;
+	for (int id = 0; id < range; id++) {
+		if (windowSlot(packets, windowSize, id, RangeIds(range)) != windowSlotScan(packets, windowSize, id)) {
+			printf("windowSlot disagrees with the original for window %d, id %d\n", windowSize, id);
+			exit(1);
+		}
+	}
+
+	double trialStart = now();
+	for (int i = 0; i < 1000; i++) sink += windowSlot(packets, windowSize, i % range, RangeIds(range));
+	long ops = scaleOps(1000, now() - trialStart);
+
+	Timing begin = start();
+	for (long i = 0; i < ops; i++) sink += windowSlot(packets, windowSize, i % range, RangeIds(range));
+	stop(begin, "windowSlot", windowSize, ops, 0);
+
+	begin = start();
+	for (long i = 0; i < ops; i++) sink += windowSlotScan(packets, windowSize, i % range);
+	stop(begin, "windowSlot (original)", windowSize, ops, 0);
+}
+
+void benchAllDone(int windowSize) {
+	Packet packets[windowSize];
+	fillWindow(packets, windowSize, windowSize * 2);
+	//Worst case: everything but the last packet is done, so the whole window is checked
+	for (int i = 0; i < windowSize - 1; i++) packets[i].secured = true;
+
+	double trialStart = now();
+	for (int i = 0; i < 1000; i++) sink += clientSide::allDone(packets, windowSize);
+	long ops = scaleOps(1000, now() - trialStart);
+
+	Timing begin = start();
+	for (long i = 0; i < ops; i++) sink += clientSide::allDone(packets, windowSize);
+	stop(begin, "allDone", windowSize, ops, 0);
+}
+
+void benchFeignError(int numDrops) {
+	int drops[numDrops > 0 ? numDrops : 1];
+	bool alreadyDone[numDrops > 0 ? numDrops : 1];
+	for (int i = 0; i < numDrops; i++) {
+		drops[i] = i;
+		alreadyDone[i] = false;
+	}
+
+	//An id that's never in the list, so the whole list is searched every time
+	double trialStart = now();
+	for (int i = 0; i < 1000; i++) sink += feignError(-1, numDrops, drops, 32, 64, 0, alreadyDone);
+	long ops = scaleOps(1000, now() - trialStart);
+
+	Timing begin = start();
+	for (long i = 0; i < ops; i++) sink += feignError(-1, numDrops, drops, 32, 64, 0, alreadyDone);
+	stop(begin, numDrops == -1 ? "feignError (random)" : "feignError (list)", numDrops, ops, 0);
+}
+
+void benchLinkedList(int count) {
+	Packet pack;
+	pack.length = 1400;
+	pack.content = pack.packed = NULL;
+	pack.codec = CODEC_NONE;
+	pack.packedLength = 0;
+	pack.checksum = 0;
+	pack.integrity = INTEGRITY_INET;
+	pack.number = -1;
+	pack.sentAt = -1;
+	pack.secured = pack.transmitted = pack.terminated = false;
+
+	//add and removeFirst are measured together, since the list has to be emptied again anyway
+	LinkedList* list = new LinkedList();
+	double trialStart = now();
+	for (int i = 0; i < count; i++) {
+		pack.id = i;
+		list->add(pack);
+	}
+	while (list->getSize() != 0) sink += list->removeFirst().id;
+	long rounds = scaleOps(1, now() - trialStart);
+
+	Timing begin = start();
+	for (long r = 0; r < rounds; r++) {
+		for (int i = 0; i < count; i++) {
+			pack.id = i;
+			list->add(pack);
+		}
+		while (list->getSize() != 0) sink += list->removeFirst().id;
+	}
+	stop(begin, "LinkedList add+removeFirst", count, rounds * count, 0);
+
+	//getByID for every id in a full list, so on average half the list is walked
+	for (int i = 0; i < count; i++) {
+		pack.id = i;
+		list->add(pack);
+	}
+	trialStart = now();
+	for (int i = 0; i < count; i++) sink += list->getByID(i).id;
+	long ops = scaleOps(count, now() - trialStart);
+	begin = start();
+	for (long i = 0; i < ops; i++) sink += list->getByID(i % count).id;
+	stop(begin, "LinkedList getByID", count, ops, 0);
+
+	//removeIfNotPresent keeping every other id. What's removed is added back so every call does the same work.
+	int numIds = count / 2 > 0 ? count / 2 : 1;
+	int ids[numIds];
+	for (int i = 0; i < numIds; i++) ids[i] = i * 2;
+	trialStart = now();
+	LinkedList* removed = list->removeIfNotPresent(ids, numIds);
+	if (removed != NULL) {
+		while (removed->getSize() != 0) list->add(removed->removeFirst());
+		delete removed;
+	}
+	rounds = scaleOps(1, now() - trialStart);
+	begin = start();
+	for (long r = 0; r < rounds; r++) {
+		removed = list->removeIfNotPresent(ids, numIds);
+		if (removed != NULL) {
+			while (removed->getSize() != 0) list->add(removed->removeFirst());
+			delete removed;
+		}
+	}
+	stop(begin, "LinkedList removeIfNotPresent", count, rounds, 0);
+
+	delete list;
+}
+
+void benchPacking(int packetSize) {
+	string ip = "localhost";
+	SocketReadWriter* sock = SocketReadWriter::getInstance(&ip, 0, packetSize);
+	if (sock == NULL) {
+		printf("Could not make a read-writer for %d bytes\n", packetSize);
+		return;
+	}
+	char* data = new char[packetSize];
+	for (int i = 0; i < packetSize; i++) data[i] = (char) (i * 31);
+
+	double trialStart = now();
+	for (int i = 0; i < 1000; i++) sock->setPacket(data, packetSize, i & 63, i);
+	long ops = scaleOps(1000, now() - trialStart);
+	Timing begin = start();
+	for (long i = 0; i < ops; i++) sock->setPacket(data, packetSize, i & 63, i);
+	stop(begin, "SocketReadWriter::setPacket", packetSize, ops, packetSize);
+
+	Header head;
+	trialStart = now();
+	for (int i = 0; i < 1000; i++) {
+		char* parsed = sock->parseData(&head, 64);
+		delete[] parsed;
+	}
+	ops = scaleOps(1000, now() - trialStart);
+	begin = start();
+	for (long i = 0; i < ops; i++) {
+		char* parsed = sock->parseData(&head, 64);
+		sink += parsed[0];
+		delete[] parsed;
+	}
+	stop(begin, "SocketReadWriter::parseData", packetSize, ops, packetSize);
+
+	delete[] data;
+	delete sock;
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1) measureTime = atof(argv[1]);
+	if (measureTime <= 0) {
+		cerr << "The time per measurement must be positive\n";
+		return 1;
+	}
+
+	printf("%-32s %8s %12s %12s\n", "benchmark", "size", "ns/op", "bytes/cycle");
+
+	int packetSizes[] = {64, 512, 1400, 8192, 65507};
+	int numPacketSizes = sizeof(packetSizes) / sizeof(packetSizes[0]);
+	int windowSizes[] = {8, 64, 512};
+	int numWindowSizes = sizeof(windowSizes) / sizeof(windowSizes[0]);
+
+	char* data = new char[65536];
+	srand(1);
+	for (int i = 0; i < 65536; i++) data[i] = (char) rand();
+	for (int i = 0; i < numPacketSizes; i++) benchChecksum(data, packetSizes[i]);
+	//Odd lengths take the path for a lone last byte
+	benchChecksum(data, 1401);
+	for (int i = 0; i < numPacketSizes; i++) benchCrc32c(data, packetSizes[i]);
+	benchCrc32c(data, 1401);
+	for (int i = 0; i < numPacketSizes; i++) benchDigest(data, packetSizes[i]);
+	for (int i = 0; i < numPacketSizes; i++) benchCodecs(packetSizes[i]);
+	delete[] data;
+
+	data = new char[1 << 20];
+	for (int i = 0; i < 1 << 20; i++) data[i] = (char) rand();
+	benchDelta(data, 1 << 20, true);
+	benchDelta(data, 1 << 20, false);
+	delete[] data;
+
+	benchAllZero(SPARSE_BLOCK);
+	benchAllZero(SPARSE_MAX_DATA);
+	//Lengths that aren't a multiple of any register take the plain path for what's left
+	benchAllZero(SPARSE_BLOCK + 77);
+
+	for (int i = 0; i < numWindowSizes; i++) {
+		benchShiftWindow(windowSizes[i], 1);
+		benchShiftWindow(windowSizes[i], windowSizes[i] / 2);
+		benchShiftWindow(windowSizes[i], windowSizes[i]);
+	}
+
+	for (int i = 0; i < numWindowSizes; i++) benchWindowSlot(windowSizes[i]);
+
+	for (int i = 0; i < numWindowSizes; i++) benchAllDone(windowSizes[i]);
+
+	benchFeignError(-1);
+	benchFeignError(1);
+	benchFeignError(16);
+	benchFeignError(256);
+
+	for (int i = 0; i < numWindowSizes; i++) benchLinkedList(windowSizes[i]);
+
+	for (int i = 0; i < numPacketSizes; i++) benchPacking(packetSizes[i]);
+
+	return sink == 42 ? 1 : 0;
+}
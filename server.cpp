@@ -1,39 +1,73 @@
+
+//Writes every packet in the list to the file, freeing them as it goes. Returns false if the file couldn't take one.
+bool writePackets(LinkedList* linkedList, FILE* file, SocketReadWriter* sock, TransferMetrics* metrics);
+
+//Do the actual work of selectRepeat and GBN once a transfer has started, with ids worked out by the given id space and
+//packets checked by the given checks (see Window.cpp). "send" is the transfer's metrics, already started.
+//GBN's rounds are held back for parity if PARITY is true.
+template <class Ids, class Checks> TransferMetrics* selectRepeatOver(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, Ids ids, Checks checks, int missed, TransferMetrics* send);
+template <bool PARITY, class Ids, class Checks> TransferMetrics* GBNOver(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, Ids ids, Checks checks, int missed, TransferMetrics* send);
+
+
 //Uses Selective Repeating to write socket data to a file.
 //sock is the read-writer class used to handle socket data
 //file is the file in question
-//packetSize is the size in bytes of each individual packet.
+//packetSize is the size in bytes of each individual packet, or PACKET_SIZE_AUTO to pick it from the path.
 //windowSize indicates how many packets there are in the window
 //sequenceRange is the maximum exclusive bound of the sequence ids (the inclusive min is 0)
 //numDropAcks is the length of the list of ids to drop (dropAcks) as part of error simulation.
-//Returns an array of longs for use in post-function statistsics
-long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropPacks, int* dropPacks) {
-	long* send = new long[3];
-	for (int i = 0; i < 3; i++) {
-		send[i] = 0L;
-	}
+//Returns the metrics of the transfer, which the caller should delete once done with them
+TransferMetrics* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropPacks, int* dropPacks) {
+	TransferMetrics* send = sock->startMetrics("sr", "server");
+	//If the client picks its packet size from the path, take anything it could pick
+	if (packetSize == PACKET_SIZE_AUTO) packetSize = sock->getPacketSize();
+	//Make room for a window of them before any come in
+	sock->fitBuffers(windowSize);
 
 
-	//If error simulation is being used, keep track of which ids have already been dropped, to avoid softlocking the program.
-	bool* alreadyDone = numDropPacks > 0 ? new bool[numDropPacks] : NULL;
-	for (int i = 0; i < numDropPacks; i++) {
-		alreadyDone[i] = false;
-	}
+	//Error simulation drops packets on their way in
+	sock->simulateDrops(numDropPacks, dropPacks, KIND_DATA, windowSize);
 	
+	//How packets are checked is settled by the client's hello, which comes ahead of its first packet. The timeouts spent
+	//waiting for it count towards the 8 the transfer gives up after, and its first round waits once more.
+	int missed = sock->awaitPacket(7);
+	return runWithChecks(sock->getIntegrity(), sock->getNumbered(), [&](auto checks) {
+		return runWithIds(sequenceRange, [&](auto ids) {
+			return selectRepeatOver(sock, file, packetSize, windowSize, ids, checks, missed, send);
+		});
+	});
+}
+
+//Does the actual work of selectRepeat
+template <class Ids, class Checks> TransferMetrics* selectRepeatOver(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, Ids ids, Checks checks, int missed, TransferMetrics* send) {
 	//Initialize the packet structs
-	cout << "Initializing packets\n";
+	LOG_INFO("Initializing packets\n");
+	sock->trace(TRACE_START, ids.range(), -1, windowSize, packetSize);
 	Packet packets[windowSize];
 	for (int i = 0; i < windowSize; i++) {
 		Packet* pack = packets + i;
 		pack->secured = pack->transmitted = false;
-		pack->id = i % sequenceRange;
+		pack->id = ids.advance(0, i);
 		pack->length = packetSize;
 		pack->content = NULL;
+		pack->packed = NULL;
+		pack->codec = CODEC_NONE;
+		pack->packedLength = 0;
+		pack->number = -1;
 		pack->checksum = -1;
+		pack->integrity = INTEGRITY_INET;
 		pack->terminated = false;
+		pack->sentAt = -1;
 	}
 
 
-	int timesNothingFound = 0;
+	int timesNothingFound = missed;
+	
+	//The number of the packet in the first slot of the window, counted from the start of the file (see PacketChecks::fits)
+	long long firstNumber = 0;
+	
+	//Cleared once the file won't take a write (a full disk, or whatever reads a stream has gone), which ends the transfer
+	bool written = true;
 
 	//Until we have gotten all the file data.
 	while (true) {
@@ -45,15 +79,29 @@ long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windo
 		//If the variables need to be shifted around, do so.
 		if (shiftValue > 0) {
 			//cout << "Shifting packets\n";
-			shiftWindow(shiftValue, windowSize, sequenceRange, packets);
-			cout << "Writing shifted packets to file\n";
+			shiftWindow(shiftValue, windowSize, ids, packets);
+			firstNumber += shiftValue;
+			LOG_DEBUG("Writing shifted packets to file\n");
 			//For every packet that was shifted to the back, write its data to the file
+			double writing = send->now();
 			for (int i = windowSize - shiftValue; i < windowSize; i++) {
-				cout << "WRITING PACKET INDEX " << i << endl;
-				fwrite(packets[i].content,1,packets[i].length, file);
+				LOG_DEBUG("WRITING PACKET INDEX " << i << "\n");
+				//fwrite only comes up short when the file can't take any more, and only what it took counts as delivered
+				written = fwrite(packets[i].content, 1, packets[i].length, file) == (size_t) packets[i].length;
+				if (!written) break;
+				sock->digestData(packets[i].content, packets[i].length);
+				send->delivered(packets[i].length);
+				//The shift has already moved these to the back and given them the ids of the packets that come next
+				sock->trace(TRACE_WRITE, ids.advance(packets[i].id, -windowSize), firstNumber - windowSize + i, i, packets[i].length);
 				packets[i].transmitted = packets[i].secured = false;
 			}
-			
+			//Whatever reads a stream gets each round's data as soon as it's in, unless it's gone
+			if (written && sock->getStreaming()) written = fflush(file) == 0;
+			send->addTime(TIME_WRITING, writing);
+			if (!written) {
+				LOG_ERROR("Couldn't write to the file: " << strerror(errno) << "\n");
+				break;
+			}
 		}
 		
 		bool gotPacket = false;
@@ -62,26 +110,40 @@ long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windo
 		while (sock->getPacket()) {
 			gotPacket = true;
 			Header head;
-			char* data = sock->parseData(&head, sequenceRange);
+			char* data = sock->parseData(checks, &head, ids.range());
+			
+			send->count(COUNT_PACKETS_RECEIVED);
+			if (data == NULL) send->count(COUNT_MALFORMED);
+			else send->count(COUNT_BYTES_RECEIVED, head.length);
 			
-			send[0] = head.id;
-			send[1]++;
+			//A packet that got damaged on the way is no use, and shouldn't replace a good copy that already arrived
+			if (data != NULL && checks.sum(data, head.length) != head.checksum) {
+				send->count(COUNT_CHECKSUM_FAILURES);
+				sock->trace(TRACE_CORRUPT, head.id, -1, -1, head.length);
+				delete[] data;
+				continue;
+			}
 			
-			//Check to see if there actually is decent data, and if should simulate an error (Pretend we failed to grab this packet).
-			//If the packet checks out, add it to the window
-			if (data != NULL && !feignError(head.id, numDropPacks, dropPacks, windowSize, sequenceRange, packets[0].id, alreadyDone)) {
-				cout << "packet of id: " << head.id << "recieved" << endl;
+			//Check to see if there actually is decent data. If the packet checks out, add it to the window
+			if (data != NULL) {
+				LOG_DEBUG("packet of id: " << head.id << "recieved\n");
 				
 				//Find the packet of the right id
-				int index = 0;
-				while (index < windowSize && packets[index].id != head.id) index++;
+				int index = windowSlot(packets, windowSize, head.id, ids);
 				Packet* pack = packets + index;
+				//A packet from another trip round the sequence range can have an id in the window, but not the number of its slot
+				bool outside = index == windowSize || !checks.fits(&head, firstNumber + index);
 				
-				//If this packet is outside the window parameters, we can't use it.
-				if (index == windowSize) {
+				//If this packet is outside the window parameters, or a repeat of one already secured, we can't use it.
+				if (outside || pack->secured) {
+					send->count(outside ? COUNT_OUT_OF_WINDOW : COUNT_DUPLICATES);
+					sock->trace(outside ? TRACE_OUT_OF_WINDOW : TRACE_DUPLICATE, head.id, outside ? head.number : firstNumber + index, outside ? -1 : index, head.length);
 					if (data != NULL) delete[] data;
 					continue;
 				}
+				//A second copy of one that's still waiting on its returned ack just takes the place of the first
+				if (pack->transmitted) send->count(COUNT_DUPLICATES);
+				sock->trace(pack->transmitted ? TRACE_DUPLICATE : TRACE_RECEIVE, head.id, firstNumber + index, index, head.length);
 
 				//Overwrite the data in the current struct.
 				if (pack->content != NULL) delete[] pack->content;
@@ -94,6 +156,7 @@ long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windo
 
 				//Checksum will be used for confirming integrity of the packet.
 				pack->checksum = head.checksum;
+				pack->integrity = head.integrity;
 			}
 			//If we can't use this data, free it.
 			else if (data != NULL) {
@@ -101,8 +164,14 @@ long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windo
 			}
 		}
 		
-		//If we didn't get a single packet this time
-		if (!gotPacket) {
+		//Whatever got lost this round may be rebuilt from the parity that came with it, saving a retransmission
+		sock->rebuildPackets(packets, windowSize, firstNumber);
+		
+		//The client only says it's finished once every packet has been acked
+		if (sock->otherSideFinished()) break;
+		
+		//If we didn't get a single packet this time (and the client isn't waiting on a round where all of them got lost)
+		if (!gotPacket && !sock->otherSideReady()) {
 			//If this is the 8th time in a row that no data was gotten, give up.
 			if (++timesNothingFound == 8) break;
 			//Else, give the server time to load.
@@ -110,61 +179,81 @@ long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windo
 		}
 		
 		timesNothingFound = 0;
-		sock->signalReady();
-		sock->waitReady();
+		if (!sock->exchangeReady()) {
+			if (!sock->otherSideFinished()) LOG_ERROR("Client stopped responding\n");
+			break;
+		}
 
 		//For every packet that has not already been confirmed
 		for (int i = 0; i < windowSize; i++) {
 			Packet* pack = packets + i;
 			
 			//If the unconfirmed packet matches its checksum, send an ack to the client.
-			if (pack->transmitted && !pack->secured && inetChecksum(pack->content, pack->length) == pack->checksum) {
-				cout << "Checksum of " << pack->id << " OK"<< endl;
-				//Add to successful packet total for stats
-				send[2]++;
-				sock->sendInt(pack->id);
-				cout << "Ack for packet id" << pack->id << "send" << endl;
+			if (pack->transmitted && !pack->secured && checks.sum(pack->content, pack->length) == pack->checksum) {
+				LOG_DEBUG("Checksum of " << pack->id << " OK\n");
+				sock->sendAck(pack->id, firstNumber + i);
+				sock->trace(TRACE_ACK_SENT, pack->id, firstNumber + i, i, pack->length);
+				LOG_DEBUG("Ack for packet id" << pack->id << "send\n");
 				
 				//Then wait for the other side to be ready for the next int
 			}else {
-				cout << "Checksum of " << pack->id << " failed" << endl;
+				LOG_DEBUG("Checksum of " << pack->id << " failed\n");
 			}
 		}
 		//printing window content
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
 				int i = 0;
 				 cout << "Current Window: [";
 				for(i = 0; i < windowSize-1; i++){
 					cout << packets[i].id << ", " ;
 				}
-				cout << packets[windowSize -1].id << "]"<< endl;
+				cout << packets[windowSize -1].id << "]\n";
+#endif
 
 
 
 		// cout << "Waiting for client to send back acks\n";
 
-		while (!sock->waitReady());
-		sock->signalReady();
+		if (!sock->exchangeReady()) {
+			if (!sock->otherSideFinished()) LOG_ERROR("Client stopped responding\n");
+			break;
+		}
 
 		//cout << "Client ready, waiting for returned acks"<< endl;
 
 		int acked;
 		while ((acked = sock->getInt()) != -3) {
 			//cout << "Got confirmed ack for " << acked << endl;
-			int index = 0;
-			while (packets[index].id != acked) index++;
+			int index = windowSlot(packets, windowSize, acked, ids);
 			
 			
-			//Mark that packet as securely sent
-			packets[index].secured = true;
+			//Mark that packet as securely sent (as long as it's one we actually acked)
+			if (index < windowSize && packets[index].transmitted) packets[index].secured = true;
 		}
 
-		cout << "\n\n";
+		LOG_DEBUG("\n\n");
 
-		sock->signalReady();
+		if (!sock->exchangeReady()) {
+			if (!sock->otherSideFinished()) LOG_ERROR("Client stopped responding\n");
+			break;
+		}
+		send->endRound();
+		sock->trace(TRACE_ROUND, send->get(COUNT_ROUNDS), -1, -1, 0);
 	}
 
-	//Delete the error-tracking array we don't need anymore
-	if (alreadyDone != NULL) delete[] alreadyDone;
+	//The client only quits once every packet was acked, so intact packets still waiting on a returned ack
+	//(the last round's copies can get lost) are written out too, up to the first one that's missing.
+	double writing = send->now();
+	for (int i = 0; written && i < windowSize && packets[i].transmitted && checks.sum(packets[i].content, packets[i].length) == packets[i].checksum; i++) {
+		written = fwrite(packets[i].content, 1, packets[i].length, file) == (size_t) packets[i].length;
+		if (!written) {
+			LOG_ERROR("Couldn't write to the file: " << strerror(errno) << "\n");
+			break;
+		}
+		sock->digestData(packets[i].content, packets[i].length);
+		send->delivered(packets[i].length);
+		sock->trace(TRACE_WRITE, packets[i].id, firstNumber + i, i, packets[i].length);
+	}
 	
 	//Clean up allocated data
 	for (int i = 0; i < windowSize; i++) {
@@ -172,53 +261,88 @@ long* selectRepeat(SocketReadWriter* sock, FILE* file, int packetSize, int windo
 	}
 	
 	fclose(file);
-	return send;
+	send->addTime(TIME_WRITING, writing);
+	
+	//Everything's written, so the client can hear that the transfer is over, and whether the file's digests match
+	if (sock->answerFin() == DIGEST_MISMATCH) LOG_ERROR("The client's " << digestNames[sock->getDigestAlgorithm()] << " of the file doesn't match\n");
+	sock->trace(TRACE_END, 0, -1, -1, 0);
+	return sock->finishMetrics();
 }
 
 
 //Uses GO-BACK-N to write socket data to a file
 //sock is the read-writer class used to handle socket data
 //file is the file in question
-//packetSize is the size in bytes of each individual packet.
+//packetSize is the size in bytes of each individual packet, or PACKET_SIZE_AUTO to pick it from the path.
 //windowSize indicates how many packets there are in the window
 //sequenceRange is the maximum exclusive bound of the sequence ids (the inclusive min is 0)
 //numDropAcks is the length of the list of ids to drop (dropAcks) as part of error simulation.
-//Returns an array of longs for use in post-function statistsics
-long* GBN(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropAcks, int* dropAcks){
-	long* send = new long[3];
-	for (int i = 0; i < 3; i++) {
-		send[i] = 0;
-	}
+//Returns the metrics of the transfer, which the caller should delete once done with them
+TransferMetrics* GBN(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, int sequenceRange, int numDropAcks, int* dropAcks) {
+	TransferMetrics* send = sock->startMetrics("gbn", "server");
+	//If the client picks its packet size from the path, take anything it could pick
+	if (packetSize == PACKET_SIZE_AUTO) packetSize = sock->getPacketSize();
+	//Make room for a window of them before any come in
+	sock->fitBuffers(windowSize);
+
+	//Error simulation drops packets on their way in
+	sock->simulateDrops(numDropAcks, dropAcks, KIND_DATA, windowSize);
 	
+	//How packets are checked, and whether parity comes with them, is settled by the client's hello, which comes ahead of its first packet
+	//(waiting as selectRepeat does)
+	int missed = sock->awaitPacket(7);
+	return runWithChecks(sock->getIntegrity(), sock->getNumbered(), [&](auto checks) {
+		return runWithIds(sequenceRange, [&](auto ids) {
+			if (sock->getParityGroup() > 0) return GBNOver<true>(sock, file, packetSize, windowSize, ids, checks, missed, send);
+			return GBNOver<false>(sock, file, packetSize, windowSize, ids, checks, missed, send);
+		});
+	});
+}
+
+//Does the actual work of GBN
+template <bool PARITY, class Ids, class Checks> TransferMetrics* GBNOver(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, Ids ids, Checks checks, int missed, TransferMetrics* send){
 	//Our window is only 1 packet wide
 	Packet packets;
 	packets.secured = false;
 	packets.id = 0;
 	packets.length = packetSize;
 	packets.content = new char[packetSize];
+	packets.packed = NULL;
+	packets.codec = CODEC_NONE;
+	packets.packedLength = 0;
+	packets.number = -1;
 	packets.checksum = -1;
+	packets.integrity = INTEGRITY_INET;
 	packets.transmitted = packets.terminated = false;
+	packets.sentAt = -1;
 
-	//Don't want to have unneeded repeats in the error simulation
-	bool* alreadyDone = numDropAcks < 1 ? NULL : new bool[numDropAcks];
-	for (int i = 0; i < numDropAcks; i++) {
-		alreadyDone[i] = false;
-	}
+	sock->trace(TRACE_START, ids.range(), -1, windowSize, packetSize);
 
 	//the linkedlist is a list of packets that will be printed to the file
-	//acklist holds the packets that have to be properly added before they can be set to be printed off
+	//acklist holds the packets accepted this round, which still have to be acked
 	LinkedList *linkedList = new LinkedList(), *ackList = new LinkedList();
 
-	//For use in debugging.
-	int count = 1;
+	//Whether any packet has been accepted yet, so there's something to re-ack when a round brings nothing new
+	bool acceptedAny = false;
+	
+	//With parity, a round's packets are held back until the round is over, so that any that got lost can be rebuilt
+	//before deciding how far the round got. Slot d holds the packet d past the one expected next, and "arrived" says
+	//which of them really came in (as opposed to being rebuilt).
+	Packet round[windowSize];
+	bool arrived[windowSize];
+	for (int d = 0; d < windowSize; d++) {
+		round[d] = packets;
+		round[d].id = ids.advance(0, d);
+		round[d].content = NULL;
+		arrived[d] = false;
+	}
 	
+	int timesNothingFound = missed;
 	
-	int timesNothingFound = 0;
+	//The number of the packet expected next, counted from the start of the file (see PacketChecks::fits)
+	long long expected = 0;
 
 	while (true){
-		bool first = true;
-		//Record the current placement of the window
-		int oldStart = packets.id;
 		//cout << "Getting header\n";
 		
 		
@@ -229,35 +353,98 @@ long* GBN(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, in
 			//Parse the data for the packet
 			gotPacket = true;
 			Header head;
-			char* data = sock->parseData(&head, sequenceRange);
-			send[0] = head.id;
-			send[1]++;
+			char* data = sock->parseData(checks, &head, ids.range());
+			send->count(COUNT_PACKETS_RECEIVED);
+			if (data == NULL) send->count(COUNT_MALFORMED);
+			else send->count(COUNT_BYTES_RECEIVED, head.length);
+			
+			bool intact = data != NULL && (packets.checksum = checks.sum(data, head.length)) == head.checksum;
+			int ahead = ids.distance(packets.id, head.id);
 			
-			//Check to see if the data is valid and that we don't feign an error here
-			if (data != NULL && !feignError(packets.id, numDropAcks, dropAcks, windowSize, sequenceRange, packets.id, alreadyDone)
-				&& (packets.checksum = inetChecksum(data, head.length)) == head.checksum && packets.id == head.id) {
+			//With parity, anything intact in the window is held for the end of the round
+			if (intact && PARITY && ahead < windowSize && !round[ahead].transmitted && checks.fits(&head, expected + ahead)) {
+				Packet* pack = round + ahead;
+				pack->content = data;
+				pack->length = head.length;
+				pack->checksum = head.checksum;
+				pack->integrity = head.integrity;
+				pack->transmitted = arrived[ahead] = true;
+			}
+			//Check to see if the data is valid and is the packet we're expecting next
+			else if (intact && !PARITY && ahead == 0 && checks.fits(&head, expected)) {
 				
-				//If the data is valid, add it to the ack list and move the sequence number.
-				cout << "Checksum of id " << packets.id << " OK"<< endl;
-
-				send[2]++;
+				//If the data is valid, it's ready for the file. Add it to the ack list and move the sequence number.
+				LOG_DEBUG("Checksum of id " << packets.id << " OK\n");
+				sock->trace(TRACE_RECEIVE, head.id, expected, 0, head.length);
 
 				packets.content = data;
 				packets.length = head.length;
+				packets.number = expected;
 
+				linkedList->add(packets);
 				ackList->add(packets);
+				acceptedAny = true;
 				//Expect the next sequence number
-				packets.id = (packets.id + 1) % sequenceRange;
+				packets.id = ids.next(packets.id);
+				expected++;
 			}
 			//If the data can't be used, say so and free the unusable data.
 			else {
-				cout << "Checksum of id" << packets.id << " failed"<< endl;
-				if (data != NULL) delete[] data;
+				LOG_DEBUG("Checksum of id" << packets.id << " failed\n");
+				if (data != NULL) {
+					//Anything intact but not next in line is either a copy of one already taken (up to a window behind), or too early
+					if (packets.checksum != head.checksum) {
+						send->count(COUNT_CHECKSUM_FAILURES);
+						sock->trace(TRACE_CORRUPT, head.id, -1, -1, head.length);
+					}
+					else if (ids.distance(head.id, packets.id) <= windowSize || (PARITY && ahead < windowSize)) {
+						send->count(COUNT_DUPLICATES);
+						sock->trace(TRACE_DUPLICATE, head.id, head.number, -1, head.length);
+					}
+					else {
+						send->count(COUNT_OUT_OF_WINDOW);
+						sock->trace(TRACE_OUT_OF_WINDOW, head.id, head.number, -1, head.length);
+					}
+					delete[] data;
+				}
+			}
+		}
+		
+		if (PARITY) {
+			//Rebuild what can be, then take everything from the expected packet up to the first one still missing,
+			//just as if it had all come in order
+			sock->rebuildPackets(round, windowSize, expected);
+			int d = 0;
+			for (; d < windowSize && round[d].transmitted; d++) {
+				if (arrived[d]) sock->trace(TRACE_RECEIVE, round[d].id, expected, 0, round[d].length);
+				packets.content = round[d].content;
+				packets.length = round[d].length;
+				packets.number = expected;
+				linkedList->add(packets);
+				ackList->add(packets);
+				acceptedAny = true;
+				packets.id = ids.next(packets.id);
+				expected++;
+			}
+			//Anything past a gap is no use to go-back-N, so the client sends it again
+			for (; d < windowSize; d++) {
+				if (!round[d].transmitted) continue;
+				send->count(COUNT_OUT_OF_WINDOW);
+				sock->trace(TRACE_OUT_OF_WINDOW, round[d].id, expected + d, -1, round[d].length);
+				delete[] round[d].content;
+			}
+			for (d = 0; d < windowSize; d++) {
+				round[d].id = ids.advance(packets.id, d);
+				round[d].content = NULL;
+				round[d].transmitted = arrived[d] = false;
 			}
 		}
 		
-		//If we didn't get a single packet
-		if (!gotPacket) {
+		//The client only says it's finished once every packet has been acked
+		if (sock->otherSideFinished()) break;
+		
+		//If we didn't get a single packet (and the client isn't waiting on a round where all of them got lost)
+		if (!gotPacket && !sock->otherSideReady()) {
 			//If this is the 8th time in a row that we couldn't get a single packet, call it the end.
 			if (++timesNothingFound == 8) break;
 			//If there's still a chance the program is loading file data, give it time.
@@ -266,77 +453,104 @@ long* GBN(SocketReadWriter* sock, FILE* file, int packetSize, int windowSize, in
 		
 		
 		timesNothingFound = 0;
-		sock->signalReady();
-		while (!sock->waitReady());
+		if (!sock->exchangeReady()) {
+			if (!sock->otherSideFinished()) LOG_ERROR("Client stopped responding\n");
+			break;
+		}
 
 		// cout << "Client ready, sending ack\n";
 
-		//Cycle through every ackable packet, sending their ids as acks.
-		for (int i = 0, max = ackList->getSize(); i < max; i++) {
+		//Cycle through every packet accepted this round, sending their ids as acks.
+		//If nothing new came in, ack the last packet accepted again, in case the client missed it.
+		if (ackList->getSize() == 0 && acceptedAny) {
+			int last = ids.advance(packets.id, -1);
+			sock->sendAck(last, expected - 1);
+			sock->trace(TRACE_ACK_SENT, last, expected - 1, 0, 0);
+			LOG_DEBUG("Sending ack of packet id " << last << "\n");
+		}
+		while (ackList->getSize() != 0) {
 			Packet pack = ackList->removeFirst();
-			sock->sendInt(pack.id);
-			cout << "Sending ack of packet id " << pack.id << endl;
-			ackList->add(pack);
+			sock->sendAck(pack.id, pack.number);
+			sock->trace(TRACE_ACK_SENT, pack.id, pack.number, 0, pack.length);
+			LOG_DEBUG("Sending ack of packet id " << pack.id << "\n");
 		}
-		cout << "Current Window: [" << packets.id << "]" << endl;
+		LOG_DEBUG("Current Window: [" << packets.id << "]\n");
 
 		//cout << "Out of acks, waiting for client to be ready with copies\n";
 
-		while (!sock->waitReady());
-		sock->signalReady();
+		if (!sock->exchangeReady()) {
+			if (!sock->otherSideFinished()) LOG_ERROR("Client stopped responding\n");
+			break;
+		}
 		
 
 		//cout << "Getting copies...\n";
 
+		//Acks are cumulative, so the copies are only reported. Losing some of them changes nothing.
 		int ack;
-		cout << "Acks returned: ";
+		LOG_DEBUG("Acks returned: ");
 		while ((ack = sock->getInt()) != -3) {
-			//cout << "oldStart:" << oldStart << " ack:" << ack << endl;
-			if (oldStart == ack) {
-				oldStart = (oldStart + 1) % sequenceRange;
-				Packet pack = ackList->getByID(ack);
-				cout << pack.id << ", ";
-				linkedList->add(pack);
-			}	
+			LOG_DEBUG(ack << ", ");
 		}
 
-		packets.id = oldStart;
-
-		cout << "\n";
+		LOG_DEBUG("\n");
 
-		while (ackList->getSize() != 0) {
-			ackList->removeFirst();
+		//Everything accepted so far is in order, so it can go to the file now instead of piling up until the end.
+		//If the file won't take it (a full disk, or whatever reads a stream has gone), there's no point going on.
+		if (!writePackets(linkedList, file, sock, send)) {
+			LOG_ERROR("Couldn't write to the file: " << strerror(errno) << "\n");
+			break;
 		}
 
-		cout << "Indicating ready for next loop\n\n";
+		LOG_DEBUG("Indicating ready for next loop\n\n");
 
-		sock->signalReady();
+		if (!sock->exchangeReady()) {
+			if (!sock->otherSideFinished()) LOG_ERROR("Client stopped responding\n");
+			break;
+		}
+		send->endRound();
+		sock->trace(TRACE_ROUND, send->get(COUNT_ROUNDS), -1, -1, 0);
     
 	}
 
-	if (alreadyDone != NULL) delete[] alreadyDone;
+	LOG_INFO("Writing listed data to file...\n");
+	if (!writePackets(linkedList, file, sock, send)) LOG_ERROR("Couldn't write to the file: " << strerror(errno) << "\n");
 
-	cout << "Writing listed data to file...\n";
+	fclose(file);
+	delete linkedList;
+	delete ackList;
+	
+	//Everything's written, so the client can hear that the transfer is over, and whether the file's digests match
+	if (sock->answerFin() == DIGEST_MISMATCH) LOG_ERROR("The client's " << digestNames[sock->getDigestAlgorithm()] << " of the file doesn't match\n");
 
-	int i = 1;
-	size_t bytes = 0;
-	while (linkedList->getSize() != 0){
-		packets = linkedList->removeFirst();
+	sock->trace(TRACE_END, 0, -1, -1, 0);
+	return sock->finishMetrics();
+}
 
-		//cout << "REMOVED ONE! " << linkedList->getSize() << " packet(s) to go!\n";
 
-		//cout << "PRINTING PACKET OF ID " << packets.id << " AND CHECKSUM " << packets.checksum << " #" << i++ << endl;
-		size_t bytesWritten = 0;
-		while (bytesWritten < packets.length) bytesWritten += fwrite(packets.content + bytesWritten, 1, packets.length - bytesWritten, file);
+//Writes out and frees every packet in the list, in order. What's written (and the time it takes) goes in the given metrics,
+//and each write is traced through the given read-writer.
+//Returns false if a write came up short, in which case the rest of the list is freed without being written.
+bool writePackets(LinkedList* linkedList, FILE* file, SocketReadWriter* sock, TransferMetrics* metrics) {
+	double writing = metrics->now();
+	bool send = true;
+	while (linkedList->getSize() != 0){
+		Packet pack = linkedList->removeFirst();
+
+		//fwrite only comes up short when the file can't take any more
+		send = send && fwrite(pack.content, 1, pack.length, file) == (size_t) pack.length;
+		if (!send) {
+			delete [] pack.content;
+			continue;
+		}
+		sock->digestData(pack.content, pack.length);
+		metrics->delivered(pack.length);
+		sock->trace(TRACE_WRITE, pack.id, pack.number, 0, pack.length);
 		
-		bytes += bytesWritten;
-		//cout << "TOTAL BYTES SO FAR: " << bytes << endl;
-		delete [] packets.content;
+		delete [] pack.content;
 	} 
-
-	fclose(file);
-	delete linkedList;
-	delete ackList;
-
+	//Whatever reads a stream gets each round's data as soon as it's in
+	if (send && sock->getStreaming()) send = fflush(file) == 0;
+	metrics->addTime(TIME_WRITING, writing);
 	return send;
 }
@@ -0,0 +1,470 @@
+//Runs a whole GBN or SR transfer in one process over a simulated link, on a virtual clock.
+//Nothing really waits on the network, so even huge transfers finish in seconds, and the same seed
+//always gives the same result. At the end it reports how long the transfer would have taken on that link.
+//
+//Usage: simulate.exe [--option value]...
+//	--mode gbn|sr          which protocol to use (default sr)
+//	--integrity inet|crc32c  limit how packets are checked to this (default: either, which picks crc32c)
+//	--digest md5|xxh64|none  the digest of the whole file both sides work out and compare at the end (default xxh64)
+//	--parity packets       send a parity packet after every this many, to rebuild lost ones from (default 0, none)
+//	--compress none|lz|deflate  what the client packs each packet with, when that makes it smaller (default none)
+//	--pack-threads count   how many threads the client packs on, 0 for the send loop itself (default 2)
+//	--file path            file to send (default: generated data of --size bytes)
+//	--size bytes           how much data to generate when no file is given (default 100000000)
+//	--output path          where the server writes the data (default: thrown away)
+//	--basis path           an old copy of the file for the server to have, so the client sends a delta against it (default: none)
+//	--block bytes          how long the blocks of the old copy are, 0 to pick from its size (default 0)
+//	--resume               keep a journal next to --output, so a transfer of --file that gets cut off can pick up where it stopped
+//	--cut seconds          stop the link at this simulated time and end the process abruptly, as if it crashed, to try --resume on (default: never)
+//	--sparse               send the holes in --file, and blocks of nothing but zeroes, as holes the server seeks past
+//	--store dir            a block store for the server to keep blocks of the files it's sent in, so blocks of --file it has
+//	                       already, or that come more than once, aren't sent again (default: none)
+//	--store-size bytes     how much of the blocks the store keeps, dropping those least recently used (default 1000000000)
+//	--dir path             send everything in this directory as a bundle, instead of --file, into the directory --output
+//	--writers count        how many threads the server writes a bundle's files on (default 4)
+//	--packet bytes|auto    packet size, or auto to probe the path for the longest that gets through whole (default 1400)
+//	--window packets       window size (default 32)
+//	--range ids            sequence range, at least twice the window for sr (default 64)
+//	--timeout seconds      receive timeout on both sides (default 0.05)
+//	--bandwidth bytes/s    link bandwidth, 0 for unlimited (default 12500000, 100Mbit/s)
+//	--delay seconds        one-way delay (default 0.01)
+//	--jitter seconds       random extra delay per datagram (default 0)
+//	--queue bytes          link queue size, 0 for unlimited (default 1000000)
+//	--loss fraction        chance of losing any one datagram (default 0)
+//	--mtu bytes            longest IP packet the link carries, headers and all, 0 for any (default 0)
+//	--mtu-change s:bytes   change the MTU to this many bytes at this simulated time, like a route moving (default: never)
+//	--seed number          seed for loss and jitter (default 1)
+//	--stall seconds        give up after this long without any delivery (default 60)
+//	--metrics path         write each side's detailed metrics to this file as JSON lines (default: none)
+//	--metrics-interval s   how often, in simulated seconds, the metrics are written during the transfer (default 1)
+//	--trace path           trace every packet event of both sides to this file, for traceAnalyze.exe (default: none)
+//	--verbose              keep the protocols' own output
+
+#include "SocketReadWriter.cpp"
+#include "LinkedList.cpp"
+#include <thread>
+#include <atomic>
+#include <time.h>
+
+namespace serverSide {
+#include "server.cpp"
+}
+namespace clientSide {
+#include "client.cpp"
+}
+
+
+//Everything needed to run one side of the simulated transfer
+typedef struct SimulatedSide {
+	SocketReadWriter* sock;
+	FILE* file;
+	bool gbn;
+	int packetSize, windowSize, sequenceRange;
+	//Filled in once the side is done: its metrics, the virtual time it finished at, how it checked packets,
+	//and its digest of the file and how that compared with the other side's
+	TransferMetrics* metrics;
+	double finishedAt;
+	int integrity, digestAlgorithm, digestResult, deltaResult, dedupResult, sparseResult;
+	//The packet size it ended up with, and the longest datagram it knew to get across whole (see SocketReadWriter::probePath)
+	int pickedSize, pathBytes;
+	bool resumeComplete;
+	string digest;
+	atomic<bool> done;
+} SimulatedSide;
+
+//State for the generated data source, which makes up its bytes as they're read instead of storing a file
+typedef struct GeneratedData {
+	long size, position;
+} GeneratedData;
+
+//fopencookie read function for generated data. The bytes follow a simple pattern so runs are repeatable.
+ssize_t readGenerated(void* cookie, char* buffer, size_t bytes) {
+	GeneratedData* data = (GeneratedData*) cookie;
+	size_t count = 0;
+	while (count < bytes && data->position < data->size) {
+		buffer[count++] = (char) (data->position * 31 + (data->position >> 8));
+		data->position++;
+	}
+	return count;
+}
+
+int closeGenerated(void* cookie) {
+	delete (GeneratedData*) cookie;
+	return 0;
+}
+
+//Returns the wall-clock time in seconds
+double wallTime() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//Keeps what's wanted from a side once it's done, before its read-writer goes
+void keepResults(SimulatedSide* side, SimulatedLink* link) {
+	side->finishedAt = link->now();
+	side->integrity = side->sock->getIntegrity();
+	side->digestAlgorithm = side->sock->getDigestAlgorithm();
+	side->digestResult = side->sock->getDigestResult();
+	side->deltaResult = side->sock->getDeltaResult();
+	side->dedupResult = side->sock->getDedupResult();
+	side->sparseResult = side->sock->getSparseResult();
+	side->resumeComplete = side->sock->getResumeComplete();
+	side->pickedSize = side->sock->getPacketSize();
+	side->pathBytes = side->sock->getPathBytes();
+	side->digest = side->sock->getDigest() != NULL ? side->sock->getDigest() : "";
+}
+
+void runServer(SimulatedSide* side, SimulatedLink* link) {
+	if (side->gbn) side->metrics = serverSide::GBN(side->sock, side->file, side->packetSize, side->windowSize, side->sequenceRange, 0, NULL);
+	else side->metrics = serverSide::selectRepeat(side->sock, side->file, side->packetSize, side->windowSize, side->sequenceRange, 0, NULL);
+	keepResults(side, link);
+	delete side->sock;
+	side->done = true;
+}
+
+void runClient(SimulatedSide* side, SimulatedLink* link) {
+	if (side->gbn) side->metrics = clientSide::GBN(side->sock, side->file, side->packetSize, side->windowSize, side->sequenceRange, 0, NULL);
+	else side->metrics = clientSide::selectRepeat(side->sock, side->file, side->packetSize, side->windowSize, side->sequenceRange, 0, NULL);
+	keepResults(side, link);
+	delete side->sock;
+	side->done = true;
+}
+
+int main(int argc, char** argv) {
+	string mode = "sr", input = "", output = "", basisPath = "", storePath = "", bundlePath = "", metricsPath = "", tracePath = "", integrity = "", digest = "", compress = "none";
+	long size = 100000000;
+	long long storeSize = 1000000000;
+	int packetSize = 1400, windowSize = 32, sequenceRange = 64, parity = 0, packThreads = 2, blockSize = 0, writers = 4;
+	double timeout = 0.05, metricsInterval = 1;
+	bool verbose = false, resume = false, sparse = false;
+
+	LinkSettings settings;
+	settings.bandwidth = 12500000;
+	settings.delay = 0.01;
+	settings.jitter = 0;
+	settings.queueBytes = 1000000;
+	settings.loss = 0;
+	settings.seed = 1;
+	settings.stallTime = 60;
+	settings.mtu = settings.laterMtu = 0;
+	settings.mtuChangeAt = 0;
+	settings.cutAt = 0;
+
+	for (int i = 1; i < argc; i++) {
+		string option = argv[i];
+		if (option.compare("--verbose") == 0) {
+			verbose = true;
+			continue;
+		}
+		if (option.compare("--resume") == 0) {
+			resume = true;
+			continue;
+		}
+		if (option.compare("--sparse") == 0) {
+			sparse = true;
+			continue;
+		}
+		if (i + 1 == argc) {
+			cerr << "Missing value for " << option << endl;
+			return 1;
+		}
+		char* value = argv[++i];
+
+		if (option.compare("--mode") == 0) mode = value;
+		else if (option.compare("--integrity") == 0) integrity = value;
+		else if (option.compare("--digest") == 0) digest = value;
+		else if (option.compare("--parity") == 0) parity = atoi(value);
+		else if (option.compare("--compress") == 0) compress = value;
+		else if (option.compare("--pack-threads") == 0) packThreads = atoi(value);
+		else if (option.compare("--file") == 0) input = value;
+		else if (option.compare("--size") == 0) size = atol(value);
+		else if (option.compare("--output") == 0) output = value;
+		else if (option.compare("--basis") == 0) basisPath = value;
+		else if (option.compare("--block") == 0) blockSize = atoi(value);
+		else if (option.compare("--cut") == 0) settings.cutAt = atof(value);
+		else if (option.compare("--store") == 0) storePath = value;
+		else if (option.compare("--store-size") == 0) storeSize = atoll(value);
+		else if (option.compare("--dir") == 0) bundlePath = value;
+		else if (option.compare("--writers") == 0) writers = atoi(value);
+		else if (option.compare("--packet") == 0) packetSize = strcmp(value, "auto") == 0 ? PACKET_SIZE_AUTO : atoi(value);
+		else if (option.compare("--window") == 0) windowSize = atoi(value);
+		else if (option.compare("--range") == 0) sequenceRange = atoi(value);
+		else if (option.compare("--timeout") == 0) timeout = atof(value);
+		else if (option.compare("--bandwidth") == 0) settings.bandwidth = atof(value);
+		else if (option.compare("--delay") == 0) settings.delay = atof(value);
+		else if (option.compare("--jitter") == 0) settings.jitter = atof(value);
+		else if (option.compare("--queue") == 0) settings.queueBytes = atol(value);
+		else if (option.compare("--loss") == 0) settings.loss = atof(value);
+		else if (option.compare("--mtu") == 0) settings.mtu = atoi(value);
+		else if (option.compare("--mtu-change") == 0) {
+			if (sscanf(value, "%lf:%d", &settings.mtuChangeAt, &settings.laterMtu) != 2) settings.laterMtu = -1;
+		}
+		else if (option.compare("--seed") == 0) settings.seed = strtoul(value, NULL, 10);
+		else if (option.compare("--stall") == 0) settings.stallTime = atof(value);
+		else if (option.compare("--metrics") == 0) metricsPath = value;
+		else if (option.compare("--metrics-interval") == 0) metricsInterval = atof(value);
+		else if (option.compare("--trace") == 0) tracePath = value;
+		else {
+			cerr << "Unknown option " << option << endl;
+			return 1;
+		}
+	}
+
+	if ((packetSize < 1 && packetSize != PACKET_SIZE_AUTO) || windowSize < 1 || sequenceRange <= windowSize || timeout <= 0) {
+		cerr << "Packet size and window size must be positive, the sequence range larger than the window, and the timeout positive\n";
+		return 1;
+	}
+	//Anything shorter than the headers couldn't carry a datagram at all
+	if ((settings.mtu != 0 && settings.mtu <= PROBE_FLOOR) || (settings.laterMtu != 0 && settings.laterMtu <= PROBE_FLOOR)) {
+		cerr << "The MTU has to be over " << PROBE_FLOOR << " bytes, and --mtu-change given as seconds:bytes\n";
+		return 1;
+	}
+	//Selective repeat's acks only carry ids, so an ack the server sends again for a packet the client has moved past
+	//would pass for the packet that took its id, unless the range leaves room for both windows
+	if (mode.compare("gbn") != 0 && sequenceRange < 2 * windowSize) {
+		cerr << "Selective repeat needs a sequence range of at least twice the window\n";
+		return 1;
+	}
+	if (resume && (input.length() == 0 || output.length() == 0 || basisPath.length() > 0)) {
+		cerr << "--resume needs both --file and --output, and can't go with --basis\n";
+		return 1;
+	}
+	if (sparse && (resume || basisPath.length() > 0)) {
+		cerr << "--sparse can't go with --resume (which leaves out zeroes anyway) or --basis\n";
+		return 1;
+	}
+	if (storePath.length() > 0 && (output.length() == 0 || resume || sparse || basisPath.length() > 0)) {
+		cerr << "--store needs --output, which it reads back from, and can't go with --resume, --sparse or --basis\n";
+		return 1;
+	}
+	if (bundlePath.length() > 0 && (input.length() > 0 || output.length() == 0 || resume || sparse || basisPath.length() > 0 || storePath.length() > 0)) {
+		cerr << "--dir needs --output for the directory to write into, and can't go with --file, --resume, --sparse, --basis or --store\n";
+		return 1;
+	}
+
+	//Open the data source, either the given file or generated data. A bundle is opened by the client.
+	FILE* source = NULL;
+	if (input.length() > 0) {
+		source = fopen(input.c_str(), "rb");
+		if (source != NULL) {
+			fseeko(source, 0, SEEK_END);
+			size = ftello(source);
+			rewind(source);
+		}
+	}
+	else if (bundlePath.length() == 0) {
+		GeneratedData* data = new GeneratedData;
+		data->size = size;
+		data->position = 0;
+		cookie_io_functions_t functions = {readGenerated, NULL, NULL, closeGenerated};
+		source = fopencookie(data, "rb", functions);
+	}
+	//A resumed or deduplicated transfer's output is opened by the server, since it mustn't be emptied or has to be read back,
+	//and so is a bundle's directory
+	bool serverOpens = resume || storePath.length() > 0 || bundlePath.length() > 0;
+	FILE* sink = serverOpens ? NULL : fopen(output.length() > 0 ? output.c_str() : "/dev/null", "wb");
+	FILE* metrics = metricsPath.length() > 0 ? fopen(metricsPath.c_str(), "w") : NULL;
+	//Both sides trace into the same ring, which is safe to share between threads
+	TraceRing* ring = tracePath.length() > 0 ? TraceRing::getInstance(fopen(tracePath.c_str(), "wb"), 16) : NULL;
+	if ((source == NULL && bundlePath.length() == 0) || (sink == NULL && !serverOpens) || (metricsPath.length() > 0 && metrics == NULL) || (tracePath.length() > 0 && ring == NULL)) {
+		cerr << "Could not open the input, output, metrics or trace file\n";
+		return 1;
+	}
+
+	if (!verbose) cout.setstate(ios::failbit);
+
+	SimulatedLink* link = new SimulatedLink(settings);
+	int seconds = (int) timeout, microSeconds = (int) ((timeout - seconds) * 1e6);
+
+	//Endpoint 0 is the server, endpoint 1 the client
+	SimulatedSide server, client;
+	server.sock = SocketReadWriter::getSimulatedInstance(link, 0, packetSize, seconds, microSeconds);
+	client.sock = SocketReadWriter::getSimulatedInstance(link, 1, packetSize, seconds, microSeconds);
+	//Both sides write to the same file, and each report is written as a whole, so lines never get mixed
+	if (metrics != NULL) setvbuf(metrics, NULL, _IOFBF, 1 << 20);
+	server.sock->reportMetrics(metrics, metricsInterval);
+	client.sock->reportMetrics(metrics, metricsInterval);
+	server.sock->setTrace(ring);
+	client.sock->setTrace(ring);
+	if (integrity.length() > 0) {
+		int allowed = 0;
+		for (int i = 0; i < NUM_INTEGRITY; i++) {
+			if (integrity.compare(integrityNames[i]) == 0) allowed = 1 << i;
+		}
+		if (!server.sock->setIntegrity(allowed) || !client.sock->setIntegrity(allowed)) {
+			cerr << "Unknown integrity algorithm " << integrity << endl;
+			return 1;
+		}
+	}
+	if (digest.length() > 0) {
+		int allowed = -1;
+		if (digest.compare("none") == 0) allowed = 0;
+		for (int i = 0; i < NUM_DIGESTS; i++) {
+			if (digest.compare(digestNames[i]) == 0) allowed = 1 << i;
+		}
+		if (!server.sock->setDigests(allowed) || !client.sock->setDigests(allowed)) {
+			cerr << "Unknown digest " << digest << endl;
+			return 1;
+		}
+	}
+	//Only the sending side asks for parity, and the server takes whatever it's offered
+	if (!client.sock->setParity(parity)) {
+		cerr << "The parity group can be at most " << WIRE_MAX_GROUP << " packets\n";
+		return 1;
+	}
+	int codec = 0;
+	while (codec < NUM_CODECS && compress.compare(codecNames[codec]) != 0) codec++;
+	if (!client.sock->setCompression(codec, packThreads)) {
+		cerr << "Unknown codec " << compress << ", or a negative number of threads\n";
+		return 1;
+	}
+	//The server reads its old copy, and the client offers a delta against it
+	if (basisPath.length() > 0) {
+		FILE* basis = fopen(basisPath.c_str(), "rb");
+		if (basis == NULL || !server.sock->setBasis(basis, blockSize)) {
+			cerr << "Could not read " << basisPath << ", or the block size is above " << DELTA_MAX_BLOCK << endl;
+			return 1;
+		}
+		client.sock->setDelta(true);
+		sink = server.sock->deltaSink(sink);
+		source = client.sock->deltaSource(source);
+	}
+	if (resume) {
+		if ((sink = server.sock->resumeSink(output.c_str())) == NULL) {
+			cerr << "Could not open " << output << " or its journal\n";
+			return 1;
+		}
+		client.sock->setResume(true);
+		source = client.sock->resumeSource(source);
+	}
+	if (sparse) {
+		sink = server.sock->sparseSink(sink);
+		client.sock->setSparse(true);
+		source = client.sock->sparseSource(source);
+	}
+	if (storePath.length() > 0) {
+		if (!server.sock->setBlockStore(storePath.c_str(), storeSize) || (sink = server.sock->dedupSink(output.c_str())) == NULL) {
+			cerr << "Could not open the block store in " << storePath << " (or it's in use), or " << output << endl;
+			return 1;
+		}
+		client.sock->setDedup(true);
+		source = client.sock->dedupSource(source);
+	}
+	if (bundlePath.length() > 0) {
+		if ((source = client.sock->bundleSource(bundlePath.c_str())) == NULL || (sink = server.sock->bundleSink(output.c_str(), writers)) == NULL) {
+			cerr << "Could not read " << bundlePath << ", or make the directory " << output << endl;
+			return 1;
+		}
+		size = client.sock->getBundleBytes();
+	}
+	server.file = sink;
+	client.file = source;
+	server.gbn = client.gbn = mode.compare("gbn") == 0;
+	server.packetSize = client.packetSize = packetSize;
+	server.windowSize = client.windowSize = windowSize;
+	server.sequenceRange = client.sequenceRange = sequenceRange;
+	server.done = client.done = false;
+
+	double start = wallTime();
+	thread serverThread(runServer, &server, link);
+	thread clientThread(runClient, &client, link);
+
+	//A stalled transfer never finishes, so keep an eye on the link instead of just joining
+	while (!(server.done && client.done) && !link->hasStalled() && !link->wasCut()) {
+		usleep(10000);
+	}
+	double wall = wallTime() - start;
+
+	cout.clear();
+	if (!(server.done && client.done) && link->wasCut()) {
+		printf("Cut off at %.3fs of simulated time\n", link->now());
+		fflush(stdout);
+		_exit(3);
+	}
+	if (link->hasStalled()) {
+		printf("Transfer stalled: nothing was delivered for %gs of simulated time (at %.3fs)\n", settings.stallTime, link->now());
+		printf("client to server: ");
+		link->report(stdout, 1);
+		printf("server to client: ");
+		link->report(stdout, 0);
+		printf("wall time: %.3fs\n", wall);
+		//The protocol threads are stuck for good, so there's nothing to clean up with
+		fflush(stdout);
+		_exit(2);
+	}
+	clientThread.join();
+	serverThread.join();
+
+	printf("mode: %s, integrity: %s, packet: %d%s, window: %d, range: %d, timeout: %gs\n", mode.c_str(), integrityNames[client.integrity],
+		client.pickedSize, packetSize == PACKET_SIZE_AUTO ? " (auto)" : "", windowSize, sequenceRange, timeout);
+	printf("link: %g bytes/s, delay %gs, jitter %gs, queue %ld bytes, loss %g, seed %lu", settings.bandwidth, settings.delay, settings.jitter,
+		settings.queueBytes, settings.loss, settings.seed);
+	if (settings.mtu > 0) printf(", mtu %d", settings.mtu);
+	if (settings.laterMtu > 0) printf(", mtu %d from %gs", settings.laterMtu, settings.mtuChangeAt);
+	printf("\n");
+	if (packetSize == PACKET_SIZE_AUTO) {
+		printf("path: %d bytes get through whole, %ld of %ld probes answered, %ld size errors during the transfer\n", client.pathBytes,
+			client.metrics->get(COUNT_PROBES_ANSWERED), client.metrics->get(COUNT_PROBES_SENT), client.metrics->get(COUNT_SIZE_ERRORS));
+	}
+	printf("client to server: ");
+	link->report(stdout, 1);
+	printf("server to client: ");
+	link->report(stdout, 0);
+	printf("packets sent: %ld (%ld retransmitted)\n", client.metrics->get(COUNT_PACKETS_SENT), client.metrics->get(COUNT_PACKETS_RETRANSMITTED));
+	if (server.metrics->get(COUNT_PARITY_RECEIVED) > 0 || client.metrics->get(COUNT_PARITY_SENT) > 0) {
+		long rebuilt = server.metrics->get(COUNT_PACKETS_REBUILT), unrecoverable = server.metrics->get(COUNT_UNRECOVERABLE);
+		printf("parity: group %d, %ld sent, %ld received, %ld packets rebuilt, %ld unrecoverable (recovery rate %.3f)\n", parity,
+			client.metrics->get(COUNT_PARITY_SENT), server.metrics->get(COUNT_PARITY_RECEIVED), rebuilt, unrecoverable,
+			rebuilt + unrecoverable > 0 ? (double) rebuilt / (rebuilt + unrecoverable) : 1.0);
+	}
+	if (client.metrics->get(COUNT_PACKETS_PACKED) > 0) {
+		long sent = client.metrics->get(COUNT_BYTES_SENT), saved = client.metrics->get(COUNT_BYTES_SAVED);
+		printf("compression: %s, %ld of %ld packets packed, %ld bytes sent as %ld (ratio %.3f), %.3fs waiting on packing, %.3fs unpacking\n",
+			compress.c_str(), client.metrics->get(COUNT_PACKETS_PACKED), client.metrics->get(COUNT_PACKETS_SENT), sent, sent - saved,
+			sent - saved > 0 ? (double) sent / (sent - saved) : 1.0, client.metrics->getTime(TIME_PACKING), server.metrics->getTime(TIME_UNPACKING));
+	}
+	if (client.metrics->get(COUNT_SIGNATURE_BYTES) > 0) {
+		long literal = client.metrics->get(COUNT_DELTA_LITERAL), copied = client.metrics->get(COUNT_DELTA_COPIED);
+		printf("delta: %ld bytes of signatures, %ld bytes sent as literals and %ld copied from the old copy (%.1f%% of the file sent), file put back together: %s\n",
+			client.metrics->get(COUNT_SIGNATURE_BYTES), literal, copied, literal + copied > 0 ? 100.0 * literal / (literal + copied) : 0.0,
+			server.deltaResult == DIGEST_MATCH ? "match" : server.deltaResult == DIGEST_MISMATCH ? "MISMATCH" : "unchecked");
+	}
+	if (resume) {
+		long resumed = server.metrics->get(COUNT_RESUMED_BYTES);
+		printf("resume: %ld bytes already there (%.1f%% of the file), file %s\n", resumed, size > 0 ? 100.0 * resumed / size : 0.0,
+			server.resumeComplete ? "complete" : "INCOMPLETE, journal kept");
+	}
+	if (sparse || server.metrics->get(COUNT_HOLE_BYTES) > 0) {
+		long holes = server.metrics->get(COUNT_HOLE_BYTES);
+		printf("holes: %ld bytes of the file sent as holes (%.1f%%), file put back together: %s\n", holes, size > 0 ? 100.0 * holes / size : 0.0,
+			server.sparseResult == DIGEST_MATCH ? "match" : server.sparseResult == DIGEST_MISMATCH ? "MISMATCH" : "unchecked");
+	}
+	if (storePath.length() > 0) {
+		long saved = server.metrics->get(COUNT_DEDUP_BYTES);
+		printf("dedup: %ld bytes of queries and answers, %ld bytes of the file not sent (%.1f%%), file put back together: %s\n",
+			client.metrics->get(COUNT_DEDUP_QUERY_BYTES), saved, size > 0 ? 100.0 * saved / size : 0.0,
+			server.dedupResult == DIGEST_MATCH ? "match" : server.dedupResult == DIGEST_MISMATCH ? "MISMATCH" : "unchecked");
+	}
+	if (bundlePath.length() > 0) {
+		printf("bundle: %ld of %ld files written (%ld bytes) on %d threads, %.0f files/s\n", server.metrics->get(COUNT_BUNDLE_FILES),
+			client.metrics->get(COUNT_BUNDLE_FILES), server.metrics->get(COUNT_BUNDLE_BYTES), writers,
+			client.finishedAt > 0 ? server.metrics->get(COUNT_BUNDLE_FILES) / client.finishedAt : 0.0);
+	}
+	printf("time spent waiting on the other side: %.3fs client, %.3fs server\n", client.metrics->getTime(TIME_WAITING), server.metrics->getTime(TIME_WAITING));
+	printf("simulated completion time: %.3fs (server finished at %.3fs)\n", client.finishedAt, server.finishedAt);
+	printf("simulated goodput: %.3f MB/s\n", client.finishedAt > 0 ? size / client.finishedAt / 1e6 : 0);
+	if (client.digestAlgorithm == -1) printf("digest: none\n");
+	else {
+		printf("digest: %s %s, server %s (%s)\n", digestNames[client.digestAlgorithm], client.digest.c_str(), server.digest.c_str(),
+			client.digestResult == DIGEST_MATCH ? "match" : client.digestResult == DIGEST_MISMATCH ? "MISMATCH" : "unchecked");
+	}
+	printf("wall time: %.3fs\n", wall);
+
+	delete server.metrics;
+	delete client.metrics;
+	if (metrics != NULL) fclose(metrics);
+	if (ring != NULL) delete ring;
+	delete link;
+	return 0;
+}
@@ -0,0 +1,256 @@
+//Reads the binary packet traces written by TraceRing and turns them into something a person (or a plotting tool) can use.
+//Any number of trace files can be given, for example one from each side of a transfer, and their records are merged by time.
+//Ids are only unique within the sequence range, so packets are told apart by the number each record carries instead, counted
+//from the start of the file, which never comes round again. A record without one (a damaged packet, or a stale ack) is
+//listed, but isn't put on any packet's timeline.
+//
+//Usage: traceAnalyze.exe trace [trace]... [--option value]...
+//	--seqtime path      write every packet event as CSV (time, side, event, id, packet number, slot, bytes),
+//	                    for plotting sequence numbers against time
+//	--timeline path     write one CSV row per packet with when it was first sent, every retransmission, and when it was
+//	                    acked, secured and written, for following retransmissions
+//	--top count         how many of the most retransmitted packets to list in the summary (default 10)
+
+#include "SocketReadWriter.cpp"
+#include <vector>
+#include <map>
+#include <algorithm>
+
+
+//Everything that happened to one packet, by its number. Times are in seconds from the start of the trace,
+//and -1 for anything that never happened.
+typedef struct Timeline {
+	double firstSent, acked, secured, received, written;
+	vector<double> retransmits;
+	int duplicates, bytes;
+} Timeline;
+
+//Returns true for events whose seq is a packet id
+bool isPacketEvent(int event) {
+	return event != TRACE_START && event != TRACE_ROUND && event != TRACE_LOST && event != TRACE_END && event != TRACE_PARITY;
+}
+
+//Reads every record from a trace file onto the end of "records". Returns false if it isn't a trace file.
+bool readTrace(const char* path, vector<TraceRecord>* records) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) return false;
+	char magic[8];
+	bool send = fread(magic, 1, 8, file) == 8 && memcmp(magic, TRACE_MAGIC, 8) == 0;
+	TraceRecord record;
+	while (send && fread(&record, sizeof(record), 1, file) == 1) records->push_back(record);
+	fclose(file);
+	return send;
+}
+
+bool earlier(const TraceRecord& a, const TraceRecord& b) {
+	return a.time < b.time;
+}
+
+const char* sideName(int side) {
+	return side == TRACE_CLIENT ? "client" : "server";
+}
+
+const char* eventName(int event) {
+	return event < NUM_TRACE_EVENTS ? traceEventNames[event] : "unknown";
+}
+
+//Returns the timeline for the packet with the given number, making an empty one if it's new
+Timeline* timelineFor(map<long, Timeline>* timelines, long sequence) {
+	map<long, Timeline>::iterator found = timelines->find(sequence);
+	if (found != timelines->end()) return &found->second;
+	Timeline empty;
+	empty.firstSent = empty.acked = empty.secured = empty.received = empty.written = -1;
+	empty.duplicates = 0;
+	empty.bytes = 0;
+	(*timelines)[sequence] = empty;
+	return &(*timelines)[sequence];
+}
+
+int main(int argc, char** argv) {
+	vector<string> paths;
+	string seqtimePath = "", timelinePath = "";
+	int top = 10;
+
+	for (int i = 1; i < argc; i++) {
+		string option = argv[i];
+		if (option.compare(0, 2, "--") != 0) {
+			paths.push_back(option);
+			continue;
+		}
+		if (i + 1 == argc) {
+			cerr << "Missing value for " << option << endl;
+			return 1;
+		}
+		char* value = argv[++i];
+		if (option.compare("--seqtime") == 0) seqtimePath = value;
+		else if (option.compare("--timeline") == 0) timelinePath = value;
+		else if (option.compare("--top") == 0) top = atoi(value);
+		else {
+			cerr << "Unknown option " << option << endl;
+			return 1;
+		}
+	}
+	if (paths.empty()) {
+		cerr << "Usage: traceAnalyze.exe trace [trace]... [--seqtime path] [--timeline path] [--top count]\n";
+		return 1;
+	}
+
+	vector<TraceRecord> records;
+	for (size_t i = 0; i < paths.size(); i++) {
+		if (!readTrace(paths[i].c_str(), &records)) {
+			cerr << paths[i] << " is not a trace file\n";
+			return 1;
+		}
+	}
+	//Records that were lost carry no time, and only matter for the summary
+	long lostRecords = 0;
+	for (size_t i = 0; i < records.size(); i++) {
+		if (records[i].event == TRACE_LOST) lostRecords += records[i].bytes;
+	}
+	stable_sort(records.begin(), records.end(), earlier);
+
+	uint64_t startTime = 0;
+	for (size_t i = 0; i < records.size(); i++) {
+		if (records[i].event == TRACE_LOST) continue;
+		startTime = records[i].time;
+		break;
+	}
+
+	FILE* seqtime = NULL;
+	if (seqtimePath.length() > 0) {
+		if ((seqtime = fopen(seqtimePath.c_str(), "w")) == NULL) {
+			cerr << "Could not open " << seqtimePath << endl;
+			return 1;
+		}
+		fprintf(seqtime, "time_s,side,event,id,seq,slot,bytes\n");
+	}
+
+	long counts[2][NUM_TRACE_EVENTS];
+	double firstTime[2], lastTime[2];
+	int range[2], windowSize[2], packetSize[2];
+	bool seen[2], gbn[2];
+	for (int s = 0; s < 2; s++) {
+		for (int e = 0; e < NUM_TRACE_EVENTS; e++) counts[s][e] = 0;
+		firstTime[s] = lastTime[s] = 0;
+		range[s] = windowSize[s] = packetSize[s] = 0;
+		seen[s] = gbn[s] = false;
+	}
+	map<long, Timeline> timelines;
+
+	for (size_t i = 0; i < records.size(); i++) {
+		TraceRecord* record = &records[i];
+		if (record->event == TRACE_LOST || record->event >= NUM_TRACE_EVENTS) continue;
+		int side = record->side == TRACE_CLIENT ? TRACE_CLIENT : TRACE_SERVER;
+		double time = (record->time - startTime) / 1e9;
+
+		counts[side][record->event]++;
+		if (!seen[side]) firstTime[side] = time;
+		seen[side] = true;
+		lastTime[side] = time;
+		gbn[side] = record->gbn;
+
+		if (record->event == TRACE_START) {
+			range[side] = record->seq;
+			windowSize[side] = record->slot;
+			packetSize[side] = record->bytes;
+			continue;
+		}
+		if (!isPacketEvent(record->event)) continue;
+
+		long sequence = (long) record->number;
+		if (seqtime != NULL) {
+			fprintf(seqtime, "%.9f,%s,%s,%d,%ld,%d,%d\n", time, sideName(side), eventName(record->event),
+				record->seq, sequence, record->slot, record->bytes);
+		}
+		//There's no telling which packet a record without a number is about
+		if (sequence < 0) continue;
+
+		Timeline* timeline = timelineFor(&timelines, sequence);
+		switch (record->event) {
+			case TRACE_SEND:
+				if (timeline->firstSent < 0) timeline->firstSent = time;
+				timeline->bytes = record->bytes;
+				break;
+			case TRACE_RETRANSMIT:
+				timeline->retransmits.push_back(time);
+				break;
+			case TRACE_ACK_RECEIVED:
+				if (timeline->acked < 0) timeline->acked = time;
+				break;
+			case TRACE_SECURED:
+				if (timeline->secured < 0) timeline->secured = time;
+				break;
+			case TRACE_RECEIVE:
+			case TRACE_REBUILT:
+				if (timeline->received < 0) timeline->received = time;
+				if (timeline->bytes == 0) timeline->bytes = record->bytes;
+				break;
+			case TRACE_DUPLICATE:
+				timeline->duplicates++;
+				break;
+			case TRACE_WRITE:
+				if (timeline->written < 0) timeline->written = time;
+				break;
+		}
+	}
+	if (seqtime != NULL) fclose(seqtime);
+
+	if (timelinePath.length() > 0) {
+		FILE* timeline = fopen(timelinePath.c_str(), "w");
+		if (timeline == NULL) {
+			cerr << "Could not open " << timelinePath << endl;
+			return 1;
+		}
+		fprintf(timeline, "seq,bytes,first_sent_s,retransmits,last_sent_s,acked_s,secured_s,received_s,written_s,duplicates,retransmit_times_s\n");
+		for (map<long, Timeline>::iterator i = timelines.begin(); i != timelines.end(); i++) {
+			Timeline* t = &i->second;
+			double lastSent = t->retransmits.empty() ? t->firstSent : t->retransmits.back();
+			fprintf(timeline, "%ld,%d,%.9f,%zu,%.9f,%.9f,%.9f,%.9f,%.9f,%d,", i->first, t->bytes, t->firstSent, t->retransmits.size(),
+				lastSent, t->acked, t->secured, t->received, t->written, t->duplicates);
+			for (size_t r = 0; r < t->retransmits.size(); r++) fprintf(timeline, "%s%.9f", r == 0 ? "" : ";", t->retransmits[r]);
+			fprintf(timeline, "\n");
+		}
+		fclose(timeline);
+	}
+
+	//The summary
+	printf("%zu records from %zu file(s)", records.size(), paths.size());
+	if (lostRecords > 0) printf(", %ld more lost because the trace ring filled up", lostRecords);
+	printf("\n");
+	for (int s = 0; s < 2; s++) {
+		if (!seen[s]) continue;
+		printf("\n%s (%s, range %d, window %d, packet %d): %.6fs from first to last event\n", sideName(s), gbn[s] ? "gbn" : "sr",
+			range[s], windowSize[s], packetSize[s], lastTime[s] - firstTime[s]);
+		for (int e = 0; e < NUM_TRACE_EVENTS; e++) {
+			if (counts[s][e] > 0 && e != TRACE_START && e != TRACE_END) printf("  %-14s %ld\n", eventName(e), counts[s][e]);
+		}
+	}
+
+	//Retransmissions: how many packets needed them, and how long the worst ones took to get through
+	long retransmitted = 0, packets = 0;
+	double totalDelay = 0;
+	vector<pair<long, long> > worst;
+	for (map<long, Timeline>::iterator i = timelines.begin(); i != timelines.end(); i++) {
+		Timeline* t = &i->second;
+		if (t->firstSent < 0) continue;
+		packets++;
+		if (t->retransmits.empty()) continue;
+		retransmitted++;
+		worst.push_back(make_pair(-(long) t->retransmits.size(), i->first));
+		if (t->secured >= 0) totalDelay += t->secured - t->firstSent;
+	}
+	if (packets > 0) {
+		printf("\n%ld of %ld packets needed retransmitting (%.2f%%)", retransmitted, packets, 100.0 * retransmitted / packets);
+		if (retransmitted > 0) printf(", taking %.6fs on average from first send to secured", totalDelay / retransmitted);
+		printf("\n");
+	}
+	sort(worst.begin(), worst.end());
+	for (size_t i = 0; i < worst.size() && (int) i < top; i++) {
+		Timeline* t = &timelines[worst[i].second];
+		printf("  seq %ld: sent at %.6fs, retransmitted %ld time(s) at", worst[i].second, t->firstSent, -worst[i].first);
+		for (size_t r = 0; r < t->retransmits.size() && r < 8; r++) printf(" %.6f", t->retransmits[r]);
+		if (t->retransmits.size() > 8) printf(" ...");
+		printf(", secured at %.6fs\n", t->secured);
+	}
+	return 0;
+}
@@ -0,0 +1,122 @@
+//Measures how fast each transport can move packets between two processes on this machine.
+//Run it with no arguments for the default packet sizes, or give it packet sizes to try instead.
+//With --offload, UDP is measured a second time with segmentation offload on (see SocketReadWriter::setOffload), as "gso".
+//The sender pushes bursts of packets, and both sides trade ready signals after each burst,
+//which is roughly the pattern the protocols use for one window.
+
+#include "SocketReadWriter.cpp"
+#include <vector>
+#include <sys/wait.h>
+#include <time.h>
+
+//How many packets go out between each ready signal
+#define BENCH_BURST 64
+//Roughly how many bytes are moved per measurement
+#define BENCH_BYTES (256L << 20)
+
+
+//Returns the current time in seconds, as precise as the clock allows
+double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//Makes the read-writer for one side of the measurement.
+//The receiving side is always set up first, so it's the one that creates the shared memory.
+SocketReadWriter* makeSide(string transport, int port, int packetSize, bool receiver) {
+	//Offload only ever comes out as the kernel allows, so what's measured may be plain UDP after all
+	bool offload = transport.compare("gso") == 0;
+	if (transport.compare("shm") == 0) {
+		return SocketReadWriter::getSharedMemoryInstance(port, receiver, packetSize, 0, 200000);
+	}
+
+	string ip = "localhost";
+	SocketReadWriter* sock = SocketReadWriter::getInstance(&ip, receiver ? port : port + 1, packetSize, 0, 200000);
+	if (sock != NULL) sock->setOtherSidePort(receiver ? port + 1 : port);
+	if (sock != NULL && offload) sock->setOffload(true);
+	return sock;
+}
+
+//Receives bursts of packets until the sender signals it's done, then exits.
+void receiveSide(string transport, int port, int packetSize, long rounds) {
+	SocketReadWriter* sock = makeSide(transport, port, packetSize, true);
+	if (sock == NULL) _exit(1);
+
+	for (long r = 0; r < rounds; r++) {
+		for (int i = 0; i < BENCH_BURST; i++) {
+			//A lost packet shows up as a timeout, at which point the rest of the burst isn't coming either.
+			//The sender signalling ready ends the burst early the same way.
+			if (!sock->getPacket()) break;
+		}
+		if (!sock->exchangeReady()) break;
+	}
+
+	delete sock;
+	_exit(0);
+}
+
+//Runs one measurement and prints a line of results. Returns false if the transport couldn't be set up.
+bool measure(string transport, int packetSize, int port) {
+	long rounds = BENCH_BYTES / ((long) packetSize * BENCH_BURST) + 1;
+
+	pid_t child = fork();
+	if (child == 0) receiveSide(transport, port, packetSize, rounds);
+
+	//Give the receiver time to set up before connecting to it
+	usleep(100000);
+	SocketReadWriter* sock = makeSide(transport, port, packetSize, false);
+	if (sock == NULL) {
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+		return false;
+	}
+
+	char* data = new char[packetSize];
+	memset(data, 'x', packetSize);
+
+	long timeouts = 0;
+	double start = now();
+	for (long r = 0; r < rounds; r++) {
+		for (int i = 0; i < BENCH_BURST; i++) {
+			sock->setPacket(data, packetSize, i, i);
+			sock->sendPacket();
+		}
+		sock->flushPackets();
+		if (!sock->exchangeReady()) timeouts++;
+	}
+	double elapsed = now() - start;
+
+	waitpid(child, NULL, 0);
+	delete sock;
+	delete[] data;
+
+	double packets = (double) rounds * BENCH_BURST;
+	printf("%-5s %8d %12.1f %12.0f %10ld\n", transport.c_str(), packetSize, packets * packetSize / elapsed / 1e6, packets / elapsed, timeouts);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	int defaults[] = {512, 1400, 8192, 32768, 65000};
+	vector<int> sizes;
+	string transports[] = {"udp", "shm", "gso"};
+	int numTransports = 2;
+	for (int i = 1; i < argc; i++) {
+		if (string(argv[i]).compare("--offload") == 0) numTransports = 3;
+		else sizes.push_back(atoi(argv[i]));
+	}
+	if (sizes.empty()) sizes.assign(defaults, defaults + sizeof(defaults) / sizeof(defaults[0]));
+
+	printf("%-5s %8s %12s %12s %10s\n", "kind", "bytes", "MB/s", "packets/s", "timeouts");
+	int port = 40000 + getpid() % 10000;
+	for (size_t i = 0; i < sizes.size(); i++) {
+		int packetSize = sizes[i];
+		for (int t = 0; t < numTransports; t++) {
+			if (!measure(transports[t], packetSize, port)) {
+				printf("%-5s %8d could not be set up\n", transports[t].c_str(), packetSize);
+			}
+			port += 2;
+		}
+	}
+	return 0;
+}